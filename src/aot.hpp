@@ -0,0 +1,255 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include "types.hpp"
+#include "helpers.hpp"
+#include "mmu.hpp"
+#include "cpu.hpp"
+
+// Runtime for code generated by main --recompile (see recompiler.hpp). Every
+// recovered block becomes a function that works on a copy of the registers
+// and goes to memory through the MMU like the CPU would, so devices and
+// bank switching behave the same. Blocks stop early when they run out of
+// cycles or write over their own code, and the runner only enters a block
+// if the bytes in memory are still the ones it was compiled from. Anything
+// else (code that wasn't found, changed code, undocumented opcodes) runs on
+// the interpreter. Compiled code doesn't keep the instruction history, and
+// breakpoints and watchpoints are ignored.
+struct AotContext {
+	MMU* mmu = nullptr;
+	CPU* scratch = nullptr; // For decimal mode arithmetic
+	CPUType type = MOS;
+	Byte A = 0, X = 0, Y = 0, SP = 0, SF = 0;
+	Word PC = 0;
+	unsigned long cycles = 0;
+	unsigned long instructions = 0;
+	unsigned long deadline = 0;
+	CPUStatus status = CONTINUE;
+};
+
+using AotFunction = void (*)(AotContext&);
+
+struct AotBlock {
+	Word address;
+	Word length;             // Bytes of code
+	std::size_t code_offset; // Where those bytes are in AotProgram::code
+	AotFunction run;
+};
+
+struct AotProgram {
+	const char* source; // ROM it was generated from
+	const AotBlock* blocks;
+	std::size_t block_count;
+	const Byte* code;
+};
+
+#ifdef YA6502_AOT
+// Defined by the generated source
+extern const AotProgram aot_program;
+#endif
+
+// Generated code is written in terms of these
+
+#define AOT_ENTER(start, length) \
+	MMU& mmu = *c.mmu; \
+	Byte A = c.A, X = c.X, Y = c.Y, SP = c.SP, SF = c.SF; \
+	unsigned long cycles = c.cycles; \
+	const unsigned long deadline = c.deadline; \
+	const Word block_start = start; \
+	const Word block_length = length; \
+	bool dirty = false; \
+	Word address = 0; \
+	Byte value = 0; \
+	(void)mmu; (void)deadline; (void)address; (void)value; (void)block_start; (void)block_length; (void)dirty
+
+#define AOT_EXIT(next_pc, count) do { \
+		c.A = A; c.X = X; c.Y = Y; c.SP = SP; c.SF = SF; \
+		c.cycles = cycles; \
+		c.instructions += count; \
+		c.PC = static_cast<Word>(next_pc); \
+		return; \
+	} while (0)
+
+#define AOT_HALT(next_pc, count) do { \
+		c.status = HALT; \
+		AOT_EXIT(next_pc, count); \
+	} while (0)
+
+#define AOT_READ(addr) mmu.read_byte(static_cast<Word>(addr))
+
+#define AOT_WRITE(addr, v) do { \
+		Word write_address = static_cast<Word>(addr); \
+		mmu.write_byte(write_address, v); \
+		dirty = dirty || static_cast<Word>(write_address - block_start) < block_length; \
+	} while (0)
+
+// After each instruction: out of cycles, or the rest of the block may no
+// longer be what's in memory
+#define AOT_NEXT(next_pc, count) do { \
+		if (dirty || cycles >= deadline) AOT_EXIT(next_pc, count); \
+	} while (0)
+
+inline Byte aot_nz(Byte flags, Byte v) {
+	flags = static_cast<Byte>(flags & ~(CPU_FLAG_N | CPU_FLAG_Z));
+	return static_cast<Byte>(flags | (v & CPU_FLAG_N) | (v == 0 ? CPU_FLAG_Z : 0));
+}
+
+inline void aot_push(MMU& mmu, Byte& SP, Byte v, Word block_start, Word block_length, bool& dirty) {
+	Word address = static_cast<Word>(0x0100 | SP);
+	mmu.write_byte(address, v);
+	dirty = dirty || static_cast<Word>(address - block_start) < block_length;
+	SP--;
+}
+
+inline Byte aot_pull(MMU& mmu, Byte& SP) {
+	SP++;
+	return mmu.read_byte(static_cast<Word>(0x0100 | SP));
+}
+
+// B and the unused bit are kept, like stack_pull_status_flags
+inline Byte aot_pulled_flags(Byte old_flags, Byte pulled) {
+	Byte retain = CPU_FLAG_B | CPU_FLAG_UNUSED;
+	return static_cast<Byte>((old_flags & retain) | (pulled & ~retain));
+}
+
+// ADC, and SBC with an inverted operand. Decimal mode goes through the CPU's
+// own adder.
+inline void aot_add(AotContext& c, Byte& A, Byte& SF, Byte operand, bool subtract) {
+	if ((SF & CPU_FLAG_D) && c.type != NES) {
+		CPU& cpu = *c.scratch;
+		cpu.type = c.type;
+		cpu.A = A;
+		cpu.SF = SF;
+		cpu.full_add(operand, subtract);
+		A = cpu.A;
+		SF = cpu.SF;
+		return;
+	}
+	unsigned sum = unsigned(A) + operand + (SF & CPU_FLAG_C);
+	Byte result = static_cast<Byte>(sum);
+	Byte flags = static_cast<Byte>(SF & ~(CPU_FLAG_V | CPU_FLAG_C));
+	if (~(A ^ operand) & (A ^ result) & 0x80) flags |= CPU_FLAG_V;
+	if (sum > 0xFF) flags |= CPU_FLAG_C;
+	A = result;
+	SF = aot_nz(flags, result);
+}
+
+inline Byte aot_compare(Byte flags, Byte reg, Byte v) {
+	flags = static_cast<Byte>(flags & ~CPU_FLAG_C);
+	if (reg >= v) flags |= CPU_FLAG_C;
+	return aot_nz(flags, static_cast<Byte>(reg - v));
+}
+
+inline Byte aot_bit(Byte flags, Byte A, Byte v) {
+	flags = static_cast<Byte>(flags & ~(CPU_FLAG_N | CPU_FLAG_V | CPU_FLAG_Z));
+	return static_cast<Byte>(flags | (v & (CPU_FLAG_N | CPU_FLAG_V)) | ((A & v) == 0 ? CPU_FLAG_Z : 0));
+}
+
+inline Byte aot_shift(Byte& SF, Byte v, bool left, bool rotate) {
+	Byte carry_in = rotate ? static_cast<Byte>(SF & CPU_FLAG_C) : 0;
+	Byte carry_out = left ? static_cast<Byte>(v >> 7) : static_cast<Byte>(v & 1);
+	Byte result = left ? static_cast<Byte>(v << 1 | carry_in) : static_cast<Byte>(v >> 1 | carry_in << 7);
+	SF = aot_nz(static_cast<Byte>((SF & ~CPU_FLAG_C) | carry_out), result);
+	return result;
+}
+
+struct AotStats {
+	unsigned long blocks = 0;
+	unsigned long compiled_instructions = 0;
+	unsigned long interpreted_instructions = 0;
+	unsigned long stale_blocks = 0; // Entries refused because the code changed
+};
+
+// Runs a program with its compiled blocks wherever they apply and the
+// interpreter everywhere else
+class AotRunner {
+public:
+	explicit AotRunner(const AotProgram& aot) : program(aot), table(65536, nullptr) {
+		for (std::size_t i = 0; i < program.block_count; i++) {
+			table[program.blocks[i].address] = &program.blocks[i];
+		}
+	}
+
+	// Same contract as running exec_instruction in a loop: stops after the
+	// given number of cycles, or on HALT or an invalid instruction
+	CPUStatus run(CPU& cpu, MMU& mmu, unsigned long run_cycles) {
+		unsigned long end = cpu.cycle_count + run_cycles;
+		AotContext c;
+		c.mmu = &mmu;
+		c.scratch = &scratch;
+		c.type = cpu.type;
+		c.deadline = end;
+
+		while (cpu.cycle_count < end) {
+			const AotBlock* block = table[cpu.PC];
+			if (block && still_matches(mmu, *block)) {
+				c.A = cpu.A; c.X = cpu.X; c.Y = cpu.Y; c.SP = cpu.SP; c.SF = cpu.SF;
+				c.PC = cpu.PC;
+				c.cycles = cpu.cycle_count;
+				c.instructions = 0;
+				c.status = CONTINUE;
+				// Stay in compiled code for as long as possible
+				do {
+					block->run(c);
+					stats.blocks++;
+					block = table[c.PC];
+				} while (c.status == CONTINUE && c.cycles < end && block && still_matches(mmu, *block));
+
+				cpu.A = c.A; cpu.X = c.X; cpu.Y = c.Y; cpu.SP = c.SP; cpu.SF = c.SF;
+				cpu.PC = c.PC;
+				cpu.cycle_count = c.cycles;
+				cpu.instruction_count += c.instructions;
+				stats.compiled_instructions += c.instructions;
+				if (c.status != CONTINUE) return c.status;
+				continue;
+			}
+
+			CPUStatus status = cpu.exec_instruction(mmu, true);
+			stats.interpreted_instructions++;
+			if (status == HALT || status == INVALID) return status;
+		}
+		return CONTINUE;
+	}
+
+	void report(std::ostream& os) const {
+		unsigned long total = stats.compiled_instructions + stats.interpreted_instructions;
+		os << std::dec << std::fixed << std::setprecision(1)
+			<< "Compiled code: " << program.block_count << " blocks from " << program.source << ", " << stats.blocks << " block runs, "
+			<< (total > 0 ? 100.0 * static_cast<double>(stats.compiled_instructions) / static_cast<double>(total) : 0.0)
+			<< "% of instructions" << std::endl;
+		os.unsetf(std::ios::fixed);
+		if (stats.stale_blocks > 0) {
+			os << "Blocks skipped because their code changed: " << stats.stale_blocks << std::endl;
+		}
+	}
+
+	AotStats stats;
+
+private:
+	const AotProgram& program;
+	std::vector<const AotBlock*> table;
+	CPU scratch;
+
+	// Memory has to be plain (so fetching code has no side effects) and
+	// hold the same bytes the block was compiled from. The byte after the
+	// block is fetched too, by one-byte instructions.
+	bool still_matches(MMU& mmu, const AotBlock& block) {
+		const Byte* expected = program.code + block.code_offset;
+		for (std::size_t done = 0; done < block.length;) {
+			Word address = static_cast<Word>(block.address + done);
+			const Byte* page = mmu.pages[hi(address)]->read_data();
+			if (!page) return false;
+			std::size_t count = std::min<std::size_t>(256 - lo(address), block.length - done);
+			if (std::memcmp(page + lo(address), expected + done, count) != 0) {
+				stats.stale_blocks++;
+				return false;
+			}
+			done += count;
+		}
+		return mmu.pages[hi(static_cast<Word>(block.address + block.length))]->read_data() != nullptr;
+	}
+};
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include "cpu.hpp"
+#include "metrics.hpp"
+#include "sharedmem.hpp"
+
+// Set by Ctrl-C while the program runs in the background, which pauses it
+// instead of killing the process
+inline std::atomic<bool>& interrupt_requested() {
+	static std::atomic<bool> requested(false);
+	return requested;
+}
+
+extern "C" inline void handle_interrupt(int) {
+	interrupt_requested().store(true, std::memory_order_relaxed);
+}
+
+// Ctrl-C is only caught for as long as this is in scope, i.e. while a run is
+// going. At the prompt it quits like it always did.
+class InterruptHandlerScope {
+public:
+	InterruptHandlerScope() {
+		std::signal(SIGINT, handle_interrupt);
+	}
+
+	~InterruptHandlerScope() {
+		std::signal(SIGINT, SIG_DFL);
+	}
+};
+
+// Runs the program on a worker thread while the monitor keeps reading
+// commands. The worker only looks at the pause request (and Ctrl-C) every
+// BACKGROUND_CHECK_INTERVAL instructions, so the loop in between is the same
+// one the monitor would run. The CPU's counters are published at the same
+// points so the monitor can show progress without touching the CPU.
+static constexpr unsigned BACKGROUND_CHECK_INTERVAL = 1024;
+
+class BackgroundRunner {
+public:
+	// Published at every check, if set
+	Metrics* metrics = nullptr;
+	SharedMemory* shared = nullptr;
+
+	~BackgroundRunner() {
+		pause();
+	}
+
+	// Calls step(bypass_breakpoints) until it returns false (halt, breakpoint,
+	// ...) or the run is paused, and on_interrupt() on the worker if Ctrl-C
+	// stopped it. The first call bypasses breakpoints so a run can start
+	// from one.
+	template <typename Step, typename Interrupted>
+	void start(Step step, Interrupted on_interrupt, const CPU& cpu) {
+		pause();
+		first_cycles = cpu.cycle_count;
+		first_instructions = cpu.instruction_count;
+		cycles.store(first_cycles, std::memory_order_relaxed);
+		instructions.store(first_instructions, std::memory_order_relaxed);
+		started = std::chrono::steady_clock::now();
+		relaunch = [this, step, on_interrupt, &cpu](bool bypass_first) {
+			launch(step, on_interrupt, cpu, bypass_first);
+		};
+		relaunch(true);
+	}
+
+	// Waits for the worker to stop at its next check. Afterwards the CPU and
+	// memory belong to the caller again. Returns true if this interrupted a
+	// run, false if there was none or it had already stopped by itself.
+	bool pause() {
+		if (!worker.joinable()) return false;
+		pause_requested.store(true, std::memory_order_relaxed);
+		worker.join();
+		return !stopped.load(std::memory_order_acquire);
+	}
+
+	// Picks up a paused run where it left off
+	void resume() {
+		if (relaunch && !worker.joinable()) relaunch(false);
+	}
+
+	// Waits for the run to stop by itself
+	void wait() {
+		if (worker.joinable()) worker.join();
+	}
+
+	bool is_running() const {
+		return worker.joinable() && !stopped.load(std::memory_order_acquire);
+	}
+
+	// True if the worker has stopped by itself (or on Ctrl-C) and hasn't
+	// been collected with pause() yet
+	bool has_stopped() const {
+		return worker.joinable() && stopped.load(std::memory_order_acquire);
+	}
+
+	// Emulated speed since start, from the last published counters
+	void report(std::ostream& os) const {
+		unsigned long ran_cycles = cycles.load(std::memory_order_relaxed) - first_cycles;
+		unsigned long ran_instructions = instructions.load(std::memory_order_relaxed) - first_instructions;
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+		os << std::dec << std::fixed << std::setprecision(3)
+			<< "Running for " << seconds << " s: " << ran_cycles << " cycles (" << ran_instructions << " instructions), "
+			<< (seconds > 0 ? static_cast<double>(ran_cycles) / seconds / 1e6 : 0.0) << " MHz" << std::endl;
+		os.unsetf(std::ios::fixed);
+	}
+
+private:
+	std::thread worker;
+	std::function<void(bool)> relaunch;
+	std::atomic<bool> pause_requested{false};
+	std::atomic<bool> stopped{false};
+	std::atomic<unsigned long> cycles{0};
+	std::atomic<unsigned long> instructions{0};
+	unsigned long first_cycles = 0;
+	unsigned long first_instructions = 0;
+	std::chrono::steady_clock::time_point started;
+
+	template <typename Step, typename Interrupted>
+	void launch(Step step, Interrupted on_interrupt, const CPU& cpu, bool bypass_first) {
+		interrupt_requested().store(false, std::memory_order_relaxed);
+		pause_requested.store(false, std::memory_order_relaxed);
+		stopped.store(false, std::memory_order_relaxed);
+		worker = std::thread([this, step, on_interrupt, &cpu, bypass_first]() mutable {
+			InterruptHandlerScope interrupt_handler;
+			bool bypass_breakpoints = bypass_first;
+			while (true) {
+				for (unsigned i = 0; i < BACKGROUND_CHECK_INTERVAL; i++) {
+					if (!step(bypass_breakpoints)) {
+						cycles.store(cpu.cycle_count, std::memory_order_relaxed);
+						instructions.store(cpu.instruction_count, std::memory_order_relaxed);
+						if (metrics) metrics->publish(cpu);
+						if (shared) shared->publish(cpu);
+						stopped.store(true, std::memory_order_release);
+						return;
+					}
+					bypass_breakpoints = false;
+				}
+				cycles.store(cpu.cycle_count, std::memory_order_relaxed);
+				instructions.store(cpu.instruction_count, std::memory_order_relaxed);
+				if (metrics) metrics->publish(cpu);
+				if (shared) shared->publish(cpu);
+				if (interrupt_requested().load(std::memory_order_relaxed)) {
+					on_interrupt();
+					stopped.store(true, std::memory_order_release);
+					return;
+				}
+				if (pause_requested.load(std::memory_order_relaxed)) return;
+			}
+		});
+	}
+};
+
+// Stops a background run for as long as it's in scope, e.g. while the
+// monitor runs a command, and lets it carry on afterwards
+class BackgroundPause {
+public:
+	// Only a run this actually interrupted is resumed, not one that ended
+	// by itself in the meantime
+	explicit BackgroundPause(BackgroundRunner& background) : runner(background), resume(background.pause()) {}
+
+	~BackgroundPause() {
+		if (resume) runner.resume();
+	}
+
+	// Leave it paused
+	void cancel() {
+		resume = false;
+	}
+
+	bool was_running() const {
+		return resume;
+	}
+
+private:
+	BackgroundRunner& runner;
+	bool resume;
+};
@@ -0,0 +1,247 @@
+#pragma once
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include "types.hpp"
+#include "mmu.hpp"
+#include "cpu.hpp"
+#include "system.hpp"
+#include "perfcount.hpp"
+#include "lanes.hpp"
+#include "aot.hpp"
+#include "metrics.hpp"
+#include "sharedmem.hpp"
+
+struct BenchConfig {
+	unsigned long cycles = 100000000;
+	bool fusion = true;
+	bool idle_skip = true;
+	bool perf_counters = true;
+};
+
+// Metrics and shared memory are published between chunks of this many cycles
+static constexpr unsigned long BENCH_CHUNK_CYCLES = 65536;
+
+// Runs the loaded program with no monitor for a number of emulated cycles
+// (or until it halts) and reports how fast the emulator went. With aot, the
+// compiled blocks run wherever they can.
+inline int run_benchmark(const BenchConfig& config, CPU& cpu, MMU& mmu, std::ostream& os, AotRunner* aot = nullptr, Metrics* metrics = nullptr,
+	SharedMemory* shared = nullptr) {
+	cpu.fusion_enabled = config.fusion;
+	unsigned long start_cycles = cpu.cycle_count;
+	// Compiled code doesn't keep track of loops
+	cpu.idle_detection = config.idle_skip && !aot;
+	cpu.cycle_deadline = start_cycles + config.cycles;
+	unsigned long start_skipped = cpu.idle_cycles_skipped;
+	unsigned long start_instructions = cpu.instruction_count;
+	CPUStatus status = CONTINUE;
+	PerfCounters counters;
+	bool counting = config.perf_counters && counters.open();
+
+	auto started = std::chrono::steady_clock::now();
+	if (counting) counters.start();
+	while (status != HALT && status != INVALID && status != SANITIZER && cpu.cycle_count - start_cycles < config.cycles) {
+		unsigned long chunk = std::min(BENCH_CHUNK_CYCLES, config.cycles - (cpu.cycle_count - start_cycles));
+		if (aot) {
+			status = aot->run(cpu, mmu, chunk);
+		}
+		unsigned long chunk_start = cpu.cycle_count;
+		while (!aot && cpu.cycle_count - chunk_start < chunk) {
+			status = cpu.exec_instruction(mmu, true);
+			if (status == HALT || status == INVALID || status == SANITIZER) break;
+		}
+		if (metrics) metrics->publish(cpu);
+		if (shared) shared->publish(cpu);
+	}
+	if (counting) counters.stop();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+	unsigned long cycles = cpu.cycle_count - start_cycles;
+	unsigned long instructions = cpu.instruction_count - start_instructions;
+	if (status == HALT || status == INVALID) {
+		os << (status == HALT ? "Halted" : "Invalid instruction") << " at " << format_address(cpu.PC, cpu.symbols) << std::endl;
+	}
+	if (status == SANITIZER) {
+		cpu.sanitizer->describe(os, cpu.symbols);
+	}
+	os << std::dec << std::setfill(' ') << std::fixed << std::setprecision(3)
+		<< "Ran " << cycles << " cycles (" << instructions << " instructions) in " << seconds << " s" << std::endl
+		<< "Emulated clock: " << (seconds > 0 ? static_cast<double>(cycles) / seconds / 1e6 : 0.0) << " MHz, "
+		<< (seconds > 0 ? static_cast<double>(instructions) / seconds / 1e6 : 0.0) << " M instructions/s" << std::endl;
+	os.unsetf(std::ios::fixed);
+	if (aot) {
+		aot->report(os);
+	}
+	if (cpu.idle_detection) {
+		os << "Idle loop cycles skipped: " << cpu.idle_cycles_skipped - start_skipped << std::endl;
+	}
+	os << "RAM in use: " << mmu.ram_pages_in_use() << " of 256 pages" << std::endl;
+
+	if (config.fusion) {
+		os << "Fused idioms:" << std::endl;
+		cpu.dump_fusion_stats(os);
+	}
+	if (config.perf_counters) {
+		counters.report(os, instructions);
+	}
+	return status == INVALID || status == SANITIZER ? 1 : 0;
+}
+
+// Same for a system with several CPUs: each of them runs for the given number
+// of cycles, scheduled by quantum on one thread or on a host thread each
+inline int run_system_benchmark(const BenchConfig& config, System& system, bool threaded, std::ostream& os) {
+	std::vector<unsigned long> start_cycles;
+	std::vector<unsigned long> start_instructions;
+	for (std::unique_ptr<SystemCore>& core : system.cores) {
+		core->cpu.fusion_enabled = config.fusion;
+		core->cpu.idle_detection = config.idle_skip;
+		start_cycles.push_back(core->cpu.cycle_count);
+		start_instructions.push_back(core->cpu.instruction_count);
+	}
+
+	PerfCounters counters;
+	bool counting = config.perf_counters && counters.open();
+
+	auto started = std::chrono::steady_clock::now();
+	if (counting) counters.start();
+	CPUStatus status = threaded ? system.run_threaded(config.cycles) : system.run(config.cycles);
+	if (counting) counters.stop();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+	if (status != CONTINUE && system.stopped_core) {
+		const CPU& cpu = system.stopped_core->cpu;
+		os << "CPU '" << system.stopped_core->name << "' "
+			<< (status == HALT ? "halted" : status == INVALID ? "hit an invalid instruction" : "stopped")
+			<< " at " << format_address(cpu.PC, cpu.symbols) << std::endl;
+	}
+
+	unsigned long total_cycles = 0;
+	unsigned long total_instructions = 0;
+	os << std::dec << std::setfill(' ') << std::fixed << std::setprecision(3);
+	for (std::size_t i = 0; i < system.cores.size(); i++) {
+		const CPU& cpu = system.cores[i]->cpu;
+		unsigned long cycles = cpu.cycle_count - start_cycles[i];
+		total_cycles += cycles;
+		total_instructions += cpu.instruction_count - start_instructions[i];
+		os << "CPU " << i << " (" << system.cores[i]->name << "): " << cycles << " cycles, "
+			<< cpu.instruction_count - start_instructions[i] << " instructions" << std::endl;
+	}
+	os << "Ran " << system.cores.size() << " CPUs in " << seconds << " s ("
+		<< (threaded ? "one thread each" : "quantum of " + std::to_string(system.quantum) + " cycles") << ")" << std::endl
+		<< "Combined emulated clock: " << (seconds > 0 ? static_cast<double>(total_cycles) / seconds / 1e6 : 0.0) << " MHz" << std::endl;
+	os.unsetf(std::ios::fixed);
+	if (config.perf_counters) {
+		counters.report(os, total_instructions);
+	}
+	return status == INVALID ? 1 : 0;
+}
+
+struct LaneConfig {
+	std::size_t lanes = 0;
+	bool use_lane_var = false;
+	Word lane_var = 0;   // Each lane finds its number here
+	bool verify = false; // Run every lane again on the scalar core and compare
+};
+
+inline bool lane_matches(LaneEngine& engine, std::size_t lane, CPU& cpu, CPUStatus status, MMU& mmu, std::ostream& os) {
+	CPU result;
+	engine.export_lane(lane, result);
+	bool same = result.A == cpu.A && result.X == cpu.X && result.Y == cpu.Y && result.SP == cpu.SP
+		&& result.SF == cpu.SF && result.PC == cpu.PC && result.cycle_count == cpu.cycle_count
+		&& result.instruction_count == cpu.instruction_count && engine.lane_status(lane) == status;
+	if (!same) {
+		os << "Lane " << std::dec << lane << " differs: " << result.log_state(engine.mmu(lane)) << " SP:" << std::hex << (int)result.SP
+			<< " cycles " << std::dec << result.cycle_count << ", scalar core " << cpu.log_state(mmu) << " SP:" << std::hex << (int)cpu.SP
+			<< " cycles " << std::dec << cpu.cycle_count << std::endl;
+		return false;
+	}
+	const Byte* lane_memory = engine.memory(lane);
+	for (std::size_t address = 0; address < 65536; address++) {
+		if (lane_memory[address] != mmu.read_byte(static_cast<Word>(address))) {
+			os << "Lane " << std::dec << lane << " differs at $" << std::hex << address << std::dec << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+// Runs the program on a number of lanes at once (see lanes.hpp), each for the
+// given number of cycles, and reports the combined speed
+inline int run_lane_benchmark(const BenchConfig& config, const LaneConfig& lane_config, const std::vector<Byte>& image, CPUType type, std::ostream& os) {
+	LaneEngine engine(lane_config.lanes, type);
+	engine.load_image(image);
+	if (lane_config.use_lane_var) {
+		for (std::size_t i = 0; i < engine.size(); i++) engine.memory(i)[lane_config.lane_var] = static_cast<Byte>(i);
+	}
+	engine.reset();
+	std::vector<unsigned long> start_cycles;
+	for (std::size_t i = 0; i < engine.size(); i++) start_cycles.push_back(engine.lane_cycles(i));
+
+	PerfCounters counters;
+	bool counting = config.perf_counters && counters.open();
+	auto started = std::chrono::steady_clock::now();
+	if (counting) counters.start();
+	engine.run(config.cycles);
+	if (counting) counters.stop();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+	unsigned long total_cycles = 0;
+	unsigned long total_instructions = 0;
+	bool invalid = false;
+	for (std::size_t i = 0; i < engine.size(); i++) {
+		total_cycles += engine.lane_cycles(i) - start_cycles[i];
+		total_instructions += engine.lane_instructions(i);
+		CPUStatus status = engine.lane_status(i);
+		invalid = invalid || status == INVALID;
+		CPU lane;
+		engine.export_lane(i, lane);
+		os << "Lane " << std::dec << i << ": " << lane.cycle_count - start_cycles[i] << " cycles, " << lane.instruction_count << " instructions, "
+			<< lane.log_state(engine.mmu(i));
+		if (status != CONTINUE) os << (status == HALT ? "  halted" : "  invalid instruction");
+		os << std::endl;
+	}
+	unsigned long grouped = engine.vector_instructions;
+	os << std::dec << std::fixed << std::setprecision(3)
+		<< "Ran " << engine.size() << " lanes in " << seconds << " s" << std::endl
+		<< "Combined emulated clock: " << (seconds > 0 ? static_cast<double>(total_cycles) / seconds / 1e6 : 0.0) << " MHz, "
+		<< (seconds > 0 ? static_cast<double>(total_instructions) / seconds / 1e6 : 0.0) << " M instructions/s" << std::endl
+		<< "In lockstep: " << (total_instructions > 0 ? 100.0 * static_cast<double>(grouped) / static_cast<double>(total_instructions) : 0.0)
+		<< "% of instructions, " << (engine.group_steps > 0 ? static_cast<double>(grouped) / static_cast<double>(engine.group_steps) : 0.0)
+		<< " lanes per step" << std::endl;
+	os.unsetf(std::ios::fixed);
+	if (config.perf_counters) {
+		counters.report(os, total_instructions);
+	}
+	if (!lane_config.verify) return invalid ? 1 : 0;
+
+	// Plain scalar runs, no fusion or idle loop skipping
+	std::size_t mismatches = 0;
+	double scalar_seconds = 0;
+	for (std::size_t i = 0; i < engine.size(); i++) {
+		MMU mmu;
+		mmu.initialize();
+		mmu.load_image(image.data(), image.size());
+		if (lane_config.use_lane_var) mmu.write_byte(lane_config.lane_var, static_cast<Byte>(i));
+		CPU cpu;
+		cpu.type = type;
+		cpu.reset(mmu);
+		CPUStatus status = CONTINUE;
+		started = std::chrono::steady_clock::now();
+		while (cpu.cycle_count - start_cycles[i] < config.cycles) {
+			status = cpu.exec_instruction(mmu, true);
+			if (status == HALT || status == INVALID) break;
+		}
+		scalar_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+		if (!lane_matches(engine, i, cpu, status, mmu, os)) mismatches++;
+	}
+	os << std::fixed << std::setprecision(3) << "Scalar core took " << scalar_seconds << " s for the same lanes ("
+		<< (seconds > 0 ? scalar_seconds / seconds : 0.0) << "x)" << std::endl;
+	os.unsetf(std::ios::fixed);
+	if (mismatches > 0) {
+		os << mismatches << " of " << engine.size() << " lanes differ from the scalar core" << std::endl;
+		return 1;
+	}
+	os << "All " << engine.size() << " lanes match the scalar core" << std::endl;
+	return invalid ? 1 : 0;
+}
@@ -0,0 +1,1502 @@
+#pragma once
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iomanip>
+#include "types.hpp"
+#include "helpers.hpp"
+#include "bin.hpp"
+#include "trace.hpp"
+#include "symbols.hpp"
+#include "mmu.hpp"
+#include "expr.hpp"
+#include "sanitizer.hpp"
+
+static Byte addr_mode_table[8][8] = {
+	{ CPU_ADDR_MODE_IMM,     CPU_ADDR_MODE_ZPG, CPU_ADDR_MODE_INVALID, CPU_ADDR_MODE_ABS, CPU_ADDR_MODE_INVALID, CPU_ADDR_MODE_ZPX, CPU_ADDR_MODE_INVALID, CPU_ADDR_MODE_ABX },
+	{ CPU_ADDR_MODE_ZPX_IND, CPU_ADDR_MODE_ZPG, CPU_ADDR_MODE_IMM,     CPU_ADDR_MODE_ABS, CPU_ADDR_MODE_ZPY_IND, CPU_ADDR_MODE_ZPX, CPU_ADDR_MODE_ABY,     CPU_ADDR_MODE_ABX },
+	{ CPU_ADDR_MODE_IMM,     CPU_ADDR_MODE_ZPG, CPU_ADDR_MODE_ACC,     CPU_ADDR_MODE_ABS, CPU_ADDR_MODE_INVALID, CPU_ADDR_MODE_ZPX, CPU_ADDR_MODE_INVALID, CPU_ADDR_MODE_ABX },
+
+	{ CPU_ADDR_MODE_INVALID },
+	{ CPU_ADDR_MODE_INVALID },
+	{ CPU_ADDR_MODE_INVALID },
+	{ CPU_ADDR_MODE_INVALID },
+	{ CPU_ADDR_MODE_INVALID }
+};
+
+// One executed instruction, as seen right before it ran. address is the last
+// bus access the instruction made, which for anything touching memory is
+// its effective address.
+struct HistoryEntry {
+	Word PC;
+	Word address;
+	Byte opcode;
+	Byte A, X, Y, SP, SF;
+};
+
+// Must be a power of two
+static constexpr std::size_t CPU_HISTORY_SIZE = 256;
+
+// Instruction sequences that exec_instruction can run in one go
+enum FusedIdiom {
+	FUSED_DEC_BNE,   // DEX/DEY, BNE
+	FUSED_COPY_LOOP, // LDA (zp),Y, STA abs,Y, INY, BNE
+	FUSED_CMP_BRANCH, // CMP #imm, BEQ/BNE
+	FUSED_CLC_ADC,   // CLC, ADC #imm/zp/abs
+	FUSED_IDIOM_COUNT
+};
+
+struct Breakpoint {
+	Word address;
+	Expression condition; // Empty means always stop
+	unsigned long hits = 0; // Times the address was reached, counting this one
+};
+
+// Stops after an instruction that reads and/or writes address
+struct Watchpoint {
+	Word address;
+	Byte access; // CPU_UOP_FETCH and/or CPU_UOP_WRITE
+	Expression condition;
+	unsigned long hits = 0;
+};
+
+// Longest loop body (in bytes) the idle loop detector looks at
+static constexpr Word CPU_IDLE_MAX_BODY = 64;
+
+// A loop that jumped back to target from origin, and the state it was in
+// right after doing so
+struct IdleLoop {
+	Word origin = 0;
+	Word target = 0;
+	Byte A = 0, X = 0, Y = 0, SP = 0, SF = 0;
+	unsigned long instructions = 0;
+	unsigned long cycles = 0;
+	std::size_t length = 0; // Instructions per iteration, 0 if it can't be skipped
+};
+
+static const char* const fused_idiom_names[FUSED_IDIOM_COUNT] = {
+	"DEX/DEY + BNE",
+	"LDA (zp),Y + STA abs,Y + INY + BNE",
+	"CMP #imm + BEQ/BNE",
+	"CLC + ADC"
+};
+
+struct CPU;
+
+// Runs host code for the escape opcode, see hostcall.hpp. number is the
+// byte after the opcode. Anything but CONTINUE stops the CPU with the PC
+// still on the escape.
+class HostCallHandler {
+public:
+	virtual ~HostCallHandler() {}
+	virtual CPUStatus host_call(CPU& cpu, MMU& mmu, Byte number) = 0;
+};
+
+struct CPU {
+	unsigned long cycle_count = 0;
+	
+	CPUType type = MOS;
+	Byte A, X, Y; // Registers
+	Byte SP;      // Stack Pointer
+	Word PC;      // Program Counter
+	Byte SF;      // Status Flags
+	Word addr_bus_value = 0;
+	Byte data_bus_value = 0;
+
+	Word last_good_instruction = 0;
+	Word last_jump_origin = 0;
+	Word last_jump_target = 0;
+
+	std::vector<Breakpoint> breakpoints;
+	std::vector<Watchpoint> watchpoints;
+	// Access bits per address, only allocated while there are watchpoints so
+	// the check in exec_cycle is a single empty() otherwise
+	std::vector<Byte> watch_map;
+	int triggered_watchpoint = -1;
+	Byte triggered_access = 0;
+	Byte triggered_value = 0;
+
+	// Ring buffer of the last CPU_HISTORY_SIZE instructions, always on
+	unsigned long instruction_count = 0;
+	HistoryEntry history[CPU_HISTORY_SIZE];
+
+	// AFL-style edge hit counters (64K entries), only kept up to date while
+	// fuzzing. See fuzz.hpp.
+	Byte* coverage_map = nullptr;
+
+	// Opt-in escape to host code: host_call_opcode followed by a handler
+	// number. Without a handler the opcode is as invalid as ever.
+	HostCallHandler* host_calls = nullptr;
+	Byte host_call_opcode = 0x03;
+
+	// Checked on every access when built with YA6502_SANITIZE, see
+	// sanitizer.hpp. Ignored otherwise.
+	Sanitizer* sanitizer = nullptr;
+
+	// Only used to make addresses readable in output
+	SymbolTable* symbols = nullptr;
+
+	// Run common idioms as one step. Anything that wants to see every
+	// instruction on its own (stepping, logging, profiling) has to turn this
+	// off, since a fused step is several instructions per exec_instruction.
+	bool fusion_enabled = false;
+	unsigned long fusion_hits[FUSED_IDIOM_COUNT] = {};
+
+	// Skip iterations of loops that can't do anything until something else
+	// happens. Off for the same reasons as fusion. cycle_deadline is when the
+	// next thing happens; skipping stops short of it, and with 0 (nothing
+	// planned) nothing is skipped.
+	bool idle_detection = false;
+	unsigned long cycle_deadline = 0;
+	unsigned long idle_cycles_skipped = 0;
+	IdleLoop idle_loop;
+	bool jumped_back = false;
+	Word jump_back_origin = 0;
+
+	void reset(MMU& mmu) {
+		A = 0;
+		X = 0;
+		Y = 0;
+		SP = 0xFD; // Stack pointer starts at 0x01FF, but is decremented first
+		PC = mmu.read_word(0xFFFC); // Read reset vector
+		SF = 0b00100100; // Processor status. No interrupts, no BCD mode, set break flag
+		cycle_count = 7; // Takes 7 cycles to reset
+	}
+
+	void set_flag(Byte flag, Byte value) {
+		if (value == 0) {
+			SF &= ~flag;
+		} else {
+			SF |= flag;
+		}
+	}
+
+	bool check_flag(Byte flag) {
+		if (SF & flag) {
+			return true;
+		}
+		return false;
+	}
+
+	void record_edge(Word from, Word to) {
+		if (coverage_map == nullptr) return;
+		// Multiplying by an odd constant scrambles the address bits without
+		// collisions, the shift keeps A->B and B->A apart
+		unsigned from_id = (from * 0x9E37u) & 0xFFFFu;
+		unsigned to_id = (to * 0x9E37u) & 0xFFFFu;
+		coverage_map[from_id ^ (to_id >> 1)]++;
+	}
+
+	void dump_state(MMU& mmu) {
+		std::cout << "CPU State:" << std::endl;
+		Byte instruction = mmu.read_byte(PC);
+		Word next_word = mmu.read_word(PC + 1);
+		std::cout << "Instruction: 0x" << std::hex << (int)instruction << std::endl;
+		std::cout << "Next Word: 0x" << std::hex << (int)next_word << std::endl;
+		std::cout << "A: 0x"  << std::hex << (int)A  << std::endl;
+		std::cout << "X: 0x"  << std::hex << (int)X  << std::endl;
+		std::cout << "Y: 0x"  << std::hex << (int)Y  << std::endl;
+		std::cout << "SP: 0x" << std::hex << (int)SP << std::endl;
+		std::cout << "PC: " << format_address(PC, symbols) << std::endl;
+		std::cout << "SF: 0b" << bin << (int)SF << std::endl << std::endl;
+		std::cout << "Last known good instruction was at " << format_address(last_good_instruction, symbols) << std::endl;
+		std::cout << "How did we get here? " << format_address(last_jump_origin, symbols)
+			<< " jumped to " << format_address(last_jump_target, symbols) << std::endl;
+	}
+
+	// Prints the last n instructions, oldest first
+	void dump_history(std::ostream& os, std::size_t n) {
+		if (instruction_count == 0) {
+			os << "No instructions executed yet." << std::endl;
+			return;
+		}
+		history[(instruction_count - 1) & (CPU_HISTORY_SIZE - 1)].address = addr_bus_value;
+
+		n = std::min<std::size_t>({ n, CPU_HISTORY_SIZE, static_cast<std::size_t>(instruction_count) });
+		os << "Last " << std::dec << n << " instructions:" << std::endl;
+		for (unsigned long i = instruction_count - n; i < instruction_count; i++) {
+			const HistoryEntry& entry = history[i & (CPU_HISTORY_SIZE - 1)];
+			os << std::dec << std::setw(10) << std::setfill(' ') << i << "  "
+				<< std::hex << std::setfill('0') << std::setw(4) << (int)entry.PC
+				<< " " << std::setw(2) << (int)entry.opcode
+				<< "  A:" << std::setw(2) << (int)entry.A
+				<< " X:" << std::setw(2) << (int)entry.X
+				<< " Y:" << std::setw(2) << (int)entry.Y
+				<< " P:" << std::setw(2) << (int)entry.SF
+				<< " SP:" << std::setw(2) << (int)entry.SP;
+			// Fetches from the instruction itself aren't interesting
+			if (static_cast<Word>(entry.address - entry.PC) > 2) {
+				os << "  [$" << std::setw(4) << (int)entry.address << "]";
+			}
+			std::string label = symbols ? symbols->describe(entry.PC) : "";
+			if (!label.empty()) os << "  " << label;
+			os << std::setfill(' ') << std::endl;
+		}
+	}
+
+	std::string log_state(MMU& mmu) {
+		Byte instruction = mmu.read_byte(PC);
+		std::ostringstream oss;
+		oss << std::hex << std::setw(4) << std::setfill('0') << (int)PC;
+		oss << " " << std::hex << std::setw(2) << std::setfill('0') << (int)instruction;
+		std::string label = symbols ? symbols->describe(PC) : "";
+		if (label.empty()) {
+			oss << std::setw(32) << std::setfill(' ') << "";
+		}
+		else {
+			oss << " " << std::left << std::setw(31) << std::setfill(' ') << label << std::right;
+		}
+		oss << "A:" << std::hex << std::setw(2) << std::setfill('0') << (int)A;
+		oss << " X:" << std::hex << std::setw(2) << std::setfill('0') << (int)X;
+		oss << " Y:" << std::hex << std::setw(2) << std::setfill('0') << (int)Y;
+		oss << " P:" << std::hex << std::setw(2) << std::setfill('0') << (int)SF;
+		std::string result = oss.str();
+		return result;
+	}
+
+	TraceRecord trace_record(MMU& mmu) {
+		TraceRecord rec;
+		rec.PC = PC;
+		rec.opcode = mmu.read_byte(PC);
+		rec.A = A;
+		rec.X = X;
+		rec.Y = Y;
+		rec.SF = SF;
+		rec.SP = SP;
+		rec.cycles = cycle_count;
+		rec.fields = TRACE_FIELD_ALL;
+		return rec;
+	}
+
+	void dump_fusion_stats(std::ostream& os) {
+		os << std::dec << std::setfill(' ');
+		for (int i = 0; i < FUSED_IDIOM_COUNT; i++) {
+			os << std::setw(12) << fusion_hits[i] << "  " << fused_idiom_names[i] << std::endl;
+		}
+	}
+
+	void exec_cycle(MMU& mmu, Byte micro_op) {
+		switch (micro_op) {
+			case CPU_UOP_FETCH:
+			data_bus_value = mmu.read_byte(addr_bus_value);
+			break;
+			case CPU_UOP_WRITE:
+			mmu.write_byte(addr_bus_value, data_bus_value);
+			break;
+			case CPU_UOP_NONE:
+			default: break;
+		}
+
+		if (!watch_map.empty() && (watch_map[addr_bus_value] & micro_op)) {
+			check_watchpoints(mmu, micro_op);
+		}
+		cycle_count++;
+	}
+
+	ExprContext expr_context(MMU& mmu, unsigned long hits, Byte value) {
+		return { A, X, Y, SP, SF, PC, cycle_count, hits, value, &mmu };
+	}
+
+	// True if a breakpoint at PC wants to stop. Every breakpoint at the
+	// address counts the hit, even if an earlier one already said stop.
+	bool breakpoint_hit(MMU& mmu) {
+		bool stop = false;
+		for (Breakpoint& breakpoint : breakpoints) {
+			if (breakpoint.address != PC) continue;
+			breakpoint.hits++;
+			if (breakpoint.condition.empty() || breakpoint.condition.evaluate(expr_context(mmu, breakpoint.hits, 0)) != 0) {
+				stop = true;
+			}
+		}
+		return stop;
+	}
+
+	void check_watchpoints(MMU& mmu, Byte access) {
+		for (std::size_t i = 0; i < watchpoints.size(); i++) {
+			Watchpoint& watchpoint = watchpoints[i];
+			if (watchpoint.address != addr_bus_value || !(watchpoint.access & access)) continue;
+			watchpoint.hits++;
+			if (triggered_watchpoint < 0 && (watchpoint.condition.empty()
+				|| watchpoint.condition.evaluate(expr_context(mmu, watchpoint.hits, data_bus_value)) != 0)) {
+				triggered_watchpoint = static_cast<int>(i);
+				triggered_access = access;
+				triggered_value = data_bus_value;
+			}
+		}
+	}
+
+	// Call after changing watchpoints
+	void rebuild_watch_map() {
+		watch_map.clear();
+		if (watchpoints.empty()) return;
+		watch_map.assign(65536, 0);
+		for (const Watchpoint& watchpoint : watchpoints) {
+			watch_map[watchpoint.address] |= watchpoint.access;
+		}
+	}
+
+	void stall_n_cycles(MMU& mmu, int n_cycles) {
+		// Could probably just cycle_count+=n_cycles but whatever
+                for (; n_cycles > 0; n_cycles--) {
+                        exec_cycle(mmu, CPU_UOP_NONE);
+                }
+	}
+
+	Byte fetch_one_byte(MMU& mmu, Word address) {
+#ifdef YA6502_SANITIZE
+		if (sanitizer) sanitizer->check_read(address);
+#endif
+		addr_bus_value = address;
+		exec_cycle(mmu, CPU_UOP_FETCH);
+		return data_bus_value;
+	}
+
+	// A read the 6502 makes and throws away, so whatever is there is fine
+	void dummy_read(MMU& mmu, Word address) {
+		addr_bus_value = address;
+		exec_cycle(mmu, CPU_UOP_FETCH);
+	}
+
+	// Code fetch from a page that is plain memory. Same cycles and bus values
+	// as going through the MMU, minus the virtual call.
+	void fetch_code_cycle(const Byte* page, Word address) {
+		addr_bus_value = address;
+		data_bus_value = page[lo(address)];
+		cycle_count++;
+	}
+
+	void write_one_byte(MMU& mmu, Word address, Byte value) {
+#ifdef YA6502_SANITIZE
+		if (sanitizer) sanitizer->check_write(address);
+#endif
+		addr_bus_value = address;
+		data_bus_value = value;
+		exec_cycle(mmu, CPU_UOP_WRITE);
+	}
+
+	void stack_push(MMU& mmu, Byte value) {
+#ifdef YA6502_SANITIZE
+		if (sanitizer) sanitizer->check_push(SP);
+#endif
+		Word address = (Word)SP | 0x0100;
+		write_one_byte(mmu, address, value);
+		SP--;
+	}
+
+	Byte stack_pull(MMU& mmu) {
+#ifdef YA6502_SANITIZE
+		if (sanitizer) sanitizer->check_pull(SP);
+#endif
+		SP++;
+		Word address = (Word)SP | 0x0100;
+		return fetch_one_byte(mmu, address);
+	}
+
+	void stack_push_status_flags(MMU& mmu) {
+		// " The status register will be pushed with the break
+		//   flag and bit 5 set to 1. "
+		// https://www.masswerk.at/6502/6502_instruction_set.html
+		// So if this is wrong blame those guys.
+		stack_push(mmu, SF | CPU_FLAG_B | CPU_FLAG_UNUSED);
+	}
+
+	void stack_pull_status_flags(MMU& mmu) {
+		// " The status register will be pulled with the break
+		//   flag and bit 5 ignored. "
+		Byte old_flags = SF;
+		Byte new_flags = stack_pull(mmu);
+		Byte retain = CPU_FLAG_B | CPU_FLAG_UNUSED;
+		SF = (old_flags & retain) | (new_flags & ~retain);
+	}
+
+	Byte decode_addr_mode(Byte group, Byte opcode_encoded_mode) {
+		return addr_mode_table[group][opcode_encoded_mode];
+	}
+
+	void auto_increment_pc(Byte addressing_mode) {
+		switch (addressing_mode) {
+			case CPU_ADDR_MODE_ACC:
+			PC++;
+			break;
+			case CPU_ADDR_MODE_IMM:
+			case CPU_ADDR_MODE_ZPG:
+			case CPU_ADDR_MODE_ZPX:
+			case CPU_ADDR_MODE_ZPY:
+			case CPU_ADDR_MODE_ZPX_IND:
+			case CPU_ADDR_MODE_ZPY_IND:
+			PC += 2;
+			break;
+			case CPU_ADDR_MODE_ABS:
+			case CPU_ADDR_MODE_ABX:
+			case CPU_ADDR_MODE_ABY:
+			PC += 3;
+			break;
+		}
+	}
+
+	// https://www.nesdev.org/obelisk-6502-guide/addressing.html
+	// TODO: Handle the 6502's page boundary bugs
+	Byte auto_fetch_value(MMU& mmu, Byte next_byte, Byte addressing_mode) {
+		switch (addressing_mode) {
+			case CPU_ADDR_MODE_IMM:
+			return next_byte;
+			case CPU_ADDR_MODE_ACC:
+			return A;
+			case CPU_ADDR_MODE_ZPG:
+			return fetch_one_byte(mmu, widen(next_byte));
+			case CPU_ADDR_MODE_ZPX: {
+				// The 6502 wastes a cycle reading the unindexed ZP address
+				dummy_read(mmu, widen(next_byte));
+				return fetch_one_byte(mmu, lo(widen(next_byte) + X));
+			}
+			case CPU_ADDR_MODE_ZPY: {
+				// The 6502 wastes a cycle reading the unindexed ZP address
+				dummy_read(mmu, widen(next_byte));
+				return fetch_one_byte(mmu, lo(widen(next_byte) + Y));
+			}
+			case CPU_ADDR_MODE_ABS: {
+				Byte high_addr_byte = fetch_one_byte(mmu, PC + 2);
+				Word address = make_address(next_byte, high_addr_byte);
+				return fetch_one_byte(mmu, address);
+			}
+			case CPU_ADDR_MODE_ABX: {
+				Byte high_addr_byte = fetch_one_byte(mmu, PC + 2);
+				Word address = make_address(next_byte, high_addr_byte);
+				return fetch_one_byte(mmu, address + X); // TODO: Page boundary
+			}
+			case CPU_ADDR_MODE_ABY: {
+				Byte high_addr_byte = fetch_one_byte(mmu, PC + 2);
+				Word address = make_address(next_byte, high_addr_byte);
+				return fetch_one_byte(mmu, address + Y); // TODO: Page boundary
+			}
+			case CPU_ADDR_MODE_ZPX_IND: {
+				// ZPX Indexed Indirect addressing typically fetches from an address stored in a table residing in ZP
+				Byte zp_indexed = lo(widen(next_byte) + X);
+				// TODO: Does zp wrapping also occur here?
+				Byte zp_indexed_next = lo(static_cast<Word>(widen(next_byte) + X + 1));
+				// Read address from table
+				Byte addr_lo = fetch_one_byte(mmu, zp_indexed);
+				Byte addr_hi = fetch_one_byte(mmu, zp_indexed_next);
+				Word address = make_address(addr_lo, addr_hi);
+				return fetch_one_byte(mmu, address); // Read from that address
+			}
+			// The NESDev Obelisk guide documents Indirect,Y incorrectly
+			case CPU_ADDR_MODE_ZPY_IND: {
+				// ZP contains pointer (base addr)
+				Byte addr_lo = fetch_one_byte(mmu, widen(next_byte));
+				// TODO: Does zp wrapping also occur here?
+				Byte addr_hi = fetch_one_byte(mmu, widen(static_cast<Byte>(next_byte + 1)));
+				Word address = make_address(addr_lo, addr_hi) + Y;
+				return fetch_one_byte(mmu, address); // Get it baby!
+			}
+			default: break;
+		}
+		return 0;
+	}
+
+	void auto_write_value(MMU& mmu, Byte next_byte, Byte addressing_mode, Byte value) {
+		// NOTE: Perhaps percolate some kind of error on invalid memory ops? (e.g. writing in immediate mode)
+		switch (addressing_mode) {
+			case CPU_ADDR_MODE_ACC:
+			A = value;
+			break;
+			case CPU_ADDR_MODE_ZPG:
+			write_one_byte(mmu, widen(next_byte), value);
+			break;
+			case CPU_ADDR_MODE_ZPX: {
+				// The 6502 wastes a cycle reading the unindexed ZP address
+				dummy_read(mmu, widen(next_byte));
+				write_one_byte(mmu, lo(widen(next_byte) + X), value);
+				break;
+			}
+			case CPU_ADDR_MODE_ZPY: {
+				// The 6502 wastes a cycle reading the unindexed ZP address
+				dummy_read(mmu, widen(next_byte));
+				write_one_byte(mmu, lo(widen(next_byte) + Y), value);
+				break;
+			}
+			case CPU_ADDR_MODE_ABS: {
+				Byte high_addr_byte = fetch_one_byte(mmu, PC + 2);
+				Word address = make_address(next_byte, high_addr_byte);
+				write_one_byte(mmu, address, value);
+				break;
+			}
+			case CPU_ADDR_MODE_ABX: {
+				Byte high_addr_byte = fetch_one_byte(mmu, PC + 2);
+				Word address = make_address(next_byte, high_addr_byte);
+				// TODO: Does the extra cycle from reading the unindexed address apply here?
+				write_one_byte(mmu, address + X, value); // TODO: Page boundary
+				break;
+			}
+			case CPU_ADDR_MODE_ABY: {
+				Byte high_addr_byte = fetch_one_byte(mmu, PC + 2);
+				Word address = make_address(next_byte, high_addr_byte);
+				// TODO: Does the extra cycle from reading the unindexed address apply here?
+				write_one_byte(mmu, address + Y, value); // TODO: Page boundary
+				break;
+			}
+			case CPU_ADDR_MODE_ZPX_IND: {
+				Byte zp_indexed = lo(widen(next_byte) + X);
+				// TODO: Does zp wrapping also occur here?
+				Byte zp_indexed_next = lo(static_cast<Word>(widen(next_byte) + X + 1));
+				// Read address from table
+				Byte addr_lo = fetch_one_byte(mmu, zp_indexed);
+				Byte addr_hi = fetch_one_byte(mmu, zp_indexed_next);
+				Word address = make_address(addr_lo, addr_hi);
+				write_one_byte(mmu, address, value);
+				break;
+			}
+			case CPU_ADDR_MODE_ZPY_IND: {
+				// ZP contains pointer (base addr)
+				Byte addr_lo = fetch_one_byte(mmu, widen(next_byte));
+				Byte addr_hi = fetch_one_byte(mmu, widen(static_cast<Byte>(next_byte + 1)));
+				Word address = make_address(addr_lo, addr_hi) + Y;
+				write_one_byte(mmu, address, value);
+				break;
+			}
+			default: break;
+		}
+	}
+
+	bool should_apply_bcd() {
+		return check_flag(CPU_FLAG_D) && type != NES;
+	}
+
+	bool nibble_add(bool bcd_sub, Byte a, Byte b, Byte c, Byte& d) {
+		Byte result = static_cast<Byte>(a + b + c);
+		d = result & 0xF_b;
+		bool alu_c_out = result > 0xF;
+		bool bcd_invalid = d > 9;
+		
+		// As far as I can tell nobody has described this behavior accurately
+		// This took me about a whole day of screwing around to get it to pass
+		if (should_apply_bcd()) {
+			if (bcd_invalid) {
+				if (bcd_sub) {
+					d = static_cast<Byte>(d - 6) & 0xF_b;
+					if (!alu_c_out) {
+						return false;
+					}
+				}
+				else {
+					d = static_cast<Byte>(d + 6) & 0xF_b;
+				}
+			}
+			else if (alu_c_out && !bcd_sub) {
+				d = static_cast<Byte>(d + 6) & 0xF_b;
+			}
+			else if (!alu_c_out && bcd_sub) {
+				d = static_cast<Byte>(d - 6) & 0xF_b;
+			}
+
+			return alu_c_out || bcd_invalid;
+		}
+
+		return alu_c_out;
+	}
+
+	// http://www.6502.org/tutorials/decimal_mode.html#A
+	// https://forums.atariage.com/topic/163876-flags-on-decimal-mode-on-the-nmos-6502
+	// https://c74project.com/card-b-alu-cu/
+	void full_add(Byte operand, bool bcd_sub) {
+		Byte A_lo_nib = A & 0xF_b;
+		Byte A_hi_nib = A >> 4;
+		Byte o_lo_nib = operand & 0xF_b;
+		Byte o_hi_nib = operand >> 4;
+
+		Byte result_lo_nib = 0;
+		Byte result_hi_nib = 0;
+		bool half_carry = nibble_add(bcd_sub, A_lo_nib, o_lo_nib, check_flag(CPU_FLAG_C), result_lo_nib);
+		bool carry_out = nibble_add(bcd_sub, A_hi_nib, o_hi_nib, half_carry, result_hi_nib);
+		Byte result = make_byte(result_lo_nib, result_hi_nib);
+
+		set_flag(CPU_FLAG_C, carry_out);
+		set_flag(CPU_FLAG_Z, result == 0);
+		set_flag(CPU_FLAG_V, (~(A ^ operand) & (A ^ result)) & 0b10000000);
+		set_flag(CPU_FLAG_N, result & 0b10000000);
+
+		A = result;
+	}
+
+	void compare(Byte reg, Byte value) {
+		Word result = static_cast<Word>(reg - value);
+		set_flag(CPU_FLAG_C, reg >= value);
+		set_flag(CPU_FLAG_Z, result == 0);
+		set_flag(CPU_FLAG_N, static_cast<Byte>(result & 0b10000000));
+	}
+
+	// PC is still at the branch instruction
+	void branch(MMU& mmu, Byte offset, bool taken) {
+		Word origin = PC;
+		if (taken) {
+			last_jump_origin = PC;
+			stall_n_cycles(mmu, 1); // TODO: 2 if to a new page
+			PC = static_cast<Word>(PC + (Byte_S)offset); // Convert to signed type to do signed addition
+		}
+
+		PC += 2; // PC is always incremented by 2 here
+		last_jump_target = PC;
+		record_edge(origin, PC);
+		if (taken && PC <= origin) {
+			jumped_back = true;
+			jump_back_origin = origin;
+		}
+	}
+
+	// Bookkeeping at the end of every multi-byte instruction
+	CPUStatus finish_instruction(Word old_pc) {
+		last_good_instruction = old_pc;
+		if (PC == old_pc) return HALT;
+		return CONTINUE;
+	}
+
+	// Starts the history entry for the instruction at PC
+	HistoryEntry& begin_history() {
+		// The previous instruction is done with the bus by now
+		history[(instruction_count - 1) & (CPU_HISTORY_SIZE - 1)].address = addr_bus_value;
+		HistoryEntry& entry = history[instruction_count & (CPU_HISTORY_SIZE - 1)];
+		instruction_count++;
+		entry.PC = PC;
+		entry.A = A;
+		entry.X = X;
+		entry.Y = Y;
+		entry.SP = SP;
+		entry.SF = SF;
+		return entry;
+	}
+
+	bool breakpoint_between(Word first, Word last) {
+		for (const Breakpoint& breakpoint : breakpoints) {
+			if (breakpoint.address >= first && breakpoint.address <= last) return true;
+		}
+		return false;
+	}
+
+	// Superinstructions. If the code at PC starts one of the idioms, runs the
+	// whole sequence and returns true. Each instruction in it still gets its
+	// own history entry and makes exactly the bus accesses and cycles it would
+	// on its own; the savings come from skipping the decoder and reading the
+	// instruction bytes straight out of the page. Only code in pages that can
+	// be read without side effects is fused, and never over a breakpoint.
+	bool exec_fused(MMU& mmu, CPUStatus& status) {
+		// Code fetches here skip exec_cycle, so read watchpoints wouldn't see them
+		if (!watch_map.empty()) return false;
+#ifdef YA6502_SANITIZE
+		// Nor would the sanitizer
+		if (sanitizer) return false;
+#endif
+		const Byte* code = mmu.pages[hi(PC)]->read_data();
+		if (code == nullptr) return false;
+		// Sequences never cross into the next page, so the lookups stay simple
+		std::size_t offset = lo(PC);
+		std::size_t room = 256 - offset;
+		Word start = PC;
+		Byte first = code[offset];
+		Byte second = room > 1 ? code[offset + 1] : 0;
+
+		if ((first == 0xCA || first == 0x88) && second == 0xD0 && room >= 3) {
+			if (breakpoint_between(start + 1, start + 1)) return false;
+			// DEX/DEY
+			begin_history().opcode = first;
+			fetch_code_cycle(code, PC);
+			fetch_code_cycle(code, PC + 1);
+			Byte& reg = first == 0xCA ? X : Y;
+			reg--;
+			set_flag(CPU_FLAG_Z, reg == 0);
+			set_flag(CPU_FLAG_N, reg & 0b10000000);
+			PC++;
+			// BNE
+			begin_history().opcode = 0xD0;
+			fetch_code_cycle(code, PC);
+			fetch_code_cycle(code, PC + 1);
+			branch(mmu, data_bus_value, !check_flag(CPU_FLAG_Z));
+			status = finish_instruction(start + 1);
+			fusion_hits[FUSED_DEC_BNE]++;
+			return true;
+		}
+
+		if (first == 0xC9 && room >= 4 && (code[offset + 2] == 0xF0 || code[offset + 2] == 0xD0)) {
+			if (breakpoint_between(start + 2, start + 2)) return false;
+			// CMP #imm
+			begin_history().opcode = first;
+			fetch_code_cycle(code, PC);
+			fetch_code_cycle(code, PC + 1);
+			compare(A, data_bus_value);
+			PC += 2;
+			last_good_instruction = start;
+			// BEQ/BNE
+			Byte branch_opcode = code[offset + 2];
+			begin_history().opcode = branch_opcode;
+			fetch_code_cycle(code, PC);
+			fetch_code_cycle(code, PC + 1);
+			branch(mmu, data_bus_value, check_flag(CPU_FLAG_Z) == (branch_opcode == 0xF0));
+			status = finish_instruction(start + 2);
+			fusion_hits[FUSED_CMP_BRANCH]++;
+			return true;
+		}
+
+		if (first == 0x18 && (second == 0x69 || second == 0x65 || (second == 0x6D && room >= 4)) && room >= 3) {
+			if (breakpoint_between(start + 1, start + 1)) return false;
+			// CLC
+			begin_history().opcode = first;
+			fetch_code_cycle(code, PC);
+			fetch_code_cycle(code, PC + 1);
+			set_flag(CPU_FLAG_C, 0);
+			PC++;
+			// ADC
+			begin_history().opcode = second;
+			fetch_code_cycle(code, PC);
+			fetch_code_cycle(code, PC + 1);
+			Byte operand = data_bus_value;
+			if (second == 0x65) {
+				operand = fetch_one_byte(mmu, widen(operand));
+				PC += 2;
+			}
+			else if (second == 0x6D) {
+				Byte addr_lo = operand;
+				fetch_code_cycle(code, PC + 2);
+				operand = fetch_one_byte(mmu, make_address(addr_lo, data_bus_value));
+				PC += 3;
+			}
+			else {
+				PC += 2;
+			}
+			full_add(operand, false);
+			status = finish_instruction(start + 1);
+			fusion_hits[FUSED_CLC_ADC]++;
+			return true;
+		}
+
+		if (first == 0xB1 && room >= 8 && code[offset + 2] == 0x99 && code[offset + 5] == 0xC8 && code[offset + 6] == 0xD0) {
+			if (breakpoint_between(start + 2, start + 6)) return false;
+			// LDA (zp),Y
+			begin_history().opcode = first;
+			fetch_code_cycle(code, PC);
+			fetch_code_cycle(code, PC + 1);
+			Byte zp = data_bus_value;
+			Byte addr_lo = fetch_one_byte(mmu, widen(zp));
+			Byte addr_hi = fetch_one_byte(mmu, widen(static_cast<Byte>(zp + 1)));
+			A = fetch_one_byte(mmu, make_address(addr_lo, addr_hi) + Y);
+			set_flag(CPU_FLAG_Z, A == 0);
+			set_flag(CPU_FLAG_N, A & 0b10000000);
+			PC += 2;
+			last_good_instruction = start;
+			// STA abs,Y
+			begin_history().opcode = 0x99;
+			fetch_code_cycle(code, PC);
+			fetch_code_cycle(code, PC + 1);
+			addr_lo = data_bus_value;
+			fetch_code_cycle(code, PC + 2);
+			write_one_byte(mmu, make_address(addr_lo, data_bus_value) + Y, A);
+			PC += 3;
+			last_good_instruction = start + 2;
+			fusion_hits[FUSED_COPY_LOOP]++;
+			// The store may have rewritten the rest of the loop or switched
+			// banks under it, in which case it runs the slow way
+			if (mmu.pages[hi(start)]->read_data() != code || code[offset + 5] != 0xC8 || code[offset + 6] != 0xD0) {
+				status = CONTINUE;
+				return true;
+			}
+			// INY
+			begin_history().opcode = 0xC8;
+			fetch_code_cycle(code, PC);
+			fetch_code_cycle(code, PC + 1);
+			Y++;
+			set_flag(CPU_FLAG_Z, Y == 0);
+			set_flag(CPU_FLAG_N, Y & 0b10000000);
+			PC++;
+			// BNE
+			begin_history().opcode = 0xD0;
+			fetch_code_cycle(code, PC);
+			fetch_code_cycle(code, PC + 1);
+			branch(mmu, data_bus_value, !check_flag(CPU_FLAG_Z));
+			status = finish_instruction(start + 6);
+			return true;
+		}
+
+		return false;
+	}
+
+	// Length of an instruction that only reads memory and registers, with the
+	// address it reads (if any) in address. 0 for anything else.
+	static Word pure_instruction_length(Byte opcode, const Byte* operand, Word& address, bool& reads_memory) {
+		reads_memory = false;
+		switch (opcode) {
+			case 0xEA: // NOP
+			case 0x18: case 0x38: case 0x58: case 0x78: case 0xB8: case 0xD8: case 0xF8: // Flags
+			case 0xAA: case 0xA8: case 0x8A: case 0x98: case 0xBA: case 0x9A: // Transfers
+			case 0xE8: case 0xCA: case 0xC8: case 0x88: // INX, DEX, INY, DEY
+			return 1;
+			case 0xA9: case 0xA2: case 0xA0: case 0xC9: case 0xE0: case 0xC0: // Load/compare immediate
+			case 0x29: case 0x09: case 0x49: case 0x69: case 0xE9: // Logic/arithmetic immediate
+			return 2;
+			case 0xA5: case 0xA6: case 0xA4: case 0xC5: case 0xE4: case 0xC4: // Load/compare zero page
+			case 0x25: case 0x05: case 0x45: case 0x65: case 0xE5: case 0x24: // Logic/arithmetic/BIT zero page
+			reads_memory = true;
+			address = widen(operand[0]);
+			return 2;
+			case 0xAD: case 0xAE: case 0xAC: case 0xCD: case 0xEC: case 0xCC: // Load/compare absolute
+			case 0x2D: case 0x0D: case 0x4D: case 0x6D: case 0xED: case 0x2C: // Logic/arithmetic/BIT absolute
+			reads_memory = true;
+			address = make_address(operand[0], operand[1]);
+			return 3;
+			default: return 0;
+		}
+	}
+
+	// Checks that the loop from target to the jump at origin is straight-line
+	// code that writes nothing and only reads memory nobody else can change.
+	// Returns the number of instructions in it, or 0 if it doesn't qualify.
+	std::size_t idle_loop_length(MMU& mmu, Word target, Word origin) {
+		if (breakpoint_between(target, origin)) return 0;
+		std::size_t count = 0;
+		Word address = target;
+		while (address != origin) {
+			Byte bytes[3];
+			for (Word i = 0; i < 3; i++) {
+				const Byte* code = mmu.pages[hi(static_cast<Word>(address + i))]->read_data();
+				if (code == nullptr) return 0;
+				bytes[i] = code[lo(static_cast<Word>(address + i))];
+			}
+
+			Word read_address = 0;
+			bool reads_memory = false;
+			Word length = pure_instruction_length(bytes[0], bytes + 1, read_address, reads_memory);
+			if (length == 0 || static_cast<Word>(origin - address) < length) return 0;
+			if (reads_memory) {
+				const MemoryPage* page = mmu.pages[hi(read_address)];
+				if (page->read_data() == nullptr || page->is_volatile()) return 0;
+			}
+			address = static_cast<Word>(address + length);
+			count++;
+		}
+		return count + 1; // The jump back
+	}
+
+	// Runs after an instruction (or fused sequence) that jumped backwards. When
+	// the last iteration was a pass through a side-effect-free loop that left
+	// every register the way it found it, every further iteration will be the
+	// same, so they are skipped in one go: as many whole iterations as fit
+	// before cycle_deadline, with the counters and history ending up exactly
+	// where running them would have left them.
+	CPUStatus check_idle_loop(MMU& mmu, CPUStatus status) {
+		if (!jumped_back) return status;
+		jumped_back = false;
+		if (!idle_detection || status != CONTINUE || coverage_map != nullptr || !watch_map.empty()) return status;
+
+		IdleLoop& loop = idle_loop;
+		bool repeated = loop.length > 0 && loop.origin == jump_back_origin && loop.target == PC
+			&& loop.A == A && loop.X == X && loop.Y == Y && loop.SP == SP && loop.SF == SF
+			&& instruction_count - loop.instructions == loop.length;
+		if (!repeated) {
+			// Still going round the same loop, which doesn't write anything, so
+			// there's no need to decode the body again
+			bool same_loop = loop.length > 0 && loop.origin == jump_back_origin && loop.target == PC
+				&& instruction_count - loop.instructions == loop.length;
+			loop.origin = jump_back_origin;
+			loop.target = PC;
+			loop.A = A;
+			loop.X = X;
+			loop.Y = Y;
+			loop.SP = SP;
+			loop.SF = SF;
+			loop.instructions = instruction_count;
+			loop.cycles = cycle_count;
+			if (!same_loop) {
+				loop.length = jump_back_origin - PC > CPU_IDLE_MAX_BODY ? 0 : idle_loop_length(mmu, PC, jump_back_origin);
+			}
+			return status;
+		}
+
+		// Nothing to skip ahead to, so it keeps spinning like it would step
+		// by step. Something outside the CPU may still change what it polls.
+		if (cycle_deadline == 0) return status;
+
+		unsigned long period = cycle_count - loop.cycles;
+		unsigned long skip = cycle_deadline > cycle_count ? (cycle_deadline - cycle_count) / period : 0;
+		if (skip > 0) {
+			// The iteration that just ran is what the skipped ones would have
+			// left in the history
+			history[(instruction_count - 1) & (CPU_HISTORY_SIZE - 1)].address = addr_bus_value;
+			HistoryEntry iteration[CPU_IDLE_MAX_BODY + 1];
+			unsigned long first = instruction_count - loop.length;
+			for (std::size_t i = 0; i < loop.length; i++) {
+				iteration[i] = history[(first + i) & (CPU_HISTORY_SIZE - 1)];
+			}
+			unsigned long end = instruction_count + skip * loop.length;
+			unsigned long refill = std::max(first, end > CPU_HISTORY_SIZE ? end - CPU_HISTORY_SIZE : 0);
+			for (unsigned long i = refill; i < end; i++) {
+				history[i & (CPU_HISTORY_SIZE - 1)] = iteration[(i - first) % loop.length];
+			}
+
+			instruction_count = end;
+			cycle_count += skip * period;
+			idle_cycles_skipped += skip * period;
+		}
+		loop.instructions = instruction_count;
+		loop.cycles = cycle_count;
+		return status;
+	}
+
+	CPUStatus exec_instruction(MMU& mmu, bool bypass_breakpoints) {
+		// Conditions are only evaluated when the address matches
+		if (!bypass_breakpoints && !breakpoints.empty() && breakpoint_hit(mmu)) {
+			return BREAKPOINT;
+		}
+
+		CPUStatus status = execute(mmu);
+		// Watchpoints let the instruction finish, then stop
+		if (triggered_watchpoint >= 0 && status == CONTINUE) {
+			return WATCHPOINT;
+		}
+#ifdef YA6502_SANITIZE
+		if (sanitizer && sanitizer->fault != SAN_NONE && status == CONTINUE) {
+			return SANITIZER;
+		}
+#endif
+		return status;
+	}
+
+	// https://www.nesdev.org/obelisk-6502-guide/reference.html
+	// https://llx.com/Neil/a2/opcodes.html
+	CPUStatus execute(MMU& mmu) {
+		triggered_watchpoint = -1;
+		if (fusion_enabled) {
+			CPUStatus fused_status;
+			if (exec_fused(mmu, fused_status)) return check_idle_loop(mmu, fused_status);
+		}
+
+		HistoryEntry& entry = begin_history();
+#ifdef YA6502_SANITIZE
+		if (sanitizer) sanitizer->begin_instruction(PC);
+#endif
+		addr_bus_value = PC;
+		exec_cycle(mmu, CPU_UOP_FETCH);
+		Byte instruction = data_bus_value;
+		entry.opcode = instruction;
+		
+		// " All single-byte instructions waste a cycle reading and ignoring
+		//   the byte that comes immediately after the instruction. "
+		// - Sun Tzu, The Art of 6502
+		addr_bus_value = PC + 1;
+		exec_cycle(mmu, CPU_UOP_FETCH);
+		Byte next_byte = data_bus_value;
+
+		Byte aaa = (instruction & 0b11100000) >> 5; // Opcode
+		Byte bbb = (instruction & 0b00011100) >> 2; // Addressing Mode
+		Byte cc  = (instruction & 0b00000011);      // Opcode group
+		Byte final_addr_mode = decode_addr_mode(cc, bbb);
+
+		bool complex_instruction = false;
+		Word old_pc = PC;
+
+		if (host_calls && instruction == host_call_opcode) {
+			CPUStatus status = host_calls->host_call(*this, mmu, next_byte);
+			if (status != CONTINUE) return status;
+			PC += 2;
+			return check_idle_loop(mmu, finish_instruction(old_pc));
+		}
+
+		// First we'll handle the stray one-byte instructions
+		switch (instruction) {
+			case 0xEA: break; // NOP
+			case 0x00: {
+				// BRK
+				Word to_push = PC + 2;
+				stack_push(mmu, hi(to_push));
+				stack_push(mmu, lo(to_push));
+				stack_push_status_flags(mmu);
+				// https://www.masswerk.at/6502/6502_instruction_set.html#BRK
+				// These guys say BRK does not disable interrupts, but everywhere
+				// else I look says it does.
+				SF |= CPU_FLAG_B | CPU_FLAG_I;
+				Word interrupt_vector = make_address(fetch_one_byte(mmu, 0xFFFE), fetch_one_byte(mmu, 0xFFFF));
+				last_jump_origin = PC;
+				last_jump_target = interrupt_vector;
+				record_edge(PC, interrupt_vector);
+				PC = interrupt_vector - 1; // -1 to compensate for later PC++
+				break;
+			}
+			case 0x40:{
+				// RTI
+				// TODO: Does flag B come from the stack or not???
+				stack_pull_status_flags(mmu);
+				Byte b_lo = stack_pull(mmu);
+				Byte b_hi = stack_pull(mmu);
+				Word target = make_address(b_lo, b_hi);
+				last_jump_origin = PC;
+				last_jump_target = target;
+				record_edge(PC, target);
+				PC = target - 1; // Compensate
+				break;
+			}
+			case 0x60: {
+				// RTS
+				Byte b_lo = stack_pull(mmu);
+				Byte b_hi = stack_pull(mmu);
+				Word target = make_address(b_lo, b_hi);
+				last_jump_origin = PC;
+				last_jump_target = target + 1;
+				record_edge(PC, last_jump_target);
+				// Normally we would compensate for PC++ by subtracting 1.
+				// However, JSR pushes the return address minus 1.
+				// So, in this case, we want PC++ to happen.
+				PC = target;
+				break;
+			}
+
+			// Flag manipulation instructions
+			case 0x18:
+			// CLC
+			set_flag(CPU_FLAG_C, 0);
+			break;
+			case 0x38:
+			// SEC
+			set_flag(CPU_FLAG_C, 1);
+			break;
+			case 0x58:
+			// CLI
+			set_flag(CPU_FLAG_I, 0);
+			break;
+			case 0x78:
+			// SEI
+			set_flag(CPU_FLAG_I, 1);
+			break;
+			case 0xB8:
+			// CLV
+			set_flag(CPU_FLAG_V, 0);
+			break;
+			case 0xD8:
+			// CLD
+			set_flag(CPU_FLAG_D, 0);
+			break;
+			case 0xF8:
+			// SED
+			set_flag(CPU_FLAG_D, 1);
+			break;
+
+			// Register transfer instructions
+			case 0xA8:
+			// TAY
+			Y = A;
+			set_flag(CPU_FLAG_Z, Y == 0);
+			set_flag(CPU_FLAG_N, Y & 0b10000000);
+			break;
+			case 0x98:
+			// TYA
+			A = Y;
+			set_flag(CPU_FLAG_Z, A == 0);
+			set_flag(CPU_FLAG_N, A & 0b10000000);
+			break;
+			case 0xAA:
+			// TAX
+			X = A;
+			set_flag(CPU_FLAG_Z, X == 0);
+			set_flag(CPU_FLAG_N, X & 0b10000000);
+			break;
+			case 0x8A:
+			// TXA
+			A = X;
+			set_flag(CPU_FLAG_Z, A == 0);
+			set_flag(CPU_FLAG_N, A & 0b10000000);
+			break;
+			case 0x9A:
+			// TXS
+			SP = X;
+			break;
+			case 0xBA:
+			// TSX
+			X = SP;
+			set_flag(CPU_FLAG_Z, X == 0);
+			set_flag(CPU_FLAG_N, X & 0b10000000);
+			break;
+
+			// Stack instructions
+			case 0x08:
+			// PHP
+			stack_push_status_flags(mmu);
+			break;
+			case 0x28:
+			// PLP
+			stack_pull_status_flags(mmu);
+			break;
+			case 0x48:
+			// PHA
+			stack_push(mmu, A);
+			break;
+			case 0x68:
+			// PLA
+			A = stack_pull(mmu);
+			set_flag(CPU_FLAG_Z, A == 0);
+			set_flag(CPU_FLAG_N, A & 0b10000000);
+			break;
+
+			// Increment and decrement instructions
+			case 0xC8:
+			// INY
+			Y++;
+			set_flag(CPU_FLAG_Z, Y == 0);
+			set_flag(CPU_FLAG_N, Y & 0b10000000);
+			break;
+			case 0x88:
+			// DEY
+			Y--;
+			set_flag(CPU_FLAG_Z, Y == 0);
+			set_flag(CPU_FLAG_N, Y & 0b10000000);
+			break;
+			case 0xE8:
+			// INX
+			X++;
+			set_flag(CPU_FLAG_Z, X == 0);
+			set_flag(CPU_FLAG_N, X & 0b10000000);
+			break;
+			case 0xCA:
+			// DEX
+			X--;
+			set_flag(CPU_FLAG_Z, X == 0);
+			set_flag(CPU_FLAG_N, X & 0b10000000);
+			break;
+
+			// Odd one out:
+			case 0x20: {
+				// JSR
+				// PC + 3 is the address of the next instruction.
+				// JSR pushes next_instruction_addr - 1, in essence PC + 2.
+				Word return_addr = PC + 2;
+				stack_push(mmu, hi(return_addr));
+				stack_push(mmu, lo(return_addr));
+				Word target = make_address(next_byte, fetch_one_byte(mmu, PC + 2));
+				last_jump_origin = PC;
+				last_jump_target = target;
+				record_edge(PC, target);
+				PC = target - 1; // Compensate
+				break;
+			}
+
+			default: complex_instruction = true; break;
+		}
+
+		if (!complex_instruction) {
+			PC++;
+			return CONTINUE;
+		}
+
+		switch (cc) {
+			case 0b01: // Group 1
+			switch (aaa) {
+				case 0b000: {
+					// ORA - Logical OR
+					A |= auto_fetch_value(mmu, next_byte, final_addr_mode);
+					set_flag(CPU_FLAG_Z, A == 0);
+					set_flag(CPU_FLAG_N, A & 0b10000000);
+					break;
+				}
+				case 0b001: {
+					// AND - Logical AND
+					A &= auto_fetch_value(mmu, next_byte, final_addr_mode);
+					set_flag(CPU_FLAG_Z, A == 0);
+					set_flag(CPU_FLAG_N, A & 0b10000000);
+					break;
+				}
+				case 0b010: {
+					// EOR - Logical Exclusive OR
+					A ^= auto_fetch_value(mmu, next_byte, final_addr_mode);
+					set_flag(CPU_FLAG_Z, A == 0);
+					set_flag(CPU_FLAG_N, A & 0b10000000);
+					break;
+				}
+				case 0b011: {
+					// ADC - Add with Carry
+					Byte operand = auto_fetch_value(mmu, next_byte, final_addr_mode);
+					full_add(operand, false);
+					break;
+				}
+				case 0b100: {
+					// STA - Store Accumulator
+					auto_write_value(mmu, next_byte, final_addr_mode, A);
+					break;
+				}
+				case 0b101: {
+					// LDA - Load Accumulator
+					A = auto_fetch_value(mmu, next_byte, final_addr_mode);
+					set_flag(CPU_FLAG_Z, A == 0);
+					set_flag(CPU_FLAG_N, A & 0b10000000);
+					break;
+				}
+				case 0b110: {
+					// CMP - Compare Accumulator
+					compare(A, auto_fetch_value(mmu, next_byte, final_addr_mode));
+					break;
+				}
+				case 0b111: {
+					// SBC - Subtract with Carry
+					Byte operand = ~auto_fetch_value(mmu, next_byte, final_addr_mode);
+					full_add(operand, true);
+					break;
+				}
+				default:
+				PC++;
+				return INVALID;
+			}
+			auto_increment_pc(final_addr_mode);
+			break;
+			case 0b10: // Group 2
+			switch (aaa) {
+				case 0b000: {
+					// ASL - Arithmetic Shift Left
+					Byte to_shift = auto_fetch_value(mmu, next_byte, final_addr_mode);
+					set_flag(CPU_FLAG_C, to_shift & 0b10000000);
+					to_shift <<= 1;
+					set_flag(CPU_FLAG_Z, to_shift == 0); // Documented incorrectly on NESdev?
+					set_flag(CPU_FLAG_N, to_shift & 0b10000000);
+					// TODO: Figure out how this works if we are in accumulator addressing mode
+					auto_write_value(mmu, next_byte, final_addr_mode, to_shift);
+					break;
+				}
+				case 0b001: {
+					// ROL - Rotate Left
+					Byte to_rotate = auto_fetch_value(mmu, next_byte, final_addr_mode);
+					Byte old_carry = check_flag(CPU_FLAG_C);
+					set_flag(CPU_FLAG_C, to_rotate & 0b10000000);
+					to_rotate <<= 1;
+					to_rotate |= old_carry;
+					set_flag(CPU_FLAG_Z, to_rotate == 0); // Documented incorrectly on NESdev?
+					set_flag(CPU_FLAG_N, to_rotate & 0b10000000);
+					// TODO: Figure out how this works if we are in accumulator addressing mode
+					auto_write_value(mmu, next_byte, final_addr_mode, to_rotate);
+					break;
+				}
+				case 0b010: {
+					// LSR - Logical Shift Right
+					Byte to_shift = auto_fetch_value(mmu, next_byte, final_addr_mode);
+					set_flag(CPU_FLAG_C, to_shift & 1);
+					to_shift >>= 1;
+					set_flag(CPU_FLAG_Z, to_shift == 0); // Weirdly differs from the others on NESdev
+					set_flag(CPU_FLAG_N, to_shift & 0b10000000);
+					// TODO: Figure out how this works if we are in accumulator addressing mode
+					auto_write_value(mmu, next_byte, final_addr_mode, to_shift);
+					break;
+				}
+				case 0b011: {
+					// ROR - Rotate Right
+					Byte to_rotate = auto_fetch_value(mmu, next_byte, final_addr_mode);
+					Byte old_carry = check_flag(CPU_FLAG_C);
+					set_flag(CPU_FLAG_C, to_rotate & 1);
+					to_rotate >>= 1;
+					to_rotate |= old_carry << 7;
+					set_flag(CPU_FLAG_Z, to_rotate == 0); // Documented incorrectly on NESdev?
+					set_flag(CPU_FLAG_N, to_rotate & 0b10000000);
+					// TODO: Figure out how this works if we are in accumulator addressing mode
+					auto_write_value(mmu, next_byte, final_addr_mode, to_rotate);
+					break;
+				}
+				case 0b100: {
+					// STX - Store X Register
+					// STX A = TXA but that is handled earlier
+
+					// Addressing mode quirk:
+					// zpx <-> zpy
+					// abx <-> aby
+					if (final_addr_mode == CPU_ADDR_MODE_ZPX)
+						final_addr_mode = CPU_ADDR_MODE_ZPY;
+					else if (final_addr_mode == CPU_ADDR_MODE_ZPY)
+						final_addr_mode = CPU_ADDR_MODE_ZPX;
+
+					// STX abs,Y is unassigned
+					if (final_addr_mode != CPU_ADDR_MODE_INVALID) {
+						auto_write_value(mmu, next_byte, final_addr_mode, X);
+					}
+					break;
+				}
+				case 0b101: {
+					// LDX - Load X Register
+					// LDX A = TAX but that is handled earlier
+
+					// Addressing mode quirk:
+					// zpx <-> zpy
+					// abx <-> aby
+					if (final_addr_mode == CPU_ADDR_MODE_ZPX)
+						final_addr_mode = CPU_ADDR_MODE_ZPY;
+					else if (final_addr_mode == CPU_ADDR_MODE_ZPY)
+						final_addr_mode = CPU_ADDR_MODE_ZPX;
+					else if (final_addr_mode == CPU_ADDR_MODE_ABX)
+						final_addr_mode = CPU_ADDR_MODE_ABY;
+					else if (final_addr_mode == CPU_ADDR_MODE_ABY)
+						final_addr_mode = CPU_ADDR_MODE_ABX;
+					
+					X = auto_fetch_value(mmu, next_byte, final_addr_mode);
+					set_flag(CPU_FLAG_Z, X == 0);
+					set_flag(CPU_FLAG_N, X & 0b10000000);
+					break;
+				}
+				case 0b110: {
+					// DEC - Decrement Memory
+					// DEC A is DEX but that is handled earlier
+					// TODO: Check if this uses the correct number of cycles
+					Byte M = lo(static_cast<Word>(auto_fetch_value(mmu, next_byte, final_addr_mode) - 1));
+					set_flag(CPU_FLAG_Z, M == 0);
+					set_flag(CPU_FLAG_N, M & 0b10000000);
+					auto_write_value(mmu, next_byte, final_addr_mode, M);
+					break;
+				}
+				case 0b111: {
+					// INC - Increment Memory
+					// INC A is NOP but that is handled earlier
+					// TODO: Check if this uses the correct number of cycles
+					Byte M = lo(static_cast<Word>(auto_fetch_value(mmu, next_byte, final_addr_mode) + 1));
+					set_flag(CPU_FLAG_Z, M == 0);
+					set_flag(CPU_FLAG_N, M & 0b10000000);
+					auto_write_value(mmu, next_byte, final_addr_mode, M);
+					break;
+				}
+				default:
+				PC++;
+				return INVALID;
+			}
+			auto_increment_pc(final_addr_mode);
+			break;
+			case 0b00: // Group 3
+			if (bbb == 0b100) {
+				// Covers all conditional branch instructions
+				Byte untranslated_flag = aaa >> 1;
+				Byte condition = aaa & 1;
+				Byte flag = 0;
+				switch (untranslated_flag) {
+					case 0: flag = CPU_FLAG_N; break;
+					case 1: flag = CPU_FLAG_V; break;
+					case 2: flag = CPU_FLAG_C; break;
+					case 3: flag = CPU_FLAG_Z;
+					default: break;
+				}
+
+				branch(mmu, next_byte, check_flag(flag) == condition);
+				break; // Prevents the switch(aaa) from running
+			}
+			switch (aaa) {
+				case 0b001: {
+					// BIT - Bit Test
+					Word address_to_test = widen(next_byte);
+					if (bbb == 0b011) {
+						// Absolute mode
+						addr_bus_value = PC + 2;
+						exec_cycle(mmu, CPU_UOP_FETCH); // Get second byte of address to test
+						address_to_test |= static_cast<Word>(widen(data_bus_value) << 8);
+						PC++;
+					}
+					
+					addr_bus_value = address_to_test;
+					exec_cycle(mmu, CPU_UOP_FETCH);
+					Byte result = A & data_bus_value;
+
+					set_flag(CPU_FLAG_Z, result == 0);
+					set_flag(CPU_FLAG_V, data_bus_value & 0b01000000);
+					set_flag(CPU_FLAG_N, data_bus_value & 0b10000000);
+
+					PC += 2;
+					break;
+				}
+				// llx.com gets these two backwards
+				case 0b010: {
+					// JMP - Absolute Jump
+					Word jump_target = make_address(next_byte, fetch_one_byte(mmu, PC + 2));
+					last_jump_origin = PC;
+					last_jump_target = jump_target;
+					record_edge(PC, jump_target);
+					if (jump_target < PC) {
+						jumped_back = true;
+						jump_back_origin = PC;
+					}
+					PC = jump_target;
+					break;
+				}
+				case 0b011: {
+					// JMP - Indirect Jump
+					Byte jump_target_location_lo = next_byte;
+					Byte jump_target_location_hi = fetch_one_byte(mmu, PC + 2);
+					Word jump_target_location = make_address(jump_target_location_lo, jump_target_location_hi);
+					bool wraparound = jump_target_location_lo == 0xFF;
+
+					Byte jump_target_lo = fetch_one_byte(mmu, jump_target_location);
+					Byte jump_target_hi = fetch_one_byte(mmu, wraparound ? jump_target_location + 1 - 0x100 : jump_target_location + 1);
+					Word jump_target = make_address(jump_target_lo, jump_target_hi);
+					last_jump_origin = PC;
+					last_jump_target = jump_target;
+					record_edge(PC, jump_target);
+					PC = jump_target;
+					break;
+				}
+				case 0b100: {
+					// STY - Store Y Register
+					auto_write_value(mmu, next_byte, final_addr_mode, Y);
+					auto_increment_pc(final_addr_mode);
+					break;
+				}
+				case 0b101: {
+					// LDY - Load Y Register
+					Y = auto_fetch_value(mmu, next_byte, final_addr_mode);
+					set_flag(CPU_FLAG_Z, Y == 0);
+					set_flag(CPU_FLAG_N, Y & 0b10000000);
+					auto_increment_pc(final_addr_mode);
+					break;
+				}
+				case 0b110: {
+					// CPY - Compare Y Register
+					compare(Y, auto_fetch_value(mmu, next_byte, final_addr_mode));
+					auto_increment_pc(final_addr_mode);
+					break;
+				}
+				case 0b111: {
+					// CPX - Compare X Register
+					compare(X, auto_fetch_value(mmu, next_byte, final_addr_mode));
+					auto_increment_pc(final_addr_mode);
+					break;
+				}
+				default:
+				PC++;
+				return INVALID;
+			}
+			break;
+			default:
+			PC++;
+			return INVALID;
+		}
+
+		return check_idle_loop(mmu, finish_instruction(old_pc));
+	}
+};
+
+// Cycles an instruction takes on this core, which only depend on the opcode
+// and (for branches) the flags. For code that runs 6502 instructions some
+// other way and has to keep the same time.
+inline unsigned long measure_instruction_cycles(CPUType type, Byte opcode, Byte flags) {
+	MMU mmu;
+	mmu.initialize();
+	CPU cpu;
+	cpu.type = type;
+	cpu.A = cpu.X = cpu.Y = 0;
+	cpu.SP = 0xFD;
+	cpu.SF = flags | CPU_FLAG_UNUSED;
+	cpu.PC = 0x0200;
+	mmu.write_byte(0x0200, opcode);
+	mmu.write_byte(0x0201, 0x10);
+	mmu.write_byte(0x0202, 0x03);
+	cpu.execute(mmu);
+	return cpu.cycle_count;
+}
+
+// Whether this core runs opcode as an instruction at all
+inline bool is_valid_opcode(CPUType type, Byte opcode) {
+	MMU mmu;
+	mmu.initialize();
+	CPU cpu;
+	cpu.type = type;
+	cpu.A = cpu.X = cpu.Y = 0;
+	cpu.SP = 0xFD;
+	cpu.SF = CPU_FLAG_UNUSED;
+	cpu.PC = 0x0200;
+	mmu.write_byte(0x0200, opcode);
+	return cpu.execute(mmu) != INVALID;
+}
@@ -0,0 +1,373 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "types.hpp"
+#include "page.hpp"
+#include "mmu.hpp"
+#include "cpu.hpp"
+#include "memops.hpp"
+#include "aot.hpp"
+#include "bench.hpp"
+
+// Checks a fast engine (fusion and idle loop skipping, or compiled code with
+// --aot) against plain exec_instruction. The fast engine runs on the
+// program's own CPU in intervals of a number of cycles, and the reference
+// follows on another thread with a copy of the machine, stepping to the
+// same instruction count. At the end of each interval the two compare a
+// hash of their registers, counters and everything they've written to
+// memory. When the hashes differ, both sides go back to the start of that
+// interval and the fast engine's cycle budget is bisected to find the first
+// step where they disagree.
+struct DiffConfig {
+	bool enabled = false;
+	unsigned long interval = 65536; // Cycles between comparisons
+};
+
+static constexpr uint64_t DIFF_HASH_BASIS = 0xCBF29CE484222325ull;
+static constexpr uint64_t DIFF_HASH_PRIME = 0x100000001B3ull;
+// Intervals the fast engine may get ahead of the reference
+static constexpr std::size_t DIFF_MAX_PENDING = 4;
+
+inline uint64_t diff_hash(uint64_t hash, uint64_t value) {
+	for (int i = 0; i < 8; i++) {
+		hash = (hash ^ (value & 0xFF)) * DIFF_HASH_PRIME;
+		value >>= 8;
+	}
+	return hash;
+}
+
+// Folds every write through it into a running hash of address and value.
+// It has no raw_data, so bulk writes (host calls, memops) are hashed too.
+class WriteHashPage : public MemoryPage {
+public:
+	WriteHashPage(MemoryPage* page, Byte number, uint64_t& write_hash) : inner(page), page_number(number), hash(&write_hash) {}
+
+	Byte read_byte(Byte address) const {
+		return inner->read_byte(address);
+	}
+
+	void write_byte(Byte address, Byte value) {
+		inner->write_byte(address, value);
+		*hash = diff_hash(*hash, static_cast<uint64_t>(page_number) << 16 | static_cast<uint64_t>(address) << 8 | value);
+	}
+
+	const Byte* read_data() const {
+		return inner->read_data();
+	}
+
+	bool is_volatile() const {
+		return inner->is_volatile();
+	}
+
+	MemoryPage* wrapped() const {
+		return inner;
+	}
+
+private:
+	MemoryPage* inner;
+	Byte page_number;
+	uint64_t* hash;
+};
+
+// What the two engines compare
+struct DiffState {
+	Byte A = 0, X = 0, Y = 0, SP = 0, SF = 0;
+	Word PC = 0;
+	unsigned long cycles = 0;
+	unsigned long instructions = 0;
+	uint64_t writes = 0;
+	CPUStatus status = CONTINUE;
+
+	uint64_t hash() const {
+		uint64_t hash = DIFF_HASH_BASIS;
+		hash = diff_hash(hash, static_cast<uint64_t>(A) | static_cast<uint64_t>(X) << 8 | static_cast<uint64_t>(Y) << 16
+			| static_cast<uint64_t>(SP) << 24 | static_cast<uint64_t>(SF) << 32 | static_cast<uint64_t>(PC) << 40);
+		hash = diff_hash(hash, cycles);
+		hash = diff_hash(hash, instructions);
+		hash = diff_hash(hash, writes);
+		return diff_hash(hash, static_cast<uint64_t>(status));
+	}
+};
+
+// One engine's machine, with its writes hashed
+class DiffSide {
+public:
+	DiffSide(CPU& side_cpu, MMU& side_mmu) : cpu(side_cpu), mmu(side_mmu) {
+		for (int i = 0; i < 256; i++) {
+			wrappers.push_back(std::make_unique<WriteHashPage>(mmu.pages[i], static_cast<Byte>(i), writes));
+			mmu.map_page(static_cast<Byte>(i), wrappers.back().get());
+		}
+	}
+
+	// Puts the original pages back
+	~DiffSide() {
+		for (int i = 0; i < 256; i++) {
+			const std::unique_ptr<WriteHashPage>& wrapper = wrappers[static_cast<std::size_t>(i)];
+			if (mmu.pages[i] == wrapper.get()) mmu.map_page(static_cast<Byte>(i), wrapper->wrapped());
+		}
+	}
+
+	DiffState state(CPUStatus status) const {
+		DiffState state;
+		state.A = cpu.A; state.X = cpu.X; state.Y = cpu.Y; state.SP = cpu.SP; state.SF = cpu.SF;
+		state.PC = cpu.PC;
+		state.cycles = cpu.cycle_count;
+		state.instructions = cpu.instruction_count;
+		state.writes = writes;
+		state.status = status == HALT || status == INVALID ? status : CONTINUE;
+		return state;
+	}
+
+	struct Snapshot {
+		CPU cpu;
+		std::vector<Byte> memory;
+		uint64_t writes = 0;
+	};
+
+	void save(Snapshot& snapshot) const {
+		snapshot.cpu = cpu;
+		snapshot.memory.resize(65536);
+		memory_read(mmu, 0, 65536, snapshot.memory.data());
+		snapshot.writes = writes;
+	}
+
+	void restore(const Snapshot& snapshot) {
+		cpu = snapshot.cpu;
+		memory_write(mmu, 0, snapshot.memory.data(), 65536);
+		writes = snapshot.writes;
+	}
+
+	CPU& cpu;
+	MMU& mmu;
+	uint64_t writes = DIFF_HASH_BASIS;
+
+private:
+	std::vector<std::unique_ptr<WriteHashPage>> wrappers;
+};
+
+// Up to the given number of cycles on the engine being checked
+inline CPUStatus run_fast_engine(CPU& cpu, MMU& mmu, AotRunner* aot, unsigned long cycles) {
+	if (aot) return aot->run(cpu, mmu, cycles);
+	unsigned long start = cpu.cycle_count;
+	CPUStatus status = CONTINUE;
+	while (cpu.cycle_count - start < cycles) {
+		status = cpu.exec_instruction(mmu, true);
+		if (status == HALT || status == INVALID) break;
+	}
+	return status;
+}
+
+// One instruction at a time up to an instruction count
+inline CPUStatus run_reference_engine(CPU& cpu, MMU& mmu, unsigned long instructions) {
+	CPUStatus status = CONTINUE;
+	while (cpu.instruction_count < instructions) {
+		status = cpu.exec_instruction(mmu, true);
+		if (status == HALT || status == INVALID) break;
+	}
+	return status;
+}
+
+class DiffChecker {
+public:
+	// The fast engine is cpu/mmu as configured by the caller. The reference
+	// gets a copy of the CPU and a fresh MMU loaded with the same image.
+	DiffChecker(const DiffConfig& diff_config, CPU& cpu, MMU& mmu, const std::vector<Byte>& image, AotRunner* aot_runner)
+		: config(diff_config), aot(aot_runner), reference_cpu(cpu), fast(cpu, mmu),
+		  reference(reference_cpu, load(reference_mmu, image)) {
+		reference_cpu.fusion_enabled = false;
+		reference_cpu.idle_detection = false;
+	}
+
+	// Runs the fast engine for the given number of cycles with the reference
+	// checking it. Returns false if they disagreed.
+	bool run(unsigned long cycles, std::ostream& os) {
+		auto started = std::chrono::steady_clock::now();
+		std::thread checker([this]() { check_intervals(); });
+		unsigned long start_cycles = fast.cpu.cycle_count;
+		unsigned long start_instructions = fast.cpu.instruction_count;
+		unsigned long intervals = 0;
+		CPUStatus status = CONTINUE;
+		while (status != HALT && status != INVALID && fast.cpu.cycle_count - start_cycles < cycles
+			&& !diverged.load(std::memory_order_relaxed)) {
+			std::unique_ptr<Interval> interval = std::make_unique<Interval>();
+			interval->budget = std::min(config.interval, cycles - (fast.cpu.cycle_count - start_cycles));
+			fast.save(interval->fast_start);
+			status = run_fast_engine(fast.cpu, fast.mmu, aot, interval->budget);
+			interval->fast_end = fast.state(status);
+			intervals++;
+
+			std::unique_lock<std::mutex> lock(mutex);
+			space.wait(lock, [this]() { return pending.size() < DIFF_MAX_PENDING || diverged.load(); });
+			pending.push_back(std::move(interval));
+			ready.notify_one();
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			finished = true;
+		}
+		ready.notify_one();
+		checker.join();
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+		if (!bad) {
+			os << std::dec << std::fixed << std::setprecision(3)
+				<< "Ran " << fast.cpu.cycle_count - start_cycles << " cycles (" << fast.cpu.instruction_count - start_instructions
+				<< " instructions) in " << seconds << " s" << std::endl;
+			os.unsetf(std::ios::fixed);
+			os << "Differential check: all " << intervals << " intervals of up to " << config.interval
+				<< " cycles matched the reference" << (aot ? " (compiled code)" : "") << std::endl;
+			if (status == HALT || status == INVALID) {
+				os << (status == HALT ? "Halted" : "Invalid instruction") << " at " << format_address(fast.cpu.PC, fast.cpu.symbols) << std::endl;
+			}
+			return true;
+		}
+		bisect(os);
+		return false;
+	}
+
+private:
+	struct Interval {
+		unsigned long budget = 0;
+		DiffSide::Snapshot fast_start;
+		DiffState fast_end;
+	};
+
+	const DiffConfig& config;
+	AotRunner* aot;
+	CPU reference_cpu;
+	MMU reference_mmu;
+	DiffSide fast;
+	DiffSide reference;
+
+	std::mutex mutex;
+	std::condition_variable ready;
+	std::condition_variable space;
+	std::deque<std::unique_ptr<Interval>> pending;
+	bool finished = false;
+	std::atomic<bool> diverged{false};
+	// The first interval that didn't match, and where the reference was
+	// when it started
+	std::unique_ptr<Interval> bad;
+	DiffSide::Snapshot bad_reference_start;
+
+	static MMU& load(MMU& mmu, const std::vector<Byte>& image) {
+		mmu.initialize();
+		mmu.load_image(image.data(), image.size());
+		return mmu;
+	}
+
+	// The reference thread: replays each interval the fast engine finished
+	// and compares the result
+	void check_intervals() {
+		DiffSide::Snapshot start;
+		while (true) {
+			std::unique_ptr<Interval> interval;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				ready.wait(lock, [this]() { return !pending.empty() || finished; });
+				if (pending.empty()) return;
+				interval = std::move(pending.front());
+				pending.pop_front();
+			}
+			space.notify_one();
+
+			reference.save(start);
+			CPUStatus status = run_reference_engine(reference.cpu, reference.mmu, interval->fast_end.instructions);
+			if (reference.state(status).hash() != interval->fast_end.hash()) {
+				bad = std::move(interval);
+				bad_reference_start = start;
+				diverged.store(true);
+				space.notify_one();
+				return;
+			}
+		}
+	}
+
+	// Both sides from the start of the bad interval, the fast engine with the
+	// given budget and the reference to wherever it ended up
+	bool replay(unsigned long budget, DiffState& fast_state, DiffState& reference_state) {
+		fast.restore(bad->fast_start);
+		fast_state = fast.state(run_fast_engine(fast.cpu, fast.mmu, aot, budget));
+		reference.restore(bad_reference_start);
+		reference_state = reference.state(run_reference_engine(reference.cpu, reference.mmu, fast_state.instructions));
+		return fast_state.hash() == reference_state.hash();
+	}
+
+	void bisect(std::ostream& os) {
+		DiffState fast_state, reference_state;
+		if (replay(bad->budget, fast_state, reference_state)) {
+			os << "The engines disagreed by instruction " << std::dec << bad->fast_end.instructions
+				<< ", but not when the interval was run again from " << bad->fast_start.cpu.instruction_count
+				<< " (the difference depends on something before it)" << std::endl;
+			return;
+		}
+
+		// Smallest budget where they disagree. With a budget of 0 they agree
+		// by definition.
+		unsigned long good = 0;
+		unsigned long failing = bad->budget;
+		while (failing - good > 1) {
+			unsigned long middle = good + (failing - good) / 2;
+			if (replay(middle, fast_state, reference_state)) good = middle;
+			else failing = middle;
+		}
+		replay(good, fast_state, reference_state);
+		unsigned long first = fast_state.instructions;
+		Word agreed_pc = fast_state.PC;
+		replay(failing, fast_state, reference_state);
+
+		unsigned long last = fast_state.instructions;
+		// Numbered like the history
+		os << "The engines diverge " << (last - first > 1 ? "in instructions " : "at instruction ") << std::dec << first;
+		if (last - first > 1) os << "-" << last - 1 << " (one step of the fast engine)";
+		os << ", starting at " << format_address(agreed_pc, reference.cpu.symbols) << std::endl;
+		os << "Reference history up to there:" << std::endl;
+		reference.cpu.dump_history(os, std::min<unsigned long>(last - first + 4, CPU_HISTORY_SIZE));
+		os << "Fast engine: " << fast.cpu.log_state(fast.mmu) << " SP:" << std::hex << (int)fast.cpu.SP
+			<< " CYC:" << std::dec << fast_state.cycles << " INS:" << fast_state.instructions << std::endl;
+		os << "Reference:   " << reference.cpu.log_state(reference.mmu) << " SP:" << std::hex << (int)reference.cpu.SP
+			<< " CYC:" << std::dec << reference_state.cycles << " INS:" << reference_state.instructions << std::endl;
+		if (fast_state.status != reference_state.status) {
+			os << "Status: fast engine " << status_name(fast_state.status) << ", reference " << status_name(reference_state.status) << std::endl;
+		}
+
+		std::vector<Byte> fast_memory(65536), reference_memory(65536);
+		memory_read(fast.mmu, 0, 65536, fast_memory.data());
+		memory_read(reference.mmu, 0, 65536, reference_memory.data());
+		int shown = 0;
+		for (std::size_t address = 0; address < 65536 && shown < 8; address++) {
+			if (fast_memory[address] == reference_memory[address]) continue;
+			os << "Memory at " << format_address(static_cast<Word>(address), reference.cpu.symbols) << ": fast engine 0x" << std::hex
+				<< (int)fast_memory[address] << ", reference 0x" << (int)reference_memory[address] << std::endl;
+			shown++;
+		}
+		if (shown == 0 && fast_state.writes != reference_state.writes) {
+			os << "Memory ends up the same, but the writes that got it there differ" << std::endl;
+		}
+	}
+
+	static const char* status_name(CPUStatus status) {
+		return status == HALT ? "halted" : status == INVALID ? "hit an invalid instruction" : "kept running";
+	}
+};
+
+// --bench with --diff-check: the program runs on the engine --bench would
+// use, with the reference checking it
+inline int run_diff_check(const BenchConfig& bench_config, const DiffConfig& diff_config, CPU& cpu, MMU& mmu,
+	const std::vector<Byte>& image, std::ostream& os, AotRunner* aot = nullptr) {
+	cpu.fusion_enabled = bench_config.fusion;
+	cpu.idle_detection = bench_config.idle_skip && !aot;
+	cpu.cycle_deadline = cpu.cycle_count + bench_config.cycles;
+	DiffChecker checker(diff_config, cpu, mmu, image, aot);
+	return checker.run(bench_config.cycles, os) ? 0 : 1;
+}
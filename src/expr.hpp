@@ -0,0 +1,304 @@
+#pragma once
+
+#include <stdint.h>
+#include <cctype>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "types.hpp"
+#include "helpers.hpp"
+#include "mmu.hpp"
+#include "symbols.hpp"
+
+// Everything a condition can look at
+struct ExprContext {
+	Byte A, X, Y, SP, SF;
+	Word PC;
+	unsigned long cycles;
+	unsigned long hits;
+	Byte value; // Byte read or written, for watchpoints
+	MMU* mmu;
+};
+
+enum ExprOp : Byte {
+	EXPR_CONST,
+	EXPR_A, EXPR_X, EXPR_Y, EXPR_SP, EXPR_SF, EXPR_PC,
+	EXPR_CYCLES, EXPR_HITS, EXPR_VALUE,
+	EXPR_MEM,
+	EXPR_NEG, EXPR_NOT, EXPR_INVERT,
+	EXPR_MUL, EXPR_DIV, EXPR_MOD, EXPR_ADD, EXPR_SUB, EXPR_SHL, EXPR_SHR,
+	EXPR_LT, EXPR_LE, EXPR_GT, EXPR_GE, EXPR_EQ, EXPR_NE,
+	EXPR_AND, EXPR_XOR, EXPR_OR, EXPR_LOGICAL_AND, EXPR_LOGICAL_OR
+};
+
+struct ExprInstruction {
+	ExprOp op;
+	int64_t value;
+};
+
+// A breakpoint/watchpoint condition like "A==$42 && mem[$10]>3", compiled
+// once into postfix bytecode for a small stack machine. C operators and
+// precedence; numbers are anything parse_numeric_literal takes; names are
+// registers (A X Y SP P PC), cycles, hits, value, mem[addr] or labels.
+class Expression {
+public:
+	static constexpr std::size_t MAX_STACK = 32;
+
+	Expression() {}
+
+	// Throws std::invalid_argument with a description of what's wrong
+	Expression(const std::string& text, const SymbolTable& symbols) : source(text) {
+		Parser parser(text, symbols, code);
+		parser.parse();
+	}
+
+	bool empty() const {
+		return code.empty();
+	}
+
+	const std::string& text() const {
+		return source;
+	}
+
+	int64_t evaluate(const ExprContext& context) const {
+		int64_t stack[MAX_STACK];
+		std::size_t top = 0;
+		for (const ExprInstruction& instruction : code) {
+			switch (instruction.op) {
+				case EXPR_CONST: stack[top++] = instruction.value; break;
+				case EXPR_A: stack[top++] = context.A; break;
+				case EXPR_X: stack[top++] = context.X; break;
+				case EXPR_Y: stack[top++] = context.Y; break;
+				case EXPR_SP: stack[top++] = context.SP; break;
+				case EXPR_SF: stack[top++] = context.SF; break;
+				case EXPR_PC: stack[top++] = context.PC; break;
+				case EXPR_CYCLES: stack[top++] = static_cast<int64_t>(context.cycles); break;
+				case EXPR_HITS: stack[top++] = static_cast<int64_t>(context.hits); break;
+				case EXPR_VALUE: stack[top++] = context.value; break;
+				case EXPR_MEM: stack[top - 1] = peek(context, static_cast<Word>(stack[top - 1])); break;
+				case EXPR_NEG: stack[top - 1] = -stack[top - 1]; break;
+				case EXPR_NOT: stack[top - 1] = !stack[top - 1]; break;
+				case EXPR_INVERT: stack[top - 1] = ~stack[top - 1]; break;
+				default: {
+					int64_t right = stack[--top];
+					int64_t& left = stack[top - 1];
+					left = binary(instruction.op, left, right);
+					break;
+				}
+			}
+		}
+		return top > 0 ? stack[top - 1] : 0;
+	}
+
+private:
+	std::string source;
+	std::vector<ExprInstruction> code;
+
+	// Plain memory is read directly so checking a condition can't set off a
+	// device; anything else is read like the i command does
+	static Byte peek(const ExprContext& context, Word address) {
+		const MemoryPage* page = context.mmu->pages[hi(address)];
+		const Byte* data = page->read_data();
+		return data ? data[lo(address)] : page->read_byte(lo(address));
+	}
+
+	static int64_t binary(ExprOp op, int64_t left, int64_t right) {
+		switch (op) {
+			case EXPR_MUL: return left * right;
+			case EXPR_DIV: return right == 0 ? 0 : left / right;
+			case EXPR_MOD: return right == 0 ? 0 : left % right;
+			case EXPR_ADD: return left + right;
+			case EXPR_SUB: return left - right;
+			case EXPR_SHL: return right < 0 || right > 62 ? 0 : left << right;
+			case EXPR_SHR: return right < 0 || right > 62 ? 0 : left >> right;
+			case EXPR_LT: return left < right;
+			case EXPR_LE: return left <= right;
+			case EXPR_GT: return left > right;
+			case EXPR_GE: return left >= right;
+			case EXPR_EQ: return left == right;
+			case EXPR_NE: return left != right;
+			case EXPR_AND: return left & right;
+			case EXPR_XOR: return left ^ right;
+			case EXPR_OR: return left | right;
+			case EXPR_LOGICAL_AND: return left && right;
+			case EXPR_LOGICAL_OR: return left || right;
+			default: return 0;
+		}
+	}
+
+	// Recursive descent, one function per precedence level, emitting
+	// postfix as it goes
+	class Parser {
+	public:
+		Parser(const std::string& text, const SymbolTable& symbol_table, std::vector<ExprInstruction>& output)
+			: str(text), symbols(symbol_table), code(output) {}
+
+		void parse() {
+			if (peek_token().empty()) fail("empty condition");
+			binary_level(0);
+			if (!peek_token().empty()) fail("unexpected '" + peek_token() + "'");
+		}
+
+	private:
+		const std::string& str;
+		const SymbolTable& symbols;
+		std::vector<ExprInstruction>& code;
+		std::size_t pos = 0;
+		std::size_t depth = 0;
+
+		struct BinaryOperator {
+			const char* token;
+			ExprOp op;
+			int level;
+		};
+
+		// Lowest precedence first
+		static const BinaryOperator* operators(std::size_t& count) {
+			static const BinaryOperator table[] = {
+				{ "||", EXPR_LOGICAL_OR, 0 },
+				{ "&&", EXPR_LOGICAL_AND, 1 },
+				{ "|", EXPR_OR, 2 },
+				{ "^", EXPR_XOR, 3 },
+				{ "&", EXPR_AND, 4 },
+				{ "==", EXPR_EQ, 5 }, { "!=", EXPR_NE, 5 },
+				{ "<=", EXPR_LE, 6 }, { ">=", EXPR_GE, 6 }, { "<", EXPR_LT, 6 }, { ">", EXPR_GT, 6 },
+				{ "<<", EXPR_SHL, 7 }, { ">>", EXPR_SHR, 7 },
+				{ "+", EXPR_ADD, 8 }, { "-", EXPR_SUB, 8 },
+				{ "*", EXPR_MUL, 9 }, { "/", EXPR_DIV, 9 }, { "%", EXPR_MOD, 9 }
+			};
+			count = sizeof(table) / sizeof(table[0]);
+			return table;
+		}
+
+		static constexpr int UNARY_LEVEL = 10;
+
+		[[noreturn]] void fail(const std::string& why) {
+			throw std::invalid_argument(why + " in condition '" + str + "'");
+		}
+
+		void emit(ExprOp op, int64_t value = 0) {
+			switch (op) {
+				case EXPR_CONST: case EXPR_A: case EXPR_X: case EXPR_Y: case EXPR_SP: case EXPR_SF: case EXPR_PC:
+				case EXPR_CYCLES: case EXPR_HITS: case EXPR_VALUE:
+				if (++depth > MAX_STACK) fail("too deeply nested");
+				break;
+				case EXPR_MEM: case EXPR_NEG: case EXPR_NOT: case EXPR_INVERT:
+				break;
+				default:
+				depth--;
+				break;
+			}
+			code.push_back({ op, value });
+		}
+
+		void skip_space() {
+			while (pos < str.size() && std::isspace(static_cast<unsigned char>(str[pos]))) pos++;
+		}
+
+		static bool is_name_char(char c) {
+			return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '@' || c == '.';
+		}
+
+		// The next token without consuming it
+		std::string peek_token() {
+			skip_space();
+			if (pos >= str.size()) return "";
+			char c = str[pos];
+			if (c == '$' || is_name_char(c)) {
+				std::size_t end = pos + 1;
+				while (end < str.size() && is_name_char(str[end])) end++;
+				return str.substr(pos, end - pos);
+			}
+			static const char* const two_char[] = { "||", "&&", "==", "!=", "<=", ">=", "<<", ">>" };
+			for (const char* op : two_char) {
+				if (str.compare(pos, 2, op) == 0) return op;
+			}
+			return std::string(1, c);
+		}
+
+		std::string next_token() {
+			std::string token = peek_token();
+			pos += token.size();
+			return token;
+		}
+
+		void expect(const std::string& token) {
+			if (next_token() != token) fail("expected '" + token + "'");
+		}
+
+		void binary_level(int level) {
+			if (level >= UNARY_LEVEL) {
+				unary();
+				return;
+			}
+			binary_level(level + 1);
+			while (true) {
+				std::string token = peek_token();
+				std::size_t count = 0;
+				const BinaryOperator* table = operators(count);
+				const BinaryOperator* match = nullptr;
+				for (std::size_t i = 0; i < count; i++) {
+					if (table[i].level == level && token == table[i].token) match = &table[i];
+				}
+				if (!match) return;
+				next_token();
+				binary_level(level + 1);
+				emit(match->op);
+			}
+		}
+
+		void unary() {
+			std::string token = peek_token();
+			if (token == "-" || token == "!" || token == "~") {
+				next_token();
+				unary();
+				emit(token == "-" ? EXPR_NEG : token == "!" ? EXPR_NOT : EXPR_INVERT);
+				return;
+			}
+			primary();
+		}
+
+		void primary() {
+			std::string token = next_token();
+			if (token.empty()) fail("unexpected end");
+			if (token == "(") {
+				binary_level(0);
+				expect(")");
+				return;
+			}
+			if (token[0] == '$' || std::isdigit(static_cast<unsigned char>(token[0]))) {
+				try {
+					emit(EXPR_CONST, parse_numeric_literal(token));
+				}
+				catch (const std::exception&) {
+					fail("bad number '" + token + "'");
+				}
+				return;
+			}
+			if (!is_name_char(token[0])) fail("unexpected '" + token + "'");
+
+			std::string name = token;
+			for (char& c : name) c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+			if (name == "MEM") {
+				expect("[");
+				binary_level(0);
+				expect("]");
+				emit(EXPR_MEM);
+			}
+			else if (name == "A") emit(EXPR_A);
+			else if (name == "X") emit(EXPR_X);
+			else if (name == "Y") emit(EXPR_Y);
+			else if (name == "SP") emit(EXPR_SP);
+			else if (name == "P" || name == "SF") emit(EXPR_SF);
+			else if (name == "PC") emit(EXPR_PC);
+			else if (name == "CYCLES") emit(EXPR_CYCLES);
+			else if (name == "HITS") emit(EXPR_HITS);
+			else if (name == "VALUE") emit(EXPR_VALUE);
+			else {
+				Word address = 0;
+				if (!symbols.lookup(token, address)) fail("unknown name '" + token + "'");
+				emit(EXPR_CONST, address);
+			}
+		}
+	};
+};
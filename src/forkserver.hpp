@@ -0,0 +1,209 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#ifndef _WIN32
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#endif
+#include "types.hpp"
+#include "mmu.hpp"
+#include "cpu.hpp"
+#include "fuzz.hpp"
+
+struct ForkServerConfig {
+	std::string endpoint; // "-" for stdin/stdout, anything else is a unix socket path
+	// Where booting stops: at a PC, after a number of cycles, or at a PC with
+	// the cycle count as an upper bound
+	bool has_warm_pc = false;
+	Word warm_pc = 0;
+	unsigned long warm_cycles = 0;
+};
+
+// Wire format, everything little-endian:
+//   job:    u32 input length | input bytes
+//   result: u8 outcome | u8 A | u8 X | u8 Y | u8 SP | u8 P | u16 PC | u64 cycles | u64 instructions
+// outcome is a FuzzOutcome, or FORK_SERVER_CHILD_DIED if the job's process
+// didn't exit cleanly.
+static constexpr std::size_t FORK_SERVER_RESULT_SIZE = 24;
+static constexpr Byte FORK_SERVER_CHILD_DIED = 0xFF;
+static constexpr uint32_t FORK_SERVER_MAX_INPUT = 1 << 20;
+
+// Boots the machine once, then forks a child per job so every run starts from
+// the warm state. The OS shares the parent's memory copy-on-write, so a child
+// only pays for the pages its run actually writes.
+class ForkServer {
+public:
+	ForkServer(const ForkServerConfig& server_config, const FuzzConfig& job_config, CPU& machine_cpu, MMU& machine_mmu, InputDevicePage* input_device)
+		: config(server_config), jobs(job_config), cpu(machine_cpu), mmu(machine_mmu), device(input_device) {}
+
+	// Runs from reset to the warm-start point. Fails if the program stops
+	// (or blows through the cycle limit) before getting there.
+	bool boot(std::ostream& log) {
+		while (true) {
+			if (config.has_warm_pc && cpu.PC == config.warm_pc) break;
+			if (config.warm_cycles > 0 && cpu.cycle_count >= config.warm_cycles) {
+				if (!config.has_warm_pc) break;
+				log << "Warm start PC was not reached within " << std::dec << config.warm_cycles << " cycles" << std::endl;
+				return false;
+			}
+			if (!config.has_warm_pc && config.warm_cycles == 0) break;
+
+			CPUStatus status = cpu.exec_instruction(mmu, true);
+			if (status == HALT || status == INVALID) {
+				log << "The program stopped at 0x" << std::hex << cpu.PC << " before the warm start point" << std::endl;
+				return false;
+			}
+		}
+		log << "Booted to 0x" << std::hex << cpu.PC << " after " << std::dec << cpu.cycle_count << " cycles" << std::endl;
+		return true;
+	}
+
+#ifndef _WIN32
+	int serve(std::ostream& log) {
+		if (config.endpoint == "-") {
+			log << "Serving jobs on stdin/stdout" << std::endl;
+			serve_stream(STDIN_FILENO, STDOUT_FILENO);
+			return 0;
+		}
+
+		int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		sockaddr_un address;
+		std::memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		if (listener < 0 || config.endpoint.size() >= sizeof(address.sun_path)) {
+			log << "Could not create socket '" << config.endpoint << "'" << std::endl;
+			return 1;
+		}
+		std::strncpy(address.sun_path, config.endpoint.c_str(), sizeof(address.sun_path) - 1);
+		unlink(config.endpoint.c_str());
+		if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 16) != 0) {
+			log << "Could not listen on '" << config.endpoint << "': " << std::strerror(errno) << std::endl;
+			return 1;
+		}
+
+		// Connection handlers are reaped automatically. They put the default
+		// back so they can wait for their own job children.
+		signal(SIGCHLD, SIG_IGN);
+		log << "Serving jobs on '" << config.endpoint << "'" << std::endl;
+		while (true) {
+			int connection = accept(listener, nullptr, nullptr);
+			if (connection < 0) {
+				if (errno == EINTR) continue;
+				log << "accept failed: " << std::strerror(errno) << std::endl;
+				return 1;
+			}
+
+			// Every client gets its own handler so several can run jobs at once
+			pid_t handler = fork();
+			if (handler == 0) {
+				close(listener);
+				signal(SIGCHLD, SIG_DFL);
+				serve_stream(connection, connection);
+				_exit(0);
+			}
+			close(connection);
+		}
+	}
+#else
+	int serve(std::ostream& log) {
+		log << "The fork server needs fork(), which this platform doesn't have." << std::endl;
+		return 1;
+	}
+#endif
+
+private:
+	const ForkServerConfig& config;
+	const FuzzConfig& jobs;
+	CPU& cpu;
+	MMU& mmu;
+	InputDevicePage* device;
+
+#ifndef _WIN32
+	static bool read_full(int fd, void* buffer, std::size_t size) {
+		char* out = static_cast<char*>(buffer);
+		while (size > 0) {
+			ssize_t got = read(fd, out, size);
+			if (got < 0 && errno == EINTR) continue;
+			if (got <= 0) return false;
+			out += got;
+			size -= static_cast<std::size_t>(got);
+		}
+		return true;
+	}
+
+	static bool write_full(int fd, const void* buffer, std::size_t size) {
+		const char* in = static_cast<const char*>(buffer);
+		while (size > 0) {
+			ssize_t sent = write(fd, in, size);
+			if (sent < 0 && errno == EINTR) continue;
+			if (sent <= 0) return false;
+			in += sent;
+			size -= static_cast<std::size_t>(sent);
+		}
+		return true;
+	}
+
+	static void put_u64(Byte* out, uint64_t value) {
+		for (int i = 0; i < 8; i++) out[i] = static_cast<Byte>(value >> (8 * i));
+	}
+
+	void encode_result(Byte outcome, Byte* out) const {
+		out[0] = outcome;
+		out[1] = cpu.A;
+		out[2] = cpu.X;
+		out[3] = cpu.Y;
+		out[4] = cpu.SP;
+		out[5] = cpu.SF;
+		out[6] = lo(cpu.PC);
+		out[7] = hi(cpu.PC);
+		put_u64(out + 8, cpu.cycle_count);
+		put_u64(out + 16, cpu.instruction_count);
+	}
+
+	void serve_stream(int in_fd, int out_fd) {
+		std::vector<Byte> input;
+		while (true) {
+			Byte header[4];
+			if (!read_full(in_fd, header, sizeof(header))) return;
+			uint32_t length = static_cast<uint32_t>(header[0]) | (static_cast<uint32_t>(header[1]) << 8)
+				| (static_cast<uint32_t>(header[2]) << 16) | (static_cast<uint32_t>(header[3]) << 24);
+			if (length > FORK_SERVER_MAX_INPUT) return;
+			input.resize(length);
+			if (length > 0 && !read_full(in_fd, input.data(), length)) return;
+			if (!run_job(input, out_fd)) return;
+		}
+	}
+
+	bool run_job(const std::vector<Byte>& input, int out_fd) {
+		pid_t child = fork();
+		if (child < 0) return false;
+		if (child == 0) {
+			// Everything from here on happens in the child's private copy
+			inject_input(jobs, mmu, device, input);
+			FuzzOutcome outcome = run_with_budget(jobs, cpu, mmu);
+			Byte result[FORK_SERVER_RESULT_SIZE];
+			encode_result(static_cast<Byte>(outcome), result);
+			_exit(write_full(out_fd, result, sizeof(result)) ? 0 : 1);
+		}
+
+		int status = 0;
+		while (waitpid(child, &status, 0) < 0) {
+			if (errno != EINTR) return false;
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			Byte result[FORK_SERVER_RESULT_SIZE];
+			encode_result(FORK_SERVER_CHILD_DIED, result);
+			return write_full(out_fd, result, sizeof(result));
+		}
+		return true;
+	}
+#endif
+};
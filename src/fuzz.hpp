@@ -0,0 +1,454 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+#include "types.hpp"
+#include "page.hpp"
+#include "mmu.hpp"
+#include "cpu.hpp"
+
+static constexpr std::size_t FUZZ_MAP_SIZE = 65536;
+
+struct FuzzConfig {
+	// Where the input goes: a fixed memory region, an input device page, or both
+	bool use_region = false;
+	Word region_start = 0x0200;
+	Word region_length = 0;
+	bool use_device = false;
+	Byte device_page = 0;
+	// Optionally store the input length (capped at 255) at this address
+	bool store_length = false;
+	Word length_address = 0;
+
+	bool has_entry = false;
+	Word entry = 0;
+	bool has_exit = false;
+	Word exit = 0;
+
+	CPUType type = MOS;
+	unsigned long cycle_budget = 100000;
+	unsigned threads = 0; // 0 = one per core
+	unsigned long max_runs = 0; // 0 = no limit
+	unsigned long max_seconds = 0; // 0 = no limit
+	std::size_t max_input = 256;
+	std::string corpus_dir;
+};
+
+enum FuzzOutcome {
+	FUZZ_OK = 0,
+	FUZZ_CRASH,
+	FUZZ_TIMEOUT
+};
+
+// Memory-mapped input for the program under test. Reading offset 0 consumes
+// the next input byte (0 once the input is exhausted), offset 1 tells how many
+// bytes are left, capped at 255. Writes are ignored.
+class InputDevicePage : public MemoryPage {
+public:
+	void set_input(const std::vector<Byte>& data) {
+		input = &data;
+		position = 0;
+	}
+
+	Byte read_byte(Byte address) const {
+		std::size_t left = input ? input->size() - position : 0;
+		if (address == 1) {
+			return static_cast<Byte>(left > 255 ? 255 : left);
+		}
+		if (address == 0 && left > 0) {
+			return (*input)[position++];
+		}
+		return 0;
+	}
+
+	void write_byte(Byte, Byte) {}
+
+private:
+	const std::vector<Byte>* input = nullptr;
+	mutable std::size_t position = 0;
+};
+
+// Buckets raw hit counts the way AFL does, so that going from 5 to 6 loop
+// iterations isn't new coverage but going from 1 to 2 is.
+inline Byte fuzz_bucket(Byte count) {
+	if (count <= 3) return count == 3 ? 4 : count;
+	if (count <= 7) return 8;
+	if (count <= 15) return 16;
+	if (count <= 31) return 32;
+	if (count <= 127) return 64;
+	return 128;
+}
+
+struct FuzzBucketTable {
+	Byte lookup[256];
+
+	FuzzBucketTable() {
+		for (int i = 0; i < 256; i++) lookup[i] = fuzz_bucket(static_cast<Byte>(i));
+	}
+};
+
+inline void fuzz_classify_counts(Byte* map) {
+	static const FuzzBucketTable table;
+	const Byte* lookup = table.lookup;
+
+	for (std::size_t i = 0; i < FUZZ_MAP_SIZE; i += 8) {
+		uint64_t chunk;
+		std::memcpy(&chunk, map + i, 8);
+		if (chunk == 0) continue; // Most of the map is untouched
+		for (std::size_t j = i; j < i + 8; j++) map[j] = lookup[map[j]];
+	}
+}
+
+// Virgin maps start out all ones and lose bits as buckets are seen. Returns
+// whether the trace hit anything new, and clears those bits if update is set.
+inline bool fuzz_has_new_bits(const Byte* trace, Byte* virgin, bool update) {
+	bool found = false;
+	for (std::size_t i = 0; i < FUZZ_MAP_SIZE; i += 8) {
+		uint64_t t, v;
+		std::memcpy(&t, trace + i, 8);
+		std::memcpy(&v, virgin + i, 8);
+		if ((t & v) == 0) continue;
+		found = true;
+		if (!update) return true;
+		v &= ~t;
+		std::memcpy(virgin + i, &v, 8);
+	}
+	return found;
+}
+
+inline std::size_t fuzz_count_edges(const Byte* virgin) {
+	std::size_t count = 0;
+	for (std::size_t i = 0; i < FUZZ_MAP_SIZE; i++) {
+		if (virgin[i] != 0xFF) count++;
+	}
+	return count;
+}
+
+inline void make_directory(const std::string& path) {
+#ifdef _WIN32
+	_mkdir(path.c_str());
+#else
+	mkdir(path.c_str(), 0755);
+#endif
+}
+
+inline std::vector<std::vector<Byte>> read_directory_files(const std::string& path) {
+	std::vector<std::vector<Byte>> files;
+	DIR* dir = opendir(path.c_str());
+	if (dir == nullptr) return files;
+
+	while (dirent* entry = readdir(dir)) {
+		if (entry->d_name[0] == '.') continue;
+		std::string file_path = path + "/" + entry->d_name;
+		struct stat info;
+		if (stat(file_path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) continue;
+		std::ifstream file(file_path, std::ios::binary);
+		if (!file) continue;
+		std::vector<Byte> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		if (!data.empty()) files.push_back(data);
+	}
+	closedir(dir);
+	return files;
+}
+
+// Puts an input where the program under test expects it
+inline void inject_input(const FuzzConfig& config, MMU& mmu, InputDevicePage* device, const std::vector<Byte>& input) {
+	if (config.use_region) {
+		for (Word i = 0; i < config.region_length; i++) {
+			mmu.write_byte(static_cast<Word>(config.region_start + i), i < input.size() ? input[i] : 0);
+		}
+	}
+	if (config.store_length) {
+		mmu.write_byte(config.length_address, static_cast<Byte>(input.size() > 255 ? 255 : input.size()));
+	}
+	if (device) {
+		device->set_input(input);
+	}
+}
+
+// Runs from wherever the CPU is until it stops, reaches the exit address or
+// uses up the cycle budget
+inline FuzzOutcome run_with_budget(const FuzzConfig& config, CPU& cpu, MMU& mmu) {
+	unsigned long deadline = cpu.cycle_count + config.cycle_budget;
+	while (true) {
+		CPUStatus status = cpu.exec_instruction(mmu, true);
+		if (status == INVALID) return FUZZ_CRASH;
+		if (status == HALT) return FUZZ_OK;
+		if (config.has_exit && cpu.PC == config.exit) return FUZZ_OK;
+		if (cpu.cycle_count >= deadline) return FUZZ_TIMEOUT;
+	}
+}
+
+// One emulated machine that can be rewound to the loaded image and run on an
+// input over and over. Each fuzzing thread owns one.
+class FuzzInstance {
+public:
+	FuzzInstance(const FuzzConfig& fuzz_config, const std::vector<Byte>& rom_image)
+		: config(fuzz_config), image(rom_image), trace(FUZZ_MAP_SIZE, 0) {
+		mmu.initialize();
+		if (config.use_device) {
+			auto page = std::make_unique<InputDevicePage>();
+			device = page.get();
+			mmu.install_page(config.device_page, std::move(page));
+		}
+		cpu.type = config.type;
+		cpu.coverage_map = trace.data();
+	}
+
+	FuzzOutcome run(const std::vector<Byte>& input) {
+		for (int page = 0; page < 256; page++) {
+			mmu.load_page(static_cast<Byte>(page), image.data() + page * 256);
+		}
+		std::fill(trace.begin(), trace.end(), 0);
+
+		inject_input(config, mmu, device, input);
+		cpu.reset(mmu);
+		if (config.has_entry) cpu.PC = config.entry;
+		return run_with_budget(config, cpu, mmu);
+	}
+
+	// Classified coverage of the last run
+	const Byte* coverage() {
+		fuzz_classify_counts(trace.data());
+		return trace.data();
+	}
+
+private:
+	const FuzzConfig& config;
+	const std::vector<Byte>& image;
+	std::vector<Byte> trace;
+	MMU mmu;
+	CPU cpu;
+	InputDevicePage* device = nullptr;
+};
+
+class Fuzzer {
+public:
+	Fuzzer(const FuzzConfig& fuzz_config, const std::vector<Byte>& rom_image)
+		: config(fuzz_config), image(rom_image),
+		  virgin(FUZZ_MAP_SIZE, 0xFF), crash_virgin(FUZZ_MAP_SIZE, 0xFF) {}
+
+	int run() {
+		if (!config.corpus_dir.empty()) {
+			make_directory(config.corpus_dir);
+			make_directory(config.corpus_dir + "/queue");
+			make_directory(config.corpus_dir + "/crashes");
+			corpus = read_directory_files(config.corpus_dir);
+			// Picks up where an earlier session left off
+			for (auto& input : read_directory_files(config.corpus_dir + "/queue")) {
+				corpus.push_back(input);
+			}
+			std::cout << "Loaded " << corpus.size() << " seed inputs from '" << config.corpus_dir << "'" << std::endl;
+		}
+		if (corpus.empty()) {
+			corpus.push_back(std::vector<Byte>(1, 0));
+		}
+
+		// Seeds only stay if they cover something the earlier ones didn't
+		FuzzInstance seed_runner(config, image);
+		std::vector<std::vector<Byte>> seeds;
+		seeds.swap(corpus);
+		for (const auto& seed : seeds) {
+			std::vector<Byte> input(seed.begin(), seed.begin() + static_cast<std::ptrdiff_t>(std::min(seed.size(), config.max_input)));
+			seed_runner.run(input);
+			if (fuzz_has_new_bits(seed_runner.coverage(), virgin.data(), true) || corpus.empty()) {
+				corpus.push_back(input);
+			}
+		}
+
+		unsigned n_threads = config.threads;
+		if (n_threads == 0) n_threads = std::max(1u, std::thread::hardware_concurrency());
+		std::cout << "Fuzzing with " << n_threads << " threads, " << corpus.size() << " inputs in the corpus, "
+			<< config.cycle_budget << " cycles per run" << std::endl;
+
+		auto start = std::chrono::steady_clock::now();
+		std::vector<std::thread> workers;
+		for (unsigned i = 0; i < n_threads; i++) {
+			workers.emplace_back(&Fuzzer::worker, this, i);
+		}
+
+		unsigned long last_runs = 0;
+		while (!stop) {
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+			double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			unsigned long runs = total_runs;
+			print_stats(runs, runs - last_runs);
+			last_runs = runs;
+
+			if (config.max_seconds > 0 && elapsed >= static_cast<double>(config.max_seconds)) stop = true;
+			if (config.max_runs > 0 && runs >= config.max_runs) stop = true;
+		}
+
+		for (auto& worker : workers) worker.join();
+		std::cout << "Fuzzing finished." << std::endl;
+		print_stats(total_runs, 0);
+		return 0;
+	}
+
+private:
+	const FuzzConfig& config;
+	const std::vector<Byte>& image;
+
+	std::mutex lock;
+	std::vector<std::vector<Byte>> corpus;
+	std::vector<Byte> virgin;
+	std::vector<Byte> crash_virgin;
+	unsigned long saved_id = 0;
+	// Keeps file names from different sessions in the same corpus apart
+	std::time_t session_id = std::time(nullptr);
+
+	std::atomic<bool> stop { false };
+	std::atomic<unsigned long> total_runs { 0 };
+	std::atomic<unsigned long> crashes { 0 };
+	std::atomic<unsigned long> unique_crashes { 0 };
+	std::atomic<unsigned long> timeouts { 0 };
+
+	void print_stats(unsigned long runs, unsigned long per_second) {
+		std::size_t corpus_size, edges;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			corpus_size = corpus.size();
+			edges = fuzz_count_edges(virgin.data());
+		}
+		std::cout << std::dec << "runs: " << runs << "  runs/s: " << per_second
+			<< "  corpus: " << corpus_size << "  edges: " << edges
+			<< "  crashes: " << crashes << " (" << unique_crashes << " unique)"
+			<< "  timeouts: " << timeouts << std::endl;
+	}
+
+	void save_input(const char* kind, const std::vector<Byte>& input) {
+		// Called with the lock held
+		if (config.corpus_dir.empty()) return;
+		char name[48];
+		std::snprintf(name, sizeof(name), "/id_%lld_%06lu", static_cast<long long>(session_id), saved_id++);
+		std::ofstream out(config.corpus_dir + "/" + kind + name, std::ios::binary);
+		out.write(reinterpret_cast<const char*>(input.data()), static_cast<std::streamsize>(input.size()));
+	}
+
+	void worker(unsigned id) {
+		FuzzInstance instance(config, image);
+		std::mt19937 rng(std::random_device{}() ^ (id * 0x9E3779B9u));
+		std::vector<Byte> local_virgin;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			local_virgin = virgin;
+		}
+
+		std::vector<Byte> input, other;
+		while (!stop) {
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				input = corpus[rng() % corpus.size()];
+				other = corpus[rng() % corpus.size()];
+			}
+
+			// A batch of mutations per corpus pick keeps the lock out of the hot loop
+			for (int round = 0; round < 64 && !stop; round++) {
+				std::vector<Byte> candidate = input;
+				mutate(candidate, other, rng);
+				FuzzOutcome outcome = instance.run(candidate);
+				total_runs++;
+
+				const Byte* coverage = instance.coverage();
+				if (outcome == FUZZ_CRASH) {
+					crashes++;
+					std::lock_guard<std::mutex> guard(lock);
+					if (fuzz_has_new_bits(coverage, crash_virgin.data(), true)) {
+						unique_crashes++;
+						save_input("crashes", candidate);
+					}
+				}
+				else if (outcome == FUZZ_TIMEOUT) {
+					timeouts++;
+				}
+
+				// The local virgin map is a stale superset of the shared one, so
+				// nothing new locally means nothing new globally either
+				if (outcome != FUZZ_CRASH && fuzz_has_new_bits(coverage, local_virgin.data(), false)) {
+					std::lock_guard<std::mutex> guard(lock);
+					if (fuzz_has_new_bits(coverage, virgin.data(), true)) {
+						corpus.push_back(candidate);
+						save_input("queue", candidate);
+					}
+					local_virgin = virgin;
+				}
+
+				if (config.max_runs > 0 && total_runs >= config.max_runs) stop = true;
+			}
+		}
+	}
+
+	void mutate(std::vector<Byte>& input, const std::vector<Byte>& other, std::mt19937& rng) {
+		static const Byte interesting[] = { 0x00, 0x01, 0x02, 0x0F, 0x10, 0x20, 0x40, 0x7F, 0x80, 0x81, 0xFE, 0xFF };
+		auto random = [&rng](std::size_t limit) -> std::size_t {
+			return limit == 0 ? 0 : rng() % limit;
+		};
+
+		int n_mutations = 1 << random(4);
+		for (int i = 0; i < n_mutations; i++) {
+			if (input.empty()) input.push_back(0);
+			std::size_t pos = random(input.size());
+			switch (random(8)) {
+				case 0: // Flip a bit
+				input[pos] ^= static_cast<Byte>(1 << random(8));
+				break;
+				case 1: // Random byte
+				input[pos] = static_cast<Byte>(rng());
+				break;
+				case 2: // Interesting value
+				input[pos] = interesting[random(sizeof(interesting))];
+				break;
+				case 3: // Small arithmetic
+				input[pos] = static_cast<Byte>(input[pos] + random(35) - 17);
+				break;
+				case 4: { // Delete a block
+					if (input.size() < 2) break;
+					std::size_t len = 1 + random(std::min<std::size_t>(input.size() - pos, 16));
+					input.erase(input.begin() + static_cast<std::ptrdiff_t>(pos), input.begin() + static_cast<std::ptrdiff_t>(std::min(pos + len, input.size())));
+					break;
+				}
+				case 5: { // Duplicate a block
+					std::size_t len = 1 + random(std::min<std::size_t>(input.size() - pos, 16));
+					std::vector<Byte> block(input.begin() + static_cast<std::ptrdiff_t>(pos), input.begin() + static_cast<std::ptrdiff_t>(pos + len));
+					input.insert(input.begin() + static_cast<std::ptrdiff_t>(random(input.size() + 1)), block.begin(), block.end());
+					break;
+				}
+				case 6: { // Overwrite with a chunk of another input
+					if (other.empty()) break;
+					std::size_t from = random(other.size());
+					std::size_t len = 1 + random(std::min(other.size() - from, input.size() - pos));
+					std::copy(other.begin() + static_cast<std::ptrdiff_t>(from), other.begin() + static_cast<std::ptrdiff_t>(from + len), input.begin() + static_cast<std::ptrdiff_t>(pos));
+					break;
+				}
+				default: { // Splice: our head, their tail
+					if (other.size() < 2) break;
+					std::size_t cut = random(other.size());
+					input.resize(pos);
+					input.insert(input.end(), other.begin() + static_cast<std::ptrdiff_t>(cut), other.end());
+					break;
+				}
+			}
+		}
+
+		if (input.empty()) input.push_back(0);
+		if (input.size() > config.max_input) input.resize(config.max_input);
+	}
+};
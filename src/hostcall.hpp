@@ -0,0 +1,269 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "types.hpp"
+#include "helpers.hpp"
+#include "mmu.hpp"
+#include "cpu.hpp"
+#include "memops.hpp"
+
+// Handler numbers of the standard host calls. Apart from PUTC, every call
+// takes its arguments from a parameter block in zero page at X, and reports
+// failure by setting carry.
+enum HostCallNumber : Byte {
+	HOST_CALL_MEMCPY = 0x00, // src(2) dst(2) len(2), overlapping ranges are fine
+	HOST_CALL_MEMSET = 0x01, // dst(2) len(2), fills with A
+	HOST_CALL_MUL16 = 0x02,  // a(2) b(2) -> product(4)
+	HOST_CALL_DIV16 = 0x03,  // a(2) b(2) -> quotient(2) remainder(2)
+	HOST_CALL_MUL32 = 0x04,  // a(4) b(4) -> product(8)
+	HOST_CALL_DIV32 = 0x05,  // a(4) b(4) -> quotient(4) remainder(4)
+	HOST_CALL_PUTC = 0x10,   // Prints A
+	HOST_CALL_PRINT = 0x11,  // string(2), NUL-terminated
+	HOST_CALL_OPEN = 0x20,   // name(2) mode(1): 0 read, 1 write, 2 append -> handle in A
+	HOST_CALL_READ = 0x21,   // buffer(2) len(2) -> count(2), handle in A
+	HOST_CALL_WRITE = 0x22,  // buffer(2) len(2) -> count(2), handle in A
+	HOST_CALL_CLOSE = 0x23   // Handle in A
+};
+
+static constexpr std::size_t HOST_CALL_MAX_FILES = 8;
+static constexpr std::size_t HOST_CALL_MAX_NAME = 64;
+
+// Native replacements for routines a 6502 program would otherwise spend most
+// of its time in. Each handler charges a fixed number of cycles plus some per
+// byte it handled, so timing stays in the same ballpark as the routine it
+// replaces; both can be changed per handler.
+class HostCalls : public HostCallHandler {
+public:
+	// Returns how many bytes it handled, for the per-byte cost
+	using Function = std::function<std::size_t(CPU&, MMU&)>;
+
+	struct Handler {
+		std::string name;
+		Function run;
+		unsigned long cycles = 0;
+		unsigned long cycles_per_byte = 0;
+	};
+
+	HostCalls() {
+		for (std::FILE*& file : files) file = nullptr;
+	}
+
+	~HostCalls() {
+		for (std::FILE* file : files) {
+			if (file) std::fclose(file);
+		}
+	}
+
+	HostCalls(const HostCalls&) = delete;
+	HostCalls& operator=(const HostCalls&) = delete;
+
+	void add(Byte number, const std::string& name, Function run, unsigned long cycles, unsigned long cycles_per_byte = 0) {
+		Handler& handler = handlers[number];
+		handler.name = name;
+		handler.run = std::move(run);
+		handler.cycles = cycles;
+		handler.cycles_per_byte = cycles_per_byte;
+	}
+
+	// False if there's no handler with that number
+	bool set_cost(Byte number, unsigned long cycles, unsigned long cycles_per_byte) {
+		if (!handlers[number].run) return false;
+		handlers[number].cycles = cycles;
+		handlers[number].cycles_per_byte = cycles_per_byte;
+		return true;
+	}
+
+	// Registers everything in HostCallNumber. Files are only opened inside
+	// sandbox, by plain names (letters, digits, '.', '_' and '-').
+	void add_standard(const std::string& sandbox) {
+		sandbox_dir = sandbox;
+		add(HOST_CALL_MEMCPY, "memcpy", [this](CPU& cpu, MMU& mmu) {
+			Word length = block_word(cpu, mmu, 4);
+			buffer.resize(length);
+			memory_read(mmu, block_word(cpu, mmu, 0), length, buffer.data());
+			memory_write(mmu, block_word(cpu, mmu, 2), buffer.data(), length);
+			return succeed(cpu, length);
+		}, 40, 12);
+		add(HOST_CALL_MEMSET, "memset", [this](CPU& cpu, MMU& mmu) {
+			Word length = block_word(cpu, mmu, 2);
+			memory_fill(mmu, block_word(cpu, mmu, 0), length, cpu.A);
+			return succeed(cpu, length);
+		}, 30, 8);
+		add(HOST_CALL_MUL16, "mul16", [this](CPU& cpu, MMU& mmu) {
+			uint32_t product = static_cast<uint32_t>(block_word(cpu, mmu, 0)) * block_word(cpu, mmu, 2);
+			set_block(cpu, mmu, 4, product, 4);
+			return succeed(cpu, 0);
+		}, 200);
+		add(HOST_CALL_DIV16, "div16", [this](CPU& cpu, MMU& mmu) {
+			Word divisor = block_word(cpu, mmu, 2);
+			if (divisor == 0) return fail(cpu);
+			Word dividend = block_word(cpu, mmu, 0);
+			set_block(cpu, mmu, 4, dividend / divisor, 2);
+			set_block(cpu, mmu, 6, dividend % divisor, 2);
+			return succeed(cpu, 0);
+		}, 250);
+		add(HOST_CALL_MUL32, "mul32", [this](CPU& cpu, MMU& mmu) {
+			uint64_t product = block_value(cpu, mmu, 0, 4) * block_value(cpu, mmu, 4, 4);
+			set_block(cpu, mmu, 8, product, 8);
+			return succeed(cpu, 0);
+		}, 700);
+		add(HOST_CALL_DIV32, "div32", [this](CPU& cpu, MMU& mmu) {
+			uint64_t divisor = block_value(cpu, mmu, 4, 4);
+			if (divisor == 0) return fail(cpu);
+			uint64_t dividend = block_value(cpu, mmu, 0, 4);
+			set_block(cpu, mmu, 8, dividend / divisor, 4);
+			set_block(cpu, mmu, 12, dividend % divisor, 4);
+			return succeed(cpu, 0);
+		}, 900);
+		add(HOST_CALL_PUTC, "putc", [this](CPU& cpu, MMU&) {
+			std::cout << static_cast<char>(cpu.A) << std::flush;
+			return succeed(cpu, 1);
+		}, 20);
+		add(HOST_CALL_PRINT, "print", [this](CPU& cpu, MMU& mmu) {
+			std::string text = read_string(mmu, block_word(cpu, mmu, 0), 0xFFFF);
+			std::cout << text << std::flush;
+			return succeed(cpu, text.size());
+		}, 30, 10);
+		add(HOST_CALL_OPEN, "open", [this](CPU& cpu, MMU& mmu) {
+			return open_file(cpu, mmu);
+		}, 100);
+		add(HOST_CALL_READ, "read", [this](CPU& cpu, MMU& mmu) {
+			return transfer(cpu, mmu, false);
+		}, 100, 10);
+		add(HOST_CALL_WRITE, "write", [this](CPU& cpu, MMU& mmu) {
+			return transfer(cpu, mmu, true);
+		}, 100, 10);
+		add(HOST_CALL_CLOSE, "close", [this](CPU& cpu, MMU&) {
+			std::FILE** file = handle(cpu.A);
+			if (!file) return fail(cpu);
+			std::fclose(*file);
+			*file = nullptr;
+			return succeed(cpu, 0);
+		}, 50);
+	}
+
+	CPUStatus host_call(CPU& cpu, MMU& mmu, Byte number) {
+		Handler& handler = handlers[number];
+		if (!handler.run) return INVALID;
+		calls++;
+		std::size_t bytes = handler.run(cpu, mmu);
+		cpu.cycle_count += handler.cycles + handler.cycles_per_byte * bytes;
+		return CONTINUE;
+	}
+
+	void list(std::ostream& os, Byte opcode) const {
+		os << "Host calls (opcode 0x" << std::hex << (int)opcode << " followed by the number):" << std::endl;
+		for (int i = 0; i < 256; i++) {
+			const Handler& handler = handlers[i];
+			if (!handler.run) continue;
+			os << "  0x" << std::hex << i << " " << handler.name << ": " << std::dec << handler.cycles << " cycles";
+			if (handler.cycles_per_byte) os << " + " << handler.cycles_per_byte << " per byte";
+			os << std::endl;
+		}
+	}
+
+	unsigned long calls = 0;
+
+private:
+	Handler handlers[256];
+	std::string sandbox_dir;
+	std::FILE* files[HOST_CALL_MAX_FILES];
+	std::vector<Byte> buffer;
+
+	// Parameter blocks wrap around within zero page
+	static uint64_t block_value(CPU& cpu, MMU& mmu, Byte offset, int size) {
+		uint64_t value = 0;
+		for (int i = 0; i < size; i++) {
+			value |= static_cast<uint64_t>(mmu.read_byte(static_cast<Byte>(cpu.X + offset + i))) << (8 * i);
+		}
+		return value;
+	}
+
+	static Word block_word(CPU& cpu, MMU& mmu, Byte offset) {
+		return static_cast<Word>(block_value(cpu, mmu, offset, 2));
+	}
+
+	static void set_block(CPU& cpu, MMU& mmu, Byte offset, uint64_t value, int size) {
+		for (int i = 0; i < size; i++) {
+			mmu.write_byte(static_cast<Byte>(cpu.X + offset + i), static_cast<Byte>(value >> (8 * i)));
+		}
+	}
+
+	static std::size_t succeed(CPU& cpu, std::size_t bytes) {
+		cpu.set_flag(CPU_FLAG_C, 0);
+		return bytes;
+	}
+
+	static std::size_t fail(CPU& cpu) {
+		cpu.set_flag(CPU_FLAG_C, 1);
+		return 0;
+	}
+
+	static std::string read_string(MMU& mmu, Word address, std::size_t limit) {
+		std::string text;
+		for (std::size_t i = 0; i < limit; i++) {
+			Byte c = mmu.read_byte(static_cast<Word>(address + i));
+			if (c == 0) break;
+			text.push_back(static_cast<char>(c));
+		}
+		return text;
+	}
+
+	std::FILE** handle(Byte number) {
+		if (number >= HOST_CALL_MAX_FILES || !files[number]) return nullptr;
+		return &files[number];
+	}
+
+	static bool is_plain_name(const std::string& name) {
+		if (name.empty() || name.size() > HOST_CALL_MAX_NAME || name[0] == '.') return false;
+		for (char c : name) {
+			bool ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '.' || c == '_' || c == '-';
+			if (!ok) return false;
+		}
+		return true;
+	}
+
+	std::size_t open_file(CPU& cpu, MMU& mmu) {
+		std::string name = read_string(mmu, block_word(cpu, mmu, 0), HOST_CALL_MAX_NAME + 1);
+		Byte mode = mmu.read_byte(static_cast<Byte>(cpu.X + 2));
+		static const char* const modes[] = { "rb", "wb", "ab" };
+		if (!is_plain_name(name) || mode > 2) return fail(cpu);
+
+		for (std::size_t i = 0; i < HOST_CALL_MAX_FILES; i++) {
+			if (files[i]) continue;
+			files[i] = std::fopen((sandbox_dir + "/" + name).c_str(), modes[mode]);
+			if (!files[i]) return fail(cpu);
+			cpu.A = static_cast<Byte>(i);
+			return succeed(cpu, 0);
+		}
+		return fail(cpu);
+	}
+
+	std::size_t transfer(CPU& cpu, MMU& mmu, bool write) {
+		std::FILE** file = handle(cpu.A);
+		if (!file) return fail(cpu);
+		Word address = block_word(cpu, mmu, 0);
+		Word length = block_word(cpu, mmu, 2);
+		buffer.resize(length);
+		std::size_t count;
+		if (write) {
+			memory_read(mmu, address, length, buffer.data());
+			count = std::fwrite(buffer.data(), 1, length, *file);
+		}
+		else {
+			count = std::fread(buffer.data(), 1, length, *file);
+			memory_write(mmu, address, buffer.data(), count);
+		}
+		set_block(cpu, mmu, 4, count, 2);
+		if (std::ferror(*file)) {
+			std::clearerr(*file);
+			return fail(cpu) + count;
+		}
+		return succeed(cpu, count);
+	}
+};
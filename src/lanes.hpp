@@ -0,0 +1,618 @@
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include "types.hpp"
+#include "helpers.hpp"
+#include "page.hpp"
+#include "mmu.hpp"
+#include "cpu.hpp"
+
+static constexpr std::size_t LANE_MAX = 32;
+using LaneMask = uint32_t;
+
+// Plain memory that lives in somebody else's buffer
+class ExternalRAMPage : public MemoryPage {
+public:
+	explicit ExternalRAMPage(Byte* memory) : data(memory) {}
+
+	Byte read_byte(Byte address) const {
+		return data[address];
+	}
+
+	void write_byte(Byte address, Byte value) {
+		data[address] = value;
+	}
+
+	Byte* raw_data() {
+		return data;
+	}
+
+	const Byte* read_data() const {
+		return data;
+	}
+
+private:
+	Byte* data;
+};
+
+enum LaneOpKind : Byte {
+	LANE_OP_SCALAR = 0, // Everything not listed runs on the scalar core, a lane at a time
+	LANE_OP_NOP,
+	LANE_OP_FLAG,
+	LANE_OP_TRANSFER,
+	LANE_OP_INCREMENT,
+	LANE_OP_DECREMENT,
+	LANE_OP_LOAD,
+	LANE_OP_STORE,
+	LANE_OP_ORA,
+	LANE_OP_AND,
+	LANE_OP_EOR,
+	LANE_OP_ADC,
+	LANE_OP_SBC,
+	LANE_OP_COMPARE,
+	LANE_OP_BIT,
+	LANE_OP_INC_MEMORY,
+	LANE_OP_DEC_MEMORY,
+	LANE_OP_ASL,
+	LANE_OP_ROL,
+	LANE_OP_LSR,
+	LANE_OP_ROR,
+	LANE_OP_BRANCH,
+	LANE_OP_JMP
+};
+
+enum LaneRegister : Byte {
+	LANE_A = 0,
+	LANE_X,
+	LANE_Y,
+	LANE_SP,
+	LANE_REGISTER_COUNT
+};
+
+struct LaneOp {
+	LaneOpKind kind = LANE_OP_SCALAR;
+	Byte mode = CPU_ADDR_MODE_INVALID; // INVALID for implied
+	Byte reg = LANE_A;                 // Register loaded, stored, compared or transferred to
+	Byte source = LANE_A;              // Transfers only
+	Byte flag = 0;                     // Flag instructions and branches
+	bool condition = false;            // Value set, or flag value a branch is taken on
+	Byte length = 1;
+	unsigned long cycles = 0;
+	unsigned long taken_cycles = 0;    // Branches only
+};
+
+// Runs up to LANE_MAX copies of a machine side by side, e.g. one program over
+// a sweep of inputs. Registers are kept as arrays indexed by lane, and lanes
+// whose PC is the same execute that instruction together: register work is
+// done for all lanes at once with masks (plain loops the compiler turns into
+// vector code), and memory operands are gathered from and scattered to each
+// lane's own 64K. Anything that isn't in the table (stack, subroutines,
+// interrupts, decimal mode, invalid opcodes) runs through a scalar CPU for
+// each lane on its own, so results match the scalar core exactly. Cycle
+// counts are taken from the scalar core too.
+class LaneEngine {
+public:
+	LaneEngine(std::size_t lanes, CPUType cpu_type) : lane_count(lanes > LANE_MAX ? LANE_MAX : lanes), type(cpu_type),
+		ram(lane_count * 65536, 0) {
+		for (std::size_t i = 0; i < lane_count; i++) {
+			mmus.push_back(std::make_unique<MMU>());
+			for (int page = 0; page < 256; page++) {
+				mmus[i]->install_page(static_cast<Byte>(page), std::make_unique<ExternalRAMPage>(memory(i) + page * 256));
+			}
+		}
+		scalar.type = type;
+		build_ops();
+		time_ops();
+	}
+
+	LaneEngine(const LaneEngine&) = delete;
+	LaneEngine& operator=(const LaneEngine&) = delete;
+
+	std::size_t size() const {
+		return lane_count;
+	}
+
+	Byte* memory(std::size_t lane) {
+		return ram.data() + lane * 65536;
+	}
+
+	MMU& mmu(std::size_t lane) {
+		return *mmus[lane];
+	}
+
+	CPUStatus lane_status(std::size_t lane) const {
+		return status[lane];
+	}
+
+	// Every lane gets the same 64K, tweak them afterwards through memory()
+	void load_image(const std::vector<Byte>& image) {
+		for (std::size_t i = 0; i < lane_count; i++) {
+			std::copy(image.begin(), image.begin() + static_cast<std::ptrdiff_t>(std::min<std::size_t>(image.size(), 65536)), memory(i));
+		}
+	}
+
+	// Each lane starts at its own reset vector
+	void reset() {
+		for (std::size_t i = 0; i < lane_count; i++) {
+			scalar.reset(*mmus[i]);
+			scalar.instruction_count = 0;
+			import_lane(i, scalar);
+			status[i] = CONTINUE;
+		}
+	}
+
+	void import_lane(std::size_t i, const CPU& cpu) {
+		regs[LANE_A][i] = cpu.A;
+		regs[LANE_X][i] = cpu.X;
+		regs[LANE_Y][i] = cpu.Y;
+		regs[LANE_SP][i] = cpu.SP;
+		SF[i] = cpu.SF;
+		PC[i] = cpu.PC;
+		cycles[i] = cpu.cycle_count;
+		instructions[i] = cpu.instruction_count;
+	}
+
+	void export_lane(std::size_t i, CPU& cpu) const {
+		cpu.A = regs[LANE_A][i];
+		cpu.X = regs[LANE_X][i];
+		cpu.Y = regs[LANE_Y][i];
+		cpu.SP = regs[LANE_SP][i];
+		cpu.SF = SF[i];
+		cpu.PC = PC[i];
+		cpu.cycle_count = cycles[i];
+		cpu.instruction_count = instructions[i];
+	}
+
+	// Every lane runs for this many more cycles, or until it halts or hits an
+	// invalid instruction. Like the scalar core, a lane can end up a few
+	// cycles past the end since instructions aren't split.
+	void run(unsigned long run_cycles) {
+		unsigned long end[LANE_MAX];
+		for (std::size_t i = 0; i < lane_count; i++) end[i] = cycles[i] + run_cycles;
+
+		for (;;) {
+			LaneMask active = 0;
+			Word lowest = 0xFFFF;
+			for (std::size_t i = 0; i < lane_count; i++) {
+				if (status[i] != CONTINUE || cycles[i] >= end[i]) continue;
+				active |= LaneMask(1) << i;
+				if (PC[i] < lowest) lowest = PC[i];
+			}
+			if (active == 0) break;
+
+			// The lanes furthest back go first, so ones that took a branch
+			// forward wait there for the rest to catch up
+			LaneMask group = 0;
+			for (std::size_t i = 0; i < lane_count; i++) {
+				if ((active >> i & 1) && PC[i] == lowest) group |= LaneMask(1) << i;
+			}
+			step(group, lowest);
+		}
+	}
+
+	unsigned long lane_cycles(std::size_t lane) const {
+		return cycles[lane];
+	}
+
+	unsigned long lane_instructions(std::size_t lane) const {
+		return instructions[lane];
+	}
+
+	// Instructions run together with other lanes, instructions run on the
+	// scalar core, and how many group steps the former took
+	unsigned long vector_instructions = 0;
+	unsigned long scalar_instructions = 0;
+	unsigned long group_steps = 0;
+
+private:
+	std::size_t lane_count;
+	CPUType type;
+	std::vector<Byte> ram;
+	std::vector<std::unique_ptr<MMU>> mmus;
+	CPU scalar;
+	LaneOp ops[256];
+
+	alignas(32) Byte regs[LANE_REGISTER_COUNT][LANE_MAX] = {};
+	alignas(32) Byte SF[LANE_MAX] = {};
+	alignas(32) Word PC[LANE_MAX] = {};
+	unsigned long cycles[LANE_MAX] = {};
+	unsigned long instructions[LANE_MAX] = {};
+	CPUStatus status[LANE_MAX] = {};
+
+	static Byte blend(Byte mask, Byte old_value, Byte new_value) {
+		return static_cast<Byte>((old_value & ~mask) | (new_value & mask));
+	}
+
+	static Byte nz(Byte value) {
+		return static_cast<Byte>((value & CPU_FLAG_N) | (value == 0 ? CPU_FLAG_Z : 0));
+	}
+
+	static Byte length_of(Byte mode) {
+		switch (mode) {
+			case CPU_ADDR_MODE_ABS:
+			case CPU_ADDR_MODE_ABX:
+			case CPU_ADDR_MODE_ABY:
+			return 3;
+			case CPU_ADDR_MODE_ACC:
+			case CPU_ADDR_MODE_INVALID:
+			return 1;
+			default:
+			return 2;
+		}
+	}
+
+	void set_op(Byte opcode, LaneOpKind kind, Byte mode, Byte reg = LANE_A) {
+		LaneOp& op = ops[opcode];
+		op.kind = kind;
+		op.mode = mode;
+		op.reg = reg;
+		op.length = length_of(mode);
+	}
+
+	void build_ops() {
+		set_op(0xEA, LANE_OP_NOP, CPU_ADDR_MODE_INVALID);
+
+		static const Byte flag_ops[][3] = {
+			{ 0x18, CPU_FLAG_C, 0 }, { 0x38, CPU_FLAG_C, 1 }, { 0x58, CPU_FLAG_I, 0 }, { 0x78, CPU_FLAG_I, 1 },
+			{ 0xB8, CPU_FLAG_V, 0 }, { 0xD8, CPU_FLAG_D, 0 }, { 0xF8, CPU_FLAG_D, 1 }
+		};
+		for (const Byte* f : flag_ops) {
+			set_op(f[0], LANE_OP_FLAG, CPU_ADDR_MODE_INVALID);
+			ops[f[0]].flag = f[1];
+			ops[f[0]].condition = f[2] != 0;
+		}
+
+		// Opcode, destination, source
+		static const Byte transfers[][3] = {
+			{ 0xA8, LANE_Y, LANE_A }, { 0x98, LANE_A, LANE_Y }, { 0xAA, LANE_X, LANE_A },
+			{ 0x8A, LANE_A, LANE_X }, { 0x9A, LANE_SP, LANE_X }, { 0xBA, LANE_X, LANE_SP }
+		};
+		for (const Byte* t : transfers) {
+			set_op(t[0], LANE_OP_TRANSFER, CPU_ADDR_MODE_INVALID, t[1]);
+			ops[t[0]].source = t[2];
+		}
+		set_op(0xC8, LANE_OP_INCREMENT, CPU_ADDR_MODE_INVALID, LANE_Y);
+		set_op(0xE8, LANE_OP_INCREMENT, CPU_ADDR_MODE_INVALID, LANE_X);
+		set_op(0x88, LANE_OP_DECREMENT, CPU_ADDR_MODE_INVALID, LANE_Y);
+		set_op(0xCA, LANE_OP_DECREMENT, CPU_ADDR_MODE_INVALID, LANE_X);
+
+		// Group 1 has every mode, except that STA # doesn't exist
+		static const LaneOpKind group1[8] = {
+			LANE_OP_ORA, LANE_OP_AND, LANE_OP_EOR, LANE_OP_ADC, LANE_OP_STORE, LANE_OP_LOAD, LANE_OP_COMPARE, LANE_OP_SBC
+		};
+		for (int aaa = 0; aaa < 8; aaa++) {
+			for (int bbb = 0; bbb < 8; bbb++) {
+				Byte opcode = static_cast<Byte>(aaa << 5 | bbb << 2 | 0b01);
+				if (opcode == 0x89) continue;
+				set_op(opcode, group1[aaa], addr_mode_table[1][bbb]);
+			}
+		}
+
+		// Shifts and rotates, INC and DEC. The accumulator forms of the
+		// last two are DEX and NOP, which are set above.
+		static const LaneOpKind group2[8] = {
+			LANE_OP_ASL, LANE_OP_ROL, LANE_OP_LSR, LANE_OP_ROR, LANE_OP_SCALAR, LANE_OP_SCALAR, LANE_OP_DEC_MEMORY, LANE_OP_INC_MEMORY
+		};
+		static const int group2_modes[] = { 0b001, 0b010, 0b011, 0b101, 0b111 };
+		for (int aaa = 0; aaa < 8; aaa++) {
+			if (group2[aaa] == LANE_OP_SCALAR) continue;
+			for (int bbb : group2_modes) {
+				if (aaa >= 6 && bbb == 0b010) continue;
+				set_op(static_cast<Byte>(aaa << 5 | bbb << 2 | 0b10), group2[aaa], addr_mode_table[2][bbb]);
+			}
+		}
+
+		// X and Y loads, stores and compares, only the documented modes
+		static const Byte xy_ops[][4] = {
+			{ 0xA2, LANE_OP_LOAD, CPU_ADDR_MODE_IMM, LANE_X }, { 0xA6, LANE_OP_LOAD, CPU_ADDR_MODE_ZPG, LANE_X },
+			{ 0xAE, LANE_OP_LOAD, CPU_ADDR_MODE_ABS, LANE_X }, { 0xB6, LANE_OP_LOAD, CPU_ADDR_MODE_ZPY, LANE_X },
+			{ 0xBE, LANE_OP_LOAD, CPU_ADDR_MODE_ABY, LANE_X },
+			{ 0x86, LANE_OP_STORE, CPU_ADDR_MODE_ZPG, LANE_X }, { 0x8E, LANE_OP_STORE, CPU_ADDR_MODE_ABS, LANE_X },
+			{ 0x96, LANE_OP_STORE, CPU_ADDR_MODE_ZPY, LANE_X },
+			{ 0xA0, LANE_OP_LOAD, CPU_ADDR_MODE_IMM, LANE_Y }, { 0xA4, LANE_OP_LOAD, CPU_ADDR_MODE_ZPG, LANE_Y },
+			{ 0xAC, LANE_OP_LOAD, CPU_ADDR_MODE_ABS, LANE_Y }, { 0xB4, LANE_OP_LOAD, CPU_ADDR_MODE_ZPX, LANE_Y },
+			{ 0xBC, LANE_OP_LOAD, CPU_ADDR_MODE_ABX, LANE_Y },
+			{ 0x84, LANE_OP_STORE, CPU_ADDR_MODE_ZPG, LANE_Y }, { 0x8C, LANE_OP_STORE, CPU_ADDR_MODE_ABS, LANE_Y },
+			{ 0x94, LANE_OP_STORE, CPU_ADDR_MODE_ZPX, LANE_Y },
+			{ 0xC0, LANE_OP_COMPARE, CPU_ADDR_MODE_IMM, LANE_Y }, { 0xC4, LANE_OP_COMPARE, CPU_ADDR_MODE_ZPG, LANE_Y },
+			{ 0xCC, LANE_OP_COMPARE, CPU_ADDR_MODE_ABS, LANE_Y },
+			{ 0xE0, LANE_OP_COMPARE, CPU_ADDR_MODE_IMM, LANE_X }, { 0xE4, LANE_OP_COMPARE, CPU_ADDR_MODE_ZPG, LANE_X },
+			{ 0xEC, LANE_OP_COMPARE, CPU_ADDR_MODE_ABS, LANE_X },
+			{ 0x24, LANE_OP_BIT, CPU_ADDR_MODE_ZPG, LANE_A }, { 0x2C, LANE_OP_BIT, CPU_ADDR_MODE_ABS, LANE_A },
+			{ 0x4C, LANE_OP_JMP, CPU_ADDR_MODE_ABS, LANE_A }
+		};
+		for (const Byte* o : xy_ops) {
+			set_op(o[0], static_cast<LaneOpKind>(o[1]), o[2], o[3]);
+		}
+
+		static const Byte branch_flags[4] = { CPU_FLAG_N, CPU_FLAG_V, CPU_FLAG_C, CPU_FLAG_Z };
+		for (int aaa = 0; aaa < 8; aaa++) {
+			Byte opcode = static_cast<Byte>(aaa << 5 | 0b10000);
+			set_op(opcode, LANE_OP_BRANCH, CPU_ADDR_MODE_IMM);
+			ops[opcode].flag = branch_flags[aaa >> 1];
+			ops[opcode].condition = (aaa & 1) != 0;
+		}
+	}
+
+	// Costs come from the scalar core, so the two can't disagree. Branches
+	// are timed both ways.
+	void time_ops() {
+		for (int opcode = 0; opcode < 256; opcode++) {
+			LaneOp& op = ops[opcode];
+			if (op.kind == LANE_OP_SCALAR) continue;
+			Byte taken = op.condition ? op.flag : 0;
+			Byte not_taken = op.condition ? 0 : op.flag;
+			op.cycles = measure_instruction_cycles(type, static_cast<Byte>(opcode), not_taken);
+			op.taken_cycles = measure_instruction_cycles(type, static_cast<Byte>(opcode), taken);
+		}
+	}
+
+	void scalar_step(std::size_t i) {
+		export_lane(i, scalar);
+		CPUStatus result = scalar.exec_instruction(*mmus[i], true);
+		import_lane(i, scalar);
+		if (result != CONTINUE) status[i] = result;
+		scalar_instructions++;
+	}
+
+	void step(LaneMask group, Word pc) {
+		// Lanes can have different code at the same address
+		Byte opcode = 0;
+		bool first = true;
+		for (std::size_t i = 0; i < lane_count; i++) {
+			if (!(group >> i & 1)) continue;
+			if (first) {
+				opcode = memory(i)[pc];
+				first = false;
+			}
+			else if (memory(i)[pc] != opcode) {
+				scalar_step(i);
+				group &= ~(LaneMask(1) << i);
+			}
+		}
+
+		const LaneOp& op = ops[opcode];
+		bool to_scalar = op.kind == LANE_OP_SCALAR;
+		// Only binary arithmetic is done here
+		bool decimal = type != NES && (op.kind == LANE_OP_ADC || op.kind == LANE_OP_SBC);
+		for (std::size_t i = 0; i < lane_count; i++) {
+			if (!(group >> i & 1)) continue;
+			if (to_scalar || (decimal && (SF[i] & CPU_FLAG_D))) {
+				scalar_step(i);
+				group &= ~(LaneMask(1) << i);
+			}
+		}
+		if (group == 0) return;
+		execute_group(op, group);
+	}
+
+	void execute_group(const LaneOp& op, LaneMask group) {
+		alignas(32) Byte m[LANE_MAX];
+		alignas(32) Byte value[LANE_MAX] = {};
+		alignas(32) Byte result[LANE_MAX] = {};
+		Word address[LANE_MAX] = {};
+		for (std::size_t i = 0; i < LANE_MAX; i++) m[i] = (group >> i & 1) ? 0xFF : 0;
+
+		Byte* A = regs[LANE_A];
+		Byte* reg = regs[op.reg];
+		bool writes_back = false;
+
+		if (op.mode != CPU_ADDR_MODE_INVALID) gather(op, group, address, value);
+
+		switch (op.kind) {
+			case LANE_OP_NOP:
+			break;
+			case LANE_OP_FLAG:
+			for (std::size_t i = 0; i < LANE_MAX; i++) {
+				Byte flags = op.condition ? static_cast<Byte>(SF[i] | op.flag) : static_cast<Byte>(SF[i] & ~op.flag);
+				SF[i] = blend(m[i], SF[i], flags);
+			}
+			break;
+			case LANE_OP_TRANSFER: {
+				const Byte* source = regs[op.source];
+				for (std::size_t i = 0; i < LANE_MAX; i++) reg[i] = blend(m[i], reg[i], source[i]);
+				// TXS is the only one that leaves the flags alone
+				if (op.reg != LANE_SP) set_nz(m, reg);
+				break;
+			}
+			case LANE_OP_INCREMENT:
+			case LANE_OP_DECREMENT: {
+				Byte delta = op.kind == LANE_OP_INCREMENT ? 1 : 0xFF;
+				for (std::size_t i = 0; i < LANE_MAX; i++) reg[i] = blend(m[i], reg[i], static_cast<Byte>(reg[i] + delta));
+				set_nz(m, reg);
+				break;
+			}
+			case LANE_OP_LOAD:
+			for (std::size_t i = 0; i < LANE_MAX; i++) reg[i] = blend(m[i], reg[i], value[i]);
+			set_nz(m, reg);
+			break;
+			case LANE_OP_STORE:
+			for (std::size_t i = 0; i < LANE_MAX; i++) result[i] = reg[i];
+			writes_back = true;
+			break;
+			case LANE_OP_ORA:
+			for (std::size_t i = 0; i < LANE_MAX; i++) A[i] = blend(m[i], A[i], static_cast<Byte>(A[i] | value[i]));
+			set_nz(m, A);
+			break;
+			case LANE_OP_AND:
+			for (std::size_t i = 0; i < LANE_MAX; i++) A[i] = blend(m[i], A[i], static_cast<Byte>(A[i] & value[i]));
+			set_nz(m, A);
+			break;
+			case LANE_OP_EOR:
+			for (std::size_t i = 0; i < LANE_MAX; i++) A[i] = blend(m[i], A[i], static_cast<Byte>(A[i] ^ value[i]));
+			set_nz(m, A);
+			break;
+			case LANE_OP_SBC:
+			for (std::size_t i = 0; i < LANE_MAX; i++) value[i] = static_cast<Byte>(~value[i]);
+			add(m, value);
+			break;
+			case LANE_OP_ADC:
+			add(m, value);
+			break;
+			case LANE_OP_COMPARE:
+			for (std::size_t i = 0; i < LANE_MAX; i++) {
+				Byte difference = static_cast<Byte>(reg[i] - value[i]);
+				Byte flags = static_cast<Byte>((SF[i] & ~(CPU_FLAG_N | CPU_FLAG_Z | CPU_FLAG_C)) | nz(difference)
+					| (reg[i] >= value[i] ? CPU_FLAG_C : 0));
+				SF[i] = blend(m[i], SF[i], flags);
+			}
+			break;
+			case LANE_OP_BIT:
+			for (std::size_t i = 0; i < LANE_MAX; i++) {
+				Byte flags = static_cast<Byte>((SF[i] & ~(CPU_FLAG_N | CPU_FLAG_V | CPU_FLAG_Z)) | (value[i] & (CPU_FLAG_N | CPU_FLAG_V))
+					| ((A[i] & value[i]) == 0 ? CPU_FLAG_Z : 0));
+				SF[i] = blend(m[i], SF[i], flags);
+			}
+			break;
+			case LANE_OP_INC_MEMORY:
+			case LANE_OP_DEC_MEMORY: {
+				Byte delta = op.kind == LANE_OP_INC_MEMORY ? 1 : 0xFF;
+				for (std::size_t i = 0; i < LANE_MAX; i++) result[i] = static_cast<Byte>(value[i] + delta);
+				set_nz(m, result);
+				writes_back = true;
+				break;
+			}
+			case LANE_OP_ASL:
+			case LANE_OP_ROL:
+			case LANE_OP_LSR:
+			case LANE_OP_ROR: {
+				bool left = op.kind == LANE_OP_ASL || op.kind == LANE_OP_ROL;
+				bool rotate = op.kind == LANE_OP_ROL || op.kind == LANE_OP_ROR;
+				for (std::size_t i = 0; i < LANE_MAX; i++) {
+					Byte carry_in = rotate ? static_cast<Byte>(SF[i] & CPU_FLAG_C) : 0;
+					Byte shifted = left ? static_cast<Byte>(value[i] << 1 | carry_in) : static_cast<Byte>(value[i] >> 1 | carry_in << 7);
+					Byte carry_out = left ? static_cast<Byte>(value[i] >> 7) : static_cast<Byte>(value[i] & 1);
+					result[i] = shifted;
+					Byte flags = static_cast<Byte>((SF[i] & ~(CPU_FLAG_N | CPU_FLAG_Z | CPU_FLAG_C)) | nz(shifted) | carry_out);
+					SF[i] = blend(m[i], SF[i], flags);
+				}
+				if (op.mode == CPU_ADDR_MODE_ACC) {
+					for (std::size_t i = 0; i < LANE_MAX; i++) A[i] = blend(m[i], A[i], result[i]);
+				}
+				else {
+					writes_back = true;
+				}
+				break;
+			}
+			case LANE_OP_BRANCH:
+			case LANE_OP_JMP:
+			jump(op, group, address, value);
+			return;
+			case LANE_OP_SCALAR:
+			break;
+		}
+
+		if (writes_back) {
+			for (std::size_t i = 0; i < lane_count; i++) {
+				if (group >> i & 1) memory(i)[address[i]] = result[i];
+			}
+		}
+		for (std::size_t i = 0; i < LANE_MAX; i++) PC[i] = static_cast<Word>(PC[i] + (m[i] & op.length));
+		finish_group(group, op.cycles);
+	}
+
+	void finish_group(LaneMask group, unsigned long op_cycles) {
+		for (std::size_t i = 0; i < lane_count; i++) {
+			if (!(group >> i & 1)) continue;
+			cycles[i] += op_cycles;
+			instructions[i]++;
+			vector_instructions++;
+		}
+		group_steps++;
+	}
+
+	void set_nz(const Byte* m, const Byte* v) {
+		for (std::size_t i = 0; i < LANE_MAX; i++) {
+			SF[i] = blend(m[i], SF[i], static_cast<Byte>((SF[i] & ~(CPU_FLAG_N | CPU_FLAG_Z)) | nz(v[i])));
+		}
+	}
+
+	// Binary ADC, and SBC with the operand already inverted
+	void add(const Byte* m, const Byte* value) {
+		Byte* A = regs[LANE_A];
+		for (std::size_t i = 0; i < LANE_MAX; i++) {
+			unsigned sum = unsigned(A[i]) + value[i] + (SF[i] & CPU_FLAG_C);
+			Byte sum_byte = static_cast<Byte>(sum);
+			Byte overflow = static_cast<Byte>((~(A[i] ^ value[i]) & (A[i] ^ sum_byte) & 0x80) >> 1);
+			Byte flags = static_cast<Byte>((SF[i] & ~(CPU_FLAG_N | CPU_FLAG_V | CPU_FLAG_Z | CPU_FLAG_C))
+				| nz(sum_byte) | overflow | (sum > 0xFF ? CPU_FLAG_C : 0));
+			SF[i] = blend(m[i], SF[i], flags);
+			A[i] = blend(m[i], A[i], sum_byte);
+		}
+	}
+
+	// Effective addresses and operands, from each lane's own memory
+	void gather(const LaneOp& op, LaneMask group, Word* address, Byte* value) {
+		for (std::size_t i = 0; i < lane_count; i++) {
+			if (!(group >> i & 1)) continue;
+			const Byte* mem = memory(i);
+			Word pc = PC[i];
+			Byte operand = mem[static_cast<Word>(pc + 1)];
+			Byte X = regs[LANE_X][i];
+			Byte Y = regs[LANE_Y][i];
+			switch (op.mode) {
+				case CPU_ADDR_MODE_IMM:
+				value[i] = operand;
+				continue;
+				case CPU_ADDR_MODE_ACC:
+				value[i] = regs[LANE_A][i];
+				continue;
+				case CPU_ADDR_MODE_ZPG:
+				address[i] = operand;
+				break;
+				case CPU_ADDR_MODE_ZPX:
+				address[i] = lo(widen(operand) + X);
+				break;
+				case CPU_ADDR_MODE_ZPY:
+				address[i] = lo(widen(operand) + Y);
+				break;
+				case CPU_ADDR_MODE_ABS:
+				address[i] = make_address(operand, mem[static_cast<Word>(pc + 2)]);
+				break;
+				case CPU_ADDR_MODE_ABX:
+				address[i] = static_cast<Word>(make_address(operand, mem[static_cast<Word>(pc + 2)]) + X);
+				break;
+				case CPU_ADDR_MODE_ABY:
+				address[i] = static_cast<Word>(make_address(operand, mem[static_cast<Word>(pc + 2)]) + Y);
+				break;
+				case CPU_ADDR_MODE_ZPX_IND: {
+					Byte pointer = lo(widen(operand) + X);
+					address[i] = make_address(mem[pointer], mem[static_cast<Byte>(pointer + 1)]);
+					break;
+				}
+				case CPU_ADDR_MODE_ZPY_IND:
+				address[i] = static_cast<Word>(make_address(mem[operand], mem[static_cast<Byte>(operand + 1)]) + Y);
+				break;
+				default:
+				break;
+			}
+			// JMP only wants the address
+			if (op.kind != LANE_OP_JMP) value[i] = mem[address[i]];
+		}
+	}
+
+	// Branches and JMP. A lane that jumps to itself halts, like on the
+	// scalar core.
+	void jump(const LaneOp& op, LaneMask group, const Word* target, const Byte* offset) {
+		for (std::size_t i = 0; i < lane_count; i++) {
+			if (!(group >> i & 1)) continue;
+			Word origin = PC[i];
+			unsigned long cost = op.cycles;
+			if (op.kind == LANE_OP_JMP) {
+				PC[i] = target[i];
+			}
+			else {
+				bool taken = ((SF[i] & op.flag) != 0) == op.condition;
+				if (taken) cost = op.taken_cycles;
+				PC[i] = static_cast<Word>(origin + (taken ? static_cast<Byte_S>(offset[i]) : 0) + 2);
+			}
+			if (PC[i] == origin) status[i] = HALT;
+			cycles[i] += cost;
+			instructions[i]++;
+			vector_instructions++;
+		}
+		group_steps++;
+	}
+};
@@ -4,1081 +4,1130 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <iterator>
 #include <algorithm>
-#include <iomanip>
 #include "types.hpp"
 #include "helpers.hpp"
-#include "bin.hpp"
-#include "rampage.cpp"
+#include "trace.hpp"
+#include "mmu.hpp"
+#include "cpu.hpp"
+#include "fuzz.hpp"
+#include "forkserver.hpp"
+#include "bench.hpp"
+#include "system.hpp"
+#include "pacer.hpp"
+#include "savestate.hpp"
+#include "hostcall.hpp"
+#include "memops.hpp"
+#include "profiler.hpp"
+#include "mapper.hpp"
+#include "recompiler.hpp"
+#include "background.hpp"
+#include "diffcheck.hpp"
+#include "sharedmem.hpp"
+
+static bool read_rom_file(const char* path, std::vector<Byte>& data) {
+	std::cout << "Attempting to load ROM: " << path << std::endl;
+	std::ifstream rom_file(path, std::ios::binary);
+	if (!rom_file) {
+		std::cerr << "Error: Could not open ROM file." << std::endl;
+		return false;
+	}
 
-struct MMU {
-	std::unique_ptr<MemoryPage> pages[256];
+	data.assign(std::istreambuf_iterator<char>(rom_file), std::istreambuf_iterator<char>());
+	rom_file.close();
+	return true;
+}
 
-	void initialize() {
-		for (int i = 0; i < 256; i++) {
-			pages[i] = std::make_unique<RAMPage>();
-		}
+static bool load_symbols(SymbolTable& symbols, const std::string& path) {
+	int loaded = symbols.load(path);
+	if (loaded < 0) {
+		std::cerr << "Could not open symbol file '" << path << "'" << std::endl;
+		return false;
 	}
+	std::cout << "Loaded " << std::dec << loaded << " symbols from '" << path << "'" << std::endl;
+	return true;
+}
+
+// <addr>:<len>, for the --san-* options
+static bool parse_range(const std::string& value, Word& start, std::size_t& length) {
+	std::size_t colon = value.find(':');
+	if (colon == std::string::npos) return false;
+	start = static_cast<Word>(parse_numeric_literal(value.substr(0, colon)));
+	length = static_cast<std::size_t>(parse_numeric_literal(value.substr(colon + 1)));
+	return true;
+}
+
+static void print_usage(const char* program) {
+	std::cout << "Usage: " << program << " [options] [rom]" << std::endl
+		<< "  --type MOS|NES              6502 variant" << std::endl
+		<< "  --mapper <scheme>           Bank-switch a ROM bigger than 64K at $8000-$FFFF" << std::endl
+		<< "                              (nrom, uxrom, 8k or mmc1; .nes files are detected)" << std::endl
+		<< "  --symbols <file>            Load labels (ld65 .dbg, VICE labels or label = $addr)" << std::endl
+		<< "  --dump-trace <file>         Print a trace with symbols and exit" << std::endl
+		<< "  --bench <cycles>            Run without the monitor for this many cycles and report the speed" << std::endl
+		<< "  --no-fusion                 Execute common instruction sequences one instruction at a time" << std::endl
+		<< "  --no-idle-skip              Run every iteration of idle polling loops" << std::endl
+		<< "  --no-perf                   Don't read host hardware counters during --bench" << std::endl
+		<< "  --clock <MHz|nmos|nes>      Run in real time at this clock speed instead of flat out" << std::endl
+		<< "  --slice <cycles>            Cycles run between pacing waits (one 60 Hz frame)" << std::endl
+		<< "  --load-state <file>         Resume from a save state instead of the reset vector" << std::endl
+		<< "  --save-state <file>         Save the state when the monitor quits or --bench finishes" << std::endl
+		<< "  --metrics-file <file>       Keep Prometheus metrics in this file, rewritten every interval" << std::endl
+		<< "  --metrics-socket <path>     Serve Prometheus metrics on a unix socket" << std::endl
+		<< "  --metrics-interval <ms>     How often metrics are updated (1000)" << std::endl
+		<< "  --shm <name>                Keep RAM and registers in POSIX shared memory for other tools to read" << std::endl
+		<< "  --host-calls <dir>          Let opcode $03 call native routines; files live in dir" << std::endl
+		<< "  --host-call-op <opcode>     Use a different (invalid) opcode for host calls" << std::endl
+		<< "  --host-call-cost <n>:<cycles>[:<per byte>]  Cycles charged for host call n" << std::endl
+		<< "  --core <rom>                Add another CPU with its own 64K loaded from rom (repeatable)" << std::endl
+		<< "  --share <page>              Share page $xx00-$xxFF between all CPUs (repeatable)" << std::endl
+		<< "  --quantum <cycles>          Most cycles a CPU runs ahead of the others (1000)" << std::endl
+		<< "  --core-threads              Benchmark: run each CPU on its own host thread" << std::endl
+		<< "  --recompile <file.cpp>      Write the ROM's code out as C++ (build it in with -DYA6502_AOT_SOURCE)" << std::endl
+		<< "  --aot                       Benchmark: run the compiled code built into this executable" << std::endl
+		<< "  --diff-check                Benchmark: check the run against the plain interpreter on another thread" << std::endl
+		<< "  --diff-interval <cycles>    Cycles between --diff-check comparisons (65536)" << std::endl
+		<< "  --sanitize                  Stop on reads of unwritten RAM, stack wraps, writes to code and" << std::endl
+		<< "                              executing data (needs a -DYA6502_SANITIZE=ON build)" << std::endl
+		<< "  --san-ram <addr>:<len>      Treat this range as never written (default: past the end of the ROM file)" << std::endl
+		<< "  --san-code <addr>:<len>     Treat this range as code or ROM, so writing to it is a fault" << std::endl
+		<< "  --san-data <addr>:<len>     Treat this range as data, so executing it is a fault" << std::endl
+		<< "  --lanes <n>                 Benchmark: run n copies (up to 32) of the ROM in lockstep" << std::endl
+		<< "  --lane-var <addr>           Store each lane's number at addr before reset" << std::endl
+		<< "  --lanes-verify              Check every lane against a run on the scalar core" << std::endl
+		<< "  --fuzz                      Fuzz the ROM instead of starting the monitor" << std::endl
+		<< "  --fuzz-region <addr>:<len>  Copy each input into memory at addr" << std::endl
+		<< "  --fuzz-device <page>        Map an input device page (read $xx00 for bytes, $xx01 for count)" << std::endl
+		<< "  --fuzz-length <addr>        Store the input length at addr" << std::endl
+		<< "  --fuzz-entry <addr>         Start each run here instead of the reset vector" << std::endl
+		<< "  --fuzz-exit <addr>          A run ends cleanly when PC reaches addr" << std::endl
+		<< "  --fuzz-budget <cycles>      Cycles per run before it counts as a timeout (100000)" << std::endl
+		<< "  --fuzz-threads <n>          Worker threads (one per core)" << std::endl
+		<< "  --fuzz-runs <n>             Stop after n runs" << std::endl
+		<< "  --fuzz-time <seconds>       Stop after this long" << std::endl
+		<< "  --fuzz-max-len <n>          Largest input to generate (256)" << std::endl
+		<< "  --fuzz-corpus <dir>         Seed inputs; new coverage and crashes are saved here" << std::endl
+		<< "  --fork-server <socket|->    Boot once, then run inputs sent over a unix socket or stdin/stdout" << std::endl
+		<< "                              (uses the --fuzz-region/device/length/exit/budget settings)" << std::endl
+		<< "  --warm-pc <addr>            Fork server: finish booting when PC reaches addr" << std::endl
+		<< "  --warm-cycles <n>           Fork server: finish booting after n cycles (limit when --warm-pc is set)" << std::endl;
+}
 
-	Byte read_byte(Word address) {
-		Byte page_num = hi(address);
-		Byte page_addr = lo(address);
-		return pages[page_num]->read_byte(page_addr);
-	}
+int main(int argc, char* argv[]) {
+	// The monitor drives the main core; any --core ones follow it
+	System system;
+	SystemCore& main_core = system.add_core("main");
+	CPU& cpu = main_core.cpu;
+	MMU& mmu = main_core.mmu;
+
+	SymbolTable symbols;
+	cpu.symbols = &symbols;
+
+	const char* rom_path = nullptr;
+	const char* dump_trace_path = nullptr;
+	std::string mapper_scheme;
+	bool fuzz = false;
+	FuzzConfig fuzz_config;
+	ForkServerConfig fork_config;
+	bool bench = false;
+	BenchConfig bench_config;
+	std::vector<std::string> core_paths;
+	std::vector<Byte> shared_pages;
+	bool core_threads = false;
+	LaneConfig lane_config;
+	std::string recompile_path;
+	bool use_aot = false;
+	DiffConfig diff_config;
+	bool sanitize = false;
+	Sanitizer sanitizer;
+	bool sanitizer_ram_given = false;
+	double clock_hz = 0;
+	unsigned long slice_cycles = 0;
+	std::string load_state_path;
+	std::string save_state_path;
+	MetricsConfig metrics_config;
+	std::string shm_name;
+	HostCalls host_calls;
+	bool use_host_calls = false;
+	std::vector<std::string> host_call_costs;
+
+	try {
+		for (int i = 1; i < argc; i++) {
+			std::string arg = argv[i];
+			if (arg.compare(0, 2, "--") != 0) {
+				rom_path = argv[i];
+				continue;
+			}
+			if (arg == "--help") {
+				print_usage(argv[0]);
+				return 0;
+			}
+			if (arg == "--fuzz") {
+				fuzz = true;
+				continue;
+			}
+			if (arg == "--no-fusion") {
+				bench_config.fusion = false;
+				continue;
+			}
+			if (arg == "--no-idle-skip") {
+				bench_config.idle_skip = false;
+				continue;
+			}
+			if (arg == "--no-perf") {
+				bench_config.perf_counters = false;
+				continue;
+			}
+			if (arg == "--aot") {
+				use_aot = true;
+				continue;
+			}
+			if (arg == "--diff-check") {
+				diff_config.enabled = true;
+				continue;
+			}
+			if (arg == "--sanitize") {
+				sanitize = true;
+				continue;
+			}
+			if (arg == "--lanes-verify") {
+				lane_config.verify = true;
+				continue;
+			}
+			if (arg == "--core-threads") {
+				core_threads = true;
+				continue;
+			}
+			if (i + 1 >= argc) {
+				std::cerr << "Missing value for " << arg << std::endl;
+				return 1;
+			}
 
-	void write_byte(Word address, Byte value) {
-		Byte page_num = hi(address);
-		Byte page_addr = lo(address);
-		pages[page_num]->write_byte(page_addr, value);
+			std::string value = argv[++i];
+			if (arg == "--type") {
+				if (value == "MOS") cpu.type = MOS;
+				else if (value == "NES") cpu.type = NES;
+				else {
+					std::cerr << "Unknown type." << std::endl;
+					return 1;
+				}
+				fuzz_config.type = cpu.type;
+			}
+			else if (arg == "--mapper") {
+				mapper_scheme = value;
+			}
+			else if (arg == "--symbols") {
+				if (!load_symbols(symbols, value)) {
+					return 1;
+				}
+			}
+			else if (arg == "--dump-trace") {
+				dump_trace_path = argv[i];
+			}
+			else if (arg == "--bench") {
+				bench = true;
+				bench_config.cycles = static_cast<unsigned long>(parse_numeric_literal(value));
+			}
+			else if (arg == "--core") {
+				core_paths.push_back(value);
+			}
+			else if (arg == "--share") {
+				shared_pages.push_back(static_cast<Byte>(parse_numeric_literal(value)));
+			}
+			else if (arg == "--quantum") {
+				system.quantum = static_cast<unsigned long>(parse_numeric_literal(value));
+				if (system.quantum == 0) system.quantum = 1;
+			}
+			else if (arg == "--recompile") {
+				recompile_path = value;
+			}
+			else if (arg == "--lanes") {
+				lane_config.lanes = static_cast<std::size_t>(parse_numeric_literal(value));
+			}
+			else if (arg == "--diff-interval") {
+				diff_config.interval = static_cast<unsigned long>(parse_numeric_literal(value));
+			}
+			else if (arg == "--san-ram" || arg == "--san-code" || arg == "--san-data") {
+				Word start;
+				std::size_t length;
+				if (!parse_range(value, start, length)) {
+					std::cerr << "Expected <addr>:<len> for " << arg << std::endl;
+					return 1;
+				}
+				if (arg == "--san-ram") {
+					sanitizer.mark_unwritten(start, length);
+					sanitizer_ram_given = true;
+				}
+				else if (arg == "--san-code") {
+					sanitizer.mark_code(start, length);
+				}
+				else {
+					sanitizer.mark_data(start, length);
+				}
+			}
+			else if (arg == "--lane-var") {
+				lane_config.use_lane_var = true;
+				lane_config.lane_var = static_cast<Word>(parse_numeric_literal(value));
+			}
+			else if (arg == "--clock") {
+				clock_hz = parse_clock_rate(value);
+			}
+			else if (arg == "--slice") {
+				slice_cycles = static_cast<unsigned long>(parse_numeric_literal(value));
+			}
+			else if (arg == "--load-state") {
+				load_state_path = value;
+			}
+			else if (arg == "--save-state") {
+				save_state_path = value;
+			}
+			else if (arg == "--shm") {
+				shm_name = value;
+			}
+			else if (arg == "--metrics-file") {
+				metrics_config.file = value;
+			}
+			else if (arg == "--metrics-socket") {
+				metrics_config.socket = value;
+			}
+			else if (arg == "--metrics-interval") {
+				metrics_config.interval_ms = static_cast<unsigned long>(parse_numeric_literal(value));
+			}
+			else if (arg == "--host-calls") {
+				use_host_calls = true;
+				host_calls.add_standard(value);
+				cpu.host_calls = &host_calls;
+			}
+			else if (arg == "--host-call-op") {
+				cpu.host_call_opcode = static_cast<Byte>(parse_numeric_literal(value));
+			}
+			else if (arg == "--host-call-cost") {
+				host_call_costs.push_back(value);
+			}
+			else if (arg == "--fuzz-region") {
+				std::size_t colon = value.find(':');
+				if (colon == std::string::npos) {
+					std::cerr << "Expected <addr>:<len> for --fuzz-region" << std::endl;
+					return 1;
+				}
+				fuzz_config.use_region = true;
+				fuzz_config.region_start = static_cast<Word>(parse_numeric_literal(value.substr(0, colon)));
+				fuzz_config.region_length = static_cast<Word>(parse_numeric_literal(value.substr(colon + 1)));
+			}
+			else if (arg == "--fuzz-device") {
+				fuzz_config.use_device = true;
+				fuzz_config.device_page = static_cast<Byte>(parse_numeric_literal(value));
+			}
+			else if (arg == "--fuzz-length") {
+				fuzz_config.store_length = true;
+				fuzz_config.length_address = static_cast<Word>(parse_numeric_literal(value));
+			}
+			else if (arg == "--fuzz-entry") {
+				fuzz_config.has_entry = true;
+				fuzz_config.entry = static_cast<Word>(parse_numeric_literal(value));
+			}
+			else if (arg == "--fuzz-exit") {
+				fuzz_config.has_exit = true;
+				fuzz_config.exit = static_cast<Word>(parse_numeric_literal(value));
+			}
+			else if (arg == "--fuzz-budget") {
+				fuzz_config.cycle_budget = static_cast<unsigned long>(parse_numeric_literal(value));
+			}
+			else if (arg == "--fuzz-threads") {
+				fuzz_config.threads = static_cast<unsigned>(parse_numeric_literal(value));
+			}
+			else if (arg == "--fuzz-runs") {
+				fuzz_config.max_runs = static_cast<unsigned long>(parse_numeric_literal(value));
+			}
+			else if (arg == "--fuzz-time") {
+				fuzz_config.max_seconds = static_cast<unsigned long>(parse_numeric_literal(value));
+			}
+			else if (arg == "--fuzz-max-len") {
+				fuzz_config.max_input = static_cast<std::size_t>(parse_numeric_literal(value));
+			}
+			else if (arg == "--fuzz-corpus") {
+				fuzz_config.corpus_dir = value;
+			}
+			else if (arg == "--fork-server") {
+				fork_config.endpoint = value;
+			}
+			else if (arg == "--warm-pc") {
+				fork_config.has_warm_pc = true;
+				fork_config.warm_pc = resolve_address(value, symbols);
+			}
+			else if (arg == "--warm-cycles") {
+				fork_config.warm_cycles = static_cast<unsigned long>(parse_numeric_literal(value));
+			}
+			else {
+				std::cerr << "Unknown option " << arg << std::endl;
+				print_usage(argv[0]);
+				return 1;
+			}
+		}
 	}
-
-	Word read_word(Word address) {
-		// Little-endian
-		Word byte_lo = widen(read_byte(address));
-		Word byte_hi = widen(read_byte(address + 1)) << 8;
-		return byte_lo | byte_hi;
+	catch (const std::exception& e) {
+		std::cerr << "Invalid numeric input: " << e.what() << std::endl;
+		return 1;
 	}
-};
 
-static Byte addr_mode_table[8][8] = {
-	{ CPU_ADDR_MODE_IMM,     CPU_ADDR_MODE_ZPG, CPU_ADDR_MODE_INVALID, CPU_ADDR_MODE_ABS, CPU_ADDR_MODE_INVALID, CPU_ADDR_MODE_ZPX, CPU_ADDR_MODE_INVALID, CPU_ADDR_MODE_ABX },
-	{ CPU_ADDR_MODE_ZPX_IND, CPU_ADDR_MODE_ZPG, CPU_ADDR_MODE_IMM,     CPU_ADDR_MODE_ABS, CPU_ADDR_MODE_ZPY_IND, CPU_ADDR_MODE_ZPX, CPU_ADDR_MODE_ABY,     CPU_ADDR_MODE_ABX },
-	{ CPU_ADDR_MODE_IMM,     CPU_ADDR_MODE_ZPG, CPU_ADDR_MODE_ACC,     CPU_ADDR_MODE_ABS, CPU_ADDR_MODE_INVALID, CPU_ADDR_MODE_ZPX, CPU_ADDR_MODE_INVALID, CPU_ADDR_MODE_ABX },
-
-	{ CPU_ADDR_MODE_INVALID },
-	{ CPU_ADDR_MODE_INVALID },
-	{ CPU_ADDR_MODE_INVALID },
-	{ CPU_ADDR_MODE_INVALID },
-	{ CPU_ADDR_MODE_INVALID }
-};
-
-struct CPU {
-	unsigned long cycle_count = 0;
-	
-	CPUType type = MOS;
-	Byte A, X, Y; // Registers
-	Byte SP;      // Stack Pointer
-	Word PC;      // Program Counter
-	Byte SF;      // Status Flags
-	Word addr_bus_value = 0;
-	Byte data_bus_value = 0;
-
-	Word last_good_instruction = 0;
-	Word last_jump_origin = 0;
-	Word last_jump_target = 0;
-
-	std::vector<Word> breakpoints;
+	try {
+		for (const std::string& cost : host_call_costs) {
+			std::size_t colon = cost.find(':');
+			std::size_t second = colon == std::string::npos ? colon : cost.find(':', colon + 1);
+			if (colon == std::string::npos) {
+				std::cerr << "Expected <n>:<cycles>[:<per byte>] for --host-call-cost" << std::endl;
+				return 1;
+			}
+			Byte number = static_cast<Byte>(parse_numeric_literal(cost.substr(0, colon)));
+			unsigned long cycles = static_cast<unsigned long>(parse_numeric_literal(cost.substr(colon + 1, second - colon - 1)));
+			unsigned long per_byte = second == std::string::npos ? 0 : static_cast<unsigned long>(parse_numeric_literal(cost.substr(second + 1)));
+			if (!host_calls.set_cost(number, cycles, per_byte)) {
+				std::cerr << "There is no host call " << cost.substr(0, colon) << " (did you forget --host-calls?)" << std::endl;
+				return 1;
+			}
+		}
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Invalid numeric input: " << e.what() << std::endl;
+		return 1;
+	}
 
-	void reset(MMU& mmu) {
-		A = 0;
-		X = 0;
-		Y = 0;
-		SP = 0xFD; // Stack pointer starts at 0x01FF, but is decremented first
-		PC = mmu.read_word(0xFFFC); // Read reset vector
-		SF = 0b00100100; // Processor status. No interrupts, no BCD mode, set break flag
-		cycle_count = 7; // Takes 7 cycles to reset
+	// The escape is checked before decoding, so a real instruction would be lost
+	if (is_valid_opcode(cpu.type, cpu.host_call_opcode)) {
+		std::cerr << "--host-call-op needs an invalid opcode, $" << std::hex << std::setw(2) << std::setfill('0') << (int)cpu.host_call_opcode
+			<< " is an instruction." << std::endl;
+		return 1;
 	}
 
-	void set_flag(Byte flag, Byte value) {
-		if (value == 0) {
-			SF &= ~flag;
-		} else {
-			SF |= flag;
-		}
+	// Results go out on stdout in pipe mode, so everything else goes to stderr
+	if (fork_config.endpoint == "-") {
+		std::cout.rdbuf(std::cerr.rdbuf());
+	}
+	if (use_host_calls) {
+		host_calls.list(std::cout, cpu.host_call_opcode);
 	}
 
-	bool check_flag(Byte flag) {
-		if (SF & flag) {
-			return true;
+	if (dump_trace_path) {
+		TraceReader reader;
+		if (!reader.open(dump_trace_path)) {
+			std::cerr << "Could not open trace '" << dump_trace_path << "'" << std::endl;
+			return 1;
 		}
-		return false;
+		TraceRecord rec;
+		while (reader.next(rec)) {
+			std::cout << format_trace_record(rec, symbols.empty() ? nullptr : &symbols) << '\n';
+		}
+		return 0;
 	}
 
-	void dump_state(MMU& mmu) {
-		std::cout << "CPU State:" << std::endl;
-		Byte instruction = mmu.read_byte(PC);
-		Word next_word = mmu.read_word(PC + 1);
-		std::cout << "Instruction: 0x" << std::hex << (int)instruction << std::endl;
-		std::cout << "Next Word: 0x" << std::hex << (int)next_word << std::endl;
-		std::cout << "A: 0x"  << std::hex << (int)A  << std::endl;
-		std::cout << "X: 0x"  << std::hex << (int)X  << std::endl;
-		std::cout << "Y: 0x"  << std::hex << (int)Y  << std::endl;
-		std::cout << "SP: 0x" << std::hex << (int)SP << std::endl;
-		std::cout << "PC: 0x" << std::hex <<      PC << std::endl;
-		std::cout << "SF: 0b" << bin << (int)SF << std::endl << std::endl;
-		std::cout << "Last known good instruction was at 0x" << std::hex << (int)last_good_instruction << std::endl;
-		std::cout << "How did we get here? 0x" << std::hex << (int)last_jump_origin
-			<< " jumped to 0x" << std::hex << (int)last_jump_target << std::endl;
+	SharedMemory shared_memory;
+	if (!shm_name.empty()) {
+		if (fuzz || !fork_config.endpoint.empty() || lane_config.lanes > 0 || diff_config.enabled) {
+			std::cerr << "--shm works with the monitor or --bench, without --fuzz, --fork-server, --lanes or --diff-check." << std::endl;
+			return 1;
+		}
+		if (!shared_memory.open(shm_name, std::cerr)) {
+			return 1;
+		}
+		// Before the ROM goes in, since the RAM starts over
+		shared_memory.attach(mmu);
+		// Other programs can write the RAM, so a polling loop may not be idle
+		bench_config.idle_skip = false;
 	}
 
-	std::string log_state(MMU& mmu) {
-		Byte instruction = mmu.read_byte(PC);
-		std::ostringstream oss;
-		oss << std::hex << std::setw(4) << std::setfill('0') << (int)PC;
-		oss << " " << std::hex << std::setw(2) << std::setfill('0') << (int)instruction;
-		oss << std::setw(32) << std::setfill(' ') << "";
-		oss << "A:" << std::hex << std::setw(2) << std::setfill('0') << (int)A;
-		oss << " X:" << std::hex << std::setw(2) << std::setfill('0') << (int)X;
-		oss << " Y:" << std::hex << std::setw(2) << std::setfill('0') << (int)Y;
-		oss << " P:" << std::hex << std::setw(2) << std::setfill('0') << (int)SF;
-		std::string result = oss.str();
-		return result;
-	}
+	std::vector<Byte> rom_image(65536, 0);
+	std::unique_ptr<Mapper> mapper;
+	if (rom_path) {
+		std::vector<Byte> rom_data;
+		if (!read_rom_file(rom_path, rom_data)) {
+			return 1;
+		}
 
-	void exec_cycle(MMU& mmu, Byte micro_op) {
-		switch (micro_op) {
-			case CPU_UOP_FETCH:
-			data_bus_value = mmu.read_byte(addr_bus_value);
-			break;
-			case CPU_UOP_WRITE:
-			mmu.write_byte(addr_bus_value, data_bus_value);
-			break;
-			case CPU_UOP_NONE:
-			default: break;
+		if (is_ines_image(rom_data)) {
+			std::string error;
+			mapper = load_ines(rom_data, error);
+			if (!mapper) {
+				std::cerr << "Error: Could not load iNES file: " << error << std::endl;
+				return 1;
+			}
+			mirror_nes_ram(mmu);
+			cpu.type = NES;
+		}
+		else if (!mapper_scheme.empty()) {
+			mapper = make_mapper(mapper_scheme, rom_data);
+			if (!mapper) {
+				std::cerr << "Unknown mapper '" << mapper_scheme << "'" << std::endl;
+				return 1;
+			}
+		}
+		else {
+			// The raw data goes to $0000-$FFFF, anything past that is ignored
+			std::copy(rom_data.begin(), rom_data.begin() + static_cast<std::ptrdiff_t>(std::min(rom_data.size(), rom_image.size())), rom_image.begin());
+			mmu.load_image(rom_image.data(), rom_image.size());
+			// Nothing put the zeros after a short image there
+			if (!sanitizer_ram_given && rom_data.size() < rom_image.size()) {
+				sanitizer.mark_unwritten(static_cast<Word>(rom_data.size()), rom_image.size() - rom_data.size());
+			}
 		}
 
-		cycle_count++;
+		if (mapper) {
+			mapper->attach(mmu);
+			std::cout << "Mapped " << std::dec << mapper->rom_size() / 1024 << "K of ROM with the "
+				<< mapper->name() << " mapper" << std::endl;
+		}
+	} else {
+		std::cout << "No ROM provided." << std::endl;
 	}
 
-	void stall_n_cycles(MMU& mmu, int n_cycles) {
-		// Could probably just cycle_count+=n_cycles but whatever
-                for (; n_cycles > 0; n_cycles--) {
-                        exec_cycle(mmu, CPU_UOP_NONE);
-                }
+	for (const std::string& path : core_paths) {
+		std::vector<Byte> core_data;
+		if (!read_rom_file(path.c_str(), core_data)) {
+			return 1;
+		}
+		SystemCore& core = system.add_core(path);
+		core.cpu.type = cpu.type;
+		core.image.assign(core_data.begin(), core_data.begin() + static_cast<std::ptrdiff_t>(std::min(core_data.size(), rom_image.size())));
+		core.mmu.load_image(core_data.data(), core_data.size());
 	}
-
-	Byte fetch_one_byte(MMU& mmu, Word address) {
-		addr_bus_value = address;
-		exec_cycle(mmu, CPU_UOP_FETCH);
-		return data_bus_value;
+	main_core.image = rom_image;
+	main_core.mapper = mapper.get();
+	// Shared pages start out zeroed, whatever the ROMs had there
+	for (Byte page : shared_pages) {
+		system.share_page(page);
 	}
-
-	void write_one_byte(MMU& mmu, Word address, Byte value) {
-		addr_bus_value = address;
-		data_bus_value = value;
-		exec_cycle(mmu, CPU_UOP_WRITE);
+	for (std::size_t i = 1; i < system.cores.size(); i++) {
+		system.cores[i]->cpu.reset(system.cores[i]->mmu);
 	}
 
-	void stack_push(MMU& mmu, Byte value) {
-		Word address = (Word)SP | 0x0100;
-		write_one_byte(mmu, address, value);
-		SP--;
+	if ((fuzz || !fork_config.endpoint.empty()) && system.cores.size() > 1) {
+		std::cerr << "Fuzzing a system with more than one CPU isn't supported." << std::endl;
+		return 1;
 	}
-
-	Byte stack_pull(MMU& mmu) {
-		SP++;
-		Word address = (Word)SP | 0x0100;
-		return fetch_one_byte(mmu, address);
+	if (fuzz && mapper) {
+		std::cerr << "Fuzzing bank-switched ROMs isn't supported." << std::endl;
+		return 1;
 	}
-
-	void stack_push_status_flags(MMU& mmu) {
-		// " The status register will be pushed with the break
-		//   flag and bit 5 set to 1. "
-		// https://www.masswerk.at/6502/6502_instruction_set.html
-		// So if this is wrong blame those guys.
-		stack_push(mmu, SF | CPU_FLAG_B | CPU_FLAG_UNUSED);
+	if (sanitize && (fuzz || !fork_config.endpoint.empty() || use_aot || diff_config.enabled || lane_config.lanes > 0
+		|| (bench && system.cores.size() > 1))) {
+		std::cerr << "--sanitize works with the monitor or a single-CPU --bench, without --aot, --diff-check or --lanes." << std::endl;
+		return 1;
 	}
-
-	void stack_pull_status_flags(MMU& mmu) {
-		// " The status register will be pulled with the break
-		//   flag and bit 5 ignored. "
-		Byte old_flags = SF;
-		Byte new_flags = stack_pull(mmu);
-		Byte retain = CPU_FLAG_B | CPU_FLAG_UNUSED;
-		SF = (old_flags & retain) | (new_flags & ~retain);
+#ifndef YA6502_SANITIZE
+	if (sanitize) {
+		std::cerr << "This build has no sanitizer checks, configure it with -DYA6502_SANITIZE=ON." << std::endl;
+		return 1;
 	}
+#endif
+	if (sanitize) cpu.sanitizer = &sanitizer;
 
-	Byte decode_addr_mode(Byte group, Byte opcode_encoded_mode) {
-		return addr_mode_table[group][opcode_encoded_mode];
+	if (fuzz) {
+		if (!fuzz_config.use_region && !fuzz_config.use_device) {
+			std::cerr << "Fuzzing needs somewhere to put the input, use --fuzz-region or --fuzz-device." << std::endl;
+			return 1;
+		}
+		Fuzzer fuzzer(fuzz_config, rom_image);
+		return fuzzer.run();
 	}
+	if (!fork_config.endpoint.empty()) {
+		if (!fuzz_config.use_region && !fuzz_config.use_device) {
+			std::cerr << "The fork server needs somewhere to put the input, use --fuzz-region or --fuzz-device." << std::endl;
+			return 1;
+		}
+		// The device has to be there before booting so the warm state includes it
+		InputDevicePage* device = nullptr;
+		if (fuzz_config.use_device) {
+			std::unique_ptr<InputDevicePage> page = std::make_unique<InputDevicePage>();
+			device = page.get();
+			mmu.install_page(fuzz_config.device_page, std::move(page));
+		}
 
-	void auto_increment_pc(Byte addressing_mode) {
-		switch (addressing_mode) {
-			case CPU_ADDR_MODE_ACC:
-			PC++;
-			break;
-			case CPU_ADDR_MODE_IMM:
-			case CPU_ADDR_MODE_ZPG:
-			case CPU_ADDR_MODE_ZPX:
-			case CPU_ADDR_MODE_ZPY:
-			case CPU_ADDR_MODE_ZPX_IND:
-			case CPU_ADDR_MODE_ZPY_IND:
-			PC += 2;
-			break;
-			case CPU_ADDR_MODE_ABS:
-			case CPU_ADDR_MODE_ABX:
-			case CPU_ADDR_MODE_ABY:
-			PC += 3;
-			break;
+		cpu.reset(mmu);
+		std::string error;
+		if (!load_state_path.empty() && !load_state(load_state_path, system, error)) {
+			std::cerr << error << std::endl;
+			return 1;
 		}
+		ForkServer server(fork_config, fuzz_config, cpu, mmu, device);
+		if (!server.boot(std::cerr)) {
+			return 1;
+		}
+		return server.serve(std::cerr);
 	}
-
-	// https://www.nesdev.org/obelisk-6502-guide/addressing.html
-	// TODO: Handle the 6502's page boundary bugs
-	Byte auto_fetch_value(MMU& mmu, Byte next_byte, Byte addressing_mode) {
-		switch (addressing_mode) {
-			case CPU_ADDR_MODE_IMM:
-			return next_byte;
-			case CPU_ADDR_MODE_ACC:
-			return A;
-			case CPU_ADDR_MODE_ZPG:
-			return fetch_one_byte(mmu, widen(next_byte));
-			case CPU_ADDR_MODE_ZPX: {
-				// The 6502 wastes a cycle reading the unindexed ZP address
-				(void)fetch_one_byte(mmu, widen(next_byte));
-				return fetch_one_byte(mmu, lo(widen(next_byte) + X));
-			}
-			case CPU_ADDR_MODE_ZPY: {
-				// The 6502 wastes a cycle reading the unindexed ZP address
-				(void)fetch_one_byte(mmu, widen(next_byte));
-				return fetch_one_byte(mmu, lo(widen(next_byte) + Y));
-			}
-			case CPU_ADDR_MODE_ABS: {
-				Byte high_addr_byte = fetch_one_byte(mmu, PC + 2);
-				Word address = make_address(next_byte, high_addr_byte);
-				return fetch_one_byte(mmu, address);
-			}
-			case CPU_ADDR_MODE_ABX: {
-				Byte high_addr_byte = fetch_one_byte(mmu, PC + 2);
-				Word address = make_address(next_byte, high_addr_byte);
-				return fetch_one_byte(mmu, address + X); // TODO: Page boundary
-			}
-			case CPU_ADDR_MODE_ABY: {
-				Byte high_addr_byte = fetch_one_byte(mmu, PC + 2);
-				Word address = make_address(next_byte, high_addr_byte);
-				return fetch_one_byte(mmu, address + Y); // TODO: Page boundary
-			}
-			case CPU_ADDR_MODE_ZPX_IND: {
-				// ZPX Indexed Indirect addressing typically fetches from an address stored in a table residing in ZP
-				Byte zp_indexed = lo(widen(next_byte) + X);
-				// TODO: Does zp wrapping also occur here?
-				Byte zp_indexed_next = lo(static_cast<Word>(widen(next_byte) + X + 1));
-				// Read address from table
-				Byte addr_lo = fetch_one_byte(mmu, zp_indexed);
-				Byte addr_hi = fetch_one_byte(mmu, zp_indexed_next);
-				Word address = make_address(addr_lo, addr_hi);
-				return fetch_one_byte(mmu, address); // Read from that address
-			}
-			// The NESDev Obelisk guide documents Indirect,Y incorrectly
-			case CPU_ADDR_MODE_ZPY_IND: {
-				// ZP contains pointer (base addr)
-				Byte addr_lo = fetch_one_byte(mmu, widen(next_byte));
-				// TODO: Does zp wrapping also occur here?
-				Byte addr_hi = fetch_one_byte(mmu, widen(static_cast<Byte>(next_byte + 1)));
-				Word address = make_address(addr_lo, addr_hi) + Y;
-				return fetch_one_byte(mmu, address); // Get it baby!
-			}
-			default: break;
+	if (!recompile_path.empty()) {
+		if (!rom_path || mapper) {
+			std::cerr << "--recompile needs a plain 64K ROM image." << std::endl;
+			return 1;
+		}
+		Recompiler recompiler(rom_image, cpu.type);
+		recompiler.add_vectors();
+		recompiler.discover();
+		std::ofstream out(recompile_path);
+		if (!out) {
+			std::cerr << "Could not open '" << recompile_path << "' for writing" << std::endl;
+			return 1;
 		}
+		std::size_t blocks = recompiler.write(out, rom_path);
+		std::cout << "Wrote " << std::dec << blocks << " blocks (" << recompiler.instruction_count() << " instructions) to '"
+			<< recompile_path << "'" << std::endl;
 		return 0;
 	}
-
-	void auto_write_value(MMU& mmu, Byte next_byte, Byte addressing_mode, Byte value) {
-		// NOTE: Perhaps percolate some kind of error on invalid memory ops? (e.g. writing in immediate mode)
-		switch (addressing_mode) {
-			case CPU_ADDR_MODE_ACC:
-			A = value;
-			break;
-			case CPU_ADDR_MODE_ZPG:
-			write_one_byte(mmu, widen(next_byte), value);
-			break;
-			case CPU_ADDR_MODE_ZPX: {
-				// The 6502 wastes a cycle reading the unindexed ZP address
-				(void)fetch_one_byte(mmu, widen(next_byte));
-				write_one_byte(mmu, lo(widen(next_byte) + X), value);
-				break;
-			}
-			case CPU_ADDR_MODE_ZPY: {
-				// The 6502 wastes a cycle reading the unindexed ZP address
-				(void)fetch_one_byte(mmu, widen(next_byte));
-				write_one_byte(mmu, lo(widen(next_byte) + Y), value);
-				break;
-			}
-			case CPU_ADDR_MODE_ABS: {
-				Byte high_addr_byte = fetch_one_byte(mmu, PC + 2);
-				Word address = make_address(next_byte, high_addr_byte);
-				write_one_byte(mmu, address, value);
-				break;
-			}
-			case CPU_ADDR_MODE_ABX: {
-				Byte high_addr_byte = fetch_one_byte(mmu, PC + 2);
-				Word address = make_address(next_byte, high_addr_byte);
-				// TODO: Does the extra cycle from reading the unindexed address apply here?
-				write_one_byte(mmu, address + X, value); // TODO: Page boundary
-				break;
-			}
-			case CPU_ADDR_MODE_ABY: {
-				Byte high_addr_byte = fetch_one_byte(mmu, PC + 2);
-				Word address = make_address(next_byte, high_addr_byte);
-				// TODO: Does the extra cycle from reading the unindexed address apply here?
-				write_one_byte(mmu, address + Y, value); // TODO: Page boundary
-				break;
-			}
-			case CPU_ADDR_MODE_ZPX_IND: {
-				Byte zp_indexed = lo(widen(next_byte) + X);
-				// TODO: Does zp wrapping also occur here?
-				Byte zp_indexed_next = lo(static_cast<Word>(widen(next_byte) + X + 1));
-				// Read address from table
-				Byte addr_lo = fetch_one_byte(mmu, zp_indexed);
-				Byte addr_hi = fetch_one_byte(mmu, zp_indexed_next);
-				Word address = make_address(addr_lo, addr_hi);
-				write_one_byte(mmu, address, value);
-				break;
-			}
-			case CPU_ADDR_MODE_ZPY_IND: {
-				// ZP contains pointer (base addr)
-				Byte addr_lo = fetch_one_byte(mmu, widen(next_byte));
-				Byte addr_hi = fetch_one_byte(mmu, widen(static_cast<Byte>(next_byte + 1)));
-				Word address = make_address(addr_lo, addr_hi) + Y;
-				write_one_byte(mmu, address, value);
-				break;
-			}
-			default: break;
-		}
+	if (use_aot && (!bench || system.cores.size() > 1)) {
+		std::cerr << "--aot needs --bench and a single CPU." << std::endl;
+		return 1;
 	}
-
-	bool should_apply_bcd() {
-		return check_flag(CPU_FLAG_D) && type != NES;
+#ifndef YA6502_AOT
+	if (use_aot) {
+		std::cerr << "This build has no compiled code, configure it with -DYA6502_AOT_SOURCE=<file from --recompile>." << std::endl;
+		return 1;
 	}
+#endif
 
-	bool nibble_add(bool bcd_sub, Byte a, Byte b, Byte c, Byte& d) {
-		Byte result = static_cast<Byte>(a + b + c);
-		d = result & 0xF_b;
-		bool alu_c_out = result > 0xF;
-		bool bcd_invalid = d > 9;
-		
-		// As far as I can tell nobody has described this behavior accurately
-		// This took me about a whole day of screwing around to get it to pass
-		if (should_apply_bcd()) {
-			if (bcd_invalid) {
-				if (bcd_sub) {
-					d = static_cast<Byte>(d - 6) & 0xF_b;
-					if (!alu_c_out) {
-						return false;
-					}
-				}
-				else {
-					d = static_cast<Byte>(d + 6) & 0xF_b;
-				}
-			}
-			else if (alu_c_out && !bcd_sub) {
-				d = static_cast<Byte>(d + 6) & 0xF_b;
-			}
-			else if (!alu_c_out && bcd_sub) {
-				d = static_cast<Byte>(d - 6) & 0xF_b;
-			}
+	if (diff_config.enabled && (!bench || mapper || system.cores.size() > 1 || use_host_calls || !load_state_path.empty() || diff_config.interval == 0)) {
+		std::cerr << "--diff-check needs --bench and a plain 64K image, without --core, --host-calls or save states." << std::endl;
+		return 1;
+	}
 
-			return alu_c_out || bcd_invalid;
+	if (lane_config.lanes > 0) {
+		if (!bench || lane_config.lanes > LANE_MAX) {
+			std::cerr << "--lanes needs --bench and at most " << LANE_MAX << " lanes." << std::endl;
+			return 1;
 		}
-
-		return alu_c_out;
+		if (mapper || system.cores.size() > 1 || use_host_calls || !load_state_path.empty()) {
+			std::cerr << "Lanes only run a plain 64K image, without --core, --host-calls or save states." << std::endl;
+			return 1;
+		}
+		return run_lane_benchmark(bench_config, lane_config, rom_image, cpu.type, std::cout);
 	}
-
-	// http://www.6502.org/tutorials/decimal_mode.html#A
-	// https://forums.atariage.com/topic/163876-flags-on-decimal-mode-on-the-nmos-6502
-	// https://c74project.com/card-b-alu-cu/
-	void full_add(Byte operand, bool bcd_sub) {
-		Byte A_lo_nib = A & 0xF_b;
-		Byte A_hi_nib = A >> 4;
-		Byte o_lo_nib = operand & 0xF_b;
-		Byte o_hi_nib = operand >> 4;
-
-		Byte result_lo_nib = 0;
-		Byte result_hi_nib = 0;
-		bool half_carry = nibble_add(bcd_sub, A_lo_nib, o_lo_nib, check_flag(CPU_FLAG_C), result_lo_nib);
-		bool carry_out = nibble_add(bcd_sub, A_hi_nib, o_hi_nib, half_carry, result_hi_nib);
-		Byte result = make_byte(result_lo_nib, result_hi_nib);
-
-		set_flag(CPU_FLAG_C, carry_out);
-		set_flag(CPU_FLAG_Z, result == 0);
-		set_flag(CPU_FLAG_V, (~(A ^ operand) & (A ^ result)) & 0b10000000);
-		set_flag(CPU_FLAG_N, result & 0b10000000);
-
-		A = result;
+	
+	Metrics metrics;
+	metrics.count_device_accesses = [&]() {
+		unsigned long count = host_calls.calls + (mapper ? mapper->register_writes : 0);
+		for (const std::unique_ptr<SharedPage>& page : system.shared_pages()) {
+			count += page->accesses.load(std::memory_order_relaxed);
+		}
+		return count;
+	};
+	Metrics* published_metrics = metrics_config.enabled() ? &metrics : nullptr;
+	MetricsExporter metrics_exporter(metrics_config, metrics);
+	if (metrics_config.enabled() && !metrics_exporter.start(std::cerr)) {
+		return 1;
 	}
 
-	// https://www.nesdev.org/obelisk-6502-guide/reference.html
-	// https://llx.com/Neil/a2/opcodes.html
-	CPUStatus exec_instruction(MMU& mmu, bool bypass_breakpoints) {
-		if (!bypass_breakpoints && std::count(breakpoints.begin(), breakpoints.end(), PC) > 0) {
-			return BREAKPOINT;
+	cpu.reset(mmu);
+	if (!load_state_path.empty()) {
+		std::string error;
+		if (!load_state(load_state_path, system, error)) {
+			std::cerr << error << std::endl;
+			return 1;
 		}
-
-		addr_bus_value = PC;
-		exec_cycle(mmu, CPU_UOP_FETCH);
-		Byte instruction = data_bus_value;
-		
-		// " All single-byte instructions waste a cycle reading and ignoring
-		//   the byte that comes immediately after the instruction. "
-		// - Sun Tzu, The Art of 6502
-		addr_bus_value = PC + 1;
-		exec_cycle(mmu, CPU_UOP_FETCH);
-		Byte next_byte = data_bus_value;
-
-		Byte aaa = (instruction & 0b11100000) >> 5; // Opcode
-		Byte bbb = (instruction & 0b00011100) >> 2; // Addressing Mode
-		Byte cc  = (instruction & 0b00000011);      // Opcode group
-		Byte final_addr_mode = decode_addr_mode(cc, bbb);
-
-		bool complex_instruction = false;
-		Word old_pc = PC;
-
-		// First we'll handle the stray one-byte instructions
-		switch (instruction) {
-			case 0xEA: break; // NOP
-			case 0x00: {
-				// BRK
-				Word to_push = PC + 2;
-				stack_push(mmu, hi(to_push));
-				stack_push(mmu, lo(to_push));
-				stack_push_status_flags(mmu);
-				// https://www.masswerk.at/6502/6502_instruction_set.html#BRK
-				// These guys say BRK does not disable interrupts, but everywhere
-				// else I look says it does.
-				SF |= CPU_FLAG_B | CPU_FLAG_I;
-				Word interrupt_vector = make_address(fetch_one_byte(mmu, 0xFFFE), fetch_one_byte(mmu, 0xFFFF));
-				last_jump_origin = PC;
-				last_jump_target = interrupt_vector;
-				PC = interrupt_vector - 1; // -1 to compensate for later PC++
-				break;
-			}
-			case 0x40:{
-				// RTI
-				// TODO: Does flag B come from the stack or not???
-				stack_pull_status_flags(mmu);
-				Byte b_lo = stack_pull(mmu);
-				Byte b_hi = stack_pull(mmu);
-				Word target = make_address(b_lo, b_hi);
-				last_jump_origin = PC;
-				last_jump_target = target;
-				PC = target - 1; // Compensate
-				break;
-			}
-			case 0x60: {
-				// RTS
-				Byte b_lo = stack_pull(mmu);
-				Byte b_hi = stack_pull(mmu);
-				Word target = make_address(b_lo, b_hi);
-				last_jump_origin = PC;
-				last_jump_target = target + 1;
-				// Normally we would compensate for PC++ by subtracting 1.
-				// However, JSR pushes the return address minus 1.
-				// So, in this case, we want PC++ to happen.
-				PC = target;
-				break;
+		metrics.states_loaded++;
+		std::cout << "Loaded state from '" << load_state_path << "'" << std::endl;
+	}
+	auto save_on_exit = [&]() {
+		std::string error;
+		if (save_state_path.empty()) return true;
+		if (!save_state(save_state_path, system, true, error)) {
+			std::cerr << "Could not save state: " << error << std::endl;
+			return false;
+		}
+		metrics.states_saved++;
+		std::cout << "Saved state to '" << save_state_path << "'" << std::endl;
+		return true;
+	};
+
+	if (bench) {
+		std::unique_ptr<AotRunner> aot;
+#ifdef YA6502_AOT
+		if (use_aot) aot = std::make_unique<AotRunner>(aot_program);
+#endif
+		int result = diff_config.enabled
+			? run_diff_check(bench_config, diff_config, cpu, mmu, rom_image, std::cout, aot.get())
+			: system.cores.size() > 1
+			? run_system_benchmark(bench_config, system, core_threads, std::cout)
+			: run_benchmark(bench_config, cpu, mmu, std::cout, aot.get(), published_metrics, &shared_memory);
+		shared_memory.publish(cpu);
+		return save_on_exit() ? result : 1;
+	}
+	
+	cpu.dump_state(mmu);
+	
+	std::string input;
+	std::string logfile;
+	std::ofstream logfile_stream;
+	TraceWriter binary_log;
+	bool logging = false;
+	bool binary_logging = false;
+	GoldenTrace golden;
+	CallProfiler profiler;
+	Pacer pacer;
+	if (clock_hz > 0) {
+		pacer.start(clock_hz, slice_cycles, cpu.cycle_count);
+	}
+	MemorySnapshot memory_snapshot;
+	bool running = true;
+	BackgroundRunner background;
+	background.metrics = published_metrics;
+	background.shared = &shared_memory;
+
+	// One instruction and everything watching it. Returns false when execution
+	// should stop. During `r` this runs on the background thread.
+	auto step = [&](bool bypass_breakpoints, bool single) -> bool {
+		if (logging && binary_logging) {
+			if (!binary_log.is_open()) {
+				binary_log.open(logfile);
 			}
 
-			// Flag manipulation instructions
-			case 0x18:
-			// CLC
-			set_flag(CPU_FLAG_C, 0);
-			break;
-			case 0x38:
-			// SEC
-			set_flag(CPU_FLAG_C, 1);
-			break;
-			case 0x58:
-			// CLI
-			set_flag(CPU_FLAG_I, 0);
-			break;
-			case 0x78:
-			// SEI
-			set_flag(CPU_FLAG_I, 1);
-			break;
-			case 0xB8:
-			// CLV
-			set_flag(CPU_FLAG_V, 0);
-			break;
-			case 0xD8:
-			// CLD
-			set_flag(CPU_FLAG_D, 0);
-			break;
-			case 0xF8:
-			// SED
-			set_flag(CPU_FLAG_D, 1);
-			break;
-
-			// Register transfer instructions
-			case 0xA8:
-			// TAY
-			Y = A;
-			set_flag(CPU_FLAG_Z, Y == 0);
-			set_flag(CPU_FLAG_N, Y & 0b10000000);
-			break;
-			case 0x98:
-			// TYA
-			A = Y;
-			set_flag(CPU_FLAG_Z, A == 0);
-			set_flag(CPU_FLAG_N, A & 0b10000000);
-			break;
-			case 0xAA:
-			// TAX
-			X = A;
-			set_flag(CPU_FLAG_Z, X == 0);
-			set_flag(CPU_FLAG_N, X & 0b10000000);
-			break;
-			case 0x8A:
-			// TXA
-			A = X;
-			set_flag(CPU_FLAG_Z, A == 0);
-			set_flag(CPU_FLAG_N, A & 0b10000000);
-			break;
-			case 0x9A:
-			// TXS
-			SP = X;
-			break;
-			case 0xBA:
-			// TSX
-			X = SP;
-			set_flag(CPU_FLAG_Z, X == 0);
-			set_flag(CPU_FLAG_N, X & 0b10000000);
-			break;
+			binary_log.write(cpu.trace_record(mmu));
+		}
+		else if (logging) {
+			if (!logfile_stream.is_open()) {
+				logfile_stream.open(logfile);
+			}
 
-			// Stack instructions
-			case 0x08:
-			// PHP
-			stack_push_status_flags(mmu);
-			break;
-			case 0x28:
-			// PLP
-			stack_pull_status_flags(mmu);
-			break;
-			case 0x48:
-			// PHA
-			stack_push(mmu, A);
-			break;
-			case 0x68:
-			// PLA
-			A = stack_pull(mmu);
-			set_flag(CPU_FLAG_Z, A == 0);
-			set_flag(CPU_FLAG_N, A & 0b10000000);
-			break;
+			logfile_stream << cpu.log_state(mmu) << std::endl;
+		}
 
-			// Increment and decrement instructions
-			case 0xC8:
-			// INY
-			Y++;
-			set_flag(CPU_FLAG_Z, Y == 0);
-			set_flag(CPU_FLAG_N, Y & 0b10000000);
-			break;
-			case 0x88:
-			// DEY
-			Y--;
-			set_flag(CPU_FLAG_Z, Y == 0);
-			set_flag(CPU_FLAG_N, Y & 0b10000000);
-			break;
-			case 0xE8:
-			// INX
-			X++;
-			set_flag(CPU_FLAG_Z, X == 0);
-			set_flag(CPU_FLAG_N, X & 0b10000000);
-			break;
-			case 0xCA:
-			// DEX
-			X--;
-			set_flag(CPU_FLAG_Z, X == 0);
-			set_flag(CPU_FLAG_N, X & 0b10000000);
-			break;
+		if (golden.is_active() && !golden.check(cpu.trace_record(mmu), std::cout)) {
+			return false;
+		}
 
-			// Odd one out:
-			case 0x20: {
-				// JSR
-				// PC + 3 is the address of the next instruction.
-				// JSR pushes next_instruction_addr - 1, in essence PC + 2.
-				Word return_addr = PC + 2;
-				stack_push(mmu, hi(return_addr));
-				stack_push(mmu, lo(return_addr));
-				Word target = make_address(next_byte, fetch_one_byte(mmu, PC + 2));
-				last_jump_origin = PC;
-				last_jump_target = target;
-				PC = target - 1; // Compensate
-				break;
+		// Single steps and per-instruction observers need one instruction at a time
+		bool one_at_a_time = single || logging || golden.is_active() || profiler.is_active();
+		cpu.fusion_enabled = bench_config.fusion && !one_at_a_time;
+		// No deadline here to skip idle loops ahead to, and the monitor (or
+		// --shm) can change what they poll while they spin
+		cpu.idle_detection = false;
+		CPUStatus status = cpu.exec_instruction(mmu, bypass_breakpoints);
+		// A breakpoint stops before the instruction, so it's still to come
+		if (status != BREAKPOINT) {
+			golden.advance();
+		}
+		if (profiler.is_active()) {
+			profiler.observe(cpu);
+		}
+		if (!single) {
+			pacer.pace(cpu.cycle_count);
+		}
+		if (system.cores.size() > 1) {
+			SystemCore* stopped = system.catch_up(main_core);
+			if (stopped) {
+				std::cout << "CPU '" << stopped->name << "' "
+					<< (stopped->status == INVALID ? "hit an invalid instruction" : "halted")
+					<< " at " << format_address(stopped->cpu.PC, stopped->cpu.symbols) << std::endl;
 			}
-
-			default: complex_instruction = true; break;
 		}
 
-		if (!complex_instruction) {
-			PC++;
-			return CONTINUE;
+		if (status == HALT) {
+			cpu.dump_state(mmu);
+			cpu.dump_history(std::cout, 16);
+			std::cout << "A halt was detected!" << std::endl;
+			return false;
+		}
+		else if (status == INVALID) {
+			cpu.dump_state(mmu);
+			cpu.dump_history(std::cout, 16);
+			std::cout << "The CPU encountered an invalid instruction!" << std::endl
+				<< "Execution may be resumed, but unexpected behavior could occur." << std::endl;
+			return false;
 		}
+		else if (status == BREAKPOINT) {
+			cpu.dump_state(mmu);
+			cpu.dump_history(std::cout, 16);
+			std::cout << "Breakpoint hit!" << std::endl;
+			return false;
+		}
+		else if (status == WATCHPOINT) {
+			cpu.dump_state(mmu);
+			cpu.dump_history(std::cout, 16);
+			const Watchpoint& watchpoint = cpu.watchpoints[static_cast<std::size_t>(cpu.triggered_watchpoint)];
+			std::cout << "Watchpoint hit! " << (cpu.triggered_access == CPU_UOP_WRITE ? "Wrote 0x" : "Read 0x")
+				<< std::hex << (int)cpu.triggered_value << (cpu.triggered_access == CPU_UOP_WRITE ? " to " : " from ")
+				<< format_address(watchpoint.address, &symbols) << std::endl;
+			return false;
+		}
+		else if (status == SANITIZER) {
+			cpu.dump_state(mmu);
+			cpu.dump_history(std::cout, 16);
+			sanitizer.describe(std::cout, &symbols);
+			return false;
+		}
+		return true;
+	};
 
-		switch (cc) {
-			case 0b01: // Group 1
-			switch (aaa) {
-				case 0b000: {
-					// ORA - Logical OR
-					A |= auto_fetch_value(mmu, next_byte, final_addr_mode);
-					set_flag(CPU_FLAG_Z, A == 0);
-					set_flag(CPU_FLAG_N, A & 0b10000000);
-					break;
-				}
-				case 0b001: {
-					// AND - Logical AND
-					A &= auto_fetch_value(mmu, next_byte, final_addr_mode);
-					set_flag(CPU_FLAG_Z, A == 0);
-					set_flag(CPU_FLAG_N, A & 0b10000000);
-					break;
-				}
-				case 0b010: {
-					// EOR - Logical Exclusive OR
-					A ^= auto_fetch_value(mmu, next_byte, final_addr_mode);
-					set_flag(CPU_FLAG_Z, A == 0);
-					set_flag(CPU_FLAG_N, A & 0b10000000);
-					break;
-				}
-				case 0b011: {
-					// ADC - Add with Carry
-					Byte operand = auto_fetch_value(mmu, next_byte, final_addr_mode);
-					full_add(operand, false);
-					break;
-				}
-				case 0b100: {
-					// STA - Store Accumulator
-					auto_write_value(mmu, next_byte, final_addr_mode, A);
-					break;
-				}
-				case 0b101: {
-					// LDA - Load Accumulator
-					A = auto_fetch_value(mmu, next_byte, final_addr_mode);
-					set_flag(CPU_FLAG_Z, A == 0);
-					set_flag(CPU_FLAG_N, A & 0b10000000);
-					break;
-				}
-				case 0b110: {
-					// CMP - Compare Accumulator
-					Byte compare_mem = auto_fetch_value(mmu, next_byte, final_addr_mode);
-					Word result = static_cast<Word>(A - compare_mem);
-					
-					// Gross...
-					set_flag(CPU_FLAG_C, A >= result);
-					set_flag(CPU_FLAG_Z, result == 0);
-					set_flag(CPU_FLAG_N, static_cast<Byte>(result & 0b10000000));
-					break;
-				}
-				case 0b111: {
-					// SBC - Subtract with Carry
-					Byte operand = ~auto_fetch_value(mmu, next_byte, final_addr_mode);
-					full_add(operand, true);
-					break;
-				}
-				default:
-				PC++;
-				return INVALID;
+	std::cout << "\nPress Enter to execute next instruction or 'q' to quit\n";
+	
+	while (running) {
+		// Whatever the last command did
+		if (!background.is_running()) shared_memory.publish(cpu);
+		if (!std::getline(std::cin, input)) {
+			// Out of input: let a run finish, then stop
+			background.wait();
+			input = "q";
+		}
+		// Commands work on a paused machine. If it was running, it carries
+		// on afterwards.
+		BackgroundPause background_pause(background);
+		std::vector<std::string> command_parts;
+		char cmd = ' ';
+
+		if (input.length() > 0) {
+			std::istringstream splitter(input);
+			std::string current;
+
+			while (getline(splitter, current, ' ')) {
+				command_parts.push_back(current);
 			}
-			auto_increment_pc(final_addr_mode);
+
+			cmd = command_parts[0][0];
+		}
+		
+		if (cmd == 'q' || cmd == 'Q') {
+			std::cout << "Quitting emulator...\n";
+			background_pause.cancel();
+			running = false;
 			break;
-			case 0b10: // Group 2
-			switch (aaa) {
-				case 0b000: {
-					// ASL - Arithmetic Shift Left
-					Byte to_shift = auto_fetch_value(mmu, next_byte, final_addr_mode);
-					set_flag(CPU_FLAG_C, to_shift & 0b10000000);
-					to_shift <<= 1;
-					set_flag(CPU_FLAG_Z, to_shift == 0); // Documented incorrectly on NESdev?
-					set_flag(CPU_FLAG_N, to_shift & 0b10000000);
-					// TODO: Figure out how this works if we are in accumulator addressing mode
-					auto_write_value(mmu, next_byte, final_addr_mode, to_shift);
-					break;
-				}
-				case 0b001: {
-					// ROL - Rotate Left
-					Byte to_rotate = auto_fetch_value(mmu, next_byte, final_addr_mode);
-					Byte old_carry = check_flag(CPU_FLAG_C);
-					set_flag(CPU_FLAG_C, to_rotate & 0b10000000);
-					to_rotate <<= 1;
-					to_rotate |= old_carry;
-					set_flag(CPU_FLAG_Z, to_rotate == 0); // Documented incorrectly on NESdev?
-					set_flag(CPU_FLAG_N, to_rotate & 0b10000000);
-					// TODO: Figure out how this works if we are in accumulator addressing mode
-					auto_write_value(mmu, next_byte, final_addr_mode, to_rotate);
-					break;
-				}
-				case 0b010: {
-					// LSR - Logical Shift Right
-					Byte to_shift = auto_fetch_value(mmu, next_byte, final_addr_mode);
-					set_flag(CPU_FLAG_C, to_shift & 1);
-					to_shift >>= 1;
-					set_flag(CPU_FLAG_Z, to_shift == 0); // Weirdly differs from the others on NESdev
-					set_flag(CPU_FLAG_N, to_shift & 0b10000000);
-					// TODO: Figure out how this works if we are in accumulator addressing mode
-					auto_write_value(mmu, next_byte, final_addr_mode, to_shift);
-					break;
+		}
+		else if (cmd == 't' || cmd == 'T') {
+			if (command_parts.size() > 1) {
+				std::string type_name = command_parts[1];
+				bool found = true;
+				if (type_name == "MOS") {
+					cpu.type = MOS;
 				}
-				case 0b011: {
-					// ROR - Rotate Right
-					Byte to_rotate = auto_fetch_value(mmu, next_byte, final_addr_mode);
-					Byte old_carry = check_flag(CPU_FLAG_C);
-					set_flag(CPU_FLAG_C, to_rotate & 1);
-					to_rotate >>= 1;
-					to_rotate |= old_carry << 7;
-					set_flag(CPU_FLAG_Z, to_rotate == 0); // Documented incorrectly on NESdev?
-					set_flag(CPU_FLAG_N, to_rotate & 0b10000000);
-					// TODO: Figure out how this works if we are in accumulator addressing mode
-					auto_write_value(mmu, next_byte, final_addr_mode, to_rotate);
-					break;
+				else if (type_name == "NES") {
+					cpu.type = NES;
 				}
-				case 0b100: {
-					// STX - Store X Register
-					// STX A = TXA but that is handled earlier
-
-					// Addressing mode quirk:
-					// zpx <-> zpy
-					// abx <-> aby
-					if (final_addr_mode == CPU_ADDR_MODE_ZPX)
-						final_addr_mode = CPU_ADDR_MODE_ZPY;
-					else if (final_addr_mode == CPU_ADDR_MODE_ZPY)
-						final_addr_mode = CPU_ADDR_MODE_ZPX;
-
-					// STX abs,Y is unassigned
-					if (final_addr_mode != CPU_ADDR_MODE_INVALID) {
-						auto_write_value(mmu, next_byte, final_addr_mode, X);
-					}
-					break;
+				else {
+					std::cout << "Unknown type." << std::endl;
+					found = false;
 				}
-				case 0b101: {
-					// LDX - Load X Register
-					// LDX A = TAX but that is handled earlier
 
-					// Addressing mode quirk:
-					// zpx <-> zpy
-					// abx <-> aby
-					if (final_addr_mode == CPU_ADDR_MODE_ZPX)
-						final_addr_mode = CPU_ADDR_MODE_ZPY;
-					else if (final_addr_mode == CPU_ADDR_MODE_ZPY)
-						final_addr_mode = CPU_ADDR_MODE_ZPX;
-					else if (final_addr_mode == CPU_ADDR_MODE_ABX)
-						final_addr_mode = CPU_ADDR_MODE_ABY;
-					else if (final_addr_mode == CPU_ADDR_MODE_ABY)
-						final_addr_mode = CPU_ADDR_MODE_ABX;
-					
-					X = auto_fetch_value(mmu, next_byte, final_addr_mode);
-					set_flag(CPU_FLAG_Z, X == 0);
-					set_flag(CPU_FLAG_N, X & 0b10000000);
-					break;
+				if (found) {
+					std::cout << "Successfully switched 6502 type." << std::endl;
 				}
-				case 0b110: {
-					// DEC - Decrement Memory
-					// DEC A is DEX but that is handled earlier
-					// TODO: Check if this uses the correct number of cycles
-					Byte M = lo(static_cast<Word>(auto_fetch_value(mmu, next_byte, final_addr_mode) - 1));
-					set_flag(CPU_FLAG_Z, M == 0);
-					set_flag(CPU_FLAG_N, M & 0b10000000);
-					auto_write_value(mmu, next_byte, final_addr_mode, M);
-					break;
-				}
-				case 0b111: {
-					// INC - Increment Memory
-					// INC A is NOP but that is handled earlier
-					// TODO: Check if this uses the correct number of cycles
-					Byte M = lo(static_cast<Word>(auto_fetch_value(mmu, next_byte, final_addr_mode) + 1));
-					set_flag(CPU_FLAG_Z, M == 0);
-					set_flag(CPU_FLAG_N, M & 0b10000000);
-					auto_write_value(mmu, next_byte, final_addr_mode, M);
-					break;
-				}
-				default:
-				PC++;
-				return INVALID;
 			}
-			auto_increment_pc(final_addr_mode);
-			break;
-			case 0b00: // Group 3
-			if (bbb == 0b100) {
-				// Covers all conditional branch instructions
-				Byte untranslated_flag = aaa >> 1;
-				Byte condition = aaa & 1;
-				Byte flag = 0;
-				switch (untranslated_flag) {
-					case 0: flag = CPU_FLAG_N; break;
-					case 1: flag = CPU_FLAG_V; break;
-					case 2: flag = CPU_FLAG_C; break;
-					case 3: flag = CPU_FLAG_Z;
-					default: break;
-				}
-
-				if (check_flag(flag) == condition) {
-					last_jump_origin = PC;
-					stall_n_cycles(mmu, 1); // TODO: 2 if to a new page
-					PC = static_cast<Word>(PC + (Byte_S)next_byte); // Convert to signed type to do signed addition
-				}
-				
-				PC += 2; // PC is always incremented by 2 here
-				last_jump_target = PC;
-				break; // Prevents the switch(aaa) from running
-			}
-			switch (aaa) {
-				case 0b001: {
-					// BIT - Bit Test
-					Word address_to_test = widen(next_byte);
-					if (bbb == 0b011) {
-						// Absolute mode
-						addr_bus_value = PC + 2;
-						exec_cycle(mmu, CPU_UOP_FETCH); // Get second byte of address to test
-						address_to_test |= static_cast<Word>(widen(data_bus_value) << 8);
-						PC++;
+			else {
+				std::cout << "Specify the type of 6502." << std::endl;
+			}
+			continue;
+		}
+		else if (cmd == 'l' || cmd == 'L') {
+			if (command_parts.size() > 1) {
+				logfile = command_parts[1];
+				logging = true;
+				binary_logging = command_parts.size() > 2 && command_parts[2] == "bin";
+				std::cout << "Logging to '" << logfile << "'"
+					<< (binary_logging ? " (binary)" : "") << std::endl;
+			}
+			else {
+				std::cout << "Please specify a file path to log to." << std::endl;
+			}
+			continue;
+		}
+		else if (cmd == 'g' || cmd == 'G') {
+			if (command_parts.size() > 1 && command_parts[1] == "off") {
+				golden.stop();
+				std::cout << "Golden trace comparison disabled." << std::endl;
+			}
+			else if (command_parts.size() > 1) {
+				std::size_t context_size = 16;
+				Byte compare_mask = TRACE_FIELD_ALL;
+				try {
+					for (std::size_t i = 2; i < command_parts.size(); i++) {
+						if (command_parts[i] == "nocyc") {
+							compare_mask &= static_cast<Byte>(~TRACE_FIELD_CYCLES);
+						}
+						else {
+							context_size = static_cast<std::size_t>(parse_numeric_literal(command_parts[i]));
+						}
 					}
-					
-					addr_bus_value = address_to_test;
-					exec_cycle(mmu, CPU_UOP_FETCH);
-					Byte result = A & data_bus_value;
-
-					set_flag(CPU_FLAG_Z, result == 0);
-					set_flag(CPU_FLAG_V, data_bus_value & 0b01000000);
-					set_flag(CPU_FLAG_N, data_bus_value & 0b10000000);
-
-					PC += 2;
-					break;
 				}
-				// llx.com gets these two backwards
-				case 0b010: {
-					// JMP - Absolute Jump
-					Word jump_target = make_address(next_byte, fetch_one_byte(mmu, PC + 2));
-					last_jump_origin = PC;
-					last_jump_target = jump_target;
-					PC = jump_target;
-					break;
+				catch (const std::exception& e) {
+					std::cerr << "Invalid numeric input: " << e.what() << std::endl;
+					continue;
 				}
-				case 0b011: {
-					// JMP - Indirect Jump
-					Byte jump_target_location_lo = next_byte;
-					Byte jump_target_location_hi = fetch_one_byte(mmu, PC + 2);
-					Word jump_target_location = make_address(jump_target_location_lo, jump_target_location_hi);
-					bool wraparound = jump_target_location_lo == 0xFF;
 
-					Byte jump_target_lo = fetch_one_byte(mmu, jump_target_location);
-					Byte jump_target_hi = fetch_one_byte(mmu, wraparound ? jump_target_location + 1 - 0x100 : jump_target_location + 1);
-					Word jump_target = make_address(jump_target_lo, jump_target_hi);
-					last_jump_origin = PC;
-					last_jump_target = jump_target;
-					PC = jump_target;
-					break;
-				}
-				case 0b100: {
-					// STY - Store Y Register
-					auto_write_value(mmu, next_byte, final_addr_mode, Y);
-					auto_increment_pc(final_addr_mode);
-					break;
-				}
-				case 0b101: {
-					// LDY - Load Y Register
-					Y = auto_fetch_value(mmu, next_byte, final_addr_mode);
-					set_flag(CPU_FLAG_Z, Y == 0);
-					set_flag(CPU_FLAG_N, Y & 0b10000000);
-					auto_increment_pc(final_addr_mode);
-					break;
+				golden.set_symbols(symbols.empty() ? nullptr : &symbols);
+				if (golden.open(command_parts[1], context_size, compare_mask)) {
+					std::cout << "Comparing against " << (golden.reader_is_binary() ? "binary" : "text")
+						<< " trace '" << command_parts[1] << "'" << std::endl;
 				}
-				case 0b110: {
-					// CPY - Compare Y Register
-					Byte compare_mem = auto_fetch_value(mmu, next_byte, final_addr_mode);
-					Word result = static_cast<Word>(Y - compare_mem);
-					
-					set_flag(CPU_FLAG_C, Y >= compare_mem);
-					set_flag(CPU_FLAG_Z, result == 0);
-					set_flag(CPU_FLAG_N, static_cast<Byte>(result & 0b10000000));
-					auto_increment_pc(final_addr_mode);
-					break;
-				}
-				case 0b111: {
-					// CPX - Compare X Register
-					Byte compare_mem = auto_fetch_value(mmu, next_byte, final_addr_mode);
-					Word result = static_cast<Word>(X - compare_mem);
-					
-					set_flag(CPU_FLAG_C, X >= compare_mem);
-					set_flag(CPU_FLAG_Z, result == 0);
-					set_flag(CPU_FLAG_N, static_cast<Byte>(result & 0b10000000));
-					auto_increment_pc(final_addr_mode);
-					break;
+				else {
+					std::cout << "Could not open reference trace '" << command_parts[1] << "'" << std::endl;
 				}
-				default:
-				PC++;
-				return INVALID;
 			}
-			break;
-			default:
-			PC++;
-			return INVALID;
+			else {
+				std::cout << "Please specify a reference trace to compare against." << std::endl;
+			}
+			continue;
 		}
-
-		last_good_instruction = old_pc;
-		if (PC == old_pc) return HALT;
-		return CONTINUE;
-	}
-};
-
-int main(int argc, char* argv[]) {
-	CPU cpu;
-	MMU mmu;
-	mmu.initialize();
-
-	if (argc > 1) {
-		std::cout << "Attempting to load ROM: " << argv[1] << std::endl;
-		std::ifstream rom_file(argv[1], std::ios::binary);
-		if (!rom_file) {
-			std::cerr << "Error: Could not open ROM file." << std::endl;
-			return 1;
+		else if (cmd == 'y' || cmd == 'Y') {
+			if (command_parts.size() > 1) {
+				load_symbols(symbols, command_parts[1]);
+			}
+			else {
+				std::cout << std::dec << symbols.size() << " symbols loaded." << std::endl;
+			}
+			continue;
 		}
-
-		char byte;
-		Word address = 0x0000;
-		while (rom_file.get(byte)) {
-			mmu.write_byte(address++, static_cast<Byte>(byte));
+		else if (cmd == 'h' || cmd == 'H') {
+			try {
+				std::size_t count = CPU_HISTORY_SIZE;
+				if (command_parts.size() > 1) {
+					count = static_cast<std::size_t>(parse_numeric_literal(command_parts[1]));
+				}
+				cpu.dump_history(std::cout, count);
+			}
+			catch (const std::exception& e) {
+				std::cerr << "Invalid numeric input: " << e.what() << std::endl;
+			}
+			continue;
 		}
-		rom_file.close();
-	} else {
-		std::cout << "No ROM provided." << std::endl;
-	}
-	
-	cpu.reset(mmu);
-	cpu.dump_state(mmu);
-	
-	std::string input;
-	std::string logfile;
-	std::ofstream logfile_stream;
-	bool logging = false;
-	bool running = true;
-	bool paused = true;
-	
-	std::cout << "\nPress Enter to execute next instruction or 'q' to quit\n";
-	
-	while (running) {
-		bool bypass_breakpoints = false;
-		if (paused) {
-			std::getline(std::cin, input);
-			std::vector<std::string> command_parts;
-			char cmd = ' ';
-
-			if (input.length() > 0) {
-				std::istringstream splitter(input);
-				std::string current;
-
-				while (getline(splitter, current, ' ')) {
-					command_parts.push_back(current);
+		else if (cmd == 'p' || cmd == 'P') {
+			std::string action = command_parts.size() > 1 ? command_parts[1] : "";
+			if (action == "on") {
+				profiler.start(cpu);
+				std::cout << "Call profiler started." << std::endl;
+			}
+			else if (action == "off") {
+				profiler.stop();
+				std::cout << "Call profiler stopped." << std::endl;
+			}
+			else if ((action == "folded" || action == "chrome") && command_parts.size() > 2) {
+				bool written = action == "folded"
+					? profiler.write_folded(command_parts[2], &symbols, cpu.cycle_count)
+					: profiler.write_chrome_trace(command_parts[2], &symbols, cpu.cycle_count);
+				if (written) {
+					std::cout << "Wrote profile to '" << command_parts[2] << "'" << std::endl;
+				}
+				else {
+					std::cout << "Could not write '" << command_parts[2] << "'" << std::endl;
 				}
-
-				cmd = command_parts[0][0];
+			}
+			else if (action.empty()) {
+				profiler.report(std::cout, &symbols, cpu.cycle_count);
 			}
 			else {
-				bypass_breakpoints = true;
+				std::cout << "Usage: p [on|off|folded <file>|chrome <file>]" << std::endl;
 			}
-			
-			if (cmd == 'q' || cmd == 'Q') {
-				std::cout << "Quitting emulator...\n";
-				running = false;
-				break;
+			continue;
+		}
+		else if (cmd == 'm' || cmd == 'M') {
+			try {
+				memory_command(command_parts, mmu, symbols, memory_snapshot, std::cout);
 			}
-			else if (cmd == 't' || cmd == 'T') {
-				if (command_parts.size() > 1) {
-					std::string type_name = command_parts[1];
-					bool found = true;
-					if (type_name == "MOS") {
-						cpu.type = MOS;
-					}
-					else if (type_name == "NES") {
-						cpu.type = NES;
-					}
-					else {
-						std::cout << "Unknown type." << std::endl;
-						found = false;
-					}
-
-					if (found) {
-						std::cout << "Successfully switched 6502 type." << std::endl;
+			catch (const std::exception& e) {
+				std::cerr << "Invalid numeric input: " << e.what() << std::endl;
+			}
+			continue;
+		}
+		else if (cmd == 'j' || cmd == 'J') {
+			try {
+				Word location = resolve_address(command_parts.at(1), symbols);
+				std::cout << "Jumping to " << format_address(location, &symbols) << std::endl;
+				cpu.PC = location;
+			}
+			catch (const std::exception& e) {
+				std::cerr << "Invalid numeric input: " << e.what() << std::endl;
+			}
+			continue;
+		}
+		else if (cmd == 'b' || cmd == 'B') {
+			try {
+				if (command_parts.size() < 2) {
+					for (std::size_t i = 0; i < cpu.breakpoints.size(); i++) {
+						const Breakpoint& breakpoint = cpu.breakpoints[i];
+						std::cout << std::dec << i + 1 << ": " << format_address(breakpoint.address, &symbols)
+							<< (breakpoint.condition.empty() ? "" : " if " + breakpoint.condition.text())
+							<< ", hit " << breakpoint.hits << " times" << std::endl;
 					}
+					if (cpu.breakpoints.empty()) std::cout << "No breakpoints set." << std::endl;
+				}
+				else if (command_parts[1] == "del") {
+					std::size_t number = static_cast<std::size_t>(parse_numeric_literal(command_parts.at(2)));
+					if (number == 0 || number > cpu.breakpoints.size()) throw std::out_of_range("no breakpoint " + command_parts[2]);
+					cpu.breakpoints.erase(cpu.breakpoints.begin() + static_cast<std::ptrdiff_t>(number - 1));
+					std::cout << "Breakpoint deleted." << std::endl;
 				}
 				else {
-					std::cout << "Specify the type of 6502." << std::endl;
+					Breakpoint breakpoint;
+					breakpoint.address = resolve_address(command_parts[1], symbols);
+					std::size_t condition = input.find(" if ");
+					if (condition != std::string::npos) {
+						breakpoint.condition = Expression(input.substr(condition + 4), symbols);
+					}
+					std::cout << "Breakpoint set at " << format_address(breakpoint.address, &symbols)
+						<< (breakpoint.condition.empty() ? "" : " if " + breakpoint.condition.text()) << std::endl;
+					cpu.breakpoints.push_back(breakpoint);
 				}
-				continue;
 			}
-			else if (cmd == 'l' || cmd == 'L') {
-				if (command_parts.size() > 1) {
-					logfile = command_parts[1];
-					logging = true;
-					std::cout << "Logging to '" << logfile << "'" << std::endl;
+			catch (const std::exception& e) {
+				std::cerr << "Invalid numeric input: " << e.what() << std::endl;
+			}
+			continue;
+		}
+		else if (cmd == 'w' || cmd == 'W') {
+			try {
+				if (command_parts.size() < 2) {
+					for (std::size_t i = 0; i < cpu.watchpoints.size(); i++) {
+						const Watchpoint& watchpoint = cpu.watchpoints[i];
+						std::cout << std::dec << i + 1 << ": " << format_address(watchpoint.address, &symbols)
+							<< ((watchpoint.access & CPU_UOP_FETCH) ? " r" : " ") << ((watchpoint.access & CPU_UOP_WRITE) ? "w" : "")
+							<< (watchpoint.condition.empty() ? "" : " if " + watchpoint.condition.text())
+							<< ", hit " << watchpoint.hits << " times" << std::endl;
+					}
+					if (cpu.watchpoints.empty()) std::cout << "No watchpoints set." << std::endl;
+				}
+				else if (command_parts[1] == "del") {
+					std::size_t number = static_cast<std::size_t>(parse_numeric_literal(command_parts.at(2)));
+					if (number == 0 || number > cpu.watchpoints.size()) throw std::out_of_range("no watchpoint " + command_parts[2]);
+					cpu.watchpoints.erase(cpu.watchpoints.begin() + static_cast<std::ptrdiff_t>(number - 1));
+					cpu.rebuild_watch_map();
+					std::cout << "Watchpoint deleted." << std::endl;
 				}
 				else {
-					std::cout << "Please specify a file path to log to." << std::endl;
+					Watchpoint watchpoint;
+					watchpoint.address = resolve_address(command_parts[1], symbols);
+					watchpoint.access = CPU_UOP_WRITE;
+					if (command_parts.size() > 2 && command_parts[2] != "if") {
+						const std::string& mode = command_parts[2];
+						if (mode == "r") watchpoint.access = CPU_UOP_FETCH;
+						else if (mode == "rw") watchpoint.access = CPU_UOP_FETCH | CPU_UOP_WRITE;
+						else if (mode != "w") throw std::invalid_argument("access must be r, w or rw");
+					}
+					std::size_t condition = input.find(" if ");
+					if (condition != std::string::npos) {
+						watchpoint.condition = Expression(input.substr(condition + 4), symbols);
+					}
+					std::cout << "Watchpoint set at " << format_address(watchpoint.address, &symbols)
+						<< (watchpoint.condition.empty() ? "" : " if " + watchpoint.condition.text()) << std::endl;
+					cpu.watchpoints.push_back(watchpoint);
+					cpu.rebuild_watch_map();
 				}
-				continue;
 			}
-			else if (cmd == 'j' || cmd == 'J') {
-				try {
-					Word location = static_cast<Word>(parse_numeric_literal(command_parts[1]));
-					std::cout << "Jumping to 0x" << std::hex << (int)location << std::endl;
-					cpu.PC = location;
-				}
-				catch (const std::exception& e) {
-					std::cerr << "Invalid numeric input: " << e.what() << std::endl;
-				}
+			catch (const std::exception& e) {
+				std::cerr << "Invalid numeric input: " << e.what() << std::endl;
+			}
+			continue;
+		}
+		else if (cmd == 'r' || cmd == 'R') {
+			if (background_pause.was_running()) {
+				std::cout << "Already running." << std::endl;
 				continue;
 			}
-			else if (cmd == 'b' || cmd == 'B') {
+			std::cout << "Running... (Enter shows progress, 'z' or Ctrl-C pauses)" << std::endl;
+			background.start(
+				[&](bool bypass_breakpoints) { return step(bypass_breakpoints, false); },
+				[&]() {
+					cpu.dump_state(mmu);
+					std::cout << "Paused." << std::endl;
+				},
+				cpu);
+			continue;
+		}
+		else if (cmd == 'z' || cmd == 'Z') {
+			if (background_pause.was_running()) {
+				background_pause.cancel();
+				cpu.dump_state(mmu);
+				std::cout << "Paused." << std::endl;
+			}
+			else {
+				std::cout << "Not running." << std::endl;
+			}
+			continue;
+		}
+		else if (cmd == 's' || cmd == 'S') {
+			std::string action = command_parts.size() > 1 ? command_parts[1] : "";
+			if (action == "off") {
+				pacer.stop();
+				std::cout << "Running unthrottled." << std::endl;
+			}
+			else if (!action.empty()) {
 				try {
-					Word location = static_cast<Word>(parse_numeric_literal(command_parts[1]));
-					std::cout << "Breakpoint set at 0x" << std::hex << (int)location << std::endl;
-					cpu.breakpoints.push_back(location);
+					double hz = parse_clock_rate(action);
+					unsigned long slice = command_parts.size() > 2 ? static_cast<unsigned long>(parse_numeric_literal(command_parts[2])) : 0;
+					pacer.start(hz, slice, cpu.cycle_count);
+					pacer.report(std::cout);
 				}
 				catch (const std::exception& e) {
 					std::cerr << "Invalid numeric input: " << e.what() << std::endl;
 				}
-				continue;
 			}
-			else if (cmd == 'r' || cmd == 'R') {
-				std::cout << "Running..." << std::endl;
-				paused = false;
+			else {
+				pacer.report(std::cout);
 			}
-			else if (cmd == 'i' || cmd == 'I') {
-				if (command_parts.size() > 1) {
-					try {
-						Word location = static_cast<Word>(parse_numeric_literal(command_parts[1]));
-						std::cout << "Value at 0x" << std::hex << (int)location 
-							<< " is 0x" << std::hex << (int)mmu.read_byte(location) << std::endl;
-					}
-					catch (const std::exception& e) {
-						std::cerr << "Invalid numeric input: " << e.what() << std::endl;
-					}
+			continue;
+		}
+		else if (cmd == 'f' || cmd == 'F') {
+			std::string action = command_parts.size() > 1 ? command_parts[1] : "";
+			std::string error;
+			if (action == "save" && command_parts.size() > 2) {
+				bool compress = !(command_parts.size() > 3 && command_parts[3] == "raw");
+				if (save_state(command_parts[2], system, compress, error)) {
+					metrics.states_saved++;
+					std::cout << "Saved state to '" << command_parts[2] << "'" << std::endl;
 				}
 				else {
+					std::cout << "Could not save state: " << error << std::endl;
+				}
+			}
+			else if (action == "load" && command_parts.size() > 2) {
+				if (load_state(command_parts[2], system, error)) {
+					metrics.states_loaded++;
+					std::cout << "Loaded state from '" << command_parts[2] << "'" << std::endl;
 					cpu.dump_state(mmu);
 				}
-				continue;
+				else {
+					std::cout << error << std::endl;
+				}
 			}
 			else {
-				std::cout << "Stepping one instruction." << std::endl;
-				bypass_breakpoints = true;
+				std::cout << "Usage: f save <file> [raw] | f load <file>" << std::endl;
 			}
+			continue;
 		}
-
-		if (logging) {
-			if (!logfile_stream.is_open()) {
-				logfile_stream.open(logfile);
+		else if (cmd == 'c' || cmd == 'C') {
+			for (std::size_t i = 1; i < system.cores.size(); i++) {
+				SystemCore& core = *system.cores[i];
+				std::cout << "CPU " << std::dec << i << " (" << core.name << ")"
+					<< (core.status == CONTINUE ? "" : ", stopped") << std::endl;
+				core.cpu.dump_state(core.mmu);
 			}
-
-			logfile_stream << cpu.log_state(mmu) << std::endl;
+			if (system.cores.size() < 2) {
+				std::cout << "There are no other CPUs, add them with --core." << std::endl;
+			}
+			continue;
 		}
-
-		CPUStatus status = cpu.exec_instruction(mmu, bypass_breakpoints);
-
-		if (status == HALT) {
-			cpu.dump_state(mmu);
-			std::cout << "A halt was detected!" << std::endl;
-			paused = true;
+		else if (cmd == 'i' || cmd == 'I') {
+			if (command_parts.size() > 1) {
+				try {
+					Word location = resolve_address(command_parts[1], symbols);
+					std::cout << "Value at " << format_address(location, &symbols)
+						<< " is 0x" << std::hex << (int)mmu.read_byte(location) << std::endl;
+				}
+				catch (const std::exception& e) {
+					std::cerr << "Invalid numeric input: " << e.what() << std::endl;
+				}
+			}
+			else {
+				cpu.dump_state(mmu);
+			}
+			continue;
 		}
-		else if (status == INVALID) {
-			cpu.dump_state(mmu);
-			std::cout << "The CPU encountered an invalid instruction!" << std::endl
-				<< "Execution may be resumed, but unexpected behavior could occur." << std::endl;
-			paused = true;
+		else if (background_pause.was_running()) {
+			// Only while it's still going; after it stopped, Enter steps
+			background.report(std::cout);
 		}
-		else if (status == BREAKPOINT) {
-			cpu.dump_state(mmu);
-			std::cout << "Breakpoint hit!" << std::endl;
-			paused = true;
+		else {
+			std::cout << "Stepping one instruction." << std::endl;
+			step(true, true);
+			if (published_metrics) published_metrics->publish(cpu);
 		}
 	}
 
 	logfile_stream.close();
+	binary_log.close();
 
-	return 0;
+	return save_on_exit() ? 0 : 1;
 }
\ No newline at end of file
@@ -0,0 +1,332 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include "types.hpp"
+#include "page.hpp"
+#include "mmu.hpp"
+
+class Mapper;
+
+// One page of the $8000-$FFFF cartridge space. Reads come straight from
+// whichever bank is currently selected; switching banks only swaps the data
+// pointer. Writes don't change ROM, they go to the mapper's registers.
+class BankWindow : public MemoryPage {
+public:
+	BankWindow(Mapper& owner, Word base) : mapper(owner), base_address(base) {}
+
+	Byte read_byte(Byte address) const {
+		return data[address];
+	}
+
+	void write_byte(Byte address, Byte value);
+
+	const Byte* read_data() const {
+		return data;
+	}
+
+	Byte* data = nullptr;
+
+private:
+	Mapper& mapper;
+	Word base_address;
+};
+
+// Bank-switched ROM larger than the address space. The whole backing store is
+// kept in one buffer and the mapper decides which part of it each 256 byte
+// window at $8000-$FFFF shows. Pages outside the cartridge space are left
+// alone, so unbanked memory pays nothing for any of this.
+class Mapper {
+public:
+	static constexpr Byte FIRST_PAGE = 0x80;
+	static constexpr std::size_t WINDOW_COUNT = 0x80;
+
+	explicit Mapper(std::vector<Byte> rom) : store(std::move(rom)) {
+		// Smaller images are mirrored up to 16K so every bank size divides evenly
+		if (store.empty()) store.assign(0x4000, 0);
+		while (store.size() < 0x4000 || store.size() % 0x2000 != 0) {
+			std::size_t size = store.size();
+			std::size_t grow = std::min<std::size_t>(size, 0x4000 - (size % 0x4000));
+			std::vector<Byte> mirror(store.begin(), store.begin() + static_cast<std::ptrdiff_t>(grow));
+			store.insert(store.end(), mirror.begin(), mirror.end());
+		}
+	}
+
+	virtual ~Mapper() {}
+
+	virtual const char* name() const = 0;
+	virtual void write_register(Word address, Byte value) = 0;
+
+	// Writes to the cartridge space, for metrics
+	unsigned long register_writes = 0;
+
+	// Maps the cartridge space into the MMU and selects the power-on banks
+	void attach(MMU& mmu) {
+		for (std::size_t i = 0; i < WINDOW_COUNT; i++) {
+			Word base = static_cast<Word>((FIRST_PAGE + i) << 8);
+			windows[i] = std::make_unique<BankWindow>(*this, base);
+			mmu.map_page(static_cast<Byte>(FIRST_PAGE + i), windows[i].get());
+		}
+		power_on();
+	}
+
+	std::size_t rom_size() const {
+		return store.size();
+	}
+
+	std::size_t bank_count(std::size_t bank_size) const {
+		return store.size() / bank_size;
+	}
+
+	// Which part of the ROM each window shows plus the mapper's own
+	// registers, for save states
+	void save_state(std::vector<Byte>& out) const {
+		for (const std::unique_ptr<BankWindow>& window : windows) {
+			std::size_t offset = window ? static_cast<std::size_t>(window->data - store.data()) : 0;
+			for (int i = 0; i < 4; i++) out.push_back(static_cast<Byte>(offset >> (8 * i)));
+		}
+		save_registers(out);
+	}
+
+	// Only checks the state unless apply is set, and changes nothing if it
+	// returns false
+	bool load_state(const Byte* in, std::size_t size, bool apply) {
+		if (size < WINDOW_COUNT * 4) return false;
+		std::size_t offsets[WINDOW_COUNT];
+		for (std::size_t i = 0; i < WINDOW_COUNT; i++) {
+			offsets[i] = 0;
+			for (std::size_t j = 0; j < 4; j++) offsets[i] |= static_cast<std::size_t>(in[i * 4 + j]) << (8 * j);
+			if (offsets[i] % 256 != 0 || offsets[i] + 256 > store.size() || !windows[i]) return false;
+		}
+		if (!load_registers(in + WINDOW_COUNT * 4, size - WINDOW_COUNT * 4, apply)) return false;
+		if (!apply) return true;
+		for (std::size_t i = 0; i < WINDOW_COUNT; i++) {
+			windows[i]->data = store.data() + offsets[i];
+		}
+		return true;
+	}
+
+protected:
+	std::vector<Byte> store;
+
+	virtual void power_on() = 0;
+
+	// Mappers with registers beyond the bank selection keep them here
+	virtual void save_registers(std::vector<Byte>&) const {}
+	virtual bool load_registers(const Byte*, std::size_t size, bool) {
+		return size == 0;
+	}
+
+	// Shows bank number `bank` (counted in units of bank_size) at cpu_address.
+	// Bank numbers past the end wrap, like the unconnected high bank bits on
+	// a real cartridge, and a bank bigger than the whole ROM (32K mode on a
+	// 16K MMC1 cartridge) shows the ROM repeated.
+	void map_bank(Word cpu_address, std::size_t bank_size, std::size_t bank) {
+		std::size_t count = bank_count(bank_size);
+		std::size_t offset = count == 0 ? 0 : (bank % count) * bank_size;
+		std::size_t first = (cpu_address >> 8) - FIRST_PAGE;
+		for (std::size_t page = 0; page < bank_size / 256; page++) {
+			windows[first + page]->data = store.data() + (offset + page * 256) % store.size();
+		}
+	}
+
+private:
+	std::unique_ptr<BankWindow> windows[WINDOW_COUNT];
+};
+
+inline void BankWindow::write_byte(Byte address, Byte value) {
+	mapper.register_writes++;
+	mapper.write_register(static_cast<Word>(base_address | address), value);
+}
+
+// NROM: 16K or 32K, no switching. 16K images show up twice.
+class FixedMapper : public Mapper {
+public:
+	using Mapper::Mapper;
+
+	const char* name() const { return "NROM"; }
+	void write_register(Word, Byte) {}
+
+protected:
+	void power_on() {
+		map_bank(0x8000, 0x4000, 0);
+		map_bank(0xC000, 0x4000, 1);
+	}
+};
+
+// UxROM style: a switchable 16K bank at $8000 and the last 16K fixed at
+// $C000. Any write to $8000-$FFFF selects the bank.
+class Switchable16kMapper : public Mapper {
+public:
+	using Mapper::Mapper;
+
+	const char* name() const { return "UxROM"; }
+
+	void write_register(Word, Byte value) {
+		map_bank(0x8000, 0x4000, value);
+	}
+
+protected:
+	void power_on() {
+		map_bank(0x8000, 0x4000, 0);
+		map_bank(0xC000, 0x4000, bank_count(0x4000) - 1);
+	}
+};
+
+// Four independent 8K windows. A write anywhere inside a window selects the
+// bank it shows. Powers on with the first banks in order and the last bank at
+// $E000 so the vectors are there.
+class Window8kMapper : public Mapper {
+public:
+	using Mapper::Mapper;
+
+	const char* name() const { return "8K windows"; }
+
+	void write_register(Word address, Byte value) {
+		map_bank(static_cast<Word>(address & 0xE000), 0x2000, value);
+	}
+
+protected:
+	void power_on() {
+		map_bank(0x8000, 0x2000, 0);
+		map_bank(0xA000, 0x2000, 1);
+		map_bank(0xC000, 0x2000, 2);
+		map_bank(0xE000, 0x2000, bank_count(0x2000) - 1);
+	}
+};
+
+// MMC1 (SxROM) PRG banking. Registers are loaded one bit at a time through a
+// 5-bit shift register; the address of the fifth write picks the register.
+// CHR banking is accepted and ignored since there is no PPU.
+// https://www.nesdev.org/wiki/MMC1
+class MMC1Mapper : public Mapper {
+public:
+	using Mapper::Mapper;
+
+	const char* name() const { return "MMC1"; }
+
+	void write_register(Word address, Byte value) {
+		if (value & 0x80) {
+			shift = 0;
+			shift_count = 0;
+			control |= 0x0C;
+			update_banks();
+			return;
+		}
+
+		shift |= static_cast<Byte>((value & 1) << shift_count);
+		shift_count++;
+		if (shift_count < 5) return;
+
+		switch ((address >> 13) & 0b11) {
+			case 0: control = shift; break;
+			case 3: prg_bank = shift & 0x0F; break;
+			default: break; // CHR banks
+		}
+		shift = 0;
+		shift_count = 0;
+		update_banks();
+	}
+
+protected:
+	void power_on() {
+		shift = 0;
+		shift_count = 0;
+		control = 0x0C;
+		prg_bank = 0;
+		update_banks();
+	}
+
+	void save_registers(std::vector<Byte>& out) const {
+		out.push_back(shift);
+		out.push_back(static_cast<Byte>(shift_count));
+		out.push_back(control);
+		out.push_back(prg_bank);
+	}
+
+	bool load_registers(const Byte* in, std::size_t size, bool apply) {
+		if (size != 4 || in[1] > 4) return false;
+		if (!apply) return true;
+		shift = in[0];
+		shift_count = in[1];
+		control = in[2];
+		prg_bank = in[3];
+		return true;
+	}
+
+private:
+	Byte shift = 0;
+	int shift_count = 0;
+	Byte control = 0x0C;
+	Byte prg_bank = 0;
+
+	void update_banks() {
+		switch ((control >> 2) & 0b11) {
+			case 0:
+			case 1: // 32K at $8000, low bit ignored
+			map_bank(0x8000, 0x8000, prg_bank >> 1);
+			break;
+			case 2: // First bank fixed at $8000, switch $C000
+			map_bank(0x8000, 0x4000, 0);
+			map_bank(0xC000, 0x4000, prg_bank);
+			break;
+			case 3: // Switch $8000, last bank fixed at $C000
+			map_bank(0x8000, 0x4000, prg_bank);
+			map_bank(0xC000, 0x4000, bank_count(0x4000) - 1);
+			break;
+		}
+	}
+};
+
+// Scheme names as accepted by --mapper
+inline std::unique_ptr<Mapper> make_mapper(const std::string& scheme, std::vector<Byte> rom) {
+	if (scheme == "nrom") return std::make_unique<FixedMapper>(std::move(rom));
+	if (scheme == "uxrom") return std::make_unique<Switchable16kMapper>(std::move(rom));
+	if (scheme == "8k") return std::make_unique<Window8kMapper>(std::move(rom));
+	if (scheme == "mmc1") return std::make_unique<MMC1Mapper>(std::move(rom));
+	return nullptr;
+}
+
+inline bool is_ines_image(const std::vector<Byte>& file) {
+	return file.size() >= 16 && file[0] == 'N' && file[1] == 'E' && file[2] == 'S' && file[3] == 0x1A;
+}
+
+// Picks the PRG ROM out of an iNES file and builds the matching mapper.
+// Supports mappers 0 (NROM), 1 (MMC1) and 2 (UxROM).
+// https://www.nesdev.org/wiki/INES
+inline std::unique_ptr<Mapper> load_ines(const std::vector<Byte>& file, std::string& error) {
+	if (!is_ines_image(file)) {
+		error = "not an iNES file";
+		return nullptr;
+	}
+
+	std::size_t prg_size = static_cast<std::size_t>(file[4]) * 0x4000;
+	bool has_trainer = file[6] & 0b100;
+	int mapper_number = (file[6] >> 4) | (file[7] & 0xF0);
+	std::size_t prg_start = 16 + (has_trainer ? 512 : 0);
+	if (prg_size == 0 || file.size() < prg_start + prg_size) {
+		error = "PRG ROM is missing or truncated";
+		return nullptr;
+	}
+
+	std::vector<Byte> prg(file.begin() + static_cast<std::ptrdiff_t>(prg_start),
+		file.begin() + static_cast<std::ptrdiff_t>(prg_start + prg_size));
+	switch (mapper_number) {
+		case 0: return std::make_unique<FixedMapper>(std::move(prg));
+		case 1: return std::make_unique<MMC1Mapper>(std::move(prg));
+		case 2: return std::make_unique<Switchable16kMapper>(std::move(prg));
+		default:
+		error = "unsupported mapper " + std::to_string(mapper_number);
+		return nullptr;
+	}
+}
+
+// The NES only has 2K of RAM, mirrored four times across $0000-$1FFF
+inline void mirror_nes_ram(MMU& mmu) {
+	for (int page = 0x08; page < 0x20; page++) {
+		mmu.map_page(static_cast<Byte>(page), mmu.pages[page & 0x07]);
+	}
+}
@@ -0,0 +1,364 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include "types.hpp"
+#include "helpers.hpp"
+#include "mmu.hpp"
+#include "symbols.hpp"
+
+// Bulk access to the address space. Pages backed by plain memory are handled
+// a page at a time with memcpy/memset; anything else (devices, bank-switched
+// ROM) goes byte by byte through the page itself, so its side effects still
+// happen the way they would for the CPU.
+
+inline void memory_read(MMU& mmu, Word start, std::size_t length, Byte* out) {
+	std::size_t address = start;
+	while (length > 0) {
+		MemoryPage* page = mmu.pages[(address >> 8) & 0xFF];
+		std::size_t offset = address & 0xFF;
+		std::size_t chunk = std::min(length, 256 - offset);
+		const Byte* data = page->read_data();
+		if (data) {
+			std::memcpy(out, data + offset, chunk);
+		}
+		else {
+			for (std::size_t i = 0; i < chunk; i++) out[i] = page->read_byte(static_cast<Byte>(offset + i));
+		}
+		address += chunk;
+		out += chunk;
+		length -= chunk;
+	}
+}
+
+inline void memory_write(MMU& mmu, Word start, const Byte* in, std::size_t length) {
+	std::size_t address = start;
+	while (length > 0) {
+		MemoryPage* page = mmu.pages[(address >> 8) & 0xFF];
+		std::size_t offset = address & 0xFF;
+		std::size_t chunk = std::min(length, 256 - offset);
+		Byte* data = page->raw_data();
+		if (data) {
+			std::memcpy(data + offset, in, chunk);
+		}
+		else {
+			for (std::size_t i = 0; i < chunk; i++) page->write_byte(static_cast<Byte>(offset + i), in[i]);
+		}
+		address += chunk;
+		in += chunk;
+		length -= chunk;
+	}
+}
+
+inline void memory_fill(MMU& mmu, Word start, std::size_t length, Byte value) {
+	std::size_t address = start;
+	while (length > 0) {
+		MemoryPage* page = mmu.pages[(address >> 8) & 0xFF];
+		std::size_t offset = address & 0xFF;
+		std::size_t chunk = std::min(length, 256 - offset);
+		Byte* data = page->raw_data();
+		if (data) {
+			std::memset(data + offset, value, chunk);
+		}
+		else {
+			for (std::size_t i = 0; i < chunk; i++) page->write_byte(static_cast<Byte>(offset + i), value);
+		}
+		address += chunk;
+		length -= chunk;
+	}
+}
+
+// Behaves like memmove when the ranges overlap
+inline void memory_copy(MMU& mmu, Word source, Word destination, std::size_t length) {
+	std::vector<Byte> buffer(length);
+	memory_read(mmu, source, length, buffer.data());
+	memory_write(mmu, destination, buffer.data(), length);
+}
+
+// All 64K at one point in time. Pages that can't be read without side
+// effects aren't read at all and are left out of comparisons and searches.
+struct MemorySnapshot {
+	std::vector<Byte> bytes;
+	bool readable[256] = {};
+
+	bool empty() const {
+		return bytes.empty();
+	}
+
+	void take(MMU& mmu) {
+		bytes.assign(65536, 0);
+		for (std::size_t page = 0; page < 256; page++) {
+			const Byte* data = mmu.pages[page]->read_data();
+			readable[page] = data != nullptr;
+			if (data) std::memcpy(&bytes[page << 8], data, 256);
+		}
+	}
+
+	// A raw 64K image, like the ones `m save` writes. Shorter files are
+	// padded with zeroes.
+	bool load(const std::string& path) {
+		std::ifstream file(path, std::ios::binary);
+		if (!file) return false;
+		bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		bytes.resize(65536, 0);
+		std::fill(readable, readable + 256, true);
+		return true;
+	}
+};
+
+inline unsigned lowest_set_bit(unsigned bits) {
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, bits);
+	return static_cast<unsigned>(index);
+#else
+	return static_cast<unsigned>(__builtin_ctz(bits));
+#endif
+}
+
+inline bool pattern_matches_at(const Byte* data, const Byte* pattern, const Byte* mask, std::size_t length) {
+	for (std::size_t i = 0; i < length; i++) {
+		if ((data[i] & mask[i]) != (pattern[i] & mask[i])) return false;
+	}
+	return true;
+}
+
+// First position at or after `from` where (data & mask) == (pattern & mask),
+// or size if there is none. Candidates are found 16 at a time by comparing
+// the first byte the mask cares about, then checked in full.
+inline std::size_t find_pattern(const Byte* data, std::size_t size, const Byte* pattern, const Byte* mask, std::size_t length, std::size_t from) {
+	if (length == 0 || length > size) return size;
+	std::size_t last = size - length;
+	std::size_t anchor = 0;
+	while (anchor < length && mask[anchor] == 0) anchor++;
+	if (anchor == length) return from <= last ? from : size; // All wildcards
+
+	Byte anchor_mask = mask[anchor];
+	Byte anchor_value = pattern[anchor] & anchor_mask;
+	std::size_t i = from;
+#if defined(__SSE2__)
+	const __m128i want = _mm_set1_epi8(static_cast<char>(anchor_value));
+	const __m128i care = _mm_set1_epi8(static_cast<char>(anchor_mask));
+	for (; i + 16 <= last + 1; i += 16) {
+		__m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + anchor));
+		unsigned hits = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(block, care), want)));
+		while (hits) {
+			std::size_t candidate = i + lowest_set_bit(hits);
+			if (pattern_matches_at(data + candidate, pattern, mask, length)) return candidate;
+			hits &= hits - 1;
+		}
+	}
+#endif
+	for (; i <= last; i++) {
+		if ((data[i + anchor] & anchor_mask) == anchor_value && pattern_matches_at(data + i, pattern, mask, length)) return i;
+	}
+	return size;
+}
+
+// First position at or after `from` where a and b differ (or, with
+// same = true, agree), or size if there is none
+inline std::size_t find_mismatch(const Byte* a, const Byte* b, std::size_t size, std::size_t from, bool same = false) {
+	std::size_t i = from;
+#if defined(__SSE2__)
+	for (; i + 16 <= size; i += 16) {
+		__m128i left = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+		__m128i right = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+		unsigned equal = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(left, right)));
+		unsigned hits = same ? equal : (~equal & 0xFFFFu);
+		if (hits) return i + lowest_set_bit(hits);
+	}
+#endif
+	for (; i < size; i++) {
+		if ((a[i] == b[i]) == same) return i;
+	}
+	return size;
+}
+
+inline void hex_dump(std::ostream& os, Word start, const Byte* data, std::size_t length) {
+	os << std::hex << std::setfill('0');
+	for (std::size_t line = 0; line < length; line += 16) {
+		os << std::setw(4) << static_cast<int>((start + line) & 0xFFFF) << ": ";
+		std::size_t count = std::min<std::size_t>(16, length - line);
+		for (std::size_t i = 0; i < 16; i++) {
+			if (i < count) os << std::setw(2) << static_cast<int>(data[line + i]) << ' ';
+			else os << "   ";
+		}
+		os << ' ';
+		for (std::size_t i = 0; i < count; i++) {
+			Byte c = data[line + i];
+			os << static_cast<char>(c >= 0x20 && c < 0x7F ? c : '.');
+		}
+		os << std::endl;
+	}
+	os << std::setfill(' ');
+}
+
+// "a9??8d" -> bytes, with ?? as a wildcard that clears the mask
+inline void parse_hex_pattern(const std::string& str, std::vector<Byte>& pattern, std::vector<Byte>& mask) {
+	if (str.empty() || str.size() % 2 != 0) throw std::invalid_argument("pattern needs an even number of hex digits");
+	pattern.clear();
+	mask.clear();
+	for (std::size_t i = 0; i < str.size(); i += 2) {
+		std::string digits = str.substr(i, 2);
+		if (digits == "??") {
+			pattern.push_back(0);
+			mask.push_back(0);
+			continue;
+		}
+		std::size_t used = 0;
+		int value = std::stoi(digits, &used, 16);
+		if (used != 2) throw std::invalid_argument("bad hex digits '" + digits + "'");
+		pattern.push_back(static_cast<Byte>(value));
+		mask.push_back(0xFF);
+	}
+}
+
+inline void check_range(std::size_t start, std::size_t length) {
+	if (start + length > 0x10000) throw std::out_of_range("range runs past $FFFF");
+}
+
+// The `m` command. Throws on unparseable numbers like the other commands.
+inline void memory_command(const std::vector<std::string>& parts, MMU& mmu, SymbolTable& symbols, MemorySnapshot& snapshot, std::ostream& os) {
+	std::string action = parts.size() > 1 ? parts[1] : "";
+	auto arg = [&](std::size_t i) -> const std::string& {
+		if (i >= parts.size()) throw std::invalid_argument("missing argument for m " + action);
+		return parts[i];
+	};
+
+	if (action == "dump") {
+		Word start = resolve_address(arg(2), symbols);
+		std::size_t length = parts.size() > 3 ? static_cast<std::size_t>(parse_numeric_literal(parts[3])) : 256;
+		check_range(start, length);
+		std::vector<Byte> buffer(length);
+		memory_read(mmu, start, length, buffer.data());
+		hex_dump(os, start, buffer.data(), length);
+	}
+	else if (action == "fill") {
+		Word start = resolve_address(arg(2), symbols);
+		std::size_t length = static_cast<std::size_t>(parse_numeric_literal(arg(3)));
+		Byte value = static_cast<Byte>(parse_numeric_literal(arg(4)));
+		check_range(start, length);
+		memory_fill(mmu, start, length, value);
+		os << "Filled " << std::dec << length << " bytes at " << format_address(start, &symbols) << std::endl;
+	}
+	else if (action == "copy") {
+		Word source = resolve_address(arg(2), symbols);
+		Word destination = resolve_address(arg(3), symbols);
+		std::size_t length = static_cast<std::size_t>(parse_numeric_literal(arg(4)));
+		check_range(source, length);
+		check_range(destination, length);
+		memory_copy(mmu, source, destination, length);
+		os << "Copied " << std::dec << length << " bytes to " << format_address(destination, &symbols) << std::endl;
+	}
+	else if (action == "load") {
+		Word start = resolve_address(arg(3), symbols);
+		std::ifstream file(arg(2), std::ios::binary);
+		if (!file) {
+			os << "Could not open '" << parts[2] << "'" << std::endl;
+			return;
+		}
+		std::vector<Byte> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		check_range(start, data.size());
+		memory_write(mmu, start, data.data(), data.size());
+		os << "Loaded " << std::dec << data.size() << " bytes at " << format_address(start, &symbols) << std::endl;
+	}
+	else if (action == "save") {
+		Word start = resolve_address(arg(3), symbols);
+		std::size_t length = static_cast<std::size_t>(parse_numeric_literal(arg(4)));
+		check_range(start, length);
+		std::vector<Byte> buffer(length);
+		memory_read(mmu, start, length, buffer.data());
+		std::ofstream file(arg(2), std::ios::binary);
+		if (!file.write(reinterpret_cast<const char*>(buffer.data()), static_cast<std::streamsize>(length))) {
+			os << "Could not write '" << parts[2] << "'" << std::endl;
+			return;
+		}
+		os << "Saved " << std::dec << length << " bytes to '" << parts[2] << "'" << std::endl;
+	}
+	else if (action == "find") {
+		std::vector<Byte> pattern, mask;
+		parse_hex_pattern(arg(2), pattern, mask);
+		if (parts.size() > 3) {
+			std::vector<Byte> explicit_mask, unused;
+			parse_hex_pattern(parts[3], explicit_mask, unused);
+			if (explicit_mask.size() != pattern.size()) throw std::invalid_argument("mask and pattern lengths differ");
+			for (std::size_t i = 0; i < mask.size(); i++) mask[i] &= explicit_mask[i];
+		}
+
+		MemorySnapshot now;
+		now.take(mmu);
+		std::size_t found = 0;
+		const std::size_t shown_limit = 64;
+		for (std::size_t at = 0; (at = find_pattern(now.bytes.data(), now.bytes.size(), pattern.data(), mask.data(), pattern.size(), at)) < now.bytes.size(); at++) {
+			// Matches touching a page that wasn't read don't count
+			if (!now.readable[at >> 8] || !now.readable[(at + pattern.size() - 1) >> 8]) continue;
+			if (found < shown_limit) os << format_address(static_cast<Word>(at), &symbols) << std::endl;
+			found++;
+		}
+		os << std::dec << found << " matches" << (found > shown_limit ? " (first 64 shown)" : "") << std::endl;
+	}
+	else if (action == "snap") {
+		snapshot.take(mmu);
+		os << "Snapshot taken." << std::endl;
+	}
+	else if (action == "diff") {
+		MemorySnapshot before;
+		if (parts.size() > 2) {
+			if (!before.load(parts[2])) {
+				os << "Could not open '" << parts[2] << "'" << std::endl;
+				return;
+			}
+		}
+		else if (snapshot.empty()) {
+			os << "No snapshot taken yet, use m snap." << std::endl;
+			return;
+		}
+		else {
+			before = snapshot;
+		}
+
+		MemorySnapshot now;
+		now.take(mmu);
+		std::size_t changed = 0, runs = 0;
+		const std::size_t shown_limit = 32;
+		std::size_t at = 0;
+		while ((at = find_mismatch(before.bytes.data(), now.bytes.data(), 65536, at)) < 65536) {
+			std::size_t end = find_mismatch(before.bytes.data(), now.bytes.data(), 65536, at, true);
+			if (!before.readable[at >> 8] || !now.readable[at >> 8]) {
+				at = ((at >> 8) + 1) << 8;
+				continue;
+			}
+			end = std::min(end, ((at >> 8) + 1) << 8); // Runs are split at pages so skipped ones stay out
+			if (runs < shown_limit) {
+				os << std::hex << std::setfill('0') << std::setw(4) << at << "-" << std::setw(4) << end - 1 << " ";
+				for (std::size_t i = at; i < end && i < at + 8; i++) os << " " << std::setw(2) << (int)before.bytes[i];
+				os << (end - at > 8 ? " ..." : "") << "  ->";
+				for (std::size_t i = at; i < end && i < at + 8; i++) os << " " << std::setw(2) << (int)now.bytes[i];
+				os << (end - at > 8 ? " ..." : "") << std::setfill(' ') << std::endl;
+			}
+			changed += end - at;
+			runs++;
+			at = end;
+		}
+		os << std::dec << changed << " bytes differ in " << runs << " runs"
+			<< (runs > shown_limit ? " (first 32 shown)" : "") << std::endl;
+	}
+	else {
+		os << "Usage: m dump <addr> [len] | fill <addr> <len> <byte> | copy <src> <dst> <len>" << std::endl
+			<< "         load <file> <addr> | save <file> <addr> <len> | find <hex, ?? = any> [mask]" << std::endl
+			<< "         snap | diff [file]" << std::endl;
+	}
+}
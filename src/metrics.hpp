@@ -0,0 +1,321 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#ifndef _WIN32
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#include "types.hpp"
+#include "cpu.hpp"
+#include "recompiler.hpp"
+
+// Rough groups of instructions for the instruction mix
+enum InstructionClass {
+	INSTRUCTION_LOAD_STORE,
+	INSTRUCTION_ARITHMETIC, // ADC, SBC, increments and decrements
+	INSTRUCTION_LOGIC,      // AND, ORA, EOR, BIT
+	INSTRUCTION_SHIFT,
+	INSTRUCTION_COMPARE,
+	INSTRUCTION_BRANCH,
+	INSTRUCTION_JUMP,       // JMP, JSR, RTS, RTI, BRK
+	INSTRUCTION_STACK,
+	INSTRUCTION_TRANSFER,
+	INSTRUCTION_FLAG,
+	INSTRUCTION_OTHER,      // NOP and anything undocumented
+	INSTRUCTION_CLASS_COUNT
+};
+
+static const char* const instruction_class_names[INSTRUCTION_CLASS_COUNT] = {
+	"load_store", "arithmetic", "logic", "shift", "compare", "branch", "jump", "stack", "transfer", "flag", "other"
+};
+
+inline InstructionClass classify_mnemonic(const std::string& name) {
+	static const struct { const char* names; InstructionClass type; } groups[] = {
+		{ "LDA LDX LDY STA STX STY", INSTRUCTION_LOAD_STORE },
+		{ "ADC SBC INC DEC INX INY DEX DEY", INSTRUCTION_ARITHMETIC },
+		{ "AND ORA EOR BIT", INSTRUCTION_LOGIC },
+		{ "ASL LSR ROL ROR", INSTRUCTION_SHIFT },
+		{ "CMP CPX CPY", INSTRUCTION_COMPARE },
+		{ "BCC BCS BEQ BNE BMI BPL BVC BVS", INSTRUCTION_BRANCH },
+		{ "JMP JSR RTS RTI BRK", INSTRUCTION_JUMP },
+		{ "PHA PHP PLA PLP", INSTRUCTION_STACK },
+		{ "TAX TAY TXA TYA TSX TXS", INSTRUCTION_TRANSFER },
+		{ "CLC CLD CLI CLV SEC SED SEI", INSTRUCTION_FLAG },
+	};
+	for (const auto& group : groups) {
+		if (std::strstr(group.names, name.c_str())) return group.type;
+	}
+	return INSTRUCTION_OTHER;
+}
+
+// Counters for a long-running process, read by MetricsExporter. Nothing
+// here is touched per instruction: whoever runs the CPU calls publish() at
+// the points where it checks for a pause anyway (every 1024 instructions in
+// the background, every chunk of a --bench run). The instruction mix is
+// sampled from the CPU's instruction history at those points.
+class Metrics {
+public:
+	// Adds up accesses to devices (mappers, shared pages, host calls). Runs
+	// on the thread that publishes.
+	std::function<unsigned long()> count_device_accesses;
+
+	std::atomic<unsigned long> cycles{0};
+	std::atomic<unsigned long> instructions{0};
+	std::atomic<unsigned long> breakpoint_hits{0};
+	std::atomic<unsigned long> watchpoint_hits{0};
+	std::atomic<unsigned long> device_accesses{0};
+	std::atomic<unsigned long> states_saved{0};
+	std::atomic<unsigned long> states_loaded{0};
+	std::atomic<unsigned long> mix[INSTRUCTION_CLASS_COUNT];
+
+	Metrics() {
+		for (std::atomic<unsigned long>& count : mix) count.store(0, std::memory_order_relaxed);
+		for (int i = 0; i < 256; i++) classes[i] = INSTRUCTION_OTHER;
+		for (const RecompilerOpcode& op : recompiler_opcodes) classes[op.opcode] = classify_mnemonic(op.name);
+	}
+
+	void publish(const CPU& cpu) {
+		unsigned long total = cpu.instruction_count;
+		std::size_t new_instructions = static_cast<std::size_t>(std::min<unsigned long>(total - sampled_up_to, CPU_HISTORY_SIZE));
+		for (unsigned long i = total - new_instructions; i < total; i++) {
+			mix[classes[cpu.history[i & (CPU_HISTORY_SIZE - 1)].opcode]].fetch_add(1, std::memory_order_relaxed);
+		}
+		sampled_up_to = total;
+
+		unsigned long hits = 0;
+		for (const Breakpoint& breakpoint : cpu.breakpoints) hits += breakpoint.hits;
+		breakpoint_hits.store(hits, std::memory_order_relaxed);
+		hits = 0;
+		for (const Watchpoint& watchpoint : cpu.watchpoints) hits += watchpoint.hits;
+		watchpoint_hits.store(hits, std::memory_order_relaxed);
+		if (count_device_accesses) device_accesses.store(count_device_accesses(), std::memory_order_relaxed);
+		cycles.store(cpu.cycle_count, std::memory_order_relaxed);
+		instructions.store(total, std::memory_order_relaxed);
+	}
+
+private:
+	InstructionClass classes[256];
+	unsigned long sampled_up_to = 0;
+};
+
+struct MetricsConfig {
+	std::string file;   // Rewritten every interval
+	std::string socket; // Unix socket, every connection gets the current metrics
+	unsigned long interval_ms = 1000;
+
+	bool enabled() const {
+		return !file.empty() || !socket.empty();
+	}
+};
+
+// Turns Metrics into Prometheus text format on a thread of its own, at the
+// configured interval. The file is written next to the target and renamed
+// over it, so readers never see half of it. Socket clients can just read
+// (socat, nc -U) or send an HTTP request (curl --unix-socket).
+class MetricsExporter {
+public:
+	MetricsExporter(const MetricsConfig& metrics_config, const Metrics& source) : config(metrics_config), metrics(source) {}
+
+	~MetricsExporter() {
+		stop();
+	}
+
+	bool start(std::ostream& log) {
+		started = std::chrono::steady_clock::now();
+		last_tick = started;
+		last_cycles = metrics.cycles.load(std::memory_order_relaxed);
+		first_cycles = last_cycles;
+#ifndef _WIN32
+		if (!config.socket.empty() && !listen_on(config.socket, log)) return false;
+#else
+		if (!config.socket.empty()) {
+			log << "Metrics sockets need unix sockets, which this platform doesn't have." << std::endl;
+			return false;
+		}
+#endif
+		worker = std::thread([this]() { run(); });
+		return true;
+	}
+
+	void stop() {
+		if (!worker.joinable()) return;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		worker.join();
+		tick();
+		if (!config.file.empty()) write_file();
+#ifndef _WIN32
+		if (listener >= 0) {
+			close(listener);
+			unlink(config.socket.c_str());
+			listener = -1;
+		}
+#endif
+	}
+
+	// The current metrics in Prometheus text format
+	std::string render() const {
+		unsigned long total_cycles = metrics.cycles.load(std::memory_order_relaxed);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+		double average_mhz = seconds > 0 ? static_cast<double>(total_cycles - first_cycles) / seconds / 1e6 : 0.0;
+
+		std::ostringstream out;
+		out << std::fixed << std::setprecision(3);
+		counter(out, "ya6502_cycles_total", "Emulated cycles", total_cycles);
+		counter(out, "ya6502_instructions_total", "Executed instructions", metrics.instructions.load(std::memory_order_relaxed));
+		out << "# HELP ya6502_emulated_mhz Emulated clock over the last interval\n# TYPE ya6502_emulated_mhz gauge\n"
+			<< "ya6502_emulated_mhz " << current_mhz.load(std::memory_order_relaxed) << "\n";
+		out << "# HELP ya6502_emulated_mhz_average Emulated clock since the exporter started\n# TYPE ya6502_emulated_mhz_average gauge\n"
+			<< "ya6502_emulated_mhz_average " << average_mhz << "\n";
+		out << "# HELP ya6502_instruction_mix_samples_total Sampled instructions by class\n# TYPE ya6502_instruction_mix_samples_total counter\n";
+		for (int i = 0; i < INSTRUCTION_CLASS_COUNT; i++) {
+			out << "ya6502_instruction_mix_samples_total{class=\"" << instruction_class_names[i] << "\"} "
+				<< metrics.mix[i].load(std::memory_order_relaxed) << "\n";
+		}
+		counter(out, "ya6502_breakpoint_hits_total", "Times breakpoint addresses were reached", metrics.breakpoint_hits.load(std::memory_order_relaxed));
+		counter(out, "ya6502_watchpoint_hits_total", "Times watched addresses were accessed", metrics.watchpoint_hits.load(std::memory_order_relaxed));
+		counter(out, "ya6502_device_accesses_total", "Mapper register writes, shared page accesses and host calls", metrics.device_accesses.load(std::memory_order_relaxed));
+		out << "# HELP ya6502_save_states_total Save states written and read\n# TYPE ya6502_save_states_total counter\n"
+			<< "ya6502_save_states_total{operation=\"save\"} " << metrics.states_saved.load(std::memory_order_relaxed) << "\n"
+			<< "ya6502_save_states_total{operation=\"load\"} " << metrics.states_loaded.load(std::memory_order_relaxed) << "\n";
+		return out.str();
+	}
+
+private:
+	const MetricsConfig& config;
+	const Metrics& metrics;
+	std::thread worker;
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool stopping = false;
+	std::chrono::steady_clock::time_point started;
+	std::chrono::steady_clock::time_point last_tick;
+	unsigned long first_cycles = 0;
+	unsigned long last_cycles = 0;
+	std::atomic<double> current_mhz{0.0};
+#ifndef _WIN32
+	int listener = -1;
+#endif
+
+	static void counter(std::ostream& out, const char* name, const char* help, unsigned long value) {
+		out << "# HELP " << name << " " << help << "\n# TYPE " << name << " counter\n" << name << " " << value << "\n";
+	}
+
+	void tick() {
+		auto now = std::chrono::steady_clock::now();
+		unsigned long total_cycles = metrics.cycles.load(std::memory_order_relaxed);
+		double seconds = std::chrono::duration<double>(now - last_tick).count();
+		if (seconds > 0) current_mhz.store(static_cast<double>(total_cycles - last_cycles) / seconds / 1e6, std::memory_order_relaxed);
+		last_tick = now;
+		last_cycles = total_cycles;
+	}
+
+	void run() {
+		std::unique_lock<std::mutex> lock(mutex);
+		auto next = std::chrono::steady_clock::now();
+		while (!stopping) {
+			next += std::chrono::milliseconds(config.interval_ms);
+			// Socket clients are answered as they come in, the rest waits for
+			// the next tick
+			while (!stopping && std::chrono::steady_clock::now() < next) {
+#ifndef _WIN32
+				if (listener >= 0) {
+					lock.unlock();
+					serve_clients(next);
+					lock.lock();
+					continue;
+				}
+#endif
+				wake.wait_until(lock, next);
+			}
+			if (stopping) break;
+			tick();
+			if (!config.file.empty()) write_file();
+		}
+	}
+
+	void write_file() const {
+		std::string temporary = config.file + ".tmp";
+		std::FILE* file = std::fopen(temporary.c_str(), "wb");
+		if (!file) return;
+		std::string text = render();
+		bool written = std::fwrite(text.data(), 1, text.size(), file) == text.size();
+		written = std::fclose(file) == 0 && written;
+		if (written) std::rename(temporary.c_str(), config.file.c_str());
+	}
+
+#ifndef _WIN32
+	bool listen_on(const std::string& path, std::ostream& log) {
+		listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		sockaddr_un address;
+		std::memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		if (listener < 0 || path.size() >= sizeof(address.sun_path)) {
+			log << "Could not create socket '" << path << "'" << std::endl;
+			return false;
+		}
+		std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+		unlink(path.c_str());
+		if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 16) != 0) {
+			log << "Could not listen on '" << path << "': " << std::strerror(errno) << std::endl;
+			close(listener);
+			listener = -1;
+			return false;
+		}
+		log << "Serving metrics on '" << path << "'" << std::endl;
+		return true;
+	}
+
+	// Answers connections until the deadline, checking for stop() every
+	// 100 ms
+	void serve_clients(std::chrono::steady_clock::time_point deadline) {
+		auto now = std::chrono::steady_clock::now();
+		long wait_ms = static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count());
+		pollfd waiting = { listener, POLLIN, 0 };
+		if (poll(&waiting, 1, static_cast<int>(std::max(0L, std::min(wait_ms, 100L)))) <= 0) return;
+		int connection = accept(listener, nullptr, nullptr);
+		if (connection < 0) return;
+
+		// HTTP clients get a response header, anything that doesn't say
+		// anything within 50 ms gets the bare text
+		std::string reply = render();
+		pollfd request = { connection, POLLIN, 0 };
+		char buffer[512];
+		if (poll(&request, 1, 50) > 0) {
+			ssize_t got = read(connection, buffer, sizeof(buffer));
+			if (got >= 4 && std::memcmp(buffer, "GET ", 4) == 0) {
+				reply = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+					+ std::to_string(reply.size()) + "\r\n\r\n" + reply;
+			}
+		}
+		const char* out = reply.data();
+		std::size_t left = reply.size();
+		while (left > 0) {
+			ssize_t sent = send(connection, out, left, MSG_NOSIGNAL);
+			if (sent < 0 && errno == EINTR) continue;
+			if (sent <= 0) break;
+			out += sent;
+			left -= static_cast<std::size_t>(sent);
+		}
+		close(connection);
+	}
+#endif
+};
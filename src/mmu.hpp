@@ -0,0 +1,93 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include "types.hpp"
+#include "helpers.hpp"
+#include "page.hpp"
+#include "rampage.cpp"
+
+struct MMU {
+	// The page table. Normally entry n is RAM page n, but a page can be
+	// replaced by one the MMU owns (owned_pages[n]), mapped in several places
+	// (mirrors) or belong to someone else, like a bank-switching mapper.
+	MemoryPage* pages[256];
+	std::unique_ptr<MemoryPage> owned_pages[256];
+	std::unique_ptr<RAMPages> ram;
+
+	// All 64K starts out as blank RAM, which only takes up memory once it's
+	// written to. Given backing (64K, zeroed), RAM is kept there instead.
+	void initialize(Byte* backing = nullptr) {
+		ram = std::make_unique<RAMPages>(backing);
+		for (int i = 0; i < 256; i++) {
+			owned_pages[i].reset();
+			pages[i] = &ram->pages[static_cast<std::size_t>(i)];
+		}
+	}
+
+	// RAM pages that have been written to and have their own storage
+	std::size_t ram_pages_in_use() const {
+		if (!ram) return 0;
+		return ram->backing ? 256 : ram->arena.pages_allocated();
+	}
+
+	// Sets a page of plain memory to the given 256 bytes. Pages that already
+	// hold them aren't touched, so blank pages stay blank.
+	void load_page(Byte page_num, const Byte* data) {
+		const Byte* current = pages[page_num]->read_data();
+		if (current && std::memcmp(current, data, 256) == 0) return;
+		Byte* raw = pages[page_num]->raw_data();
+		if (raw) std::memcpy(raw, data, 256);
+	}
+
+	// Replaces page n with one the MMU takes ownership of
+	void install_page(Byte page_num, std::unique_ptr<MemoryPage> page) {
+		owned_pages[page_num] = std::move(page);
+		pages[page_num] = owned_pages[page_num].get();
+	}
+
+	// Points page n at a page that lives somewhere else. It has to outlive
+	// the mapping.
+	void map_page(Byte page_num, MemoryPage* page) {
+		pages[page_num] = page;
+	}
+
+	// Copies data to memory from $0000 up. RAM is filled a page at a time, so
+	// pages that would only get zeros stay blank. Anything else gets the
+	// bytes written one by one.
+	void load_image(const Byte* data, std::size_t length) {
+		length = std::min<std::size_t>(length, 65536);
+		for (std::size_t start = 0; start < length; start += 256) {
+			Byte page_num = static_cast<Byte>(start >> 8);
+			std::size_t count = std::min<std::size_t>(256, length - start);
+			if (dynamic_cast<RAMPage*>(pages[page_num])) {
+				Byte buffer[256];
+				std::memcpy(buffer, pages[page_num]->read_data(), 256);
+				std::memcpy(buffer, data + start, count);
+				load_page(page_num, buffer);
+				continue;
+			}
+			for (std::size_t i = start; i < start + count; i++) write_byte(static_cast<Word>(i), data[i]);
+		}
+	}
+
+	Byte read_byte(Word address) {
+		Byte page_num = hi(address);
+		Byte page_addr = lo(address);
+		return pages[page_num]->read_byte(page_addr);
+	}
+
+	void write_byte(Word address, Byte value) {
+		Byte page_num = hi(address);
+		Byte page_addr = lo(address);
+		pages[page_num]->write_byte(page_addr, value);
+	}
+
+	Word read_word(Word address) {
+		// Little-endian
+		Word byte_lo = widen(read_byte(address));
+		Word byte_hi = widen(read_byte(address + 1)) << 8;
+		return byte_lo | byte_hi;
+	}
+};
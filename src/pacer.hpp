@@ -0,0 +1,150 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+static constexpr double NMOS_CLOCK_HZ = 1000000.0;
+static constexpr double NES_CLOCK_HZ = 1789773.0;
+
+// Falling behind by more than this (the host is too slow, or we were paused
+// in the monitor) starts over from the current time instead of running flat
+// out to catch up
+static constexpr double PACER_MAX_LAG_SECONDS = 0.25;
+static constexpr long PACER_SPIN_MICROSECONDS = 200;
+
+// "nmos", "nes" or a speed in MHz like "1.5"
+inline double parse_clock_rate(const std::string& text) {
+	if (text == "nmos" || text == "NMOS") return NMOS_CLOCK_HZ;
+	if (text == "nes" || text == "NES") return NES_CLOCK_HZ;
+	std::size_t end = 0;
+	double mhz = std::stod(text, &end);
+	if (end != text.size() || !(mhz > 0)) {
+		throw std::invalid_argument("'" + text + "' is not a clock speed");
+	}
+	return mhz * 1e6;
+}
+
+// Keeps emulation at a real-world clock speed. The CPU runs flat out for a
+// slice of cycles (a frame by default), then the pacer waits until the wall
+// clock catches up: it sleeps for most of the gap and spins for the last bit,
+// since sleeps tend to oversleep. Targets come from the total cycle count, so
+// small errors don't add up.
+class Pacer {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	void start(double clock_hz, unsigned long slice, unsigned long cycle_count) {
+		hz = clock_hz;
+		slice_cycles = slice > 0 ? slice : static_cast<unsigned long>(hz / 60);
+		if (slice_cycles == 0) slice_cycles = 1;
+		slices = late_slices = resyncs = waits = 0;
+		busy_seconds = paced_seconds = 0;
+		wake_sum = wake_sum_sq = wake_max = 0;
+		drift = 0;
+		rebase(cycle_count);
+	}
+
+	void stop() {
+		hz = 0;
+	}
+
+	bool is_active() const {
+		return hz > 0;
+	}
+
+	// Call between instructions while running; it only does anything at
+	// the end of a slice
+	void pace(unsigned long cycle_count) {
+		if (hz <= 0 || cycle_count < next_boundary) return;
+
+		Clock::time_point now = Clock::now();
+		double busy = seconds(now - slice_started);
+		double emulated = static_cast<double>(cycle_count - origin_cycles) / hz;
+		Clock::time_point target = origin + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(emulated));
+		if (seconds(now - target) > PACER_MAX_LAG_SECONDS) {
+			resyncs++;
+			rebase(cycle_count);
+			return;
+		}
+
+		slices++;
+		busy_seconds += busy;
+		paced_seconds += static_cast<double>(cycle_count - slice_start_cycles) / hz;
+		if (now < target) {
+			wait_until(target);
+			now = Clock::now();
+			double late = seconds(now - target);
+			waits++;
+			wake_sum += late;
+			wake_sum_sq += late * late;
+			if (late > wake_max) wake_max = late;
+		}
+		else {
+			late_slices++;
+		}
+		drift = emulated - seconds(now - origin);
+
+		slice_started = now;
+		slice_start_cycles = cycle_count;
+		next_boundary = cycle_count + slice_cycles;
+	}
+
+	void report(std::ostream& os) const {
+		if (hz <= 0) {
+			os << "Running unthrottled." << std::endl;
+			return;
+		}
+		double mean = waits > 0 ? wake_sum / static_cast<double>(waits) : 0;
+		double variance = waits > 0 ? wake_sum_sq / static_cast<double>(waits) - mean * mean : 0;
+		os << std::dec << std::fixed << std::setprecision(3)
+			<< "Pacing at " << hz / 1e6 << " MHz in slices of " << slice_cycles << " cycles ("
+			<< static_cast<double>(slice_cycles) / hz * 1e3 << " ms)" << std::endl
+			<< "Slices: " << slices << ", " << late_slices << " finished late, " << resyncs << " resyncs" << std::endl
+			<< "Drift: " << drift * 1e3 << " ms ahead of the wall clock" << std::endl
+			<< "Wake-up jitter: mean " << mean * 1e6 << " us, stddev " << std::sqrt(variance > 0 ? variance : 0) * 1e6
+			<< " us, max " << wake_max * 1e6 << " us" << std::endl
+			<< "Headroom: " << (busy_seconds > 0 ? paced_seconds / busy_seconds : 0.0) << "x real time" << std::endl;
+		os.unsetf(std::ios::fixed);
+	}
+
+private:
+	double hz = 0;
+	unsigned long slice_cycles = 0;
+	Clock::time_point origin;
+	unsigned long origin_cycles = 0;
+	Clock::time_point slice_started;
+	unsigned long slice_start_cycles = 0;
+	unsigned long next_boundary = 0;
+
+	unsigned long slices = 0;
+	unsigned long late_slices = 0;
+	unsigned long resyncs = 0;
+	unsigned long waits = 0;
+	double busy_seconds = 0;   // Wall time spent emulating
+	double paced_seconds = 0;  // Emulated time covered by the same slices
+	double wake_sum = 0;
+	double wake_sum_sq = 0;
+	double wake_max = 0;
+	double drift = 0;
+
+	static double seconds(Clock::duration duration) {
+		return std::chrono::duration<double>(duration).count();
+	}
+
+	void rebase(unsigned long cycle_count) {
+		origin = slice_started = Clock::now();
+		origin_cycles = slice_start_cycles = cycle_count;
+		next_boundary = cycle_count + slice_cycles;
+	}
+
+	static void wait_until(Clock::time_point target) {
+		Clock::time_point wake = target - std::chrono::microseconds(PACER_SPIN_MICROSECONDS);
+		if (Clock::now() < wake) std::this_thread::sleep_until(wake);
+		while (Clock::now() < target) {}
+	}
+};
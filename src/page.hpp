@@ -8,4 +8,16 @@ public:
 
 	virtual Byte read_byte(Byte address) const = 0;
 	virtual void write_byte(Byte address, Byte value) = 0;
+
+	// Pages backed by plain memory hand out their 256 bytes so they can be
+	// copied in bulk. Anything with side effects on access returns nullptr.
+	virtual Byte* raw_data() { return nullptr; }
+
+	// Pages where reading is just an array lookup hand out a read-only view,
+	// even if writes do something else (like bank-switched ROM)
+	virtual const Byte* read_data() const { return nullptr; }
+
+	// True for pages something other than this CPU can change, e.g. memory
+	// shared with another processor. Loops that poll them are never skipped.
+	virtual bool is_volatile() const { return false; }
 };
\ No newline at end of file
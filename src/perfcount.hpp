@@ -0,0 +1,160 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+enum PerfCounter {
+	PERF_HOST_CYCLES,
+	PERF_HOST_INSTRUCTIONS,
+	PERF_BRANCH_MISSES,
+	PERF_L1D_MISSES,
+	PERF_COUNTER_COUNT
+};
+
+static const char* const perf_counter_names[PERF_COUNTER_COUNT] = {
+	"cycles", "instructions", "branch misses", "L1D read misses"
+};
+
+// Host hardware counters around a benchmark run, through perf_event_open.
+// Each counter is opened on its own so one the machine doesn't have (common
+// in VMs) doesn't take the rest down with it. Counts get scaled up if the
+// kernel had to multiplex them.
+class PerfCounters {
+public:
+	PerfCounters() {
+		for (int& fd : fds) fd = -1;
+	}
+
+	~PerfCounters() {
+		close_all();
+	}
+
+	PerfCounters(const PerfCounters&) = delete;
+	PerfCounters& operator=(const PerfCounters&) = delete;
+
+	// True if at least one counter could be opened, otherwise error() says why
+	bool open() {
+#ifdef __linux__
+		static const uint32_t types[PERF_COUNTER_COUNT] = {
+			PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE
+		};
+		static const uint64_t configs[PERF_COUNTER_COUNT] = {
+			PERF_COUNT_HW_CPU_CYCLES,
+			PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_BRANCH_MISSES,
+			PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+		};
+
+		bool any = false;
+		for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+			perf_event_attr attr;
+			std::memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = types[i];
+			attr.config = configs[i];
+			attr.disabled = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.inherit = 1; // Count threads started during the run too
+			attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+			fds[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+			if (fds[i] >= 0) {
+				any = true;
+			}
+			else if (failure.empty()) {
+				failure = std::string(perf_counter_names[i]) + ": " + std::strerror(errno);
+				if (errno == EACCES || errno == EPERM) failure += " (check /proc/sys/kernel/perf_event_paranoid)";
+			}
+		}
+		return any;
+#else
+		failure = "perf_event_open is Linux-only";
+		return false;
+#endif
+	}
+
+	void start() {
+#ifdef __linux__
+		for (int fd : fds) {
+			if (fd < 0) continue;
+			ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+#endif
+	}
+
+	void stop() {
+#ifdef __linux__
+		for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+			valid[i] = false;
+			if (fds[i] < 0) continue;
+			ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+			uint64_t data[3];
+			if (read(fds[i], data, sizeof(data)) != static_cast<ssize_t>(sizeof(data)) || data[2] == 0) continue;
+			double scale = static_cast<double>(data[1]) / static_cast<double>(data[2]);
+			counts[i] = static_cast<double>(data[0]) * scale;
+			valid[i] = true;
+		}
+#endif
+	}
+
+	bool has(PerfCounter counter) const {
+		return valid[counter];
+	}
+
+	double count(PerfCounter counter) const {
+		return counts[counter];
+	}
+
+	const std::string& error() const {
+		return failure;
+	}
+
+	// Per emulated instruction numbers, which say whether dispatch is bound
+	// by branch mispredictions or by memory
+	void report(std::ostream& os, unsigned long emulated_instructions) const {
+		bool any = false;
+		for (bool v : valid) any = any || v;
+		if (!any) {
+			os << "Hardware counters unavailable" << (failure.empty() ? "" : ": " + failure) << std::endl;
+			return;
+		}
+
+		double per = emulated_instructions > 0 ? 1.0 / static_cast<double>(emulated_instructions) : 0;
+		os << std::dec << std::fixed << std::setprecision(2) << "Host counters per emulated instruction:" << std::endl;
+		for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+			os << "  " << std::left << std::setw(18) << perf_counter_names[i] << std::right;
+			if (valid[i]) os << counts[i] * per << std::endl;
+			else os << "unavailable" << std::endl;
+		}
+		if (valid[PERF_HOST_CYCLES] && valid[PERF_HOST_INSTRUCTIONS] && counts[PERF_HOST_CYCLES] > 0) {
+			os << "  host IPC          " << counts[PERF_HOST_INSTRUCTIONS] / counts[PERF_HOST_CYCLES] << std::endl;
+		}
+		os.unsetf(std::ios::fixed);
+	}
+
+private:
+	int fds[PERF_COUNTER_COUNT];
+	bool valid[PERF_COUNTER_COUNT] = {};
+	double counts[PERF_COUNTER_COUNT] = {};
+	std::string failure;
+
+	void close_all() {
+#ifdef __linux__
+		for (int& fd : fds) {
+			if (fd >= 0) close(fd);
+			fd = -1;
+		}
+#endif
+	}
+};
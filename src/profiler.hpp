@@ -0,0 +1,313 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "types.hpp"
+#include "cpu.hpp"
+#include "symbols.hpp"
+
+// Builds a call graph from JSR/RTS and BRK/RTI by keeping a shadow call stack.
+// Frames are tied to the stack pointer at the time of the call rather than
+// matched up one RTS per JSR, so code that pushes an address and RTSes to it
+// (a jump, not a return) or drops its return address with PLA/PLA and
+// returns straight to its caller's caller doesn't throw the model off.
+class CallProfiler {
+public:
+	void start(const CPU& cpu) {
+		frames.clear();
+		nodes.clear();
+		node_index.clear();
+		functions.clear();
+		edges.clear();
+		events.clear();
+		dropped_events = 0;
+		active_depth.assign(65536, 0);
+
+		nodes.push_back({ 0, ROOT_FUNCTION, 0 });
+		frames.push_back({ ROOT_FUNCTION, 0, ROOT_SP, 0, cpu.cycle_count, 0, false });
+		start_cycle = cpu.cycle_count;
+		seen_instructions = cpu.instruction_count;
+		active = true;
+	}
+
+	void stop() {
+		active = false;
+	}
+
+	bool is_active() const {
+		return active;
+	}
+
+	// Call after every exec_instruction while active
+	void observe(const CPU& cpu) {
+		if (cpu.instruction_count == seen_instructions) return; // Nothing ran, e.g. a breakpoint
+		seen_instructions = cpu.instruction_count;
+		const HistoryEntry& entry = cpu.history[(cpu.instruction_count - 1) & (CPU_HISTORY_SIZE - 1)];
+
+		switch (entry.opcode) {
+			case 0x20: // JSR
+			call(entry.SP, entry.PC, cpu.PC, false, cpu.cycle_count);
+			break;
+			case 0x00: // BRK
+			call(entry.SP, entry.PC, cpu.PC, true, cpu.cycle_count);
+			break;
+			case 0x60: // RTS
+			case 0x40: // RTI
+			case 0x9A: // TXS
+			unwind(cpu.SP, cpu.cycle_count);
+			break;
+			default: break;
+		}
+	}
+
+	// Interrupts don't go through an opcode, whoever raises one reports it here
+	void interrupt(Byte sp_before, Word interrupted_pc, Word handler, unsigned long cycles) {
+		call(sp_before, interrupted_pc, handler, true, cycles);
+	}
+
+	void report(std::ostream& os, SymbolTable* symbols, unsigned long now, std::size_t limit = 20) const {
+		if (frames.empty()) {
+			os << "The call profiler has not been started." << std::endl;
+			return;
+		}
+		CallProfiler done = *this;
+		done.finish(now);
+
+		unsigned long total = now - start_cycle;
+		std::vector<std::pair<Word, FunctionStats>> sorted;
+		for (const auto& function : done.functions) sorted.push_back(function);
+		std::sort(sorted.begin(), sorted.end(), [](const std::pair<Word, FunctionStats>& a, const std::pair<Word, FunctionStats>& b) {
+			return a.second.exclusive > b.second.exclusive;
+		});
+
+		os << std::dec << std::setfill(' ') << "Profiled " << total << " cycles" << std::endl;
+		os << std::setw(12) << "exclusive" << std::setw(8) << "%" << std::setw(12) << "inclusive"
+			<< std::setw(10) << "calls" << "  function" << std::endl;
+		for (std::size_t i = 0; i < sorted.size() && i < limit; i++) {
+			const FunctionStats& stats = sorted[i].second;
+			double percent = total ? 100.0 * static_cast<double>(stats.exclusive) / static_cast<double>(total) : 0.0;
+			os << std::setw(12) << stats.exclusive << std::setw(8) << std::fixed << std::setprecision(2) << percent
+				<< std::setw(12) << stats.inclusive << std::setw(10) << stats.calls
+				<< "  " << name(sorted[i].first, symbols) << std::endl;
+		}
+
+		std::vector<std::pair<uint32_t, EdgeStats>> sorted_edges(done.edges.begin(), done.edges.end());
+		std::sort(sorted_edges.begin(), sorted_edges.end(), [](const std::pair<uint32_t, EdgeStats>& a, const std::pair<uint32_t, EdgeStats>& b) {
+			return a.second.inclusive > b.second.inclusive;
+		});
+		os << std::endl << std::setw(12) << "inclusive" << std::setw(10) << "calls" << "  caller -> callee" << std::endl;
+		for (std::size_t i = 0; i < sorted_edges.size() && i < limit; i++) {
+			const EdgeStats& stats = sorted_edges[i].second;
+			os << std::setw(12) << stats.inclusive << std::setw(10) << stats.calls << "  "
+				<< name(edge_caller(sorted_edges[i].first), symbols) << " -> "
+				<< name(edge_callee(sorted_edges[i].first), symbols) << std::endl;
+		}
+		os.unsetf(std::ios::fixed);
+	}
+
+	// One line per call stack with its exclusive cycles, the input format of
+	// flamegraph.pl and most other flame graph tools
+	bool write_folded(const std::string& path, SymbolTable* symbols, unsigned long now) const {
+		if (frames.empty()) return false;
+		std::ofstream out(path);
+		if (!out) return false;
+		CallProfiler done = *this;
+		done.finish(now);
+
+		for (std::size_t i = 0; i < done.nodes.size(); i++) {
+			if (done.nodes[i].exclusive == 0) continue;
+			std::vector<Word> stack;
+			for (std::size_t n = i; ; n = done.nodes[n].parent) {
+				stack.push_back(done.nodes[n].function);
+				if (n == 0) break;
+			}
+			for (std::size_t j = stack.size(); j-- > 0; ) {
+				out << name(stack[j], symbols) << (j > 0 ? ";" : " ");
+			}
+			out << std::dec << done.nodes[i].exclusive << '\n';
+		}
+		return true;
+	}
+
+	// Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev). Timestamps
+	// are emulated cycles, so "1 us" in the viewer is one cycle.
+	bool write_chrome_trace(const std::string& path, SymbolTable* symbols, unsigned long now) const {
+		if (frames.empty()) return false;
+		std::ofstream out(path);
+		if (!out) return false;
+		CallProfiler done = *this;
+		done.finish(now);
+
+		out << "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"timestamps\":\"emulated cycles\",\"dropped_events\":"
+			<< std::dec << done.dropped_events << "},\"traceEvents\":[\n";
+		bool first = true;
+		for (const CallEvent& event : done.events) {
+			if (!first) out << ",\n";
+			first = false;
+			out << "{\"name\":\"" << json_escape(name(event.function, symbols)) << "\",\"cat\":\""
+				<< (event.interrupt ? "interrupt" : "call") << "\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":"
+				<< event.start << ",\"dur\":" << event.duration << "}";
+		}
+		out << "\n]}\n";
+		return true;
+	}
+
+private:
+	static constexpr Word ROOT_FUNCTION = 0xFFFF;
+	static constexpr int ROOT_SP = 0x100; // Above anything SP can hold, so the root is never unwound
+	static constexpr std::size_t MAX_DEPTH = 256;
+	static constexpr std::size_t MAX_EVENTS = 1000000;
+
+	struct Frame {
+		Word function;
+		Word call_site;
+		int sp_at_call; // SP before the call pushed anything
+		uint32_t node;
+		unsigned long start;
+		unsigned long child_cycles;
+		bool interrupt;
+	};
+
+	// Node of the calling context tree, one per distinct call stack
+	struct Node {
+		uint32_t parent;
+		Word function;
+		unsigned long exclusive;
+	};
+
+	struct FunctionStats {
+		unsigned long calls = 0;
+		unsigned long inclusive = 0; // Outermost activations only, so recursion isn't counted twice
+		unsigned long exclusive = 0;
+	};
+
+	struct EdgeStats {
+		unsigned long calls = 0;
+		unsigned long inclusive = 0;
+	};
+
+	struct CallEvent {
+		Word function;
+		bool interrupt;
+		unsigned long start;
+		unsigned long duration;
+	};
+
+	bool active = false;
+	unsigned long start_cycle = 0;
+	unsigned long seen_instructions = 0;
+	std::vector<Frame> frames;
+	std::vector<Node> nodes;
+	std::unordered_map<uint64_t, uint32_t> node_index;
+	std::unordered_map<Word, FunctionStats> functions;
+	std::unordered_map<uint32_t, EdgeStats> edges;
+	std::vector<uint32_t> active_depth;
+	std::vector<CallEvent> events;
+	unsigned long dropped_events = 0;
+
+	static uint32_t edge_key(Word caller, Word callee) {
+		return (static_cast<uint32_t>(caller) << 16) | callee;
+	}
+
+	static Word edge_caller(uint32_t key) {
+		return static_cast<Word>(key >> 16);
+	}
+
+	static Word edge_callee(uint32_t key) {
+		return static_cast<Word>(key & 0xFFFF);
+	}
+
+	static std::string name(Word function, SymbolTable* symbols) {
+		if (function == ROOT_FUNCTION) return "(root)";
+		std::string label = symbols ? symbols->describe(function) : "";
+		if (!label.empty()) return label;
+		std::ostringstream oss;
+		oss << "$" << std::hex << std::setw(4) << std::setfill('0') << (int)function;
+		return oss.str();
+	}
+
+	static std::string json_escape(const std::string& str) {
+		std::string out;
+		for (char c : str) {
+			if (c == '"' || c == '\\') out += '\\';
+			out += c;
+		}
+		return out;
+	}
+
+	uint32_t child_node(uint32_t parent, Word function) {
+		uint64_t key = (static_cast<uint64_t>(parent) << 16) | function;
+		auto found = node_index.find(key);
+		if (found != node_index.end()) return found->second;
+		uint32_t id = static_cast<uint32_t>(nodes.size());
+		nodes.push_back({ parent, function, 0 });
+		node_index.emplace(key, id);
+		return id;
+	}
+
+	void call(Byte sp_before, Word call_site, Word target, bool interrupt, unsigned long cycles) {
+		// Frames whose return address is already gone (TXS, stack wrapped) are dead
+		unwind(sp_before, cycles);
+		if (frames.size() >= MAX_DEPTH) return;
+
+		const Frame& parent = frames.back();
+		Frame frame;
+		frame.function = target;
+		frame.call_site = call_site;
+		frame.sp_at_call = sp_before;
+		frame.node = child_node(parent.node, target);
+		frame.start = cycles;
+		frame.child_cycles = 0;
+		frame.interrupt = interrupt;
+
+		functions[target].calls++;
+		edges[edge_key(parent.function, target)].calls++;
+		active_depth[target]++;
+		frames.push_back(frame);
+	}
+
+	void unwind(Byte sp_now, unsigned long cycles) {
+		while (frames.size() > 1 && frames.back().sp_at_call <= sp_now) {
+			pop(cycles);
+		}
+	}
+
+	void pop(unsigned long cycles) {
+		Frame frame = frames.back();
+		frames.pop_back();
+
+		unsigned long inclusive = cycles - frame.start;
+		unsigned long exclusive = inclusive - frame.child_cycles;
+		frames.back().child_cycles += inclusive;
+		nodes[frame.node].exclusive += exclusive;
+
+		FunctionStats& stats = functions[frame.function];
+		stats.exclusive += exclusive;
+		if (--active_depth[frame.function] == 0) {
+			stats.inclusive += inclusive;
+			edges[edge_key(frames.back().function, frame.function)].inclusive += inclusive;
+		}
+
+		if (events.size() < MAX_EVENTS) {
+			events.push_back({ frame.function, frame.interrupt, frame.start, inclusive });
+		}
+		else {
+			dropped_events++;
+		}
+	}
+
+	// Closes every open frame, including the root, as if they all returned now
+	void finish(unsigned long now) {
+		while (frames.size() > 1) pop(now);
+		Frame& root = frames.back();
+		nodes[0].exclusive += (now - root.start) - root.child_cycles;
+		root.start = now;
+		root.child_cycles = 0;
+	}
+};
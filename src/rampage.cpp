@@ -1,22 +1,95 @@
-#include <algorithm>
-#include <array>
+#include <cstring>
+#include <memory>
+#include <vector>
 #include "types.hpp"
 #include "page.hpp"
 
-class RAMPage : public MemoryPage {
+// Every RAM page nobody has written to yet reads from this one
+inline const Byte* blank_page() {
+	alignas(64) static const Byte zeros[256] = {};
+	return zeros;
+}
+
+// Where RAM pages get their bytes once they're written to. Pages are carved
+// out of 4K chunks (16 pages) instead of being allocated one by one, and
+// nothing is freed until the arena goes away.
+class PageArena {
 public:
-	RAMPage() {
-		std::fill(data.begin(), data.end(), 0);
+	Byte* allocate() {
+		if (chunks.empty() || used == PAGES_PER_CHUNK) {
+			chunks.push_back(std::make_unique<Byte[]>(PAGES_PER_CHUNK * 256));
+			used = 0;
+		}
+		allocated++;
+		return chunks.back().get() + 256 * used++;
+	}
+
+	std::size_t pages_allocated() const {
+		return allocated;
 	}
 
+private:
+	static constexpr std::size_t PAGES_PER_CHUNK = 16;
+	std::vector<std::unique_ptr<Byte[]>> chunks;
+	std::size_t used = 0;
+	std::size_t allocated = 0;
+};
+
+// Zero-filled RAM that costs nothing until it's written. Reads go through
+// the shared blank page until the first write (or the first raw_data call,
+// since that hands out a writable pointer) gives the page its own copy.
+class RAMPage : public MemoryPage {
+public:
+	explicit RAMPage(PageArena& page_arena) : arena(&page_arena) {}
+
+	// Lives in storage someone else owns (see sharedmem.hpp) from the start
+	RAMPage(PageArena& page_arena, Byte* storage) : arena(&page_arena), view(storage), data(storage) {}
+
 	Byte read_byte(Byte address) const {
-		return data[address];
+		return view[address];
 	}
 
 	void write_byte(Byte address, Byte value) {
+		if (!data) materialize();
 		data[address] = value;
 	}
 
+	Byte* raw_data() {
+		if (!data) materialize();
+		return data;
+	}
+
+	const Byte* read_data() const {
+		return view;
+	}
+
 private:
-	std::array<Byte, 256> data;;
+	PageArena* arena;
+	const Byte* view = blank_page();
+	Byte* data = nullptr;
+
+	void materialize() {
+		data = arena->allocate();
+		std::memcpy(data, view, 256);
+		view = data;
+	}
+};
+
+// The RAM behind an MMU: a page object for every slot and the arena they
+// draw from. With backing, the pages are the 64K there instead, in order.
+struct RAMPages {
+	PageArena arena;
+	std::vector<RAMPage> pages;
+	Byte* backing;
+
+	explicit RAMPages(Byte* memory = nullptr) : backing(memory) {
+		pages.reserve(256);
+		for (std::size_t i = 0; i < 256; i++) {
+			if (backing) pages.emplace_back(arena, backing + 256 * i);
+			else pages.emplace_back(arena);
+		}
+	}
+
+	RAMPages(const RAMPages&) = delete;
+	RAMPages& operator=(const RAMPages&) = delete;
 };
@@ -0,0 +1,533 @@
+#pragma once
+
+#include <stdint.h>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "types.hpp"
+#include "helpers.hpp"
+#include "cpu.hpp"
+
+// Modes the CPU decodes by itself instead of through addr_mode_table
+static constexpr Byte RECOMPILER_MODE_IMPLIED = CPU_ADDR_MODE_INVALID;
+static constexpr Byte RECOMPILER_MODE_RELATIVE = 0x10;
+static constexpr Byte RECOMPILER_MODE_INDIRECT = 0x11;
+
+struct RecompilerOpcode {
+	Byte opcode;
+	const char* name;
+	Byte mode;
+};
+
+// The documented instructions. Anything else is left to the interpreter.
+static const RecompilerOpcode recompiler_opcodes[] = {
+	{ 0x69, "ADC", CPU_ADDR_MODE_IMM }, { 0x65, "ADC", CPU_ADDR_MODE_ZPG }, { 0x75, "ADC", CPU_ADDR_MODE_ZPX }, { 0x6D, "ADC", CPU_ADDR_MODE_ABS },
+	{ 0x7D, "ADC", CPU_ADDR_MODE_ABX }, { 0x79, "ADC", CPU_ADDR_MODE_ABY }, { 0x61, "ADC", CPU_ADDR_MODE_ZPX_IND }, { 0x71, "ADC", CPU_ADDR_MODE_ZPY_IND },
+	{ 0x29, "AND", CPU_ADDR_MODE_IMM }, { 0x25, "AND", CPU_ADDR_MODE_ZPG }, { 0x35, "AND", CPU_ADDR_MODE_ZPX }, { 0x2D, "AND", CPU_ADDR_MODE_ABS },
+	{ 0x3D, "AND", CPU_ADDR_MODE_ABX }, { 0x39, "AND", CPU_ADDR_MODE_ABY }, { 0x21, "AND", CPU_ADDR_MODE_ZPX_IND }, { 0x31, "AND", CPU_ADDR_MODE_ZPY_IND },
+	{ 0x0A, "ASL", CPU_ADDR_MODE_ACC }, { 0x06, "ASL", CPU_ADDR_MODE_ZPG }, { 0x16, "ASL", CPU_ADDR_MODE_ZPX }, { 0x0E, "ASL", CPU_ADDR_MODE_ABS },
+	{ 0x1E, "ASL", CPU_ADDR_MODE_ABX },
+	{ 0x90, "BCC", RECOMPILER_MODE_RELATIVE }, { 0xB0, "BCS", RECOMPILER_MODE_RELATIVE }, { 0xF0, "BEQ", RECOMPILER_MODE_RELATIVE },
+	{ 0x30, "BMI", RECOMPILER_MODE_RELATIVE }, { 0xD0, "BNE", RECOMPILER_MODE_RELATIVE }, { 0x10, "BPL", RECOMPILER_MODE_RELATIVE },
+	{ 0x50, "BVC", RECOMPILER_MODE_RELATIVE }, { 0x70, "BVS", RECOMPILER_MODE_RELATIVE },
+	{ 0x24, "BIT", CPU_ADDR_MODE_ZPG }, { 0x2C, "BIT", CPU_ADDR_MODE_ABS },
+	{ 0x00, "BRK", RECOMPILER_MODE_IMPLIED },
+	{ 0x18, "CLC", RECOMPILER_MODE_IMPLIED }, { 0xD8, "CLD", RECOMPILER_MODE_IMPLIED }, { 0x58, "CLI", RECOMPILER_MODE_IMPLIED },
+	{ 0xB8, "CLV", RECOMPILER_MODE_IMPLIED },
+	{ 0xC9, "CMP", CPU_ADDR_MODE_IMM }, { 0xC5, "CMP", CPU_ADDR_MODE_ZPG }, { 0xD5, "CMP", CPU_ADDR_MODE_ZPX }, { 0xCD, "CMP", CPU_ADDR_MODE_ABS },
+	{ 0xDD, "CMP", CPU_ADDR_MODE_ABX }, { 0xD9, "CMP", CPU_ADDR_MODE_ABY }, { 0xC1, "CMP", CPU_ADDR_MODE_ZPX_IND }, { 0xD1, "CMP", CPU_ADDR_MODE_ZPY_IND },
+	{ 0xE0, "CPX", CPU_ADDR_MODE_IMM }, { 0xE4, "CPX", CPU_ADDR_MODE_ZPG }, { 0xEC, "CPX", CPU_ADDR_MODE_ABS },
+	{ 0xC0, "CPY", CPU_ADDR_MODE_IMM }, { 0xC4, "CPY", CPU_ADDR_MODE_ZPG }, { 0xCC, "CPY", CPU_ADDR_MODE_ABS },
+	{ 0xC6, "DEC", CPU_ADDR_MODE_ZPG }, { 0xD6, "DEC", CPU_ADDR_MODE_ZPX }, { 0xCE, "DEC", CPU_ADDR_MODE_ABS }, { 0xDE, "DEC", CPU_ADDR_MODE_ABX },
+	{ 0xCA, "DEX", RECOMPILER_MODE_IMPLIED }, { 0x88, "DEY", RECOMPILER_MODE_IMPLIED },
+	{ 0x49, "EOR", CPU_ADDR_MODE_IMM }, { 0x45, "EOR", CPU_ADDR_MODE_ZPG }, { 0x55, "EOR", CPU_ADDR_MODE_ZPX }, { 0x4D, "EOR", CPU_ADDR_MODE_ABS },
+	{ 0x5D, "EOR", CPU_ADDR_MODE_ABX }, { 0x59, "EOR", CPU_ADDR_MODE_ABY }, { 0x41, "EOR", CPU_ADDR_MODE_ZPX_IND }, { 0x51, "EOR", CPU_ADDR_MODE_ZPY_IND },
+	{ 0xE6, "INC", CPU_ADDR_MODE_ZPG }, { 0xF6, "INC", CPU_ADDR_MODE_ZPX }, { 0xEE, "INC", CPU_ADDR_MODE_ABS }, { 0xFE, "INC", CPU_ADDR_MODE_ABX },
+	{ 0xE8, "INX", RECOMPILER_MODE_IMPLIED }, { 0xC8, "INY", RECOMPILER_MODE_IMPLIED },
+	{ 0x4C, "JMP", CPU_ADDR_MODE_ABS }, { 0x6C, "JMP", RECOMPILER_MODE_INDIRECT }, { 0x20, "JSR", CPU_ADDR_MODE_ABS },
+	{ 0xA9, "LDA", CPU_ADDR_MODE_IMM }, { 0xA5, "LDA", CPU_ADDR_MODE_ZPG }, { 0xB5, "LDA", CPU_ADDR_MODE_ZPX }, { 0xAD, "LDA", CPU_ADDR_MODE_ABS },
+	{ 0xBD, "LDA", CPU_ADDR_MODE_ABX }, { 0xB9, "LDA", CPU_ADDR_MODE_ABY }, { 0xA1, "LDA", CPU_ADDR_MODE_ZPX_IND }, { 0xB1, "LDA", CPU_ADDR_MODE_ZPY_IND },
+	{ 0xA2, "LDX", CPU_ADDR_MODE_IMM }, { 0xA6, "LDX", CPU_ADDR_MODE_ZPG }, { 0xB6, "LDX", CPU_ADDR_MODE_ZPY }, { 0xAE, "LDX", CPU_ADDR_MODE_ABS },
+	{ 0xBE, "LDX", CPU_ADDR_MODE_ABY },
+	{ 0xA0, "LDY", CPU_ADDR_MODE_IMM }, { 0xA4, "LDY", CPU_ADDR_MODE_ZPG }, { 0xB4, "LDY", CPU_ADDR_MODE_ZPX }, { 0xAC, "LDY", CPU_ADDR_MODE_ABS },
+	{ 0xBC, "LDY", CPU_ADDR_MODE_ABX },
+	{ 0x4A, "LSR", CPU_ADDR_MODE_ACC }, { 0x46, "LSR", CPU_ADDR_MODE_ZPG }, { 0x56, "LSR", CPU_ADDR_MODE_ZPX }, { 0x4E, "LSR", CPU_ADDR_MODE_ABS },
+	{ 0x5E, "LSR", CPU_ADDR_MODE_ABX },
+	{ 0xEA, "NOP", RECOMPILER_MODE_IMPLIED },
+	{ 0x09, "ORA", CPU_ADDR_MODE_IMM }, { 0x05, "ORA", CPU_ADDR_MODE_ZPG }, { 0x15, "ORA", CPU_ADDR_MODE_ZPX }, { 0x0D, "ORA", CPU_ADDR_MODE_ABS },
+	{ 0x1D, "ORA", CPU_ADDR_MODE_ABX }, { 0x19, "ORA", CPU_ADDR_MODE_ABY }, { 0x01, "ORA", CPU_ADDR_MODE_ZPX_IND }, { 0x11, "ORA", CPU_ADDR_MODE_ZPY_IND },
+	{ 0x48, "PHA", RECOMPILER_MODE_IMPLIED }, { 0x08, "PHP", RECOMPILER_MODE_IMPLIED }, { 0x68, "PLA", RECOMPILER_MODE_IMPLIED },
+	{ 0x28, "PLP", RECOMPILER_MODE_IMPLIED },
+	{ 0x2A, "ROL", CPU_ADDR_MODE_ACC }, { 0x26, "ROL", CPU_ADDR_MODE_ZPG }, { 0x36, "ROL", CPU_ADDR_MODE_ZPX }, { 0x2E, "ROL", CPU_ADDR_MODE_ABS },
+	{ 0x3E, "ROL", CPU_ADDR_MODE_ABX },
+	{ 0x6A, "ROR", CPU_ADDR_MODE_ACC }, { 0x66, "ROR", CPU_ADDR_MODE_ZPG }, { 0x76, "ROR", CPU_ADDR_MODE_ZPX }, { 0x6E, "ROR", CPU_ADDR_MODE_ABS },
+	{ 0x7E, "ROR", CPU_ADDR_MODE_ABX },
+	{ 0x40, "RTI", RECOMPILER_MODE_IMPLIED }, { 0x60, "RTS", RECOMPILER_MODE_IMPLIED },
+	{ 0xE9, "SBC", CPU_ADDR_MODE_IMM }, { 0xE5, "SBC", CPU_ADDR_MODE_ZPG }, { 0xF5, "SBC", CPU_ADDR_MODE_ZPX }, { 0xED, "SBC", CPU_ADDR_MODE_ABS },
+	{ 0xFD, "SBC", CPU_ADDR_MODE_ABX }, { 0xF9, "SBC", CPU_ADDR_MODE_ABY }, { 0xE1, "SBC", CPU_ADDR_MODE_ZPX_IND }, { 0xF1, "SBC", CPU_ADDR_MODE_ZPY_IND },
+	{ 0x38, "SEC", RECOMPILER_MODE_IMPLIED }, { 0xF8, "SED", RECOMPILER_MODE_IMPLIED }, { 0x78, "SEI", RECOMPILER_MODE_IMPLIED },
+	{ 0x85, "STA", CPU_ADDR_MODE_ZPG }, { 0x95, "STA", CPU_ADDR_MODE_ZPX }, { 0x8D, "STA", CPU_ADDR_MODE_ABS }, { 0x9D, "STA", CPU_ADDR_MODE_ABX },
+	{ 0x99, "STA", CPU_ADDR_MODE_ABY }, { 0x81, "STA", CPU_ADDR_MODE_ZPX_IND }, { 0x91, "STA", CPU_ADDR_MODE_ZPY_IND },
+	{ 0x86, "STX", CPU_ADDR_MODE_ZPG }, { 0x96, "STX", CPU_ADDR_MODE_ZPY }, { 0x8E, "STX", CPU_ADDR_MODE_ABS },
+	{ 0x84, "STY", CPU_ADDR_MODE_ZPG }, { 0x94, "STY", CPU_ADDR_MODE_ZPX }, { 0x8C, "STY", CPU_ADDR_MODE_ABS },
+	{ 0xAA, "TAX", RECOMPILER_MODE_IMPLIED }, { 0xA8, "TAY", RECOMPILER_MODE_IMPLIED }, { 0xBA, "TSX", RECOMPILER_MODE_IMPLIED },
+	{ 0x8A, "TXA", RECOMPILER_MODE_IMPLIED }, { 0x9A, "TXS", RECOMPILER_MODE_IMPLIED }, { 0x98, "TYA", RECOMPILER_MODE_IMPLIED }
+};
+
+// Finds the code in a 64K image by following control flow from the NMI,
+// reset and IRQ vectors, and writes it out as C++ for aot.hpp: one function
+// per basic block. Jumps that can only be resolved at run time (JMP ($xxxx),
+// RTS, RTI) end a block and are looked up when they happen.
+class Recompiler {
+public:
+	Recompiler(const std::vector<Byte>& image, CPUType cpu_type) : type(cpu_type), memory(65536, 0),
+		instruction_start(65536, false), leader(65536, false) {
+		std::copy(image.begin(), image.begin() + static_cast<std::ptrdiff_t>(std::min<std::size_t>(image.size(), 65536)), memory.begin());
+		for (const RecompilerOpcode& op : recompiler_opcodes) {
+			ops[op.opcode] = &op;
+		}
+	}
+
+	void add_entry(Word address) {
+		if (!leader[address]) {
+			leader[address] = true;
+			worklist.push_back(address);
+		}
+	}
+
+	void add_vectors() {
+		for (unsigned vector : { 0xFFFAu, 0xFFFCu, 0xFFFEu }) {
+			add_entry(make_address(memory[vector], memory[vector + 1]));
+		}
+	}
+
+	// Decodes everything reachable from the entries
+	void discover() {
+		while (!worklist.empty()) {
+			unsigned pc = worklist.back();
+			worklist.pop_back();
+			for (;;) {
+				if (instruction_start[pc]) {
+					// Joined code that's already decoded; split it here
+					// so blocks don't overlap
+					add_entry(static_cast<Word>(pc));
+					break;
+				}
+				const RecompilerOpcode* op = ops[memory[pc]];
+				if (!op || pc + length(*op) > 0x10000) break;
+				instruction_start[pc] = true;
+				instructions++;
+
+				Word next = static_cast<Word>(pc + length(*op));
+				std::string name = op->name;
+				if (op->mode == RECOMPILER_MODE_RELATIVE) {
+					add_entry(branch_target(pc));
+					add_entry(next);
+					break;
+				}
+				if (name == "JMP" && op->mode == CPU_ADDR_MODE_ABS) {
+					add_entry(operand_word(pc));
+					break;
+				}
+				if (name == "JSR") {
+					add_entry(operand_word(pc));
+					add_entry(next);
+					break;
+				}
+				if (name == "BRK") {
+					// RTI comes back past the padding byte
+					add_entry(static_cast<Word>(pc + 2));
+					break;
+				}
+				if (name == "JMP" || name == "RTS" || name == "RTI") break;
+				pc = next;
+			}
+		}
+	}
+
+	std::size_t instruction_count() const {
+		return instructions;
+	}
+
+	// Writes the generated source; source_name ends up in reports
+	std::size_t write(std::ostream& os, const std::string& source_name) {
+		std::vector<Word> starts;
+		for (unsigned address = 0; address < 0x10000; address++) {
+			if (leader[address] && instruction_start[address]) starts.push_back(static_cast<Word>(address));
+		}
+
+		os << "// Generated by main --recompile from " << source_name << ", don't edit." << std::endl
+			<< "// Build it in with cmake -DYA6502_AOT_SOURCE=<this file> and run with --aot." << std::endl << std::endl
+			<< "#include \"aot.hpp\"" << std::endl << std::endl;
+
+		std::vector<Word> lengths;
+		for (Word start : starts) {
+			lengths.push_back(write_block(os, start));
+		}
+
+		os << "static const Byte aot_code[] = {";
+		std::size_t count = 0;
+		for (std::size_t i = 0; i < starts.size(); i++) {
+			for (unsigned j = 0; j < lengths[i]; j++) {
+				os << (count++ % 16 == 0 ? "\n\t" : " ") << "0x" << hex_byte(memory[static_cast<Word>(starts[i] + j)]) << ",";
+			}
+		}
+		os << "\n};" << std::endl << std::endl
+			<< "static const AotBlock aot_blocks[] = {" << std::endl;
+		std::size_t offset = 0;
+		for (std::size_t i = 0; i < starts.size(); i++) {
+			os << "\t{ 0x" << hex_word(starts[i]) << ", " << std::dec << lengths[i] << ", " << offset << ", block_" << hex_word(starts[i]) << " }," << std::endl;
+			offset += lengths[i];
+		}
+		os << "};" << std::endl << std::endl
+			<< "const AotProgram aot_program = { \"" << escape(source_name) << "\", aot_blocks, " << std::dec << starts.size() << ", aot_code };" << std::endl;
+		return starts.size();
+	}
+
+private:
+	CPUType type;
+	std::vector<Byte> memory;
+	std::vector<bool> instruction_start;
+	std::vector<bool> leader;
+	std::vector<Word> worklist;
+	const RecompilerOpcode* ops[256] = {};
+	std::size_t instructions = 0;
+	std::map<std::pair<Byte, Byte>, unsigned long> costs;
+
+	// Timed on the interpreter, by opcode and flags (for branches)
+	unsigned long cycles_of(Byte opcode, Byte flags) {
+		auto found = costs.find(std::make_pair(opcode, flags));
+		if (found != costs.end()) return found->second;
+		unsigned long cycles = measure_instruction_cycles(type, opcode, flags);
+		costs[std::make_pair(opcode, flags)] = cycles;
+		return cycles;
+	}
+
+	static unsigned length(const RecompilerOpcode& op) {
+		switch (op.mode) {
+			case RECOMPILER_MODE_IMPLIED:
+			case CPU_ADDR_MODE_ACC:
+			return 1;
+			case CPU_ADDR_MODE_ABS:
+			case CPU_ADDR_MODE_ABX:
+			case CPU_ADDR_MODE_ABY:
+			case RECOMPILER_MODE_INDIRECT:
+			return 3;
+			default:
+			return 2;
+		}
+	}
+
+	Word operand_word(unsigned pc) const {
+		return make_address(memory[static_cast<Word>(pc + 1)], memory[static_cast<Word>(pc + 2)]);
+	}
+
+	Word branch_target(unsigned pc) const {
+		return static_cast<Word>(static_cast<int>(pc) + static_cast<Byte_S>(memory[static_cast<Word>(pc + 1)]) + 2);
+	}
+
+	static std::string hex_byte(Byte b) {
+		std::ostringstream oss;
+		oss << std::hex << std::uppercase << std::setw(2) << std::setfill('0') << (int)b;
+		return oss.str();
+	}
+
+	static std::string hex_word(Word w) {
+		std::ostringstream oss;
+		oss << std::hex << std::uppercase << std::setw(4) << std::setfill('0') << (int)w;
+		return oss.str();
+	}
+
+	static std::string escape(const std::string& text) {
+		std::string escaped;
+		for (char ch : text) {
+			if (ch == '"' || ch == '\\') escaped += '\\';
+			escaped += ch;
+		}
+		return escaped;
+	}
+
+	std::string disassemble(unsigned pc, const RecompilerOpcode& op) const {
+		Byte b = memory[static_cast<Word>(pc + 1)];
+		std::string w = "$" + hex_word(operand_word(pc));
+		std::string text = op.name;
+		switch (op.mode) {
+			case CPU_ADDR_MODE_ACC: return text + " A";
+			case CPU_ADDR_MODE_IMM: return text + " #$" + hex_byte(b);
+			case CPU_ADDR_MODE_ZPG: return text + " $" + hex_byte(b);
+			case CPU_ADDR_MODE_ZPX: return text + " $" + hex_byte(b) + ",X";
+			case CPU_ADDR_MODE_ZPY: return text + " $" + hex_byte(b) + ",Y";
+			case CPU_ADDR_MODE_ABS: return text + " " + w;
+			case CPU_ADDR_MODE_ABX: return text + " " + w + ",X";
+			case CPU_ADDR_MODE_ABY: return text + " " + w + ",Y";
+			case CPU_ADDR_MODE_ZPX_IND: return text + " ($" + hex_byte(b) + ",X)";
+			case CPU_ADDR_MODE_ZPY_IND: return text + " ($" + hex_byte(b) + "),Y";
+			case RECOMPILER_MODE_INDIRECT: return text + " (" + w + ")";
+			case RECOMPILER_MODE_RELATIVE: return text + " $" + hex_word(branch_target(pc));
+			default: return text;
+		}
+	}
+
+	// Leaves the operand's address in `address`, making the same reads the
+	// CPU makes along the way
+	void emit_address(std::ostream& os, unsigned pc, Byte mode) const {
+		std::string b = "0x" + hex_byte(memory[static_cast<Word>(pc + 1)]);
+		std::string w = "0x" + hex_word(operand_word(pc));
+		switch (mode) {
+			case CPU_ADDR_MODE_ZPG:
+			os << "\taddress = " << b << ";\n";
+			break;
+			case CPU_ADDR_MODE_ZPX:
+			case CPU_ADDR_MODE_ZPY:
+			// The unindexed zero page address is read first
+			os << "\t(void)AOT_READ(" << b << ");\n"
+				<< "\taddress = static_cast<Byte>(" << b << " + " << (mode == CPU_ADDR_MODE_ZPX ? "X" : "Y") << ");\n";
+			break;
+			case CPU_ADDR_MODE_ABS:
+			os << "\taddress = " << w << ";\n";
+			break;
+			case CPU_ADDR_MODE_ABX:
+			case CPU_ADDR_MODE_ABY:
+			os << "\taddress = static_cast<Word>(" << w << " + " << (mode == CPU_ADDR_MODE_ABX ? "X" : "Y") << ");\n";
+			break;
+			case CPU_ADDR_MODE_ZPX_IND:
+			os << "\taddress = static_cast<Byte>(" << b << " + X);\n"
+				<< "\tvalue = AOT_READ(address);\n"
+				<< "\taddress = make_address(value, AOT_READ(static_cast<Byte>(address + 1)));\n";
+			break;
+			case CPU_ADDR_MODE_ZPY_IND:
+			os << "\tvalue = AOT_READ(" << b << ");\n"
+				<< "\taddress = static_cast<Word>(make_address(value, AOT_READ(0x" << hex_byte(static_cast<Byte>(memory[static_cast<Word>(pc + 1)] + 1)) << ")) + Y);\n";
+			break;
+		}
+	}
+
+	// Puts the operand in `value`
+	void emit_fetch(std::ostream& os, unsigned pc, Byte mode) const {
+		if (mode == CPU_ADDR_MODE_IMM) {
+			os << "\tvalue = 0x" << hex_byte(memory[static_cast<Word>(pc + 1)]) << ";\n";
+		}
+		else if (mode == CPU_ADDR_MODE_ACC) {
+			os << "\tvalue = A;\n";
+		}
+		else {
+			emit_address(os, pc, mode);
+			os << "\tvalue = AOT_READ(address);\n";
+		}
+	}
+
+	// Writes `value` back, for read-modify-write instructions
+	void emit_write_back(std::ostream& os, unsigned pc, Byte mode) const {
+		if (mode == CPU_ADDR_MODE_ACC) {
+			os << "\tA = value;\n";
+			return;
+		}
+		// The CPU works out the address a second time
+		if (mode == CPU_ADDR_MODE_ZPX) {
+			os << "\t(void)AOT_READ(0x" << hex_byte(memory[static_cast<Word>(pc + 1)]) << ");\n";
+		}
+		os << "\tAOT_WRITE(address, value);\n";
+	}
+
+	static const char* register_of(const std::string& name) {
+		char last = name[2];
+		return last == 'X' ? "X" : last == 'Y' ? "Y" : "A";
+	}
+
+	// One instruction. Returns false if it ends the block.
+	bool emit_instruction(std::ostream& os, unsigned pc, const RecompilerOpcode& op, unsigned count) {
+		std::string name = op.name;
+		Word next = static_cast<Word>(pc + length(op));
+		unsigned long cost = cycles_of(op.opcode, 0);
+		std::string next_pc = "0x" + hex_word(next);
+		std::string pc_text = "0x" + hex_word(static_cast<Word>(pc));
+		std::string counted = std::to_string(count);
+
+		os << "\t// $" << hex_word(static_cast<Word>(pc)) << "  ";
+		for (unsigned i = 0; i < 3; i++) {
+			os << (i < length(op) ? hex_byte(memory[static_cast<Word>(pc + i)]) + " " : "   ");
+		}
+		os << disassemble(pc, op) << "\n";
+
+		if (op.mode == RECOMPILER_MODE_RELATIVE) {
+			static const char* const conditions[8] = {
+				"!(SF & CPU_FLAG_N)", "(SF & CPU_FLAG_N)", "!(SF & CPU_FLAG_V)", "(SF & CPU_FLAG_V)",
+				"!(SF & CPU_FLAG_C)", "(SF & CPU_FLAG_C)", "!(SF & CPU_FLAG_Z)", "(SF & CPU_FLAG_Z)"
+			};
+			Word target = branch_target(pc);
+			Byte flags_taken = 0;
+			static const Byte branch_flags[4] = { CPU_FLAG_N, CPU_FLAG_V, CPU_FLAG_C, CPU_FLAG_Z };
+			Byte aaa = op.opcode >> 5;
+			if (aaa & 1) flags_taken = branch_flags[aaa >> 1];
+			unsigned long taken_cost = cycles_of(op.opcode, flags_taken);
+			unsigned long not_taken_cost = cycles_of(op.opcode, static_cast<Byte>(flags_taken ^ branch_flags[aaa >> 1]));
+			os << "\tif (" << conditions[aaa] << ") {\n"
+				<< "\t\tcycles += " << taken_cost << ";\n"
+				<< (target == pc ? "\t\tAOT_HALT(0x" : "\t\tAOT_EXIT(0x") << hex_word(target) << ", " << counted << ");\n"
+				<< "\t}\n"
+				<< "\tcycles += " << not_taken_cost << ";\n"
+				<< "\tAOT_EXIT(" << next_pc << ", " << counted << ");\n";
+			return false;
+		}
+
+		if (name == "LDA" || name == "LDX" || name == "LDY") {
+			const char* reg = register_of(name);
+			emit_fetch(os, pc, op.mode);
+			os << "\t" << reg << " = value;\n\tSF = aot_nz(SF, " << reg << ");\n";
+		}
+		else if (name == "STA" || name == "STX" || name == "STY") {
+			emit_address(os, pc, op.mode);
+			os << "\tAOT_WRITE(address, " << register_of(name) << ");\n";
+		}
+		else if (name == "ORA" || name == "AND" || name == "EOR") {
+			const char* symbol = name == "ORA" ? "|" : name == "AND" ? "&" : "^";
+			emit_fetch(os, pc, op.mode);
+			os << "\tA = static_cast<Byte>(A " << symbol << " value);\n\tSF = aot_nz(SF, A);\n";
+		}
+		else if (name == "ADC" || name == "SBC") {
+			emit_fetch(os, pc, op.mode);
+			if (name == "ADC") os << "\taot_add(c, A, SF, value, false);\n";
+			else os << "\taot_add(c, A, SF, static_cast<Byte>(~value), true);\n";
+		}
+		else if (name == "CMP" || name == "CPX" || name == "CPY") {
+			emit_fetch(os, pc, op.mode);
+			os << "\tSF = aot_compare(SF, " << (name == "CMP" ? "A" : name == "CPX" ? "X" : "Y") << ", value);\n";
+		}
+		else if (name == "BIT") {
+			emit_fetch(os, pc, op.mode);
+			os << "\tSF = aot_bit(SF, A, value);\n";
+		}
+		else if (name == "INC" || name == "DEC") {
+			emit_fetch(os, pc, op.mode);
+			os << "\tvalue = static_cast<Byte>(value " << (name == "INC" ? "+" : "-") << " 1);\n\tSF = aot_nz(SF, value);\n";
+			emit_write_back(os, pc, op.mode);
+		}
+		else if (name == "ASL" || name == "ROL" || name == "LSR" || name == "ROR") {
+			bool left = name == "ASL" || name == "ROL";
+			bool rotate = name == "ROL" || name == "ROR";
+			emit_fetch(os, pc, op.mode);
+			os << "\tvalue = aot_shift(SF, value, " << (left ? "true" : "false") << ", " << (rotate ? "true" : "false") << ");\n";
+			emit_write_back(os, pc, op.mode);
+		}
+		else if (name == "INX" || name == "INY" || name == "DEX" || name == "DEY") {
+			const char* reg = name[2] == 'X' ? "X" : "Y";
+			os << "\t" << reg << (name[0] == 'I' ? "++" : "--") << ";\n\tSF = aot_nz(SF, " << reg << ");\n";
+		}
+		else if (name[0] == 'T') {
+			// TAX, TAY, TSX, TXA, TXS, TYA
+			std::string from = name.substr(1, 1) == "S" ? "SP" : name.substr(1, 1);
+			std::string to = name.substr(2, 1) == "S" ? "SP" : name.substr(2, 1);
+			os << "\t" << to << " = " << from << ";\n";
+			if (to != "SP") os << "\tSF = aot_nz(SF, " << to << ");\n";
+		}
+		else if (name == "CLC" || name == "SEC" || name == "CLI" || name == "SEI" || name == "CLV" || name == "CLD" || name == "SED") {
+			std::string flag = std::string("CPU_FLAG_") + name[2];
+			if (name[0] == 'C') os << "\tSF = static_cast<Byte>(SF & ~" << flag << ");\n";
+			else os << "\tSF = static_cast<Byte>(SF | " << flag << ");\n";
+		}
+		else if (name == "NOP") {
+		}
+		else if (name == "PHA" || name == "PHP") {
+			os << "\taot_push(mmu, SP, " << (name == "PHA" ? "A" : "static_cast<Byte>(SF | CPU_FLAG_B | CPU_FLAG_UNUSED)")
+				<< ", block_start, block_length, dirty);\n";
+		}
+		else if (name == "PLA") {
+			os << "\tA = aot_pull(mmu, SP);\n\tSF = aot_nz(SF, A);\n";
+		}
+		else if (name == "PLP") {
+			os << "\tSF = aot_pulled_flags(SF, aot_pull(mmu, SP));\n";
+		}
+		else if (name == "JMP" && op.mode == CPU_ADDR_MODE_ABS) {
+			Word target = operand_word(pc);
+			os << "\tcycles += " << cost << ";\n"
+				<< (target == pc ? "\tAOT_HALT(0x" : "\tAOT_EXIT(0x") << hex_word(target) << ", " << counted << ");\n";
+			return false;
+		}
+		else if (name == "JMP") {
+			// The pointer's high byte doesn't carry into the next page
+			Word pointer = operand_word(pc);
+			Word pointer_hi = lo(pointer) == 0xFF ? static_cast<Word>(pointer & 0xFF00) : static_cast<Word>(pointer + 1);
+			os << "\tvalue = AOT_READ(0x" << hex_word(pointer) << ");\n"
+				<< "\taddress = make_address(value, AOT_READ(0x" << hex_word(pointer_hi) << "));\n"
+				<< "\tcycles += " << cost << ";\n"
+				<< "\tif (address == " << pc_text << ") AOT_HALT(address, " << counted << ");\n"
+				<< "\tAOT_EXIT(address, " << counted << ");\n";
+			return false;
+		}
+		else if (name == "JSR") {
+			Word return_address = static_cast<Word>(pc + 2);
+			os << "\taot_push(mmu, SP, 0x" << hex_byte(hi(return_address)) << ", block_start, block_length, dirty);\n"
+				<< "\taot_push(mmu, SP, 0x" << hex_byte(lo(return_address)) << ", block_start, block_length, dirty);\n"
+				<< "\t// The high byte is read after the pushes\n"
+				<< "\taddress = make_address(0x" << hex_byte(memory[static_cast<Word>(pc + 1)]) << ", AOT_READ(0x" << hex_word(static_cast<Word>(pc + 2)) << "));\n"
+				<< "\tcycles += " << cost << ";\n"
+				<< "\tAOT_EXIT(address, " << counted << ");\n";
+			return false;
+		}
+		else if (name == "RTS") {
+			os << "\tvalue = aot_pull(mmu, SP);\n"
+				<< "\taddress = static_cast<Word>(make_address(value, aot_pull(mmu, SP)) + 1);\n"
+				<< "\tcycles += " << cost << ";\n"
+				<< "\tAOT_EXIT(address, " << counted << ");\n";
+			return false;
+		}
+		else if (name == "RTI") {
+			os << "\tSF = aot_pulled_flags(SF, aot_pull(mmu, SP));\n"
+				<< "\tvalue = aot_pull(mmu, SP);\n"
+				<< "\taddress = make_address(value, aot_pull(mmu, SP));\n"
+				<< "\tcycles += " << cost << ";\n"
+				<< "\tAOT_EXIT(address, " << counted << ");\n";
+			return false;
+		}
+		else if (name == "BRK") {
+			Word return_address = static_cast<Word>(pc + 2);
+			os << "\taot_push(mmu, SP, 0x" << hex_byte(hi(return_address)) << ", block_start, block_length, dirty);\n"
+				<< "\taot_push(mmu, SP, 0x" << hex_byte(lo(return_address)) << ", block_start, block_length, dirty);\n"
+				<< "\taot_push(mmu, SP, static_cast<Byte>(SF | CPU_FLAG_B | CPU_FLAG_UNUSED), block_start, block_length, dirty);\n"
+				<< "\tSF = static_cast<Byte>(SF | CPU_FLAG_B | CPU_FLAG_I);\n"
+				<< "\tvalue = AOT_READ(0xFFFE);\n"
+				<< "\taddress = make_address(value, AOT_READ(0xFFFF));\n"
+				<< "\tcycles += " << cost << ";\n"
+				<< "\tAOT_EXIT(address, " << counted << ");\n";
+			return false;
+		}
+
+		os << "\tcycles += " << cost << ";\n";
+		return true;
+	}
+
+	// Returns the block's length in bytes
+	Word write_block(std::ostream& os, Word start) {
+		std::ostringstream body;
+		unsigned pc = start;
+		unsigned count = 0;
+		for (;;) {
+			const RecompilerOpcode& op = *ops[memory[pc]];
+			count++;
+			bool more = emit_instruction(body, pc, op, count);
+			unsigned next = pc + length(op);
+			if (!more) {
+				pc = next;
+				break;
+			}
+			// Straight on into the next block, or code that wasn't decoded
+			if (next >= 0x10000 || leader[next] || !instruction_start[next]) {
+				body << "\tAOT_EXIT(0x" << hex_word(static_cast<Word>(next)) << ", " << count << ");\n";
+				pc = next;
+				break;
+			}
+			body << "\tAOT_NEXT(0x" << hex_word(static_cast<Word>(next)) << ", " << count << ");\n";
+			pc = next;
+		}
+
+		Word block_length = static_cast<Word>(pc - start);
+		os << "static void block_" << hex_word(start) << "(AotContext& c) {" << std::endl
+			<< "\tAOT_ENTER(0x" << hex_word(start) << ", " << std::dec << block_length << ");" << std::endl
+			<< body.str()
+			<< "}" << std::endl << std::endl;
+		return block_length;
+	}
+};
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include "types.hpp"
+#include "symbols.hpp"
+
+enum SanitizerFault {
+	SAN_NONE = 0,
+	SAN_UNINITIALIZED_READ, // Read a byte nothing has written yet
+	SAN_STACK_OVERFLOW,     // Pushed with SP at $00, so it wrapped to $FF
+	SAN_STACK_UNDERFLOW,    // Pulled with SP at $FF, so it wrapped to $00
+	SAN_CODE_WRITE,         // Wrote into a region marked as code/ROM
+	SAN_DATA_EXECUTE,       // Fetched an opcode from a region marked as data
+	SAN_FAULT_COUNT
+};
+
+static const char* const sanitizer_fault_names[SAN_FAULT_COUNT] = {
+	"none",
+	"read of uninitialized memory",
+	"stack overflow",
+	"stack underflow",
+	"write to code",
+	"execution of data"
+};
+
+// Shadow memory for catching program bugs as they happen. One bit per
+// address in each of three bitmaps says whether the byte has never been
+// written, holds code and holds data. The CPU only calls in here when it was
+// built with YA6502_SANITIZE, so the checks cost nothing otherwise; with it,
+// each one is a shift and a mask.
+//
+// Only the first fault of an instruction is kept. The CPU lets the
+// instruction finish and then stops, like for a watchpoint.
+class Sanitizer {
+public:
+	SanitizerFault fault = SAN_NONE;
+	Word fault_address = 0; // The byte involved, or the stack slot
+	Word fault_pc = 0;      // The instruction that did it
+	unsigned long counts[SAN_FAULT_COUNT] = {};
+
+	void mark_unwritten(Word start, std::size_t length) {
+		mark(unwritten, start, length);
+	}
+
+	void mark_code(Word start, std::size_t length) {
+		mark(code, start, length);
+	}
+
+	void mark_data(Word start, std::size_t length) {
+		mark(data, start, length);
+	}
+
+	// Called with every opcode fetch, before anything else in the instruction
+	void begin_instruction(Word pc) {
+		fault = SAN_NONE;
+		instruction_pc = pc;
+		if (test(data, pc)) report(SAN_DATA_EXECUTE, pc);
+		check_read(pc);
+	}
+
+	void check_read(Word address) {
+		if (!test(unwritten, address)) return;
+		report(SAN_UNINITIALIZED_READ, address);
+		// Once is enough for each byte
+		clear(unwritten, address);
+	}
+
+	void check_write(Word address) {
+		if (test(code, address)) report(SAN_CODE_WRITE, address);
+		clear(unwritten, address);
+	}
+
+	void check_push(Byte sp) {
+		if (sp == 0x00) report(SAN_STACK_OVERFLOW, 0x0100);
+	}
+
+	void check_pull(Byte sp) {
+		if (sp == 0xFF) report(SAN_STACK_UNDERFLOW, 0x01FF);
+	}
+
+	void describe(std::ostream& os, SymbolTable* symbols) const {
+		os << "Sanitizer: " << sanitizer_fault_names[fault] << " at " << format_address(fault_address, symbols)
+			<< " by the instruction at " << format_address(fault_pc, symbols) << std::endl;
+	}
+
+	unsigned long total_faults() const {
+		unsigned long total = 0;
+		for (int i = SAN_NONE + 1; i < SAN_FAULT_COUNT; i++) total += counts[i];
+		return total;
+	}
+
+private:
+	std::uint64_t unwritten[1024] = {};
+	std::uint64_t code[1024] = {};
+	std::uint64_t data[1024] = {};
+	Word instruction_pc = 0;
+
+	static bool test(const std::uint64_t* map, Word address) {
+		return (map[address >> 6] >> (address & 63)) & 1;
+	}
+
+	static void clear(std::uint64_t* map, Word address) {
+		map[address >> 6] &= ~(std::uint64_t(1) << (address & 63));
+	}
+
+	static void mark(std::uint64_t* map, Word start, std::size_t length) {
+		for (std::size_t i = 0; i < length && start + i < 65536; i++) {
+			std::size_t address = start + i;
+			map[address >> 6] |= std::uint64_t(1) << (address & 63);
+		}
+	}
+
+	void report(SanitizerFault kind, Word address) {
+		counts[kind]++;
+		if (fault != SAN_NONE) return;
+		fault = kind;
+		fault_address = address;
+		fault_pc = instruction_pc;
+	}
+};
@@ -0,0 +1,654 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "types.hpp"
+#include "page.hpp"
+#include "mmu.hpp"
+#include "cpu.hpp"
+#include "mapper.hpp"
+#include "system.hpp"
+
+// Save state layout, everything little-endian:
+//   header: "YA6502SS" | u32 version | u32 flags | u32 body size | u32 stored size | u32 body CRC-32 | u32 0
+//   body (LZ compressed if SAVE_STATE_COMPRESSED is set):
+//     u32 core count, then per core:
+//       name (u16 length + bytes) | u32 CRC-32 of the core's startup image
+//       CPU: u8 type | A X Y SP SF | u16 PC | u16 address bus | u8 data bus
+//            | u16 last good, last jump origin, last jump target
+//            | u64 cycles, instructions, idle cycles skipped
+//            | u8 jumped back | u16 jump back origin | idle loop | fusion hits | history
+//       page table: 256 x (u8 kind, u8 argument)
+//       u16 changed RAM pages, each u8 page number + 256 bytes XORed with the image
+//       u32 mapper state size + mapper state
+//     u16 shared page count, 256 bytes each
+// Pages that still match the image aren't stored at all, and the XOR makes the
+// rest mostly zeros, which compresses very well.
+static constexpr char SAVE_STATE_MAGIC[8] = { 'Y', 'A', '6', '5', '0', '2', 'S', 'S' };
+static constexpr uint32_t SAVE_STATE_VERSION = 1;
+static constexpr uint32_t SAVE_STATE_COMPRESSED = 1;
+static constexpr std::size_t SAVE_STATE_HEADER_SIZE = 32;
+
+enum SavedPageKind : Byte {
+	SAVED_PAGE_RAM,    // Plain memory
+	SAVED_PAGE_MIRROR, // Same page as an earlier one (the argument)
+	SAVED_PAGE_SHARED, // Shared page number (the argument) of the System
+	SAVED_PAGE_BANK,   // Bank-switched ROM window, restored by the mapper
+	SAVED_PAGE_DEVICE  // Anything else, contents not saved
+};
+
+inline uint32_t crc32(const Byte* data, std::size_t size) {
+	static uint32_t table[256];
+	static bool table_ready = false;
+	if (!table_ready) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t value = i;
+			for (int bit = 0; bit < 8; bit++) value = (value >> 1) ^ ((value & 1) ? 0xEDB88320u : 0);
+			table[i] = value;
+		}
+		table_ready = true;
+	}
+	uint32_t crc = 0xFFFFFFFFu;
+	for (std::size_t i = 0; i < size; i++) crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return crc ^ 0xFFFFFFFFu;
+}
+
+// LZ4-style block compression: a token byte with the literal count in the
+// high nibble and the match length minus 4 in the low one (15 means more
+// length bytes follow, each adding up to 255), the literals, then a u16
+// backwards offset. The last sequence is literals only.
+static constexpr std::size_t LZ_MIN_MATCH = 4;
+static constexpr std::size_t LZ_HASH_BITS = 12;
+
+inline void lz_put_length(std::vector<Byte>& out, std::size_t length) {
+	while (length >= 255) {
+		out.push_back(255);
+		length -= 255;
+	}
+	out.push_back(static_cast<Byte>(length));
+}
+
+inline std::vector<Byte> lz_compress(const Byte* in, std::size_t size) {
+	std::vector<Byte> out;
+	out.reserve(size / 2 + 16);
+	std::vector<std::size_t> table(std::size_t(1) << LZ_HASH_BITS, SIZE_MAX);
+	auto hash = [&](std::size_t pos) {
+		uint32_t word = static_cast<uint32_t>(in[pos]) | (static_cast<uint32_t>(in[pos + 1]) << 8)
+			| (static_cast<uint32_t>(in[pos + 2]) << 16) | (static_cast<uint32_t>(in[pos + 3]) << 24);
+		return (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+	};
+
+	auto emit = [&](std::size_t literal_start, std::size_t literal_end, std::size_t offset, std::size_t match) {
+		std::size_t literals = literal_end - literal_start;
+		std::size_t extra = match >= LZ_MIN_MATCH ? match - LZ_MIN_MATCH : 0;
+		out.push_back(static_cast<Byte>(((literals < 15 ? literals : 15) << 4) | (extra < 15 ? extra : 15)));
+		if (literals >= 15) lz_put_length(out, literals - 15);
+		out.insert(out.end(), in + literal_start, in + literal_end);
+		if (match == 0) return;
+		out.push_back(static_cast<Byte>(offset));
+		out.push_back(static_cast<Byte>(offset >> 8));
+		if (extra >= 15) lz_put_length(out, extra - 15);
+	};
+
+	std::size_t anchor = 0;
+	std::size_t pos = 0;
+	while (pos + LZ_MIN_MATCH <= size) {
+		std::size_t slot = hash(pos);
+		std::size_t candidate = table[slot];
+		table[slot] = pos;
+		if (candidate == SIZE_MAX || pos - candidate > 0xFFFF || std::memcmp(in + candidate, in + pos, LZ_MIN_MATCH) != 0) {
+			pos++;
+			continue;
+		}
+		std::size_t match = LZ_MIN_MATCH;
+		while (pos + match < size && in[candidate + match] == in[pos + match]) match++;
+		emit(anchor, pos, pos - candidate, match);
+		pos += match;
+		anchor = pos;
+	}
+	emit(anchor, size, 0, 0);
+	return out;
+}
+
+// False if the data is corrupt or doesn't decompress to exactly out_size bytes
+inline bool lz_decompress(const Byte* in, std::size_t size, Byte* out, std::size_t out_size) {
+	const Byte* end = in + size;
+	std::size_t produced = 0;
+	auto get_length = [&](std::size_t& length) {
+		Byte more = 255;
+		while (more == 255) {
+			if (in >= end) return false;
+			more = *in++;
+			length += more;
+		}
+		return true;
+	};
+
+	while (in < end) {
+		Byte token = *in++;
+		std::size_t literals = token >> 4;
+		if (literals == 15 && !get_length(literals)) return false;
+		if (literals > static_cast<std::size_t>(end - in) || literals > out_size - produced) return false;
+		std::memcpy(out + produced, in, literals);
+		in += literals;
+		produced += literals;
+		if (in == end) break;
+
+		if (end - in < 2) return false;
+		std::size_t offset = static_cast<std::size_t>(in[0]) | (static_cast<std::size_t>(in[1]) << 8);
+		in += 2;
+		std::size_t match = token & 0x0F;
+		if (match == 15 && !get_length(match)) return false;
+		match += LZ_MIN_MATCH;
+		if (offset == 0 || offset > produced || match > out_size - produced) return false;
+		// Byte by byte, since the match may overlap what it's producing
+		for (std::size_t i = 0; i < match; i++, produced++) out[produced] = out[produced - offset];
+	}
+	return produced == out_size;
+}
+
+// A whole file as one read-only block of memory, mapped rather than read in
+// where the platform allows
+class MappedFile {
+public:
+	MappedFile() {}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile() {
+#ifndef _WIN32
+		if (mapping) munmap(mapping, length);
+#endif
+	}
+
+	bool open(const std::string& path) {
+#ifndef _WIN32
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		struct stat info;
+		bool ok = fstat(fd, &info) == 0 && info.st_size > 0;
+		if (ok) {
+			length = static_cast<std::size_t>(info.st_size);
+			void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+			ok = mapped != MAP_FAILED;
+			if (ok) mapping = mapped;
+		}
+		close(fd);
+		return ok;
+#else
+		std::ifstream file(path, std::ios::binary);
+		if (!file) return false;
+		buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		length = buffer.size();
+		return length > 0;
+#endif
+	}
+
+	const Byte* data() const {
+#ifndef _WIN32
+		return static_cast<const Byte*>(mapping);
+#else
+		return buffer.data();
+#endif
+	}
+
+	std::size_t size() const {
+		return length;
+	}
+
+private:
+	std::size_t length = 0;
+#ifndef _WIN32
+	void* mapping = nullptr;
+#else
+	std::vector<Byte> buffer;
+#endif
+};
+
+class StateWriter {
+public:
+	std::vector<Byte> data;
+
+	void u8(Byte value) {
+		data.push_back(value);
+	}
+
+	void u16(Word value) {
+		put(value, 2);
+	}
+
+	void u32(uint32_t value) {
+		put(value, 4);
+	}
+
+	void u64(uint64_t value) {
+		put(value, 8);
+	}
+
+	void bytes(const Byte* in, std::size_t size) {
+		data.insert(data.end(), in, in + size);
+	}
+
+private:
+	void put(uint64_t value, int size) {
+		for (int i = 0; i < size; i++) data.push_back(static_cast<Byte>(value >> (8 * i)));
+	}
+};
+
+// Reading past the end gives zeros and marks the reader as failed, so
+// parsing code can check once at the end instead of after every field
+class StateReader {
+public:
+	StateReader(const Byte* in, std::size_t in_size) : data(in), size(in_size) {}
+
+	bool failed = false;
+
+	Byte u8() {
+		return static_cast<Byte>(get(1));
+	}
+
+	Word u16() {
+		return static_cast<Word>(get(2));
+	}
+
+	uint32_t u32() {
+		return static_cast<uint32_t>(get(4));
+	}
+
+	uint64_t u64() {
+		return get(8);
+	}
+
+	// Pointer to the next count bytes, or nullptr if there aren't that many
+	const Byte* bytes(std::size_t count) {
+		if (failed || count > size - pos) {
+			failed = true;
+			return nullptr;
+		}
+		const Byte* out = data + pos;
+		pos += count;
+		return out;
+	}
+
+	bool at_end() const {
+		return pos == size;
+	}
+
+private:
+	const Byte* data;
+	std::size_t size;
+	std::size_t pos = 0;
+
+	uint64_t get(std::size_t count) {
+		const Byte* in = bytes(count);
+		uint64_t value = 0;
+		if (!in) return 0;
+		for (std::size_t i = 0; i < count; i++) value |= static_cast<uint64_t>(in[i]) << (8 * i);
+		return value;
+	}
+};
+
+// How each page of a core's address space is backed
+inline void classify_pages(const System& system, const SystemCore& core, Byte kinds[256], Byte args[256]) {
+	const std::vector<std::unique_ptr<SharedPage>>& shared = system.shared_pages();
+	for (int i = 0; i < 256; i++) {
+		MemoryPage* page = core.mmu.pages[i];
+		kinds[i] = SAVED_PAGE_DEVICE;
+		args[i] = 0;
+		bool found = false;
+		for (int j = 0; j < i && !found; j++) {
+			if (core.mmu.pages[j] == page) {
+				kinds[i] = SAVED_PAGE_MIRROR;
+				args[i] = static_cast<Byte>(j);
+				found = true;
+			}
+		}
+		for (std::size_t j = 0; j < shared.size() && !found; j++) {
+			if (shared[j].get() == page) {
+				kinds[i] = SAVED_PAGE_SHARED;
+				args[i] = static_cast<Byte>(j);
+				found = true;
+			}
+		}
+		if (found) continue;
+		if (dynamic_cast<RAMPage*>(page)) kinds[i] = SAVED_PAGE_RAM;
+		else if (dynamic_cast<BankWindow*>(page)) kinds[i] = SAVED_PAGE_BANK;
+	}
+}
+
+inline const Byte* image_page(const SystemCore& core, int page) {
+	static const Byte zeros[256] = {};
+	std::size_t start = static_cast<std::size_t>(page) * 256;
+	return core.image.size() >= start + 256 ? core.image.data() + start : zeros;
+}
+
+inline void save_cpu(StateWriter& out, const CPU& cpu) {
+	out.u8(static_cast<Byte>(cpu.type));
+	out.u8(cpu.A);
+	out.u8(cpu.X);
+	out.u8(cpu.Y);
+	out.u8(cpu.SP);
+	out.u8(cpu.SF);
+	out.u16(cpu.PC);
+	out.u16(cpu.addr_bus_value);
+	out.u8(cpu.data_bus_value);
+	out.u16(cpu.last_good_instruction);
+	out.u16(cpu.last_jump_origin);
+	out.u16(cpu.last_jump_target);
+	out.u64(cpu.cycle_count);
+	out.u64(cpu.instruction_count);
+	out.u64(cpu.idle_cycles_skipped);
+	out.u8(cpu.jumped_back ? 1 : 0);
+	out.u16(cpu.jump_back_origin);
+
+	const IdleLoop& loop = cpu.idle_loop;
+	out.u16(loop.origin);
+	out.u16(loop.target);
+	out.u8(loop.A);
+	out.u8(loop.X);
+	out.u8(loop.Y);
+	out.u8(loop.SP);
+	out.u8(loop.SF);
+	out.u64(loop.instructions);
+	out.u64(loop.cycles);
+	out.u64(loop.length);
+
+	out.u8(FUSED_IDIOM_COUNT);
+	for (unsigned long hits : cpu.fusion_hits) out.u64(hits);
+	out.u16(static_cast<Word>(CPU_HISTORY_SIZE));
+	for (const HistoryEntry& entry : cpu.history) {
+		out.u16(entry.PC);
+		out.u16(entry.address);
+		out.u8(entry.opcode);
+		out.u8(entry.A);
+		out.u8(entry.X);
+		out.u8(entry.Y);
+		out.u8(entry.SP);
+		out.u8(entry.SF);
+	}
+}
+
+inline void load_cpu(StateReader& in, CPU& cpu, bool apply) {
+	CPU loaded;
+	loaded.type = static_cast<CPUType>(in.u8());
+	loaded.A = in.u8();
+	loaded.X = in.u8();
+	loaded.Y = in.u8();
+	loaded.SP = in.u8();
+	loaded.SF = in.u8();
+	loaded.PC = in.u16();
+	loaded.addr_bus_value = in.u16();
+	loaded.data_bus_value = in.u8();
+	loaded.last_good_instruction = in.u16();
+	loaded.last_jump_origin = in.u16();
+	loaded.last_jump_target = in.u16();
+	loaded.cycle_count = static_cast<unsigned long>(in.u64());
+	loaded.instruction_count = static_cast<unsigned long>(in.u64());
+	loaded.idle_cycles_skipped = static_cast<unsigned long>(in.u64());
+	loaded.jumped_back = in.u8() != 0;
+	loaded.jump_back_origin = in.u16();
+
+	IdleLoop& loop = loaded.idle_loop;
+	loop.origin = in.u16();
+	loop.target = in.u16();
+	loop.A = in.u8();
+	loop.X = in.u8();
+	loop.Y = in.u8();
+	loop.SP = in.u8();
+	loop.SF = in.u8();
+	loop.instructions = static_cast<unsigned long>(in.u64());
+	loop.cycles = static_cast<unsigned long>(in.u64());
+	loop.length = static_cast<std::size_t>(in.u64());
+
+	if (in.u8() != FUSED_IDIOM_COUNT) in.failed = true;
+	for (unsigned long& hits : loaded.fusion_hits) hits = static_cast<unsigned long>(in.u64());
+	if (in.u16() != CPU_HISTORY_SIZE) in.failed = true;
+	for (HistoryEntry& entry : loaded.history) {
+		entry.PC = in.u16();
+		entry.address = in.u16();
+		entry.opcode = in.u8();
+		entry.A = in.u8();
+		entry.X = in.u8();
+		entry.Y = in.u8();
+		entry.SP = in.u8();
+		entry.SF = in.u8();
+	}
+	if (loaded.type != MOS && loaded.type != NES) in.failed = true;
+	if (!apply || in.failed) return;
+
+	cpu.type = loaded.type;
+	cpu.A = loaded.A;
+	cpu.X = loaded.X;
+	cpu.Y = loaded.Y;
+	cpu.SP = loaded.SP;
+	cpu.SF = loaded.SF;
+	cpu.PC = loaded.PC;
+	cpu.addr_bus_value = loaded.addr_bus_value;
+	cpu.data_bus_value = loaded.data_bus_value;
+	cpu.last_good_instruction = loaded.last_good_instruction;
+	cpu.last_jump_origin = loaded.last_jump_origin;
+	cpu.last_jump_target = loaded.last_jump_target;
+	cpu.cycle_count = loaded.cycle_count;
+	cpu.instruction_count = loaded.instruction_count;
+	cpu.idle_cycles_skipped = loaded.idle_cycles_skipped;
+	cpu.jumped_back = loaded.jumped_back;
+	cpu.jump_back_origin = loaded.jump_back_origin;
+	cpu.idle_loop = loaded.idle_loop;
+	std::copy(std::begin(loaded.fusion_hits), std::end(loaded.fusion_hits), std::begin(cpu.fusion_hits));
+	std::copy(std::begin(loaded.history), std::end(loaded.history), std::begin(cpu.history));
+}
+
+// Writes every core's CPU and memory plus the shared pages
+inline bool save_state(const std::string& path, System& system, bool compress, std::string& error) {
+	StateWriter body;
+	body.u32(static_cast<uint32_t>(system.cores.size()));
+	for (std::unique_ptr<SystemCore>& core : system.cores) {
+		body.u16(static_cast<Word>(core->name.size()));
+		body.bytes(reinterpret_cast<const Byte*>(core->name.data()), core->name.size());
+		body.u32(crc32(core->image.data(), core->image.size()));
+		save_cpu(body, core->cpu);
+
+		Byte kinds[256];
+		Byte args[256];
+		classify_pages(system, *core, kinds, args);
+		std::vector<int> changed;
+		for (int i = 0; i < 256; i++) {
+			body.u8(kinds[i]);
+			body.u8(args[i]);
+			if (kinds[i] == SAVED_PAGE_RAM && std::memcmp(core->mmu.pages[i]->read_data(), image_page(*core, i), 256) != 0) {
+				changed.push_back(i);
+			}
+		}
+
+		body.u16(static_cast<Word>(changed.size()));
+		for (int i : changed) {
+			const Byte* data = core->mmu.pages[i]->read_data();
+			const Byte* base = image_page(*core, i);
+			body.u8(static_cast<Byte>(i));
+			for (int j = 0; j < 256; j++) body.u8(data[j] ^ base[j]);
+		}
+
+		std::vector<Byte> mapper_state;
+		if (core->mapper) core->mapper->save_state(mapper_state);
+		body.u32(static_cast<uint32_t>(mapper_state.size()));
+		body.bytes(mapper_state.data(), mapper_state.size());
+	}
+
+	const std::vector<std::unique_ptr<SharedPage>>& shared = system.shared_pages();
+	body.u16(static_cast<Word>(shared.size()));
+	for (const std::unique_ptr<SharedPage>& page : shared) {
+		for (int i = 0; i < 256; i++) body.u8(page->read_byte(static_cast<Byte>(i)));
+	}
+
+	std::vector<Byte> packed;
+	if (compress) packed = lz_compress(body.data.data(), body.data.size());
+	const std::vector<Byte>& stored = compress ? packed : body.data;
+
+	StateWriter header;
+	header.bytes(reinterpret_cast<const Byte*>(SAVE_STATE_MAGIC), sizeof(SAVE_STATE_MAGIC));
+	header.u32(SAVE_STATE_VERSION);
+	header.u32(compress ? SAVE_STATE_COMPRESSED : 0);
+	header.u32(static_cast<uint32_t>(body.data.size()));
+	header.u32(static_cast<uint32_t>(stored.size()));
+	header.u32(crc32(body.data.data(), body.data.size()));
+	header.u32(0);
+
+	std::ofstream file(path, std::ios::binary);
+	file.write(reinterpret_cast<const char*>(header.data.data()), static_cast<std::streamsize>(header.data.size()));
+	file.write(reinterpret_cast<const char*>(stored.data()), static_cast<std::streamsize>(stored.size()));
+	if (!file) {
+		error = "could not write '" + path + "'";
+		return false;
+	}
+	return true;
+}
+
+// Parses the body; only changes the machine when apply is set. Loading runs
+// it once without to make sure everything fits before touching anything.
+inline bool apply_state_body(StateReader& in, System& system, bool apply, std::string& error) {
+	if (in.u32() != system.cores.size()) {
+		error = "it has a different number of CPUs";
+		return false;
+	}
+	for (std::unique_ptr<SystemCore>& core : system.cores) {
+		Word name_size = in.u16();
+		in.bytes(name_size);
+		if (in.u32() != crc32(core->image.data(), core->image.size())) {
+			error = "it was made with a different ROM for '" + core->name + "'";
+			return false;
+		}
+		load_cpu(in, core->cpu, apply);
+		if (apply) core->status = CONTINUE;
+
+		Byte kinds[256];
+		Byte args[256];
+		classify_pages(system, *core, kinds, args);
+		for (int i = 0; i < 256; i++) {
+			Byte kind = in.u8();
+			Byte arg = in.u8();
+			if (!in.failed && (kind != kinds[i] || arg != args[i])) {
+				error = "the memory layout of '" + core->name + "' doesn't match (ROM, mapper or --share options differ)";
+				return false;
+			}
+		}
+
+		if (apply) {
+			for (int i = 0; i < 256; i++) {
+				if (kinds[i] == SAVED_PAGE_RAM) core->mmu.load_page(static_cast<Byte>(i), image_page(*core, i));
+			}
+		}
+		Word changed = in.u16();
+		for (Word n = 0; n < changed; n++) {
+			Byte page = in.u8();
+			const Byte* delta = in.bytes(256);
+			if (in.failed) break;
+			if (kinds[page] != SAVED_PAGE_RAM) {
+				error = "it has RAM contents for a page that isn't RAM";
+				return false;
+			}
+			if (!apply) continue;
+			Byte* data = core->mmu.pages[page]->raw_data();
+			const Byte* base = image_page(*core, page);
+			for (int j = 0; j < 256; j++) data[j] = static_cast<Byte>(delta[j] ^ base[j]);
+		}
+
+		uint32_t mapper_size = in.u32();
+		const Byte* mapper_state = in.bytes(mapper_size);
+		if (in.failed) break;
+		if (!core->mapper ? mapper_size != 0 : mapper_size == 0) {
+			error = "it was made with a different mapper";
+			return false;
+		}
+		if (core->mapper && !core->mapper->load_state(mapper_state, mapper_size, apply)) {
+			error = "the mapper state is invalid";
+			return false;
+		}
+	}
+
+	const std::vector<std::unique_ptr<SharedPage>>& shared = system.shared_pages();
+	if (in.u16() != shared.size() && !in.failed) {
+		error = "it has a different number of shared pages";
+		return false;
+	}
+	for (const std::unique_ptr<SharedPage>& page : shared) {
+		const Byte* data = in.bytes(256);
+		if (!apply || !data) continue;
+		for (int i = 0; i < 256; i++) page->write_byte(static_cast<Byte>(i), data[i]);
+	}
+
+	if (in.failed || !in.at_end()) {
+		error = "it is truncated or corrupt";
+		return false;
+	}
+	return true;
+}
+
+// Restores a state into a machine set up the same way (same ROMs, mapper and
+// shared pages) as the one that saved it
+inline bool load_state(const std::string& path, System& system, std::string& error) {
+	MappedFile file;
+	if (!file.open(path)) {
+		error = "could not open '" + path + "'";
+		return false;
+	}
+
+	StateReader header(file.data(), file.size());
+	const Byte* magic = header.bytes(sizeof(SAVE_STATE_MAGIC));
+	uint32_t version = header.u32();
+	uint32_t flags = header.u32();
+	uint32_t body_size = header.u32();
+	uint32_t stored_size = header.u32();
+	uint32_t checksum = header.u32();
+	header.u32();
+	if (header.failed || std::memcmp(magic, SAVE_STATE_MAGIC, sizeof(SAVE_STATE_MAGIC)) != 0) {
+		error = "'" + path + "' is not a save state";
+		return false;
+	}
+	if (version != SAVE_STATE_VERSION) {
+		error = "'" + path + "' is version " + std::to_string(version) + ", expected " + std::to_string(SAVE_STATE_VERSION);
+		return false;
+	}
+	if (file.size() - SAVE_STATE_HEADER_SIZE != stored_size) {
+		error = "'" + path + "' is truncated";
+		return false;
+	}
+
+	// Uncompressed states are parsed straight out of the mapping
+	const Byte* body = file.data() + SAVE_STATE_HEADER_SIZE;
+	std::vector<Byte> unpacked;
+	if (flags & SAVE_STATE_COMPRESSED) {
+		unpacked.resize(body_size);
+		if (!lz_decompress(body, stored_size, unpacked.data(), body_size)) {
+			error = "'" + path + "' is corrupt";
+			return false;
+		}
+		body = unpacked.data();
+	}
+	else if (body_size != stored_size) {
+		error = "'" + path + "' is corrupt";
+		return false;
+	}
+	if (crc32(body, body_size) != checksum) {
+		error = "'" + path + "' failed its checksum";
+		return false;
+	}
+
+	StateReader check(body, body_size);
+	if (!apply_state_body(check, system, false, error)) {
+		error = "Can't load '" + path + "': " + error;
+		return false;
+	}
+	StateReader in(body, body_size);
+	return apply_state_body(in, system, true, error);
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "types.hpp"
+#include "cpu.hpp"
+#include "mmu.hpp"
+
+// Start of the shared segment. The main CPU's 64K of RAM follows at
+// ram_offset and is the emulator's actual memory, so it's always live. The
+// rest of the header is a copy of the CPU state, refreshed at the same points
+// as metrics: every BACKGROUND_CHECK_INTERVAL instructions during `r`, every
+// BENCH_CHUNK_CYCLES with --bench and after every monitor command.
+//
+// The copy is guarded by a sequence lock. Readers should:
+//   1. read sequence (acquire), and start over while it's odd
+//   2. copy the fields they want
+//   3. read sequence again (after an acquire fence) and start over if it
+//      changed
+// RAM isn't covered by it, since the program changes it all the time.
+struct SharedStateHeader {
+	char magic[8];           // "YA6502\0\0"
+	uint32_t version;        // SHARED_STATE_VERSION
+	uint32_t ram_offset;     // Where RAM starts in the segment
+	std::atomic<uint64_t> sequence;
+	uint64_t cycle_count;
+	uint64_t instruction_count;
+	uint16_t PC;
+	uint8_t A, X, Y, SP, SF;
+	uint8_t reserved;
+	// 1 where the 256 bytes at ram_offset + page * 256 are what the CPU sees
+	// at that page, 0 where something else (a mapper, a device, a mirror) is
+	// mapped in instead
+	uint8_t ram_pages[256];
+};
+
+static constexpr uint32_t SHARED_STATE_VERSION = 1;
+// The header gets a page of its own so RAM starts page-aligned
+static constexpr std::size_t SHARED_STATE_RAM_OFFSET = 4096;
+static constexpr std::size_t SHARED_STATE_SIZE = SHARED_STATE_RAM_OFFSET + 65536;
+static_assert(sizeof(SharedStateHeader) <= SHARED_STATE_RAM_OFFSET, "shared state header doesn't fit");
+
+// A POSIX shared memory segment (--shm <name>) holding the machine's RAM
+// and registers, for tools that want to watch it without the monitor
+class SharedMemory {
+public:
+	~SharedMemory() {
+		close_segment();
+	}
+
+	// Creates the segment, replacing any left over from an earlier run
+	bool open(const std::string& segment_name, std::ostream& log) {
+#ifndef _WIN32
+		name = segment_name[0] == '/' ? segment_name : "/" + segment_name;
+		shm_unlink(name.c_str());
+		int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+		if (fd < 0) {
+			log << "Could not create shared memory '" << name << "': " << std::strerror(errno) << std::endl;
+			return false;
+		}
+		if (ftruncate(fd, static_cast<off_t>(SHARED_STATE_SIZE)) != 0) {
+			log << "Could not size shared memory '" << name << "': " << std::strerror(errno) << std::endl;
+			::close(fd);
+			shm_unlink(name.c_str());
+			return false;
+		}
+		void* mapped = mmap(nullptr, SHARED_STATE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (mapped == MAP_FAILED) {
+			log << "Could not map shared memory '" << name << "': " << std::strerror(errno) << std::endl;
+			shm_unlink(name.c_str());
+			return false;
+		}
+		segment = static_cast<Byte*>(mapped);
+		header = new (segment) SharedStateHeader();
+		std::memcpy(header->magic, "YA6502\0\0", 8);
+		header->version = SHARED_STATE_VERSION;
+		header->ram_offset = static_cast<uint32_t>(SHARED_STATE_RAM_OFFSET);
+		return true;
+#else
+		log << "Shared memory needs POSIX shm_open, which this platform doesn't have." << std::endl;
+		(void)segment_name;
+		return false;
+#endif
+	}
+
+	// Moves mmu's RAM into the segment. Has to happen before anything is
+	// loaded or mapped, since the MMU starts over.
+	void attach(MMU& memory) {
+		mmu = &memory;
+		mmu->initialize(segment + SHARED_STATE_RAM_OFFSET);
+	}
+
+	void publish(const CPU& cpu) {
+		if (!header) return;
+		uint64_t sequence = header->sequence.load(std::memory_order_relaxed);
+		header->sequence.store(sequence + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		header->cycle_count = cpu.cycle_count;
+		header->instruction_count = cpu.instruction_count;
+		header->PC = cpu.PC;
+		header->A = cpu.A;
+		header->X = cpu.X;
+		header->Y = cpu.Y;
+		header->SP = cpu.SP;
+		header->SF = cpu.SF;
+		for (std::size_t i = 0; i < 256; i++) {
+			header->ram_pages[i] = mmu && mmu->ram && mmu->pages[i] == &mmu->ram->pages[i] ? 1 : 0;
+		}
+		header->sequence.store(sequence + 2, std::memory_order_release);
+	}
+
+private:
+	std::string name;
+	Byte* segment = nullptr;
+	SharedStateHeader* header = nullptr;
+	MMU* mmu = nullptr;
+
+	void close_segment() {
+#ifndef _WIN32
+		if (!segment) return;
+		header->~SharedStateHeader();
+		munmap(segment, SHARED_STATE_SIZE);
+		shm_unlink(name.c_str());
+		segment = nullptr;
+		header = nullptr;
+#endif
+	}
+};
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <stdint.h>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <cctype>
+#include "types.hpp"
+#include "helpers.hpp"
+
+// Labels loaded from assembler/debugger output. Lookups in both directions
+// are O(1): names go through a hash map, addresses through a 64K index.
+class SymbolTable {
+public:
+	SymbolTable() : exact(65536, -1), nearest(65536, -1) {}
+
+	// Understands ca65/ld65 debug files (sym lines), VICE label files
+	// ("al C:c000 .label") and plain "label = $c000" maps, even mixed.
+	// Returns the number of symbols loaded, or -1 if the file can't be read.
+	int load(const std::string& path) {
+		std::ifstream file(path);
+		if (!file) return -1;
+
+		int loaded = 0;
+		std::string line;
+		while (std::getline(file, line)) {
+			if (!line.empty() && line.back() == '\r') line.pop_back();
+			std::string name;
+			Word address = 0;
+			if (parse_line(line, name, address)) {
+				add(name, address);
+				loaded++;
+			}
+		}
+		return loaded;
+	}
+
+	void add(const std::string& name, Word address) {
+		auto found = by_name.find(name);
+		if (found != by_name.end()) {
+			Word old_address = found->second;
+			found->second = address;
+			if (old_address != address) forget(name, old_address);
+		}
+		else {
+			by_name.emplace(name, address);
+		}
+
+		int32_t id = static_cast<int32_t>(names.size());
+		names.push_back(name);
+		name_addresses.push_back(address);
+		if (exact[address] < 0) {
+			exact[address] = id;
+		}
+		nearest_dirty = true;
+	}
+
+	bool empty() const {
+		return by_name.empty();
+	}
+
+	std::size_t size() const {
+		return by_name.size();
+	}
+
+	bool lookup(const std::string& name, Word& address) const {
+		auto found = by_name.find(name);
+		if (found == by_name.end()) return false;
+		address = found->second;
+		return true;
+	}
+
+	// Exact match only, nullptr if there is no label at that address
+	const std::string* name_at(Word address) const {
+		int32_t id = exact[address];
+		return id < 0 ? nullptr : &names[static_cast<std::size_t>(id)];
+	}
+
+	// "label" or "label+3" for addresses shortly after a label, "" otherwise
+	std::string describe(Word address) {
+		if (nearest_dirty) rebuild_nearest();
+		int32_t id = nearest[address];
+		if (id < 0) return "";
+		const std::string& name = names[static_cast<std::size_t>(id)];
+		Word base = name_addresses[static_cast<std::size_t>(id)];
+		if (base == address) return name;
+		std::ostringstream oss;
+		oss << name << "+" << std::dec << (address - base);
+		return oss.str();
+	}
+
+private:
+	// How far past a label an address still gets described relative to it
+	static constexpr int NEAREST_RANGE = 256;
+
+	std::vector<std::string> names;
+	std::vector<Word> name_addresses;
+	std::unordered_map<std::string, Word> by_name;
+	std::vector<int32_t> exact;
+	std::vector<int32_t> nearest;
+	bool nearest_dirty = false;
+
+	// name has moved away from address. If the index still gives it there,
+	// use another label that's still defined at address, or none.
+	void forget(const std::string& name, Word address) {
+		int32_t id = exact[address];
+		if (id < 0 || names[static_cast<std::size_t>(id)] != name) return;
+		exact[address] = -1;
+		for (std::size_t i = 0; i < names.size(); i++) {
+			if (name_addresses[i] != address || names[i] == name) continue;
+			auto other = by_name.find(names[i]);
+			if (other != by_name.end() && other->second == address) {
+				exact[address] = static_cast<int32_t>(i);
+				break;
+			}
+		}
+		nearest_dirty = true;
+	}
+
+	void rebuild_nearest() {
+		int32_t current = -1;
+		int current_address = 0;
+		for (int address = 0; address < 65536; address++) {
+			std::size_t index = static_cast<std::size_t>(address);
+			if (exact[index] >= 0) {
+				current = exact[index];
+				current_address = address;
+			}
+			nearest[index] = (current >= 0 && address - current_address < NEAREST_RANGE) ? current : -1;
+		}
+		nearest_dirty = false;
+	}
+
+	static std::string trim(const std::string& str) {
+		std::size_t start = str.find_first_not_of(" \t");
+		if (start == std::string::npos) return "";
+		std::size_t end = str.find_last_not_of(" \t");
+		return str.substr(start, end - start + 1);
+	}
+
+	// Finds key=value in a comma separated ld65 record
+	static bool dbg_field(const std::string& line, const std::string& key, std::string& value) {
+		std::size_t pos = 0;
+		while ((pos = line.find(key + "=", pos)) != std::string::npos) {
+			if (pos == 0 || line[pos - 1] == ',' || line[pos - 1] == '\t' || line[pos - 1] == ' ') {
+				std::size_t start = pos + key.size() + 1;
+				std::size_t end = line.find(',', start);
+				value = line.substr(start, end == std::string::npos ? std::string::npos : end - start);
+				if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+					value = value.substr(1, value.size() - 2);
+				}
+				return true;
+			}
+			pos++;
+		}
+		return false;
+	}
+
+	static bool parse_line(const std::string& raw, std::string& name, Word& address) {
+		std::string line = trim(raw);
+		if (line.empty() || line[0] == ';' || line[0] == '#') return false;
+
+		try {
+			if (line.compare(0, 4, "sym\t") == 0 || line.compare(0, 4, "sym ") == 0) {
+				// sym id=3,name="main",addrsize=absolute,scope=0,def=2,ref=5,val=0xC000,seg=1,type=lab
+				std::string type, value;
+				if (!dbg_field(line, "name", name) || !dbg_field(line, "val", value)) return false;
+				if (dbg_field(line, "type", type) && type != "lab") return false;
+				address = static_cast<Word>(parse_numeric_literal(value));
+				return true;
+			}
+
+			if (line.compare(0, 3, "al ") == 0) {
+				// al C:c000 .main
+				std::istringstream parts(line.substr(3));
+				std::string value;
+				parts >> value >> name;
+				if (value.compare(0, 2, "C:") == 0) value = value.substr(2);
+				if (!name.empty() && name[0] == '.') name = name.substr(1);
+				if (name.empty()) return false;
+				address = static_cast<Word>(std::stoi(value, nullptr, 16));
+				return true;
+			}
+
+			std::size_t equals = line.find('=');
+			if (equals != std::string::npos) {
+				// main = $c000
+				name = trim(line.substr(0, equals));
+				std::string value = trim(line.substr(equals + 1));
+				std::size_t comment = value.find(';');
+				if (comment != std::string::npos) value = trim(value.substr(0, comment));
+				if (name.empty() || value.empty()) return false;
+				address = static_cast<Word>(parse_numeric_literal(value));
+				return true;
+			}
+		}
+		catch (const std::exception&) {
+			// Lines we can't make sense of are skipped
+		}
+		return false;
+	}
+};
+
+// Turns user input into an address: a label (optionally "label+offset") or
+// anything parse_numeric_literal accepts. Throws like parse_numeric_literal.
+inline Word resolve_address(const std::string& str, const SymbolTable& symbols) {
+	Word address = 0;
+	if (symbols.lookup(str, address)) return address;
+
+	std::size_t plus = str.find('+');
+	if (plus != std::string::npos && plus > 0 && symbols.lookup(str.substr(0, plus), address)) {
+		return static_cast<Word>(address + parse_numeric_literal(str.substr(plus + 1)));
+	}
+
+	char first = str.empty() ? '\0' : str[0];
+	if (std::isalpha(static_cast<unsigned char>(first)) || first == '_' || first == '@' || first == '.') {
+		throw std::invalid_argument("unknown symbol '" + str + "'");
+	}
+	return static_cast<Word>(parse_numeric_literal(str));
+}
+
+// "0xc000" or "0xc000 (main)"
+inline std::string format_address(Word address, SymbolTable* symbols) {
+	std::ostringstream oss;
+	oss << "0x" << std::hex << (int)address;
+	if (symbols) {
+		std::string name = symbols->describe(address);
+		if (!name.empty()) oss << " (" << name << ")";
+	}
+	return oss.str();
+}
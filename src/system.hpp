@@ -0,0 +1,225 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "types.hpp"
+#include "page.hpp"
+#include "mmu.hpp"
+#include "cpu.hpp"
+#include "mapper.hpp"
+
+// Memory that several processors see, e.g. a mailbox between a main CPU and
+// a drive CPU. Every byte is atomic so cores on different host threads can
+// use it, and the page is volatile so nobody skips a loop that polls it.
+class SharedPage : public MemoryPage {
+public:
+	SharedPage() {
+		for (std::atomic<Byte>& byte : data) byte.store(0, std::memory_order_relaxed);
+	}
+
+	Byte read_byte(Byte address) const {
+		if (touched) *touched = true;
+		accesses.fetch_add(1, std::memory_order_relaxed);
+		return data[address].load(std::memory_order_acquire);
+	}
+
+	void write_byte(Byte address, Byte value) {
+		if (touched) *touched = true;
+		accesses.fetch_add(1, std::memory_order_relaxed);
+		data[address].store(value, std::memory_order_release);
+	}
+
+	bool is_volatile() const {
+		return true;
+	}
+
+	// Set on every access when running single-threaded, so the scheduler
+	// can hand over to another core right after it
+	bool* touched = nullptr;
+
+	// From every core, for metrics
+	mutable std::atomic<unsigned long> accesses{0};
+
+private:
+	std::atomic<Byte> data[256];
+};
+
+struct SystemCore {
+	std::string name;
+	CPU cpu;
+	MMU mmu;
+	CPUStatus status = CONTINUE;
+	// What was loaded into plain memory at startup; save states only store
+	// how RAM differs from it
+	std::vector<Byte> image;
+	Mapper* mapper = nullptr;
+};
+
+// Several CPUs, each with its own MMU, plus the pages they share. All cores
+// run off the same clock. The scheduler lets each core run for at most one
+// quantum past the slowest of the others before switching, and (optionally)
+// switches right after any access to a shared page so the cores see each
+// other's mailbox writes in roughly the right order.
+class System {
+public:
+	unsigned long quantum = 1000;
+	bool sync_on_shared = true;
+	std::vector<std::unique_ptr<SystemCore>> cores;
+
+	// Core that stopped the last run, if any did
+	SystemCore* stopped_core = nullptr;
+
+	SystemCore& add_core(const std::string& name) {
+		std::unique_ptr<SystemCore> core = std::make_unique<SystemCore>();
+		core->name = name;
+		core->mmu.initialize();
+		cores.push_back(std::move(core));
+		return *cores.back();
+	}
+
+	// Maps a new shared page at the same page number in every core
+	SharedPage& share_page(Byte page_number) {
+		shared.push_back(std::make_unique<SharedPage>());
+		SharedPage& page = *shared.back();
+		page.touched = &shared_touched;
+		for (std::unique_ptr<SystemCore>& core : cores) {
+			core->mmu.map_page(page_number, &page);
+		}
+		return page;
+	}
+
+	const std::vector<std::unique_ptr<SharedPage>>& shared_pages() const {
+		return shared;
+	}
+
+	// Runs every core for `cycles` more cycles on one host thread. Stops early
+	// (with that core's status) as soon as any core halts, hits something
+	// invalid or stops on a breakpoint.
+	CPUStatus run(unsigned long cycles) {
+		stopped_core = nullptr;
+		std::vector<unsigned long> start;
+		for (std::unique_ptr<SystemCore>& core : cores) {
+			start.push_back(core->cpu.cycle_count);
+			core->status = CONTINUE;
+		}
+
+		while (true) {
+			// The core furthest behind goes next
+			std::size_t next = cores.size();
+			unsigned long behind = ULONG_MAX;
+			unsigned long runner_up = ULONG_MAX;
+			for (std::size_t i = 0; i < cores.size(); i++) {
+				unsigned long elapsed = cores[i]->cpu.cycle_count - start[i];
+				if (elapsed < behind) {
+					runner_up = behind;
+					behind = elapsed;
+					next = i;
+				}
+				else if (elapsed < runner_up) {
+					runner_up = elapsed;
+				}
+			}
+			if (next == cores.size() || behind >= cycles) return CONTINUE;
+
+			// It can get up to one quantum ahead of the next slowest core
+			unsigned long limit = runner_up == ULONG_MAX ? cycles : std::min(cycles, runner_up + quantum);
+			SystemCore& core = *cores[next];
+			CPUStatus status = run_core(core, start[next] + limit, sync_on_shared);
+			if (status != CONTINUE) {
+				stopped_core = &core;
+				return status;
+			}
+		}
+	}
+
+	// Same, but every core gets its own host thread. The cores only wait for
+	// each other at quantum boundaries; shared pages are still atomic, but
+	// the order in which cores see each other's writes within a quantum is up
+	// to the host.
+	CPUStatus run_threaded(unsigned long cycles) {
+		stopped_core = nullptr;
+		for (std::unique_ptr<SharedPage>& page : shared) page->touched = nullptr;
+
+		std::mutex lock;
+		std::condition_variable quantum_done;
+		std::size_t arrived = 0;
+		unsigned long generation = 0;
+		bool stop = false;
+
+		auto worker = [&](SystemCore& core) {
+			unsigned long start = core.cpu.cycle_count;
+			core.status = CONTINUE;
+			for (unsigned long done = 0; done < cycles; ) {
+				done = std::min(cycles, done + quantum);
+				if (core.status == CONTINUE) {
+					core.status = run_core(core, start + done, false);
+				}
+
+				std::unique_lock<std::mutex> guard(lock);
+				if (core.status != CONTINUE) {
+					stop = true;
+					if (!stopped_core) stopped_core = &core;
+				}
+				unsigned long waiting_for = generation;
+				if (++arrived == cores.size()) {
+					arrived = 0;
+					generation++;
+					quantum_done.notify_all();
+				}
+				else {
+					quantum_done.wait(guard, [&] { return generation != waiting_for; });
+				}
+				if (stop) break;
+			}
+		};
+
+		std::vector<std::thread> threads;
+		for (std::size_t i = 1; i < cores.size(); i++) {
+			threads.emplace_back(worker, std::ref(*cores[i]));
+		}
+		if (!cores.empty()) worker(*cores[0]);
+		for (std::thread& thread : threads) thread.join();
+
+		for (std::unique_ptr<SharedPage>& page : shared) page->touched = &shared_touched;
+		return stopped_core ? stopped_core->status : CONTINUE;
+	}
+
+	// Brings every core other than leader up to the leader's cycle count.
+	// The monitor calls this after each instruction of the main core.
+	// Returns a core that stopped on the way, if one did.
+	SystemCore* catch_up(const SystemCore& leader) {
+		SystemCore* stopped = nullptr;
+		for (std::unique_ptr<SystemCore>& core : cores) {
+			if (core.get() == &leader || core->status != CONTINUE) continue;
+			core->status = run_core(*core, leader.cpu.cycle_count, false);
+			if (core->status != CONTINUE && !stopped) stopped = core.get();
+		}
+		return stopped;
+	}
+
+private:
+	std::vector<std::unique_ptr<SharedPage>> shared;
+	bool shared_touched = false;
+
+	// Runs one core until its cycle count reaches end, it stops, or (with
+	// yield_on_shared) it touches a shared page
+	CPUStatus run_core(SystemCore& core, unsigned long end, bool yield_on_shared) {
+		CPU& cpu = core.cpu;
+		// Idle loops can skip ahead to the end of the slice, never past it
+		cpu.cycle_deadline = end;
+		shared_touched = false;
+		while (cpu.cycle_count < end) {
+			CPUStatus status = cpu.exec_instruction(core.mmu, true);
+			if (status != CONTINUE) return status;
+			if (yield_on_shared && shared_touched) break;
+		}
+		return CONTINUE;
+	}
+};
@@ -0,0 +1,408 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "types.hpp"
+#include "symbols.hpp"
+
+// One line of an execution trace, i.e. the machine state right before an
+// instruction executes. Not every source has every field (our own text logs
+// have no SP or cycle count), so each record says which fields it carries.
+struct TraceRecord {
+	Word PC = 0;
+	Byte opcode = 0;
+	Byte A = 0, X = 0, Y = 0;
+	Byte SF = 0;
+	Byte SP = 0;
+	unsigned long cycles = 0;
+	Byte fields = 0;
+};
+
+static constexpr Byte TRACE_FIELD_PC     = 0b00000001;
+static constexpr Byte TRACE_FIELD_OPCODE = 0b00000010;
+static constexpr Byte TRACE_FIELD_REGS   = 0b00000100; // A, X, Y
+static constexpr Byte TRACE_FIELD_SF     = 0b00001000;
+static constexpr Byte TRACE_FIELD_SP     = 0b00010000;
+static constexpr Byte TRACE_FIELD_CYCLES = 0b00100000;
+static constexpr Byte TRACE_FIELD_ALL    = 0b00111111;
+
+// Binary trace layout: an 16 byte header followed by fixed 16 byte records,
+// everything little-endian.
+//   header: "YA6502TR" | u32 version | u32 record size
+//   record: u16 PC | opcode | A | X | Y | SF | SP | u64 cycles
+static constexpr char TRACE_BINARY_MAGIC[8] = { 'Y', 'A', '6', '5', '0', '2', 'T', 'R' };
+static constexpr uint32_t TRACE_BINARY_VERSION = 1;
+static constexpr std::size_t TRACE_BINARY_RECORD_SIZE = 16;
+
+inline void trace_put_u32(char* out, uint32_t value) {
+	for (int i = 0; i < 4; i++) {
+		out[i] = static_cast<char>((value >> (8 * i)) & 0xFF);
+	}
+}
+
+inline uint32_t trace_get_u32(const char* in) {
+	uint32_t value = 0;
+	for (int i = 0; i < 4; i++) {
+		value |= static_cast<uint32_t>(static_cast<Byte>(in[i])) << (8 * i);
+	}
+	return value;
+}
+
+inline void trace_encode_record(const TraceRecord& rec, char* out) {
+	out[0] = static_cast<char>(rec.PC & 0xFF);
+	out[1] = static_cast<char>(rec.PC >> 8);
+	out[2] = static_cast<char>(rec.opcode);
+	out[3] = static_cast<char>(rec.A);
+	out[4] = static_cast<char>(rec.X);
+	out[5] = static_cast<char>(rec.Y);
+	out[6] = static_cast<char>(rec.SF);
+	out[7] = static_cast<char>(rec.SP);
+	uint64_t cycles = rec.cycles;
+	for (int i = 0; i < 8; i++) {
+		out[8 + i] = static_cast<char>((cycles >> (8 * i)) & 0xFF);
+	}
+}
+
+inline TraceRecord trace_decode_record(const char* in) {
+	TraceRecord rec;
+	rec.PC = static_cast<Word>(static_cast<Byte>(in[0]) | (static_cast<Byte>(in[1]) << 8));
+	rec.opcode = static_cast<Byte>(in[2]);
+	rec.A = static_cast<Byte>(in[3]);
+	rec.X = static_cast<Byte>(in[4]);
+	rec.Y = static_cast<Byte>(in[5]);
+	rec.SF = static_cast<Byte>(in[6]);
+	rec.SP = static_cast<Byte>(in[7]);
+	uint64_t cycles = 0;
+	for (int i = 0; i < 8; i++) {
+		cycles |= static_cast<uint64_t>(static_cast<Byte>(in[8 + i])) << (8 * i);
+	}
+	rec.cycles = static_cast<unsigned long>(cycles);
+	rec.fields = TRACE_FIELD_ALL;
+	return rec;
+}
+
+inline std::string format_trace_record(const TraceRecord& rec, SymbolTable* symbols = nullptr) {
+	std::ostringstream oss;
+	oss << std::hex << std::setfill('0');
+	oss << std::setw(4) << (int)rec.PC;
+	if (rec.fields & TRACE_FIELD_OPCODE) oss << " " << std::setw(2) << (int)rec.opcode;
+	else oss << "   ";
+	if (symbols) {
+		oss << " " << std::left << std::setw(24) << std::setfill(' ') << symbols->describe(rec.PC)
+			<< std::right << std::setfill('0');
+	}
+	if (rec.fields & TRACE_FIELD_REGS) {
+		oss << "  A:" << std::setw(2) << (int)rec.A;
+		oss << " X:" << std::setw(2) << (int)rec.X;
+		oss << " Y:" << std::setw(2) << (int)rec.Y;
+	}
+	if (rec.fields & TRACE_FIELD_SF) oss << " P:" << std::setw(2) << (int)rec.SF;
+	if (rec.fields & TRACE_FIELD_SP) oss << " SP:" << std::setw(2) << (int)rec.SP;
+	if (rec.fields & TRACE_FIELD_CYCLES) oss << " CYC:" << std::dec << rec.cycles;
+	return oss.str();
+}
+
+class TraceWriter {
+public:
+	bool open(const std::string& path) {
+		out.open(path, std::ios::binary);
+		if (!out) return false;
+		char header[16];
+		std::memcpy(header, TRACE_BINARY_MAGIC, 8);
+		trace_put_u32(header + 8, TRACE_BINARY_VERSION);
+		trace_put_u32(header + 12, static_cast<uint32_t>(TRACE_BINARY_RECORD_SIZE));
+		out.write(header, sizeof(header));
+		return true;
+	}
+
+	bool is_open() const {
+		return out.is_open();
+	}
+
+	void write(const TraceRecord& rec) {
+		char buf[TRACE_BINARY_RECORD_SIZE];
+		trace_encode_record(rec, buf);
+		out.write(buf, sizeof(buf));
+	}
+
+	void close() {
+		out.close();
+	}
+
+private:
+	std::ofstream out;
+};
+
+// Streams a reference trace one record at a time. Understands the binary
+// format above as well as text logs in the nestest.log layout, e.g.
+//   C000  4C F5 C5  JMP $C5F5     A:00 X:00 Y:00 P:24 SP:FD PPU:  0, 21 CYC:7
+// which also covers the text logs written by the 'l' command.
+class TraceReader {
+public:
+	bool open(const std::string& path) {
+		in.open(path, std::ios::binary);
+		if (!in) return false;
+
+		char magic[8] = { 0 };
+		in.read(magic, 8);
+		if (in.gcount() == 8 && std::memcmp(magic, TRACE_BINARY_MAGIC, 8) == 0) {
+			char rest[8];
+			in.read(rest, 8);
+			if (in.gcount() != 8 || trace_get_u32(rest) != TRACE_BINARY_VERSION
+				|| trace_get_u32(rest + 4) != TRACE_BINARY_RECORD_SIZE) {
+				return false;
+			}
+			binary = true;
+		}
+		else {
+			in.clear();
+			in.seekg(0);
+			binary = false;
+		}
+		return true;
+	}
+
+	bool is_binary() const {
+		return binary;
+	}
+
+	unsigned long line_number() const {
+		return line_no;
+	}
+
+	bool next(TraceRecord& rec) {
+		if (binary) {
+			if (buffer_pos >= buffer_len && !refill()) return false;
+			rec = trace_decode_record(buffer.data() + buffer_pos);
+			buffer_pos += TRACE_BINARY_RECORD_SIZE;
+			line_no++;
+			return true;
+		}
+
+		while (std::getline(in, line)) {
+			line_no++;
+			if (parse_text_line(line, rec)) return true;
+		}
+		return false;
+	}
+
+private:
+	std::ifstream in;
+	bool binary = false;
+	unsigned long line_no = 0;
+	std::string line;
+	std::vector<char> buffer;
+	std::size_t buffer_pos = 0;
+	std::size_t buffer_len = 0;
+
+	bool refill() {
+		buffer.resize(TRACE_BINARY_RECORD_SIZE * 4096);
+		in.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+		std::size_t got = static_cast<std::size_t>(in.gcount());
+		buffer_len = got - got % TRACE_BINARY_RECORD_SIZE;
+		buffer_pos = 0;
+		return buffer_len > 0;
+	}
+
+	static int hex_digit(char c) {
+		if (c >= '0' && c <= '9') return c - '0';
+		if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+		if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+		return -1;
+	}
+
+	// Parses exactly n hex digits at str[pos]
+	static bool parse_hex(const std::string& str, std::size_t pos, int n, unsigned& value) {
+		if (pos + static_cast<std::size_t>(n) > str.size()) return false;
+		value = 0;
+		for (int i = 0; i < n; i++) {
+			int d = hex_digit(str[pos + static_cast<std::size_t>(i)]);
+			if (d < 0) return false;
+			value = (value << 4) | static_cast<unsigned>(d);
+		}
+		return true;
+	}
+
+	static bool parse_field(const std::string& str, const char* key, Byte& value) {
+		// Keys are preceded by a space so "A:" doesn't match inside "SP:"
+		std::size_t pos = str.find(key);
+		if (pos == std::string::npos) return false;
+		unsigned parsed = 0;
+		if (!parse_hex(str, pos + std::strlen(key), 2, parsed)) return false;
+		value = static_cast<Byte>(parsed);
+		return true;
+	}
+
+	static bool parse_text_line(const std::string& str, TraceRecord& rec) {
+		rec = TraceRecord();
+		unsigned parsed = 0;
+		if (!parse_hex(str, 0, 4, parsed)) return false;
+		rec.PC = static_cast<Word>(parsed);
+		rec.fields |= TRACE_FIELD_PC;
+
+		// First opcode byte follows the PC after one or two spaces
+		std::size_t pos = 4;
+		while (pos < str.size() && str[pos] == ' ') pos++;
+		if (pos - 4 <= 2 && parse_hex(str, pos, 2, parsed)) {
+			rec.opcode = static_cast<Byte>(parsed);
+			rec.fields |= TRACE_FIELD_OPCODE;
+		}
+
+		std::size_t regs = str.find("A:");
+		if (regs == std::string::npos) return true;
+		std::string tail = " " + str.substr(regs);
+		if (parse_field(tail, " A:", rec.A) && parse_field(tail, " X:", rec.X) && parse_field(tail, " Y:", rec.Y)) {
+			rec.fields |= TRACE_FIELD_REGS;
+		}
+		if (parse_field(tail, " P:", rec.SF)) rec.fields |= TRACE_FIELD_SF;
+		if (parse_field(tail, " SP:", rec.SP)) rec.fields |= TRACE_FIELD_SP;
+
+		std::size_t cyc = tail.find("CYC:");
+		if (cyc != std::string::npos) {
+			std::size_t digit = cyc + 4;
+			unsigned long cycles = 0;
+			bool any = false;
+			while (digit < tail.size() && tail[digit] >= '0' && tail[digit] <= '9') {
+				cycles = cycles * 10 + static_cast<unsigned long>(tail[digit] - '0');
+				digit++;
+				any = true;
+			}
+			if (any) {
+				rec.cycles = cycles;
+				rec.fields |= TRACE_FIELD_CYCLES;
+			}
+		}
+		return true;
+	}
+};
+
+// Compares live execution against a reference trace, one instruction at a
+// time, remembering the last few pairs so a divergence can be shown in context.
+class GoldenTrace {
+public:
+	bool open(const std::string& path, std::size_t context_size, Byte compare_mask) {
+		if (!reader.open(path)) return false;
+		mask = compare_mask;
+		context.assign(context_size, {});
+		context_head = 0;
+		context_count = 0;
+		matched = 0;
+		pending = false;
+		active = true;
+		return true;
+	}
+
+	bool is_active() const {
+		return active;
+	}
+
+	void stop() {
+		active = false;
+	}
+
+	unsigned long matched_count() const {
+		return matched;
+	}
+
+	bool reader_is_binary() const {
+		return reader.is_binary();
+	}
+
+	void set_symbols(SymbolTable* table) {
+		symbols = table;
+	}
+
+	// Returns false when the run should stop, i.e. on the first divergence
+	// or when the reference runs out. A matching record stays current until
+	// advance() says the instruction actually ran.
+	bool check(const TraceRecord& ours, std::ostream& os) {
+		if (!pending && !reader.next(ref)) {
+			os << "Reference trace ended after " << std::dec << matched
+				<< " instructions without a divergence." << std::endl;
+			active = false;
+			return false;
+		}
+
+		Byte diff = compare(ours, ref);
+		if (diff != 0) {
+			os << "Divergence after " << std::dec << matched << " matching instructions (reference line "
+				<< reader.line_number() << ")." << std::endl;
+			print_context(os);
+			os << "  ours: " << format_trace_record(with_fields(ours, ref.fields), symbols) << std::endl;
+			os << "  ref:  " << format_trace_record(ref, symbols) << std::endl;
+			os << "  mismatched:" << describe_fields(diff) << std::endl;
+			active = false;
+			return false;
+		}
+		pending = true;
+		return true;
+	}
+
+	// The instruction check() looked at has executed, so the next check
+	// compares against the next record
+	void advance() {
+		if (!pending) return;
+		pending = false;
+		matched++;
+		if (!context.empty()) {
+			context[context_head] = ref;
+			context_head = (context_head + 1) % context.size();
+			if (context_count < context.size()) context_count++;
+		}
+	}
+
+private:
+	TraceReader reader;
+	TraceRecord ref;
+	bool pending = false;
+	std::vector<TraceRecord> context;
+	std::size_t context_head = 0;
+	std::size_t context_count = 0;
+	unsigned long matched = 0;
+	Byte mask = TRACE_FIELD_ALL;
+	bool active = false;
+	SymbolTable* symbols = nullptr;
+
+	Byte compare(const TraceRecord& ours, const TraceRecord& ref) const {
+		Byte fields = ref.fields & mask;
+		Byte diff = 0;
+		if ((fields & TRACE_FIELD_PC) && ours.PC != ref.PC) diff |= TRACE_FIELD_PC;
+		if ((fields & TRACE_FIELD_OPCODE) && ours.opcode != ref.opcode) diff |= TRACE_FIELD_OPCODE;
+		if ((fields & TRACE_FIELD_REGS) && (ours.A != ref.A || ours.X != ref.X || ours.Y != ref.Y)) diff |= TRACE_FIELD_REGS;
+		if ((fields & TRACE_FIELD_SF) && ours.SF != ref.SF) diff |= TRACE_FIELD_SF;
+		if ((fields & TRACE_FIELD_SP) && ours.SP != ref.SP) diff |= TRACE_FIELD_SP;
+		if ((fields & TRACE_FIELD_CYCLES) && ours.cycles != ref.cycles) diff |= TRACE_FIELD_CYCLES;
+		return diff;
+	}
+
+	static TraceRecord with_fields(TraceRecord rec, Byte fields) {
+		rec.fields = fields;
+		return rec;
+	}
+
+	static std::string describe_fields(Byte fields) {
+		std::string out;
+		if (fields & TRACE_FIELD_PC) out += " PC";
+		if (fields & TRACE_FIELD_OPCODE) out += " opcode";
+		if (fields & TRACE_FIELD_REGS) out += " A/X/Y";
+		if (fields & TRACE_FIELD_SF) out += " P";
+		if (fields & TRACE_FIELD_SP) out += " SP";
+		if (fields & TRACE_FIELD_CYCLES) out += " CYC";
+		return out;
+	}
+
+	void print_context(std::ostream& os) const {
+		if (context_count == 0) return;
+		os << "Last " << std::dec << context_count << " matching instructions:" << std::endl;
+		std::size_t start = (context_head + context.size() - context_count) % context.size();
+		for (std::size_t i = 0; i < context_count; i++) {
+			os << "  " << format_trace_record(context[(start + i) % context.size()], symbols) << std::endl;
+		}
+	}
+};
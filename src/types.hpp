@@ -35,7 +35,9 @@ enum CPUStatus {
 	CONTINUE = 0,
 	HALT,
 	INVALID,
-	BREAKPOINT
+	BREAKPOINT,
+	WATCHPOINT,
+	SANITIZER
 };
 
 enum CPUType {